@@ -19,6 +19,7 @@ if [[ "$OSTYPE" == "linux-gnu"* ]]; then
         libglfw3-dev \
         libgl1-mesa-dev \
         liblua5.4-dev \
+        lua5.4 \
         xxd
     
 elif [[ "$OSTYPE" == "darwin"* ]]; then
@@ -0,0 +1,55 @@
+-- ============================================================
+-- BENCHMARK: 1k bouncing entities with broadphase collisions
+-- ============================================================
+
+local COUNT = 1000
+local SIZE = 16
+
+local world = collision.newWorld(64)
+local entities = {}
+local bodies = {}
+local owners = {}      -- body id -> entity
+local pairBuffer = {}
+
+function init()
+    math.randomseed(1)
+    local size = graphics.getWindowSize()
+    for i = 1, COUNT do
+        local e = entity.create(i % 2 == 0 and "rect" or "circle")
+        local x = math.random() * (size.width - SIZE)
+        local y = math.random() * (size.height - SIZE)
+        entity.setPosition(e, x, y)
+        entity.set(e, entity.WIDTH, SIZE)
+        entity.set(e, entity.HEIGHT, SIZE)
+        entity.setVelocity(e, math.random(-120, 120), math.random(-120, 120))
+        entity.setColor(e, 0.4, 0.7, 1.0)
+        entities[i] = e
+        bodies[i] = world:insert(x, y, SIZE, SIZE)
+        owners[bodies[i]] = e
+    end
+    entities.width = size.width
+    entities.height = size.height
+end
+
+function loop(dt)
+    entity.integrate(dt)
+    
+    local w, h = entities.width - SIZE, entities.height - SIZE
+    for i = 1, COUNT do
+        local e = entities[i]
+        local x, y = entity.getPosition(e)
+        if x < 0 or x > w then entity.set(e, entity.VX, -entity.get(e, entity.VX)) end
+        if y < 0 or y > h then entity.set(e, entity.VY, -entity.get(e, entity.VY)) end
+        entity.setColor(e, 0.4, 0.7, 1.0)
+        world:update(bodies[i], x, y)
+    end
+    
+    local out, n = world:queryPairs(pairBuffer)
+    for k = 1, n * 2 do
+        entity.setColor(owners[out[k]], 1.0, 0.3, 0.3)
+    end
+end
+
+function window(alpha)
+    entity.drawAll()
+end
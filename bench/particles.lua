@@ -0,0 +1,43 @@
+-- ============================================================
+-- BENCHMARK: 50k live particles across four emitters
+-- ============================================================
+
+local LIVE = 50000
+local LIFETIME = 2.0
+local EMITTERS = 4
+
+-- Emitting LIVE / LIFETIME particles per second holds the count steady
+local perFrame = math.floor(LIVE / (LIFETIME * 60) / EMITTERS)
+local emitters = {}
+local colors = {
+    {r = 1.0, g = 0.5, b = 0.2},
+    {r = 0.2, g = 0.7, b = 1.0},
+    {r = 0.6, g = 1.0, b = 0.3},
+    {r = 1.0, g = 0.9, b = 0.4},
+}
+
+function init()
+    local size = graphics.getWindowSize()
+    for i = 1, EMITTERS do
+        local e = particle.newEmitter(size.width * i / (EMITTERS + 1), size.height / 2)
+        e:setFade(true)
+        -- Start at the steady state: one batch per frame of age
+        for age = 1, LIFETIME * 60 do
+            e:emit(perFrame, 0, -40, LIFETIME * age / (LIFETIME * 60), colors[i])
+        end
+        emitters[i] = e
+    end
+end
+
+function loop(dt)
+    for i = 1, EMITTERS do
+        emitters[i]:emit(perFrame, 0, -40, LIFETIME, colors[i])
+    end
+    particle.updateAll(emitters, dt)
+end
+
+function window(alpha)
+    for i = 1, EMITTERS do
+        emitters[i]:draw()
+    end
+end
@@ -0,0 +1,41 @@
+-- ============================================================
+-- BENCHMARK: 10k moving rectangles, one draw.rect call each
+-- ============================================================
+
+local COUNT = 10000
+
+local rects = {}
+
+function init()
+    math.randomseed(1)
+    local size = graphics.getWindowSize()
+    for i = 1, COUNT do
+        rects[i] = {
+            x = math.random() * size.width,
+            y = math.random() * size.height,
+            vx = math.random(-100, 100),
+            vy = math.random(-100, 100),
+            r = math.random(), g = math.random(), b = math.random(),
+        }
+    end
+    rects.width = size.width
+    rects.height = size.height
+end
+
+function loop(dt)
+    local w, h = rects.width, rects.height
+    for i = 1, COUNT do
+        local rect = rects[i]
+        rect.x = rect.x + rect.vx * dt
+        rect.y = rect.y + rect.vy * dt
+        if rect.x < 0 or rect.x > w then rect.vx = -rect.vx end
+        if rect.y < 0 or rect.y > h then rect.vy = -rect.vy end
+    end
+end
+
+function window(alpha)
+    for i = 1, COUNT do
+        local rect = rects[i]
+        draw.rect(rect.x, rect.y, 8, 8, rect.r, rect.g, rect.b)
+    end
+end
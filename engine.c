@@ -1,12 +1,42 @@
+/* getaddrinfo for the net module; must precede every header */
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <time.h>
+#ifndef __EMSCRIPTEN__
+#include <sys/stat.h>
+/* Threaded simulation (--threaded) is native only */
+#define ENGINE_THREADS
+/* So is UDP replication (net.*): browsers have no raw sockets */
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#define ENGINE_NET
+#endif
+/* The job pool needs pthreads: always there natively, on the web only
+ * in builds made with -pthread (make web WEB_THREADS=1) */
+#if !defined(__EMSCRIPTEN__) || defined(__EMSCRIPTEN_PTHREADS__)
+#include <pthread.h>
+#include <unistd.h>
+#define ENGINE_JOBS
+#endif
+
+/* Must precede the first GL header (glfw3.h includes GL/gl.h) */
+#define GL_GLEXT_PROTOTYPES
 
 #ifdef __EMSCRIPTEN__
 #include <emscripten.h>
 #include <emscripten/html5.h>
+#include <emscripten/fetch.h>
 #define GLFW_INCLUDE_ES2
 #else
 #include <GLFW/glfw3.h>
@@ -22,6 +52,257 @@
 /* GLOBAL STATE */
 /* ============================================================ */
 
+/* Vertex layout shared by triangles and lines: x, y, r, g, b, a */
+#define VERTEX_FLOATS 6
+/* Circle instance layout: x, y, radius, r, g, b, a */
+#define CIRCLE_FLOATS 7
+/* Queued sprite: atlas slot, 4 corners (TL, TR, BR, BL), u0, v0, u1, v1, r, g, b, a */
+#define SPRITE_FLOATS 17
+/* Expanded sprite vertex: x, y, u, v, r, g, b, a */
+#define SPRITE_VERTEX_FLOATS 8
+#define BATCH_INITIAL_FLOATS (4096 * VERTEX_FLOATS)
+
+typedef enum {
+    BATCH_TRIANGLES,
+    BATCH_LINES,
+    BATCH_CIRCLES,
+    BATCH_SPRITES,
+} BatchKind;
+
+/* Frame-level stream shared by all draw.* bindings. Elements (vertices,
+ * or instances for circles) accumulate until the kind changes or the
+ * frame ends, then go out in a single draw call. */
+typedef struct {
+    float* data;
+    int count;       /* elements queued */
+    int used;        /* floats queued */
+    int capacity;    /* floats allocated */
+    BatchKind kind;
+} Batch;
+
+/* Ring that dynamic vertex data is written into on its way to the GPU.
+ * Each frame writes into its own segment, and a fence placed after the
+ * frame's last draw guards that segment until it comes round again, so
+ * writes never wait on the GPU reading an older frame. Desktop GL maps
+ * the ring once (persistent) where buffer storage is available and maps
+ * each range unsynchronized otherwise; WebGL has neither, so the ring
+ * is a single segment orphaned at the start of every frame. */
+typedef enum {
+    STREAM_ORPHAN,
+    STREAM_UNSYNCHRONIZED,
+    STREAM_PERSISTENT,
+} StreamMode;
+
+#define STREAM_SEGMENTS 3
+#define STREAM_INITIAL_SEGMENT (1 << 20)
+#define STREAM_MAX_SEGMENT (64 << 20)
+#define STREAM_ALIGN 64
+
+typedef struct {
+    StreamMode mode;
+    GLuint buffer;
+    GLuint spill;            /* orphaned overflow for a frame that outgrows its segment */
+    unsigned char* mapped;   /* whole ring, persistent mode only */
+    size_t segmentSize;
+    int segment;             /* segment the current frame writes into */
+    size_t head;             /* write offset within the segment */
+    size_t demand;           /* bytes requested this frame, spilled or not */
+    GLsync fences[STREAM_SEGMENTS];
+} StreamBuffer;
+
+/* Where a write landed: bind `buffer` and point attributes at `offset` */
+typedef struct {
+    GLuint buffer;
+    size_t offset;
+} StreamSpan;
+
+/* A linked program with its locations resolved once at creation */
+typedef struct {
+    GLuint id;
+    GLint projectionLoc;
+    GLint positionLoc;
+    GLint colorLoc;
+    GLint cornerLoc;
+    GLint instanceLoc;
+    GLint texcoordLoc;
+    unsigned projectionVersion;  /* projection last uploaded to this program */
+} ShaderProgram;
+
+/* 2D camera: world position shown at the top-left of the screen, and a
+ * zoom factor. Inactive means screen-space drawing (HUD). */
+typedef struct {
+    float x, y;
+    float zoom;
+    int active;
+} Camera;
+
+/* What scripts draw through: the camera, and the projection and world
+ * rect derived from it. Owned by whichever thread runs Lua. */
+typedef struct {
+    Camera camera;
+    float projection[16];
+    float minX, minY, maxX, maxY;   /* world rect the projection shows */
+} View;
+
+/* Cached GL state so per-flush work skips redundant driver calls.
+ * projection is the matrix draws are being submitted under; bumping
+ * projectionVersion makes each program re-upload it lazily. */
+typedef struct {
+    GLuint currentProgram;
+    GLuint currentVAO;
+    GLuint currentTexture;
+    float projection[16];
+    unsigned projectionVersion;
+} RenderState;
+
+/* Per-frame phase timings (milliseconds) and submission counters */
+typedef enum {
+    PHASE_FRAME,     /* wall time since the previous frame */
+    PHASE_LOOP,      /* Lua loop(dt) */
+    PHASE_WINDOW,    /* Lua window() */
+    PHASE_SUBMIT,    /* final batch flush */
+    PHASE_SWAP,
+    PHASE_POLL,
+    PHASE_GC,        /* paced Lua collection, engine.gc{stepKB = ...} */
+    PHASE_COUNT
+} FramePhase;
+
+#define STATS_HISTORY 120
+
+typedef struct {
+    float ms[PHASE_COUNT];
+    int ticks;           /* loop() calls this frame */
+    int drawCalls;
+    int vertices;        /* vertices emitted, 4 per circle instance */
+    int allocations;     /* Lua allocator requests for a new block */
+    int mallocs;         /* of those, the ones that reached malloc */
+    float luaMemoryKB;
+} FrameSample;
+
+typedef struct {
+    FrameSample history[STATS_HISTORY];
+    int head;            /* next slot to write */
+    int filled;
+    FrameSample current; /* counters for the frame in progress */
+    int overlay;
+} FrameStats;
+
+/* Fixed-step simulation: loop() runs at `step` seconds per tick, at most
+ * maxSteps times per frame, and window() gets the leftover fraction of a
+ * tick for interpolation. step == 0 means one variable-dt loop per frame. */
+typedef struct {
+    double step;
+    double accumulator;
+    int maxSteps;
+} TimeStep;
+
+#define TIMESTEP_DEFAULT_MAX_STEPS 5
+/* Longest frame fed to the accumulator, so a stall (debugger, window
+ * drag) doesn't queue seconds of catch-up */
+#define TIMESTEP_MAX_FRAME 0.25
+
+/* Lua GC pacing. stepKB > 0 stops the allocation-driven collector and
+ * runs one step per frame instead, after the frame has been presented,
+ * sized to the larger of stepKB and what the frame allocated. */
+typedef struct {
+    int generational;
+    int stepKB;
+    double lastKB;       /* heap size after the previous step */
+} GCControl;
+
+/* One frame of draws recorded on the simulation thread for the render
+ * thread to submit. Each command is a flushed batch and the projection
+ * it was queued under. */
+typedef struct {
+    BatchKind kind;
+    size_t first;        /* float offset into the list's data */
+    int used;
+    int count;
+    float projection[16];
+} DrawCommand;
+
+typedef struct {
+    DrawCommand* commands;
+    int commandCount;
+    int commandCapacity;
+    float* data;
+    size_t used;         /* floats */
+    size_t capacity;
+    float clearColor[3];
+    /* Simulation side of the frame stats */
+    float loopMs, windowMs, gcMs;
+    int ticks;
+    int allocations, mallocs;
+    float luaMemoryKB;
+    unsigned int frame;  /* recording order, from 1 */
+} DrawList;
+
+/* Every digital input shares one code space: GLFW key codes, then mouse
+ * buttons, then each gamepad's buttons. Actions bind to these codes. */
+#define INPUT_GAMEPADS 4
+#define INPUT_PAD_BUTTONS (GLFW_GAMEPAD_BUTTON_LAST + 1)
+#define INPUT_PAD_AXES (GLFW_GAMEPAD_AXIS_LAST + 1)
+#define INPUT_MOUSE_BASE (GLFW_KEY_LAST + 1)
+#define INPUT_PAD_BASE (INPUT_MOUSE_BASE + GLFW_MOUSE_BUTTON_LAST + 1)
+#define INPUT_CODE_COUNT (INPUT_PAD_BASE + INPUT_GAMEPADS * INPUT_PAD_BUTTONS)
+
+/* Input state sampled on the main thread, where GLFW must be queried.
+ * pressed/released are transitions the event callbacks saw since the
+ * previous sample, so a tap shorter than a frame still registers. */
+typedef struct {
+    unsigned char down[INPUT_CODE_COUNT];
+    unsigned char pressed[INPUT_CODE_COUNT];
+    unsigned char released[INPUT_CODE_COUNT];
+    double mouseX, mouseY;
+    unsigned char padConnected[INPUT_GAMEPADS];
+    float padAxes[INPUT_GAMEPADS][INPUT_PAD_AXES];
+} InputSnapshot;
+
+typedef enum {
+    GL_OBJECT_TEXTURE,
+    GL_OBJECT_BUFFER,
+    GL_OBJECT_VERTEX_ARRAY,
+    GL_OBJECT_ATLAS_SLOT,   /* not GL: a freed atlas slot recorded sprites may still name */
+} GLObjectKind;
+
+typedef struct {
+    GLObjectKind kind;
+    GLuint name;
+    unsigned int frame;     /* list being recorded when it was released */
+} GLObject;
+
+/* Threaded mode: loop() and window() run on a simulation thread that
+ * records each frame into a DrawList, while the main thread owns GL and
+ * GLFW and only submits the latest finished list. Lists rotate through
+ * writing -> ready -> reading; the simulation waits while one is ready,
+ * so it stays at most a frame ahead. */
+typedef struct {
+    int enabled;                    /* --threaded on the command line */
+    int running;                    /* Lua is on the simulation thread */
+#ifdef ENGINE_THREADS
+    pthread_t thread;
+    pthread_mutex_t mutex;          /* guards the handoff fields below */
+    pthread_cond_t cond;
+    pthread_mutex_t resourceMutex;  /* atlas slots and pixels, released GL objects */
+#endif
+    DrawList lists[3];
+    int writing, ready, reading;
+    int hasReady;
+    int quit;
+    double lastTime;                /* main thread's frame clock */
+    InputSnapshot input;            /* latest sample from the main thread */
+    FrameStats stats;               /* main thread's history, for engine.stats */
+    int resizeWidth, resizeHeight;  /* pending framebuffer resize, 0 if none */
+    
+    GLObject* released;             /* GL objects freed by the simulation thread */
+    int releasedCount;
+    int releasedCapacity;
+    unsigned int recordFrame;       /* frame of the list being recorded */
+    
+    /* Simulation thread's copy, refreshed at the start of its frame */
+    FrameStats simStats;
+} ThreadedState;
+
 typedef struct {
     GLFWwindow* window;
     lua_State* L;
@@ -29,11 +310,44 @@ typedef struct {
     float windowWidth;
     float windowHeight;
     int running;
-    GLuint shaderProgram;
-    GLuint VAO, VBO;
+    ShaderProgram shaderProgram;
+    ShaderProgram circleProgram;
+    ShaderProgram spriteProgram;
+    GLuint VAO;
+    GLuint circleVAO, circleQuadVBO;
+    GLuint spriteVAO;
+    StreamBuffer stream;
+    Batch batch;
+    View view;
+    RenderState render;
+    float clearColor[3];
+    FrameStats stats;
+    TimeStep timestep;
+    GCControl gc;
 } EngineState;
 
-static EngineState g_engine = {0};
+/* Benchmark mode (--bench script.lua): the script replaces game.lua and
+ * runs in a hidden window without vsync, with every frame simulated as
+ * BENCH_FRAME_TIME so runs are repeatable. After `warmup` frames, the
+ * next `frames` samples are kept and summarized as JSON on exit. */
+#define BENCH_FRAME_TIME (1.0 / 60.0)
+#define BENCH_DEFAULT_FRAMES 600
+#define BENCH_DEFAULT_WARMUP 60
+
+typedef struct {
+    const char* script;
+    const char* output;  /* --bench-out path, stdout if NULL */
+    int frames;
+    int warmup;
+    int frame;           /* frames run, warmup included */
+    int recorded;
+    FrameSample* samples;
+    size_t arenaPeak;
+} BenchState;
+
+static EngineState g_engine = { .clearColor = {0.1f, 0.1f, 0.1f} };
+static ThreadedState g_threaded;
+static BenchState g_bench = { .frames = BENCH_DEFAULT_FRAMES, .warmup = BENCH_DEFAULT_WARMUP };
 
 /* ============================================================ */
 /* SHADER UTILITIES */
@@ -56,6 +370,57 @@ const char* fragmentShaderSource = "#version 100\n"
     "   gl_FragColor = fragColor;\n"
     "}\n";
 
+/* Circles are drawn instanced: a unit quad per instance, clipped to a
+ * disc in the fragment shader with a one-pixel antialiased edge. */
+const char* circleVertexShaderSource = "#version 100\n"
+    "attribute vec2 corner;\n"
+    "attribute vec3 instance;\n"
+    "attribute vec4 color;\n"
+    "varying vec2 localPos;\n"
+    "varying float radius;\n"
+    "varying vec4 fragColor;\n"
+    "uniform mat4 projection;\n"
+    "void main() {\n"
+    "   localPos = corner;\n"
+    "   radius = instance.z;\n"
+    "   fragColor = color;\n"
+    "   gl_Position = projection * vec4(instance.xy + corner * instance.z, 0.0, 1.0);\n"
+    "}\n";
+
+const char* circleFragmentShaderSource = "#version 100\n"
+    "precision mediump float;\n"
+    "varying vec2 localPos;\n"
+    "varying float radius;\n"
+    "varying vec4 fragColor;\n"
+    "void main() {\n"
+    "   float edge = (1.0 - length(localPos)) * radius + 0.5;\n"
+    "   if (edge <= 0.0) discard;\n"
+    "   gl_FragColor = vec4(fragColor.rgb, fragColor.a * clamp(edge, 0.0, 1.0));\n"
+    "}\n";
+
+/* Textured quads sampled from an atlas, tinted by the vertex color */
+const char* spriteVertexShaderSource = "#version 100\n"
+    "attribute vec2 position;\n"
+    "attribute vec2 texcoord;\n"
+    "attribute vec4 color;\n"
+    "varying vec2 uv;\n"
+    "varying vec4 fragColor;\n"
+    "uniform mat4 projection;\n"
+    "void main() {\n"
+    "   gl_Position = projection * vec4(position, 0.0, 1.0);\n"
+    "   uv = texcoord;\n"
+    "   fragColor = color;\n"
+    "}\n";
+
+const char* spriteFragmentShaderSource = "#version 100\n"
+    "precision mediump float;\n"
+    "varying vec2 uv;\n"
+    "varying vec4 fragColor;\n"
+    "uniform sampler2D atlas;\n"
+    "void main() {\n"
+    "   gl_FragColor = texture2D(atlas, uv) * fragColor;\n"
+    "}\n";
+
 GLuint compileShader(const char* source, GLenum type) {
     GLuint shader = glCreateShader(type);
     glShaderSource(shader, 1, &source, NULL);
@@ -71,9 +436,9 @@ GLuint compileShader(const char* source, GLenum type) {
     return shader;
 }
 
-GLuint createShaderProgram() {
-    GLuint vertexShader = compileShader(vertexShaderSource, GL_VERTEX_SHADER);
-    GLuint fragmentShader = compileShader(fragmentShaderSource, GL_FRAGMENT_SHADER);
+GLuint createShaderProgram(const char* vertexSource, const char* fragmentSource) {
+    GLuint vertexShader = compileShader(vertexSource, GL_VERTEX_SHADER);
+    GLuint fragmentShader = compileShader(fragmentSource, GL_FRAGMENT_SHADER);
     
     GLuint program = glCreateProgram();
     glAttachShader(program, vertexShader);
@@ -110,237 +475,9637 @@ void orthographicMatrix(float* matrix, float left, float right, float bottom, fl
 }
 
 /* ============================================================ */
-/* LUA BINDING FUNCTIONS */
+/* RENDER STATE CACHE */
 /* ============================================================ */
 
-static int lua_drawRect(lua_State* L) {
-    float x = luaL_checknumber(L, 1);
-    float y = luaL_checknumber(L, 2);
-    float w = luaL_checknumber(L, 3);
-    float h = luaL_checknumber(L, 4);
-    float r = luaL_checknumber(L, 5);
-    float g = luaL_checknumber(L, 6);
-    float b = luaL_checknumber(L, 7);
-    float a = luaL_optnumber(L, 8, 1.0);
+void initShaderProgram(ShaderProgram* program, GLuint id) {
+    program->id = id;
+    program->projectionLoc = glGetUniformLocation(id, "projection");
+    program->positionLoc = glGetAttribLocation(id, "position");
+    program->colorLoc = glGetAttribLocation(id, "color");
+    program->cornerLoc = glGetAttribLocation(id, "corner");
+    program->instanceLoc = glGetAttribLocation(id, "instance");
+    program->texcoordLoc = glGetAttribLocation(id, "texcoord");
+    program->projectionVersion = 0;
+}
+
+/* Rebuilds the projection from the window size and, when active, the
+ * camera. Callers changing it mid-frame must flush the batch first. */
+void updateProjection() {
+    View* view = &g_engine.view;
+    const Camera* camera = &view->camera;
     
-    float vertices[] = {
-        x,     y,     r, g, b, a,
-        x + w, y,     r, g, b, a,
-        x + w, y + h, r, g, b, a,
-        x,     y + h, r, g, b, a,
-    };
+    if (camera->active) {
+        view->minX = camera->x;
+        view->minY = camera->y;
+        view->maxX = camera->x + g_engine.windowWidth / camera->zoom;
+        view->maxY = camera->y + g_engine.windowHeight / camera->zoom;
+    } else {
+        view->minX = 0.0f;
+        view->minY = 0.0f;
+        view->maxX = g_engine.windowWidth;
+        view->maxY = g_engine.windowHeight;
+    }
+    orthographicMatrix(view->projection, view->minX, view->maxX, view->maxY, view->minY);
+}
+
+/* World-space rectangle currently visible on screen */
+static void getViewRect(float* minX, float* minY, float* maxX, float* maxY) {
+    const View* view = &g_engine.view;
+    *minX = view->minX;
+    *minY = view->minY;
+    *maxX = view->maxX;
+    *maxY = view->maxY;
+}
+
+/* Makes `projection` the one subsequent draws are submitted under */
+static void setProjection(const float* projection) {
+    RenderState* rs = &g_engine.render;
+    if (memcmp(rs->projection, projection, sizeof(rs->projection)) == 0) return;
+    memcpy(rs->projection, projection, sizeof(rs->projection));
+    rs->projectionVersion++;
+}
+
+/* Binds a program and brings its projection uniform up to date */
+static void useProgram(ShaderProgram* program) {
+    RenderState* rs = &g_engine.render;
     
-    GLuint VAO, VBO;
-    glGenVertexArrays(1, &VAO);
-    glGenBuffers(1, &VBO);
+    if (rs->currentProgram != program->id) {
+        glUseProgram(program->id);
+        rs->currentProgram = program->id;
+    }
     
-    glBindVertexArray(VAO);
-    glBindBuffer(GL_ARRAY_BUFFER, VBO);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+    if (program->projectionVersion != rs->projectionVersion) {
+        glUniformMatrix4fv(program->projectionLoc, 1, GL_FALSE, rs->projection);
+        program->projectionVersion = rs->projectionVersion;
+    }
+}
+
+static void bindVertexArray(GLuint vao) {
+    if (g_engine.render.currentVAO != vao) {
+        glBindVertexArray(vao);
+        g_engine.render.currentVAO = vao;
+    }
+}
+
+/* Sprites only sample unit 0, so one cached binding suffices */
+static void bindTexture(GLuint texture) {
+    if (g_engine.render.currentTexture != texture) {
+        glBindTexture(GL_TEXTURE_2D, texture);
+        g_engine.render.currentTexture = texture;
+    }
+}
+
+void onFramebufferResize(GLFWwindow* window, int width, int height) {
+    (void)window;
+    if (width <= 0 || height <= 0) return;  /* minimized */
     
-    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)0);
-    glEnableVertexAttribArray(0);
+    glViewport(0, 0, width, height);
+#ifdef ENGINE_THREADS
+    if (g_threaded.running) {
+        /* The simulation thread owns the view; it picks the size up at
+         * the start of its next frame */
+        pthread_mutex_lock(&g_threaded.mutex);
+        g_threaded.resizeWidth = width;
+        g_threaded.resizeHeight = height;
+        pthread_mutex_unlock(&g_threaded.mutex);
+        return;
+    }
+#endif
+    g_engine.windowWidth = width;
+    g_engine.windowHeight = height;
+    updateProjection();
+}
+
+/* Guards state the simulation thread mutates and the render thread
+ * reads while submitting; free when not threaded */
+static void resourceLock(void) {
+#ifdef ENGINE_THREADS
+    if (g_threaded.running) pthread_mutex_lock(&g_threaded.resourceMutex);
+#endif
+}
+
+static void resourceUnlock(void) {
+#ifdef ENGINE_THREADS
+    if (g_threaded.running) pthread_mutex_unlock(&g_threaded.resourceMutex);
+#endif
+}
+
+static void deleteGLObject(GLObjectKind kind, GLuint name) {
+    RenderState* rs = &g_engine.render;
+    switch (kind) {
+    case GL_OBJECT_TEXTURE:
+        if (rs->currentTexture == name) rs->currentTexture = 0;
+        glDeleteTextures(1, &name);
+        break;
+    case GL_OBJECT_BUFFER:
+        glDeleteBuffers(1, &name);
+        break;
+    case GL_OBJECT_VERTEX_ARRAY:
+        if (rs->currentVAO == name) rs->currentVAO = 0;
+        glDeleteVertexArrays(1, &name);
+        break;
+    case GL_OBJECT_ATLAS_SLOT:
+        /* Leaving the queue is what frees it for atlasCreate */
+        break;
+    }
+}
+
+/* Deletes a GL object now, or, on the simulation thread (which has no
+ * context), queues it for the render thread */
+static void releaseGLObject(GLObjectKind kind, GLuint name) {
+    if (!name && kind != GL_OBJECT_ATLAS_SLOT) return;
+    if (!g_threaded.running) {
+        deleteGLObject(kind, name);
+        return;
+    }
     
-    glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)(2 * sizeof(float)));
-    glEnableVertexAttribArray(1);
+    resourceLock();
+    ThreadedState* ts = &g_threaded;
+    if (ts->releasedCount == ts->releasedCapacity) {
+        int capacity = ts->releasedCapacity ? ts->releasedCapacity * 2 : 64;
+        GLObject* released = realloc(ts->released, capacity * sizeof(GLObject));
+        if (released) {
+            ts->released = released;
+            ts->releasedCapacity = capacity;
+        }
+    }
+    /* Out of memory leaks the object rather than deleting it unsafely */
+    if (ts->releasedCount < ts->releasedCapacity) {
+        ts->released[ts->releasedCount].kind = kind;
+        ts->released[ts->releasedCount].name = name;
+        ts->released[ts->releasedCount].frame = ts->recordFrame;
+        ts->releasedCount++;
+    }
+    resourceUnlock();
+}
+
+/* drawnFrame is the frame of the list the render thread now draws; lists
+ * it draws later are newer. Atlas slots released while that list or an
+ * older one was recorded stay queued, since its sprites may name them. */
+static void deleteReleasedGLObjects(unsigned int drawnFrame) {
+    resourceLock();
+    int kept = 0;
+    for (int i = 0; i < g_threaded.releasedCount; i++) {
+        GLObject* object = &g_threaded.released[i];
+        if (object->kind == GL_OBJECT_ATLAS_SLOT && object->frame >= drawnFrame) {
+            g_threaded.released[kept++] = *object;
+        } else {
+            deleteGLObject(object->kind, object->name);
+        }
+    }
+    g_threaded.releasedCount = kept;
+    resourceUnlock();
+}
+
+/* Whether an atlas slot is still waiting in the release queue; the
+ * caller holds the resource lock */
+static int atlasSlotHeld(int slot) {
+    for (int i = 0; i < g_threaded.releasedCount; i++) {
+        const GLObject* object = &g_threaded.released[i];
+        if (object->kind == GL_OBJECT_ATLAS_SLOT && object->name == (GLuint)slot) return 1;
+    }
+    return 0;
+}
+
+/* ============================================================ */
+/* SCRATCH MEMORY */
+/* ============================================================ */
+
+/* Growable buffer reused across calls for short-lived temporaries */
+typedef struct {
+    void* data;
+    size_t size;
+} Scratch;
+
+static void* scratchReserve(Scratch* scratch, size_t size) {
+    if (size > scratch->size) {
+        size_t newSize = scratch->size ? scratch->size : 4096;
+        while (newSize < size) newSize *= 2;
+        
+        void* data = realloc(scratch->data, newSize);
+        if (!data) return NULL;
+        scratch->data = data;
+        scratch->size = newSize;
+    }
+    return scratch->data;
+}
+
+/* ============================================================ */
+/* FRAME ARENA */
+/* ============================================================ */
+
+/* Bump allocator for temporaries that die by the end of the frame.
+ * When the block runs out, overflow allocations get their own malloc
+ * until the frame ends; the next reset regrows the block to the frame's
+ * peak, so a steady frame never reaches malloc. arenaMark/arenaRewind
+ * hand back what a call used, in stack order. Allocations stay valid
+ * until the owner resets the arena. */
+#define ARENA_ALIGN 16
+#define ARENA_INITIAL_SIZE (256 * 1024)
+
+typedef struct ArenaOverflow {
+    struct ArenaOverflow* next;
+} ArenaOverflow;
+
+typedef struct {
+    unsigned char* base;
+    size_t size;
+    size_t used;
+    ArenaOverflow* overflow;
+    size_t overflowBytes;
+    size_t peak;         /* high-water mark of the frame in progress */
+    size_t lastPeak;     /* of the previous frame, for engine.stats */
+} FrameArena;
+
+/* One per thread that uses them: Lua-side calls (queries, particles,
+ * glyphs) and batch submission. Single-threaded, mainLoop resets both. */
+static FrameArena g_frameArena;
+static FrameArena g_renderArena;
+
+static void* arenaAlloc(FrameArena* a, size_t size) {
+    size = size ? (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1) : ARENA_ALIGN;
+    if (!a->base) {
+        a->base = malloc(ARENA_INITIAL_SIZE);
+        a->size = a->base ? ARENA_INITIAL_SIZE : 0;
+    }
     
-    glUseProgram(g_engine.shaderProgram);
+    void* p;
+    if (a->used + size <= a->size) {
+        p = a->base + a->used;
+        a->used += size;
+    } else {
+        ArenaOverflow* block = malloc(ARENA_ALIGN + size);
+        if (!block) return NULL;
+        block->next = a->overflow;
+        a->overflow = block;
+        a->overflowBytes += size;
+        p = (unsigned char*)block + ARENA_ALIGN;
+    }
+    if (a->used + a->overflowBytes > a->peak) a->peak = a->used + a->overflowBytes;
+    return p;
+}
+
+static size_t arenaMark(const FrameArena* a) {
+    return a->used;
+}
+
+/* Overflow blocks are not rewound; they go at the next reset */
+static void arenaRewind(FrameArena* a, size_t mark) {
+    a->used = mark;
+}
+
+static void arenaReset(FrameArena* a) {
+    while (a->overflow) {
+        ArenaOverflow* next = a->overflow->next;
+        free(a->overflow);
+        a->overflow = next;
+    }
+    if (a->peak > a->size) {
+        size_t size = a->size ? a->size : ARENA_INITIAL_SIZE;
+        while (size < a->peak) size *= 2;
+        unsigned char* base = malloc(size);
+        if (base) {
+            free(a->base);
+            a->base = base;
+            a->size = size;
+        }
+    }
+    a->lastPeak = a->peak;
+    a->used = 0;
+    a->overflowBytes = 0;
+    a->peak = 0;
+}
+
+static void arenaRelease(FrameArena* a) {
+    arenaReset(a);
+    free(a->base);
+    memset(a, 0, sizeof(*a));
+}
+
+/* ============================================================ */
+/* STREAMING BUFFERS */
+/* ============================================================ */
+
+static const char* const g_streamModeNames[] = {
+    "orphan", "unsynchronized", "persistent",
+};
+
+#ifndef __EMSCRIPTEN__
+/* GL 4.4 / ARB_buffer_storage, looked up at runtime over a 3.3 context */
+static PFNGLBUFFERSTORAGEPROC g_glBufferStorage;
+
+static void streamWait(GLsync* fence) {
+    if (!*fence) return;
+    while (glClientWaitSync(*fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED) {
+    }
+    glDeleteSync(*fence);
+    *fence = NULL;
+}
+#endif
+
+static void streamAllocate(StreamBuffer* stream) {
+    size_t total = stream->segmentSize * (stream->mode == STREAM_ORPHAN ? 1 : STREAM_SEGMENTS);
+    glGenBuffers(1, &stream->buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, stream->buffer);
+    stream->segment = 0;
+    stream->head = 0;
     
-    float projection[16];
-    orthographicMatrix(projection, 0, g_engine.windowWidth, g_engine.windowHeight, 0);
+#ifndef __EMSCRIPTEN__
+    if (stream->mode == STREAM_PERSISTENT) {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        g_glBufferStorage(GL_ARRAY_BUFFER, total, NULL, flags);
+        stream->mapped = glMapBufferRange(GL_ARRAY_BUFFER, 0, total, flags);
+        if (stream->mapped) return;
+        
+        /* Storage is immutable, so falling back needs a fresh buffer */
+        glDeleteBuffers(1, &stream->buffer);
+        glGenBuffers(1, &stream->buffer);
+        glBindBuffer(GL_ARRAY_BUFFER, stream->buffer);
+        stream->mode = STREAM_UNSYNCHRONIZED;
+    }
+#endif
+    glBufferData(GL_ARRAY_BUFFER, total, NULL, GL_STREAM_DRAW);
+}
+
+/* Deleting a buffer the GPU still reads is safe; GL keeps the storage
+ * alive until those draws finish */
+static void streamRelease(StreamBuffer* stream) {
+#ifndef __EMSCRIPTEN__
+    for (int i = 0; i < STREAM_SEGMENTS; i++) {
+        if (stream->fences[i]) glDeleteSync(stream->fences[i]);
+        stream->fences[i] = NULL;
+    }
+#endif
+    if (stream->mapped) {
+        glBindBuffer(GL_ARRAY_BUFFER, stream->buffer);
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+        stream->mapped = NULL;
+    }
+    glDeleteBuffers(1, &stream->buffer);
+    stream->buffer = 0;
+}
+
+void initStream(StreamBuffer* stream) {
+#ifdef __EMSCRIPTEN__
+    stream->mode = STREAM_ORPHAN;
+#else
+    g_glBufferStorage = (PFNGLBUFFERSTORAGEPROC)glfwGetProcAddress("glBufferStorage");
+    stream->mode = g_glBufferStorage && glfwExtensionSupported("GL_ARB_buffer_storage")
+                 ? STREAM_PERSISTENT : STREAM_UNSYNCHRONIZED;
+#endif
+    stream->segmentSize = STREAM_INITIAL_SEGMENT;
+    streamAllocate(stream);
+    glGenBuffers(1, &stream->spill);
+}
+
+void shutdownStream(StreamBuffer* stream) {
+    streamRelease(stream);
+    glDeleteBuffers(1, &stream->spill);
+    stream->spill = 0;
+}
+
+/* Claims the frame's segment: grows the ring if the last frame spilled,
+ * otherwise waits for the GPU to finish with the segment's old contents
+ * (immediate unless the CPU is STREAM_SEGMENTS frames ahead) */
+static void streamBeginFrame(StreamBuffer* stream) {
+    if (stream->demand > stream->segmentSize && stream->segmentSize < STREAM_MAX_SEGMENT) {
+        while (stream->segmentSize < stream->demand && stream->segmentSize < STREAM_MAX_SEGMENT) {
+            stream->segmentSize *= 2;
+        }
+        streamRelease(stream);
+        streamAllocate(stream);
+    } else if (stream->mode == STREAM_ORPHAN) {
+        glBindBuffer(GL_ARRAY_BUFFER, stream->buffer);
+        glBufferData(GL_ARRAY_BUFFER, stream->segmentSize, NULL, GL_STREAM_DRAW);
+    } else {
+#ifndef __EMSCRIPTEN__
+        streamWait(&stream->fences[stream->segment]);
+#endif
+    }
+    stream->head = 0;
+    stream->demand = 0;
+}
+
+/* Fences the frame's draws and moves on to the next segment */
+static void streamEndFrame(StreamBuffer* stream) {
+    if (stream->mode == STREAM_ORPHAN) return;
+#ifndef __EMSCRIPTEN__
+    stream->fences[stream->segment] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    stream->segment = (stream->segment + 1) % STREAM_SEGMENTS;
+    stream->head = 0;
+#endif
+}
+
+/* Copies data into the current segment. A frame that outgrows it is
+ * served from the orphaned spill buffer, and the ring grows at the
+ * start of the next frame. */
+static StreamSpan streamWrite(StreamBuffer* stream, const void* data, size_t size) {
+    StreamSpan span;
+    size_t offset = (stream->head + STREAM_ALIGN - 1) & ~(size_t)(STREAM_ALIGN - 1);
+    stream->demand += size + STREAM_ALIGN;
     
-    GLint projLoc = glGetUniformLocation(g_engine.shaderProgram, "projection");
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, projection);
+    if (offset + size > stream->segmentSize) {
+        glBindBuffer(GL_ARRAY_BUFFER, stream->spill);
+        glBufferData(GL_ARRAY_BUFFER, size, data, GL_STREAM_DRAW);
+        span.buffer = stream->spill;
+        span.offset = 0;
+        return span;
+    }
+    stream->head = offset + size;
+    span.buffer = stream->buffer;
+    span.offset = (size_t)stream->segment * stream->segmentSize + offset;
     
-    glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+    switch (stream->mode) {
+    case STREAM_PERSISTENT:
+        memcpy(stream->mapped + span.offset, data, size);
+        break;
     
-    glDeleteBuffers(1, &VBO);
-    glDeleteVertexArrays(1, &VAO);
+    case STREAM_UNSYNCHRONIZED: {
+        glBindBuffer(GL_ARRAY_BUFFER, stream->buffer);
+        void* dst = glMapBufferRange(GL_ARRAY_BUFFER, span.offset, size,
+                                     GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+        if (dst) {
+            memcpy(dst, data, size);
+            glUnmapBuffer(GL_ARRAY_BUFFER);
+        } else {
+            glBufferSubData(GL_ARRAY_BUFFER, span.offset, size, data);
+        }
+        break;
+    }
     
-    return 0;
+    case STREAM_ORPHAN:
+        glBindBuffer(GL_ARRAY_BUFFER, stream->buffer);
+        glBufferSubData(GL_ARRAY_BUFFER, span.offset, size, data);
+        break;
+    }
+    return span;
 }
 
-static int lua_drawCircle(lua_State* L) {
-    float x = luaL_checknumber(L, 1);
-    float y = luaL_checknumber(L, 2);
-    float radius = luaL_checknumber(L, 3);
-    float r = luaL_checknumber(L, 4);
-    float g = luaL_checknumber(L, 5);
-    float b = luaL_checknumber(L, 6);
-    float a = luaL_optnumber(L, 7, 1.0);
+/* ============================================================ */
+/* TEXTURE ATLAS */
+/* ============================================================ */
+
+/* Images are packed into square RGBA8 atlases on the CPU with a shelf
+ * packer and uploaded lazily: the texture is created, or the rows
+ * touched since the last upload are resent, when a sprite batch first
+ * samples it. Every image gets a one-pixel border copied from its edge
+ * so linear filtering doesn't bleed in neighbours. */
+
+#define ATLAS_MAX 64
+#define ATLAS_DEFAULT_SIZE 1024
+#define ATLAS_PADDING 1
+#define ATLAS_STREAM_ROWS 64
+
+typedef struct {
+    int width;
+    int height;
+    unsigned char* pixels;   /* RGBA8, top row first */
+} Image;
+
+typedef struct {
+    float u0, v0, u1, v1;
+    int x, y, w, h;
+} AtlasRegion;
+
+typedef struct {
+    int slot;                /* index in g_atlases; what queued sprites store */
+    int size;
+    unsigned char* pixels;
+    GLuint texture;
+    GLint filter;
+    int dirtyMinY, dirtyMaxY;   /* rows changed since upload, empty if min > max */
+    int streamMinY, streamMaxY; /* rows from the asset loader, uploaded in slices */
+    int shelfX, shelfY, shelfHeight;
+    AtlasRegion* regions;
+    int regionCount;
+    int regionCapacity;
+} Atlas;
+
+static Atlas* g_atlases[ATLAS_MAX];
+
+/* Whole file in a malloc'd buffer, or NULL */
+static unsigned char* readFileBytes(const char* path, size_t* size) {
+    FILE* file = fopen(path, "rb");
+    if (!file) return NULL;
     
-    int segments = 32;
-    float* vertices = malloc((segments + 2) * 6 * sizeof(float));
+    unsigned char* data = NULL;
+    long length = fseek(file, 0, SEEK_END) == 0 ? ftell(file) : -1;
+    if (length >= 0 && fseek(file, 0, SEEK_SET) == 0) {
+        data = malloc(length > 0 ? (size_t)length : 1);
+        if (data && fread(data, 1, (size_t)length, file) != (size_t)length) {
+            free(data);
+            data = NULL;
+        }
+    }
+    fclose(file);
+    if (data) *size = (size_t)length;
+    return data;
+}
+
+/* Uncompressed or RLE true-color TGA (types 2 and 10, 24/32 bpp) */
+static int decodeTGA(const unsigned char* data, size_t size, Image* image, const char** error) {
+    if (size < 18) {
+        *error = "truncated header";
+        return 0;
+    }
+    const unsigned char* header = data;
+    int type = header[2];
+    int width = header[12] | (header[13] << 8);
+    int height = header[14] | (header[15] << 8);
+    int bytes = header[16] / 8;
+    int topDown = (header[17] & 0x20) != 0;
     
-    vertices[0] = x;
-    vertices[1] = y;
-    vertices[2] = r;
-    vertices[3] = g;
-    vertices[4] = b;
-    vertices[5] = a;
+    if (header[1] != 0 || (type != 2 && type != 10) || (bytes != 3 && bytes != 4) ||
+        width <= 0 || height <= 0) {
+        *error = "unsupported TGA (need 24/32-bit true-color)";
+        return 0;
+    }
+    const unsigned char* p = data + 18 + header[0];
+    const unsigned char* end = data + size;
     
-    for (int i = 0; i <= segments; i++) {
-        float angle = 2.0f * 3.14159f * i / segments;
-        float vx = x + radius * cosf(angle);
-        float vy = y + radius * sinf(angle);
-        
-        vertices[(i + 1) * 6 + 0] = vx;
-        vertices[(i + 1) * 6 + 1] = vy;
-        vertices[(i + 1) * 6 + 2] = r;
-        vertices[(i + 1) * 6 + 3] = g;
-        vertices[(i + 1) * 6 + 4] = b;
-        vertices[(i + 1) * 6 + 5] = a;
+    unsigned char* pixels = malloc((size_t)width * height * 4);
+    if (!pixels) {
+        *error = "out of memory";
+        return 0;
     }
     
-    GLuint VAO, VBO;
-    glGenVertexArrays(1, &VAO);
-    glGenBuffers(1, &VBO);
+    int total = width * height;
+    int ok = p <= end;
+    const unsigned char* bgra = NULL;
+    for (int i = 0; i < total && ok;) {
+        int run = 1, literal = 1;
+        if (type == 10) {
+            if (p >= end) { ok = 0; break; }
+            int packet = *p++;
+            run = (packet & 0x7F) + 1;
+            literal = !(packet & 0x80);
+            if (!literal) {
+                if (end - p < bytes) { ok = 0; break; }
+                bgra = p;
+                p += bytes;
+            }
+        }
+        for (int k = 0; k < run && i < total; k++, i++) {
+            if (literal) {
+                if (end - p < bytes) { ok = 0; break; }
+                bgra = p;
+                p += bytes;
+            }
+            int row = topDown ? i / width : height - 1 - i / width;
+            unsigned char* out = pixels + ((size_t)row * width + i % width) * 4;
+            out[0] = bgra[2];
+            out[1] = bgra[1];
+            out[2] = bgra[0];
+            out[3] = bytes == 4 ? bgra[3] : 255;
+        }
+    }
     
-    glBindVertexArray(VAO);
-    glBindBuffer(GL_ARRAY_BUFFER, VBO);
-    glBufferData(GL_ARRAY_BUFFER, (segments + 2) * 6 * sizeof(float), vertices, GL_STATIC_DRAW);
+    if (!ok) {
+        *error = "truncated pixel data";
+        free(pixels);
+        return 0;
+    }
+    image->width = width;
+    image->height = height;
+    image->pixels = pixels;
+    return 1;
+}
+
+static int loadTGA(const char* path, Image* image, const char** error) {
+    size_t size;
+    unsigned char* data = readFileBytes(path, &size);
+    if (!data) {
+        *error = "cannot open file";
+        return 0;
+    }
+    int ok = decodeTGA(data, size, image, error);
+    free(data);
+    return ok;
+}
+
+/* Slots, pixels and dirty rows are read by the render thread when it
+ * submits sprites, so the functions changing them take the resource
+ * lock; regions are only used on the simulation side */
+static Atlas* atlasCreate(Atlas* atlas, int size, GLint filter) {
+    memset(atlas, 0, sizeof(*atlas));
+    atlas->pixels = calloc((size_t)size * size, 4);
+    if (!atlas->pixels) return NULL;
+    atlas->size = size;
+    atlas->filter = filter;
+    atlas->dirtyMinY = atlas->streamMinY = size;
+    atlas->dirtyMaxY = atlas->streamMaxY = -1;
     
-    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)0);
-    glEnableVertexAttribArray(0);
+    resourceLock();
+    int slot = 0;
+    while (slot < ATLAS_MAX && (g_atlases[slot] || atlasSlotHeld(slot))) slot++;
+    if (slot < ATLAS_MAX) g_atlases[slot] = atlas;
+    resourceUnlock();
     
-    glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)(2 * sizeof(float)));
-    glEnableVertexAttribArray(1);
+    if (slot == ATLAS_MAX) {
+        free(atlas->pixels);
+        atlas->pixels = NULL;
+        return NULL;
+    }
+    atlas->slot = slot;
+    return atlas;
+}
+
+static void atlasDestroy(Atlas* atlas) {
+    if (!atlas->pixels) return;
+    resourceLock();
+    g_atlases[atlas->slot] = NULL;
+    free(atlas->pixels);
+    atlas->pixels = NULL;
+    GLuint texture = atlas->texture;
+    atlas->texture = 0;
+    resourceUnlock();
     
-    glUseProgram(g_engine.shaderProgram);
+    /* In threaded mode recorded sprites name atlases by slot, so the
+     * slot is reused only once no list from before now is drawn */
+    releaseGLObject(GL_OBJECT_TEXTURE, texture);
+    releaseGLObject(GL_OBJECT_ATLAS_SLOT, (GLuint)atlas->slot);
+    free(atlas->regions);
+    atlas->regions = NULL;
+}
+
+/* Registers a pixel rectangle of the atlas; returns its index or -1 */
+static int atlasAddRegion(Atlas* atlas, int x, int y, int w, int h) {
+    if (atlas->regionCount == atlas->regionCapacity) {
+        int capacity = atlas->regionCapacity ? atlas->regionCapacity * 2 : 64;
+        AtlasRegion* regions = realloc(atlas->regions, capacity * sizeof(AtlasRegion));
+        if (!regions) return -1;
+        atlas->regions = regions;
+        atlas->regionCapacity = capacity;
+    }
     
-    float projection[16];
-    orthographicMatrix(projection, 0, g_engine.windowWidth, g_engine.windowHeight, 0);
+    float texel = 1.0f / atlas->size;
+    AtlasRegion* region = &atlas->regions[atlas->regionCount];
+    region->x = x;
+    region->y = y;
+    region->w = w;
+    region->h = h;
+    region->u0 = x * texel;
+    region->v0 = y * texel;
+    region->u1 = (x + w) * texel;
+    region->v1 = (y + h) * texel;
+    return atlas->regionCount++;
+}
+
+/* Shelf packing: images fill the current row left to right, and a new
+ * row starts below the tallest image so far when one doesn't fit.
+ * Returns the pixel position, or 0 when the atlas is full. */
+static int atlasPack(Atlas* atlas, int w, int h, int* outX, int* outY) {
+    int paddedW = w + 2 * ATLAS_PADDING;
+    int paddedH = h + 2 * ATLAS_PADDING;
     
-    GLint projLoc = glGetUniformLocation(g_engine.shaderProgram, "projection");
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, projection);
+    if (paddedW > atlas->size) return 0;
+    if (atlas->shelfX + paddedW > atlas->size) {
+        atlas->shelfY += atlas->shelfHeight;
+        atlas->shelfX = 0;
+        atlas->shelfHeight = 0;
+    }
+    if (atlas->shelfY + paddedH > atlas->size) return 0;
+    
+    *outX = atlas->shelfX + ATLAS_PADDING;
+    *outY = atlas->shelfY + ATLAS_PADDING;
+    atlas->shelfX += paddedW;
+    if (paddedH > atlas->shelfHeight) atlas->shelfHeight = paddedH;
+    return 1;
+}
+
+/* Copies an image in with its edge-extruded border and marks the rows
+ * dirty, or for streamed images leaves them to atlasStreamUploads().
+ * Returns the packed position, or 0 when the atlas is full. */
+static int atlasBlit(Atlas* atlas, const Image* image, int streamed, int* outX, int* outY) {
+    int x, y;
+    if (!atlasPack(atlas, image->width, image->height, &x, &y)) return 0;
+    
+    resourceLock();
+    for (int row = -ATLAS_PADDING; row < image->height + ATLAS_PADDING; row++) {
+        int srcRow = row < 0 ? 0 : (row >= image->height ? image->height - 1 : row);
+        const unsigned char* src = image->pixels + (size_t)srcRow * image->width * 4;
+        unsigned char* dst = atlas->pixels + ((size_t)(y + row) * atlas->size + x) * 4;
+        
+        memcpy(dst, src, (size_t)image->width * 4);
+        for (int p = 1; p <= ATLAS_PADDING; p++) {
+            memcpy(dst - p * 4, src, 4);
+            memcpy(dst + (image->width - 1 + p) * 4, src + (image->width - 1) * 4, 4);
+        }
+    }
+    
+    int* minY = streamed ? &atlas->streamMinY : &atlas->dirtyMinY;
+    int* maxY = streamed ? &atlas->streamMaxY : &atlas->dirtyMaxY;
+    if (y - ATLAS_PADDING < *minY) *minY = y - ATLAS_PADDING;
+    if (y + image->height + ATLAS_PADDING - 1 > *maxY) *maxY = y + image->height + ATLAS_PADDING - 1;
+    resourceUnlock();
+    *outX = x;
+    *outY = y;
+    return 1;
+}
+
+/* Binds the atlas texture, creating it or uploading dirty rows first */
+static void atlasBind(Atlas* atlas) {
+    if (!atlas->texture) {
+        glGenTextures(1, &atlas->texture);
+        bindTexture(atlas->texture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, atlas->filter);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, atlas->filter);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, atlas->size, atlas->size, 0,
+                     GL_RGBA, GL_UNSIGNED_BYTE, atlas->pixels);
+        atlas->streamMinY = atlas->size;
+        atlas->streamMaxY = -1;
+    } else {
+        bindTexture(atlas->texture);
+        if (atlas->dirtyMinY <= atlas->dirtyMaxY) {
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, atlas->dirtyMinY, atlas->size,
+                            atlas->dirtyMaxY - atlas->dirtyMinY + 1, GL_RGBA, GL_UNSIGNED_BYTE,
+                            atlas->pixels + (size_t)atlas->dirtyMinY * atlas->size * 4);
+        }
+    }
+    atlas->dirtyMinY = atlas->size;
+    atlas->dirtyMaxY = -1;
+}
+
+/* Uploads streamed rows ATLAS_STREAM_ROWS at a time until budgetMs is
+ * spent, so loading a level doesn't stall a frame on one big upload.
+ * An atlas never drawn yet gets its texture here: empty, or with every
+ * row at once when it also holds ordinary dirty rows. */
+static void atlasStreamUploads(double budgetMs) {
+    double deadline = glfwGetTime() + budgetMs / 1000.0;
+    
+    resourceLock();
+    for (int a = 0; a < ATLAS_MAX; a++) {
+        Atlas* atlas = g_atlases[a];
+        if (!atlas || atlas->streamMinY > atlas->streamMaxY) continue;
+        if (!atlas->texture && atlas->dirtyMinY <= atlas->dirtyMaxY) {
+            atlasBind(atlas);
+        } else if (!atlas->texture) {
+            glGenTextures(1, &atlas->texture);
+            bindTexture(atlas->texture);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, atlas->filter);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, atlas->filter);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, atlas->size, atlas->size, 0,
+                         GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        } else {
+            bindTexture(atlas->texture);
+        }
+        
+        while (atlas->streamMinY <= atlas->streamMaxY && glfwGetTime() < deadline) {
+            int rows = atlas->streamMaxY - atlas->streamMinY + 1;
+            if (rows > ATLAS_STREAM_ROWS) rows = ATLAS_STREAM_ROWS;
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, atlas->streamMinY, atlas->size, rows, GL_RGBA, GL_UNSIGNED_BYTE,
+                            atlas->pixels + (size_t)atlas->streamMinY * atlas->size * 4);
+            atlas->streamMinY += rows;
+        }
+        if (atlas->streamMinY > atlas->streamMaxY) {
+            atlas->streamMinY = atlas->size;
+            atlas->streamMaxY = -1;
+        }
+    }
+    resourceUnlock();
+}
+
+/* Whether rows y0..y1 have reached the GPU; the caller holds the
+ * resource lock */
+static int atlasRowsResident(const Atlas* atlas, int y0, int y1) {
+    return atlas->texture && (atlas->streamMinY > y1 || atlas->streamMaxY < y0);
+}
+
+/* ============================================================ */
+/* BATCH RENDERER */
+/* ============================================================ */
+
+static const int batchStride[] = {
+    VERTEX_FLOATS,  /* BATCH_TRIANGLES */
+    VERTEX_FLOATS,  /* BATCH_LINES */
+    CIRCLE_FLOATS,  /* BATCH_CIRCLES */
+    SPRITE_FLOATS,  /* BATCH_SPRITES */
+};
+
+
+/* Vertex layouts, applied to the bound VAO and array buffer starting at
+ * byte `offset`. Shared by the streaming batch, which re-points them at
+ * each flush's slice of the stream ring, and retained meshes. */
+static void setupColorLayout(size_t offset) {
+    ShaderProgram* program = &g_engine.shaderProgram;
+    glVertexAttribPointer(program->positionLoc, 2, GL_FLOAT, GL_FALSE, VERTEX_FLOATS * sizeof(float), (void*)offset);
+    glEnableVertexAttribArray(program->positionLoc);
+    glVertexAttribPointer(program->colorLoc, 4, GL_FLOAT, GL_FALSE, VERTEX_FLOATS * sizeof(float), (void*)(offset + 2 * sizeof(float)));
+    glEnableVertexAttribArray(program->colorLoc);
+}
+
+/* Points the per-instance attributes at instanceVBO from `offset`. There
+ * are no base-instance draws in GL 3.3 / WebGL 2, so this is also how a
+ * draw starts partway into an instance stream. */
+static void setupCircleInstances(GLuint instanceVBO, size_t offset) {
+    ShaderProgram* program = &g_engine.circleProgram;
+    glBindBuffer(GL_ARRAY_BUFFER, instanceVBO);
+    glVertexAttribPointer(program->instanceLoc, 3, GL_FLOAT, GL_FALSE, CIRCLE_FLOATS * sizeof(float), (void*)offset);
+    glVertexAttribPointer(program->colorLoc, 4, GL_FLOAT, GL_FALSE, CIRCLE_FLOATS * sizeof(float), (void*)(offset + 3 * sizeof(float)));
+}
+
+/* Binds the shared unit quad as the corner stream and instanceVBO as
+ * the per-instance stream */
+static void setupCircleLayout(GLuint instanceVBO) {
+    ShaderProgram* program = &g_engine.circleProgram;
+    glBindBuffer(GL_ARRAY_BUFFER, g_engine.circleQuadVBO);
+    glVertexAttribPointer(program->cornerLoc, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), (void*)0);
+    glEnableVertexAttribArray(program->cornerLoc);
+    
+    setupCircleInstances(instanceVBO, 0);
+    glEnableVertexAttribArray(program->instanceLoc);
+    glVertexAttribDivisor(program->instanceLoc, 1);
+    glEnableVertexAttribArray(program->colorLoc);
+    glVertexAttribDivisor(program->colorLoc, 1);
+}
+
+static void setupSpriteLayout(size_t offset) {
+    ShaderProgram* program = &g_engine.spriteProgram;
+    glVertexAttribPointer(program->positionLoc, 2, GL_FLOAT, GL_FALSE, SPRITE_VERTEX_FLOATS * sizeof(float), (void*)offset);
+    glEnableVertexAttribArray(program->positionLoc);
+    glVertexAttribPointer(program->texcoordLoc, 2, GL_FLOAT, GL_FALSE, SPRITE_VERTEX_FLOATS * sizeof(float), (void*)(offset + 2 * sizeof(float)));
+    glEnableVertexAttribArray(program->texcoordLoc);
+    glVertexAttribPointer(program->colorLoc, 4, GL_FLOAT, GL_FALSE, SPRITE_VERTEX_FLOATS * sizeof(float), (void*)(offset + 4 * sizeof(float)));
+    glEnableVertexAttribArray(program->colorLoc);
+}
+
+void initBatch() {
+    StreamBuffer* stream = &g_engine.stream;
+    initStream(stream);
+    
+    glGenVertexArrays(1, &g_engine.VAO);
+    bindVertexArray(g_engine.VAO);
+    glBindBuffer(GL_ARRAY_BUFFER, stream->buffer);
+    setupColorLayout(0);
+    
+    /* Instanced circles: static unit quad + per-instance stream */
+    static const float quad[] = { -1, -1,  1, -1,  -1, 1,  1, 1 };
+    
+    glGenVertexArrays(1, &g_engine.circleVAO);
+    glGenBuffers(1, &g_engine.circleQuadVBO);
+    
+    bindVertexArray(g_engine.circleVAO);
+    glBindBuffer(GL_ARRAY_BUFFER, g_engine.circleQuadVBO);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(quad), quad, GL_STATIC_DRAW);
+    setupCircleLayout(stream->buffer);
+    
+    /* Sprites: expanded textured vertices */
+    glGenVertexArrays(1, &g_engine.spriteVAO);
+    bindVertexArray(g_engine.spriteVAO);
+    glBindBuffer(GL_ARRAY_BUFFER, stream->buffer);
+    setupSpriteLayout(0);
+    
+    g_engine.batch.capacity = BATCH_INITIAL_FLOATS;
+    g_engine.batch.data = malloc(g_engine.batch.capacity * sizeof(float));
+    g_engine.batch.count = 0;
+    g_engine.batch.used = 0;
+    g_engine.batch.kind = BATCH_TRIANGLES;
+}
+
+static inline float* putSpriteVertex(float* v, const float* corner, float u, float t, const float* color) {
+    v[0] = corner[0];
+    v[1] = corner[1];
+    v[2] = u;
+    v[3] = t;
+    memcpy(v + 4, color, 4 * sizeof(float));
+    return v + SPRITE_VERTEX_FLOATS;
+}
+
+/* Sprites queued since the last other primitive are counting-sorted by
+ * atlas (stable, so submission order holds within an atlas) and expanded
+ * into one vertex stream in `arena`; starts[a]..starts[a + 1] is atlas
+ * a's run of sprites. Returns NULL when out of memory. */
+static float* expandSprites(const Batch* batch, int starts[ATLAS_MAX + 1], FrameArena* arena) {
+    int n = batch->count;
+    int* order = arenaAlloc(arena, n * sizeof(int));
+    float* vertices = arenaAlloc(arena, (size_t)n * 6 * SPRITE_VERTEX_FLOATS * sizeof(float));
+    if (!order || !vertices) return NULL;
+    
+    memset(starts, 0, (ATLAS_MAX + 1) * sizeof(int));
+    for (int i = 0; i < n; i++) {
+        starts[(int)batch->data[i * SPRITE_FLOATS] + 1]++;
+    }
+    for (int a = 0; a < ATLAS_MAX; a++) {
+        starts[a + 1] += starts[a];
+    }
+    int cursor[ATLAS_MAX];
+    memcpy(cursor, starts, sizeof(cursor));
+    for (int i = 0; i < n; i++) {
+        order[cursor[(int)batch->data[i * SPRITE_FLOATS]]++] = i;
+    }
+    
+    float* v = vertices;
+    for (int k = 0; k < n; k++) {
+        const float* s = batch->data + order[k] * SPRITE_FLOATS;
+        const float* color = s + 13;
+        v = putSpriteVertex(v, s + 1, s[9],  s[10], color);
+        v = putSpriteVertex(v, s + 3, s[11], s[10], color);
+        v = putSpriteVertex(v, s + 5, s[11], s[12], color);
+        v = putSpriteVertex(v, s + 1, s[9],  s[10], color);
+        v = putSpriteVertex(v, s + 5, s[11], s[12], color);
+        v = putSpriteVertex(v, s + 7, s[9],  s[12], color);
+    }
+    return vertices;
+}
+
+/* One draw call per atlas present in the run */
+static void flushSprites(const Batch* batch) {
+    int n = batch->count;
+    int starts[ATLAS_MAX + 1];
+    size_t mark = arenaMark(&g_renderArena);
+    float* vertices = expandSprites(batch, starts, &g_renderArena);
+    if (!vertices) return;
+    
+    StreamSpan span = streamWrite(&g_engine.stream, vertices, (size_t)n * 6 * SPRITE_VERTEX_FLOATS * sizeof(float));
+    arenaRewind(&g_renderArena, mark);
+    bindVertexArray(g_engine.spriteVAO);
+    glBindBuffer(GL_ARRAY_BUFFER, span.buffer);
+    setupSpriteLayout(span.offset);
+    useProgram(&g_engine.spriteProgram);
+    
+    resourceLock();
+    for (int a = 0; a < ATLAS_MAX; a++) {
+        int count = starts[a + 1] - starts[a];
+        if (count == 0 || !g_atlases[a]) continue;
+        atlasBind(g_atlases[a]);
+        glDrawArrays(GL_TRIANGLES, starts[a] * 6, count * 6);
+        g_engine.stats.current.drawCalls++;
+    }
+    resourceUnlock();
+    g_engine.stats.current.vertices += n * 6;
+}
+
+/* Retained geometry. While a mesh is recording, flushBatch appends the
+ * batch to the mesh's staging buffers as runs instead of drawing; the
+ * staged data is then uploaded once to GL_STATIC_DRAW buffers. */
+typedef enum {
+    MESH_COLORED,    /* triangles and lines */
+    MESH_CIRCLES,
+    MESH_SPRITES,
+    MESH_STREAM_COUNT
+} MeshStream;
+
+typedef struct {
+    BatchKind kind;
+    int atlas;       /* sprites only */
+    int first;       /* vertices, or instances for circles */
+    int count;
+} MeshRun;
+
+typedef struct {
+    MeshRun* runs;
+    int runCount;
+    int runCapacity;
+    Scratch staging[MESH_STREAM_COUNT];
+    int staged[MESH_STREAM_COUNT];     /* elements staged per stream */
+    GLuint vbo[MESH_STREAM_COUNT];
+    GLuint vao[MESH_STREAM_COUNT];
+    int valid;
+    int failed;                        /* ran out of memory while recording */
+} Mesh;
+
+static Mesh* g_captureMesh;
+/* Threaded mode: the list the simulation thread is recording into */
+static DrawList* g_recordList;
+
+/* True when a bounding box lies entirely outside the view, so the draw
+ * can be dropped before generating vertices. Meshes record everything:
+ * the view when they are drawn isn't known yet. */
+static inline int viewRejects(float minX, float minY, float maxX, float maxY) {
+    const View* view = &g_engine.view;
+    return !g_captureMesh &&
+           (maxX < view->minX || minX > view->maxX || maxY < view->minY || minY > view->maxY);
+}
+
+/* Same for (x, y, w, h), allowing negative sizes */
+static inline int viewRejectsRect(float x, float y, float w, float h) {
+    return viewRejects(fminf(x, x + w), fminf(y, y + h), fmaxf(x, x + w), fmaxf(y, y + h));
+}
+
+#define CAPTURE_PINS_KEY "engine.capturePins"
+
+/* Ties the userdata at idx (an atlas or font the recording draws from)
+ * to the lifetime of the mesh being recorded, if any */
+static void capturePin(lua_State* L, int idx) {
+    if (!g_captureMesh) return;
+    idx = lua_absindex(L, idx);
+    lua_getfield(L, LUA_REGISTRYINDEX, CAPTURE_PINS_KEY);
+    lua_pushvalue(L, idx);
+    lua_pushboolean(L, 1);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+}
+
+static const int meshStreamFloats[MESH_STREAM_COUNT] = {
+    VERTEX_FLOATS, CIRCLE_FLOATS, SPRITE_VERTEX_FLOATS,
+};
+
+static void meshAppend(Mesh* mesh, MeshStream stream, BatchKind kind, int atlas,
+                       const float* data, int count) {
+    if (mesh->runCount == mesh->runCapacity) {
+        int capacity = mesh->runCapacity ? mesh->runCapacity * 2 : 16;
+        MeshRun* runs = realloc(mesh->runs, capacity * sizeof(MeshRun));
+        if (!runs) {
+            mesh->failed = 1;
+            return;
+        }
+        mesh->runs = runs;
+        mesh->runCapacity = capacity;
+    }
+    
+    size_t stride = meshStreamFloats[stream] * sizeof(float);
+    float* staging = scratchReserve(&mesh->staging[stream], (mesh->staged[stream] + count) * stride);
+    if (!staging) {
+        mesh->failed = 1;
+        return;
+    }
+    memcpy((char*)staging + mesh->staged[stream] * stride, data, count * stride);
+    
+    MeshRun* run = &mesh->runs[mesh->runCount++];
+    run->kind = kind;
+    run->atlas = atlas;
+    run->first = mesh->staged[stream];
+    run->count = count;
+    mesh->staged[stream] += count;
+}
+
+static void meshCapture(Mesh* mesh, const Batch* batch) {
+    switch (batch->kind) {
+    case BATCH_TRIANGLES:
+    case BATCH_LINES:
+        meshAppend(mesh, MESH_COLORED, batch->kind, 0, batch->data, batch->count);
+        break;
+    
+    case BATCH_CIRCLES:
+        meshAppend(mesh, MESH_CIRCLES, batch->kind, 0, batch->data, batch->count);
+        break;
+    
+    case BATCH_SPRITES: {
+        int starts[ATLAS_MAX + 1];
+        size_t mark = arenaMark(&g_frameArena);
+        float* vertices = expandSprites(batch, starts, &g_frameArena);
+        if (!vertices) {
+            mesh->failed = 1;
+            return;
+        }
+        for (int a = 0; a < ATLAS_MAX; a++) {
+            int count = starts[a + 1] - starts[a];
+            if (count == 0) continue;
+            meshAppend(mesh, MESH_SPRITES, BATCH_SPRITES, a,
+                       vertices + (size_t)starts[a] * 6 * SPRITE_VERTEX_FLOATS, count * 6);
+        }
+        arenaRewind(&g_frameArena, mark);
+        break;
+    }
+    }
+}
+
+/* Appends the batch as one command; on failure the batch is dropped */
+static void drawListAppend(DrawList* list, const Batch* batch) {
+    if (list->commandCount == list->commandCapacity) {
+        int capacity = list->commandCapacity ? list->commandCapacity * 2 : 64;
+        DrawCommand* commands = realloc(list->commands, capacity * sizeof(DrawCommand));
+        if (!commands) return;
+        list->commands = commands;
+        list->commandCapacity = capacity;
+    }
+    if (list->used + batch->used > list->capacity) {
+        size_t capacity = list->capacity ? list->capacity : BATCH_INITIAL_FLOATS;
+        while (capacity < list->used + batch->used) capacity *= 2;
+        float* data = realloc(list->data, capacity * sizeof(float));
+        if (!data) return;
+        list->data = data;
+        list->capacity = capacity;
+    }
+    
+    DrawCommand* command = &list->commands[list->commandCount++];
+    command->kind = batch->kind;
+    command->first = list->used;
+    command->used = batch->used;
+    command->count = batch->count;
+    memcpy(command->projection, g_engine.view.projection, sizeof(command->projection));
+    memcpy(list->data + list->used, batch->data, batch->used * sizeof(float));
+    list->used += batch->used;
+}
+
+/* Draws a batch under the current projection */
+static void submitBatch(const Batch* batch) {
+    StreamSpan span;
+    switch (batch->kind) {
+    case BATCH_TRIANGLES:
+    case BATCH_LINES:
+        span = streamWrite(&g_engine.stream, batch->data, batch->used * sizeof(float));
+        bindVertexArray(g_engine.VAO);
+        glBindBuffer(GL_ARRAY_BUFFER, span.buffer);
+        setupColorLayout(span.offset);
+        useProgram(&g_engine.shaderProgram);
+        glDrawArrays(batch->kind == BATCH_LINES ? GL_LINES : GL_TRIANGLES, 0, batch->count);
+        g_engine.stats.current.vertices += batch->count;
+        g_engine.stats.current.drawCalls++;
+        break;
+    
+    case BATCH_CIRCLES:
+        span = streamWrite(&g_engine.stream, batch->data, batch->used * sizeof(float));
+        bindVertexArray(g_engine.circleVAO);
+        setupCircleInstances(span.buffer, span.offset);
+        useProgram(&g_engine.circleProgram);
+        glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, batch->count);
+        g_engine.stats.current.vertices += batch->count * 4;
+        g_engine.stats.current.drawCalls++;
+        break;
+    
+    case BATCH_SPRITES:
+        flushSprites(batch);
+        break;
+    }
+}
+
+void flushBatch() {
+    Batch* batch = &g_engine.batch;
+    if (batch->count == 0) return;
+    
+    if (g_captureMesh) {
+        meshCapture(g_captureMesh, batch);
+    } else if (g_recordList) {
+        drawListAppend(g_recordList, batch);
+    } else {
+        setProjection(g_engine.view.projection);
+        submitBatch(batch);
+    }
+    batch->count = 0;
+    batch->used = 0;
+}
+
+/* Returns room for `count` elements of the given kind, flushing first if
+ * the queued elements are of a different kind. */
+static float* batchReserve(BatchKind kind, int count) {
+    Batch* batch = &g_engine.batch;
+    
+    if (batch->kind != kind) {
+        flushBatch();
+        batch->kind = kind;
+    }
+    
+    int floats = count * batchStride[kind];
+    if (batch->used + floats > batch->capacity) {
+        int capacity = batch->capacity;
+        while (batch->used + floats > capacity) capacity *= 2;
+        
+        float* data = realloc(batch->data, capacity * sizeof(float));
+        if (!data) {
+            /* Out of memory: submit what we have and reuse the buffer */
+            flushBatch();
+            if (floats > batch->capacity) return NULL;
+        } else {
+            batch->data = data;
+            batch->capacity = capacity;
+        }
+    }
+    
+    float* out = batch->data + batch->used;
+    batch->used += floats;
+    batch->count += count;
+    return out;
+}
+
+/* Gives back the last `count` elements of the latest reservation */
+static void batchUnreserve(int count) {
+    g_engine.batch.count -= count;
+    g_engine.batch.used -= count * batchStride[g_engine.batch.kind];
+}
+
+static inline float* putVertex(float* v, float x, float y, float r, float g, float b, float a) {
+    v[0] = x;
+    v[1] = y;
+    v[2] = r;
+    v[3] = g;
+    v[4] = b;
+    v[5] = a;
+    return v + VERTEX_FLOATS;
+}
+
+/* Two triangles covering (x, y, w, h) */
+static inline float* putRect(float* v, float x, float y, float w, float h, float r, float g, float b, float a) {
+    v = putVertex(v, x,     y,     r, g, b, a);
+    v = putVertex(v, x + w, y,     r, g, b, a);
+    v = putVertex(v, x + w, y + h, r, g, b, a);
+    v = putVertex(v, x,     y,     r, g, b, a);
+    v = putVertex(v, x + w, y + h, r, g, b, a);
+    return putVertex(v, x,     y + h, r, g, b, a);
+}
+
+static inline float* putCircle(float* v, float x, float y, float radius, float r, float g, float b, float a) {
+    v[0] = x;
+    v[1] = y;
+    v[2] = radius;
+    v[3] = r;
+    v[4] = g;
+    v[5] = b;
+    v[6] = a;
+    return v + CIRCLE_FLOATS;
+}
+
+/* Queues a region of an atlas over four corners (x, y pairs, clockwise
+ * from the region's top-left); the caller has done any culling */
+static void putSpriteQuad(const Atlas* atlas, const AtlasRegion* region, const float corners[8],
+                          float r, float g, float b, float a) {
+    float* v = batchReserve(BATCH_SPRITES, 1);
+    if (!v) return;
+    
+    v[0] = (float)atlas->slot;
+    memcpy(v + 1, corners, 8 * sizeof(float));
+    v[9] = region->u0;
+    v[10] = region->v0;
+    v[11] = region->u1;
+    v[12] = region->v1;
+    v[13] = r;
+    v[14] = g;
+    v[15] = b;
+    v[16] = a;
+}
+
+/* Queues a region of an atlas as a w x h quad at (x, y), rotated by
+ * `rotation` radians about its center */
+static void putSprite(const Atlas* atlas, const AtlasRegion* region,
+                      float x, float y, float w, float h, float rotation,
+                      float r, float g, float b, float a) {
+    /* Conservative reject: the rotated quad stays inside the circle
+     * through its corners */
+    float reach = rotation == 0.0f ? 0.0f : 0.5f * sqrtf(w * w + h * h);
+    float cx = x + w * 0.5f, cy = y + h * 0.5f;
+    if (rotation == 0.0f ? viewRejectsRect(x, y, w, h)
+                         : viewRejects(cx - reach, cy - reach, cx + reach, cy + reach)) return;
+    
+    float corners[8];
+    if (rotation == 0.0f) {
+        corners[0] = x;     corners[1] = y;
+        corners[2] = x + w; corners[3] = y;
+        corners[4] = x + w; corners[5] = y + h;
+        corners[6] = x;     corners[7] = y + h;
+    } else {
+        float c = cosf(rotation), s = sinf(rotation);
+        float hx = w * 0.5f, hy = h * 0.5f;
+        const float offsets[4][2] = { {-hx, -hy}, {hx, -hy}, {hx, hy}, {-hx, hy} };
+        for (int i = 0; i < 4; i++) {
+            corners[i * 2] = cx + offsets[i][0] * c - offsets[i][1] * s;
+            corners[i * 2 + 1] = cy + offsets[i][0] * s + offsets[i][1] * c;
+        }
+    }
+    putSpriteQuad(atlas, region, corners, r, g, b, a);
+}
+
+void shutdownBatch() {
+    free(g_engine.batch.data);
+    g_engine.batch.data = NULL;
+    g_engine.batch.count = g_engine.batch.used = g_engine.batch.capacity = 0;
+    
+    GLuint arrays[] = { g_engine.VAO, g_engine.circleVAO, g_engine.spriteVAO };
+    glDeleteBuffers(1, &g_engine.circleQuadVBO);
+    glDeleteVertexArrays(3, arrays);
+    shutdownStream(&g_engine.stream);
+}
+
+/* ============================================================ */
+/* LUA BINDING FUNCTIONS */
+/* ============================================================ */
+
+/* Returns the output table at `arg` (or a new one) at the stack top */
+static int pushOutputTable(lua_State* L, int arg) {
+    if (lua_istable(L, arg)) {
+        lua_pushvalue(L, arg);
+    } else {
+        lua_newtable(L);
+    }
+    return lua_gettop(L);
+}
+
+/* Nils out stale entries past `count` left over from a previous call */
+static void trimOutputTable(lua_State* L, int idx, int count) {
+    int len = (int)lua_rawlen(L, idx);
+    for (int i = count + 1; i <= len; i++) {
+        lua_pushnil(L);
+        lua_rawseti(L, idx, i);
+    }
+}
+
+static int lua_drawRect(lua_State* L) {
+    float x = luaL_checknumber(L, 1);
+    float y = luaL_checknumber(L, 2);
+    float w = luaL_checknumber(L, 3);
+    float h = luaL_checknumber(L, 4);
+    float r = luaL_checknumber(L, 5);
+    float g = luaL_checknumber(L, 6);
+    float b = luaL_checknumber(L, 7);
+    float a = luaL_optnumber(L, 8, 1.0);
+    
+    if (viewRejectsRect(x, y, w, h)) return 0;
+    float* v = batchReserve(BATCH_TRIANGLES, 6);
+    if (!v) return 0;
+    
+    putRect(v, x, y, w, h, r, g, b, a);
+    
+    return 0;
+}
+
+static int lua_drawCircle(lua_State* L) {
+    float x = luaL_checknumber(L, 1);
+    float y = luaL_checknumber(L, 2);
+    float radius = luaL_checknumber(L, 3);
+    float r = luaL_checknumber(L, 4);
+    float g = luaL_checknumber(L, 5);
+    float b = luaL_checknumber(L, 6);
+    float a = luaL_optnumber(L, 7, 1.0);
+    
+    if (viewRejects(x - radius, y - radius, x + radius, y + radius)) return 0;
+    float* v = batchReserve(BATCH_CIRCLES, 1);
+    if (!v) return 0;
+    
+    putCircle(v, x, y, radius, r, g, b, a);
+    
+    return 0;
+}
+
+/* draw.circles(array [, count]) -- array holds count * 7 numbers:
+ * x, y, radius, r, g, b, a for each circle. */
+static int lua_drawCircles(lua_State* L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    int count = (int)luaL_optinteger(L, 2, (lua_Integer)(lua_rawlen(L, 1) / CIRCLE_FLOATS));
+    if (count <= 0) return 0;
+    
+    float* v = batchReserve(BATCH_CIRCLES, count);
+    if (!v) return 0;
+    
+    /* Copy each instance in place; culled ones are overwritten by the next */
+    int culled = 0;
+    for (int c = 0; c < count; c++) {
+        for (int k = 0; k < CIRCLE_FLOATS; k++) {
+            lua_rawgeti(L, 1, c * CIRCLE_FLOATS + k + 1);
+            v[k] = (float)lua_tonumber(L, -1);
+            lua_pop(L, 1);
+        }
+        if (viewRejects(v[0] - v[2], v[1] - v[2], v[0] + v[2], v[1] + v[2])) culled++;
+        else v += CIRCLE_FLOATS;
+    }
+    batchUnreserve(culled);
+    
+    return 0;
+}
+
+static int lua_drawLine(lua_State* L) {
+    float x1 = luaL_checknumber(L, 1);
+    float y1 = luaL_checknumber(L, 2);
+    float x2 = luaL_checknumber(L, 3);
+    float y2 = luaL_checknumber(L, 4);
+    float r = luaL_checknumber(L, 5);
+    float g = luaL_checknumber(L, 6);
+    float b = luaL_checknumber(L, 7);
+    float a = luaL_optnumber(L, 8, 1.0);
+    
+    if (viewRejects(fminf(x1, x2), fminf(y1, y2), fmaxf(x1, x2), fmaxf(y1, y2))) return 0;
+    float* v = batchReserve(BATCH_LINES, 2);
+    if (!v) return 0;
+    
+    v = putVertex(v, x1, y1, r, g, b, a);
+    putVertex(v, x2, y2, r, g, b, a);
+    
+    return 0;
+}
+
+static int lua_getClearColor(lua_State* L) {
+    lua_newtable(L);
+    lua_pushnumber(L, g_engine.clearColor[0]);
+    lua_setfield(L, -2, "r");
+    lua_pushnumber(L, g_engine.clearColor[1]);
+    lua_setfield(L, -2, "g");
+    lua_pushnumber(L, g_engine.clearColor[2]);
+    lua_setfield(L, -2, "b");
+    return 1;
+}
+
+static int lua_setClearColor(lua_State* L) {
+    float r = luaL_checknumber(L, 1);
+    float g = luaL_checknumber(L, 2);
+    float b = luaL_checknumber(L, 3);
+    g_engine.clearColor[0] = r;
+    g_engine.clearColor[1] = g;
+    g_engine.clearColor[2] = b;
+    /* Threaded mode hands the color over with the frame's draw list */
+    if (!g_threaded.running) glClearColor(r, g, b, 1.0f);
+    return 0;
+}
+
+static int lua_getWindowSize(lua_State* L) {
+    lua_newtable(L);
+    lua_pushnumber(L, g_engine.windowWidth);
+    lua_setfield(L, -2, "width");
+    lua_pushnumber(L, g_engine.windowHeight);
+    lua_setfield(L, -2, "height");
+    return 1;
+}
+
+/* ============================================================ */
+/* SPRITES */
+/* ============================================================ */
+
+#define ATLAS_METATABLE "Atlas"
+
+static Atlas* checkAtlas(lua_State* L, int idx) {
+    Atlas* atlas = (Atlas*)luaL_checkudata(L, idx, ATLAS_METATABLE);
+    luaL_argcheck(L, atlas->pixels != NULL, idx, "atlas has been released");
+    return atlas;
+}
+
+/* Region ids are 1-based on the Lua side */
+static const AtlasRegion* checkRegion(lua_State* L, const Atlas* atlas, int idx) {
+    lua_Integer id = luaL_checkinteger(L, idx);
+    luaL_argcheck(L, id >= 1 && id <= atlas->regionCount, idx, "invalid atlas region");
+    return &atlas->regions[id - 1];
+}
+
+/* Packs an image and pushes its region id, or nil and a message */
+static int pushPackedImage(lua_State* L, Atlas* atlas, const Image* image) {
+    int x, y;
+    if (!atlasBlit(atlas, image, 0, &x, &y)) {
+        lua_pushnil(L);
+        lua_pushstring(L, "atlas is full");
+        return 2;
+    }
+    int region = atlasAddRegion(atlas, x, y, image->width, image->height);
+    if (region < 0) return luaL_error(L, "out of memory adding atlas region");
+    lua_pushinteger(L, region + 1);
+    return 1;
+}
+
+/* graphics.newAtlas([size], [filter]) -- filter is "nearest" or "linear" */
+static int lua_newAtlas(lua_State* L) {
+    static const char* const filters[] = { "nearest", "linear", NULL };
+    lua_Integer size = luaL_optinteger(L, 1, ATLAS_DEFAULT_SIZE);
+    int filter = luaL_checkoption(L, 2, "nearest", filters);
+    luaL_argcheck(L, size >= 16 && size <= 8192, 1, "atlas size must be in [16, 8192]");
+    
+    Atlas* atlas = (Atlas*)lua_newuserdatauv(L, sizeof(Atlas), 0);
+    memset(atlas, 0, sizeof(*atlas));
+    if (!atlasCreate(atlas, (int)size, filter ? GL_LINEAR : GL_NEAREST)) {
+        return luaL_error(L, "cannot create atlas (out of memory or more than %d atlases)", ATLAS_MAX);
+    }
+    luaL_setmetatable(L, ATLAS_METATABLE);
+    return 1;
+}
+
+/* atlas:load(path) -> region, or nil and an error (TGA images) */
+static int lua_atlasLoad(lua_State* L) {
+    Atlas* atlas = checkAtlas(L, 1);
+    const char* path = luaL_checkstring(L, 2);
+    const char* error = NULL;
+    Image image;
+    
+    if (!loadTGA(path, &image, &error)) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "%s: %s", path, error);
+        return 2;
+    }
+    int results = pushPackedImage(L, atlas, &image);
+    free(image.pixels);
+    return results;
+}
+
+/* atlas:loadSheet(path, frameWidth, frameHeight) -> firstRegion, frameCount
+ * Frames are cut left to right, top to bottom from one packed image. */
+static int lua_atlasLoadSheet(lua_State* L) {
+    Atlas* atlas = checkAtlas(L, 1);
+    const char* path = luaL_checkstring(L, 2);
+    int frameW = (int)luaL_checkinteger(L, 3);
+    int frameH = (int)luaL_checkinteger(L, 4);
+    const char* error = NULL;
+    Image image;
+    int x, y;
+    
+    luaL_argcheck(L, frameW > 0, 3, "frame width must be positive");
+    luaL_argcheck(L, frameH > 0, 4, "frame height must be positive");
+    if (!loadTGA(path, &image, &error)) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "%s: %s", path, error);
+        return 2;
+    }
+    
+    int columns = image.width / frameW;
+    int rows = image.height / frameH;
+    if (columns == 0 || rows == 0) {
+        free(image.pixels);
+        lua_pushnil(L);
+        lua_pushfstring(L, "%s: smaller than one frame", path);
+        return 2;
+    }
+    int packed = atlasBlit(atlas, &image, 0, &x, &y);
+    free(image.pixels);
+    if (!packed) {
+        lua_pushnil(L);
+        lua_pushstring(L, "atlas is full");
+        return 2;
+    }
+    
+    int first = atlas->regionCount;
+    for (int row = 0; row < rows; row++) {
+        for (int col = 0; col < columns; col++) {
+            if (atlasAddRegion(atlas, x + col * frameW, y + row * frameH, frameW, frameH) < 0) {
+                return luaL_error(L, "out of memory adding atlas region");
+            }
+        }
+    }
+    lua_pushinteger(L, first + 1);
+    lua_pushinteger(L, columns * rows);
+    return 2;
+}
+
+/* atlas:addPixels(width, height, rgba) -> region; rgba is a string of
+ * width * height * 4 bytes, top row first */
+static int lua_atlasAddPixels(lua_State* L) {
+    Atlas* atlas = checkAtlas(L, 1);
+    lua_Integer w = luaL_checkinteger(L, 2);
+    lua_Integer h = luaL_checkinteger(L, 3);
+    size_t length;
+    const char* data = luaL_checklstring(L, 4, &length);
+    
+    luaL_argcheck(L, w > 0 && h > 0, 2, "image size must be positive");
+    luaL_argcheck(L, length == (size_t)(w * h * 4), 4, "expected width * height * 4 bytes");
+    
+    Image image = { (int)w, (int)h, (unsigned char*)data };
+    return pushPackedImage(L, atlas, &image);
+}
+
+/* atlas:region(id) -> x, y, width, height in atlas pixels */
+static int lua_atlasRegion(lua_State* L) {
+    Atlas* atlas = checkAtlas(L, 1);
+    const AtlasRegion* region = checkRegion(L, atlas, 2);
+    lua_pushinteger(L, region->x);
+    lua_pushinteger(L, region->y);
+    lua_pushinteger(L, region->w);
+    lua_pushinteger(L, region->h);
+    return 4;
+}
+
+static int lua_atlasCount(lua_State* L) {
+    lua_pushinteger(L, checkAtlas(L, 1)->regionCount);
+    return 1;
+}
+
+static int lua_atlasGC(lua_State* L) {
+    Atlas* atlas = (Atlas*)luaL_checkudata(L, 1, ATLAS_METATABLE);
+    /* Queued sprites may still reference it */
+    if (g_engine.batch.kind == BATCH_SPRITES) flushBatch();
+    atlasDestroy(atlas);
+    return 0;
+}
+
+/* draw.sprite(atlas, region, x, y, [w], [h], [rotation], [r, g, b, a])
+ * Size defaults to the region's; rotation is in radians about the center. */
+static int lua_drawSprite(lua_State* L) {
+    Atlas* atlas = checkAtlas(L, 1);
+    const AtlasRegion* region = checkRegion(L, atlas, 2);
+    float x = luaL_checknumber(L, 3);
+    float y = luaL_checknumber(L, 4);
+    float w = luaL_optnumber(L, 5, region->w);
+    float h = luaL_optnumber(L, 6, region->h);
+    float rotation = luaL_optnumber(L, 7, 0.0);
+    float r = luaL_optnumber(L, 8, 1.0);
+    float g = luaL_optnumber(L, 9, 1.0);
+    float b = luaL_optnumber(L, 10, 1.0);
+    float a = luaL_optnumber(L, 11, 1.0);
+    
+    putSprite(atlas, region, x, y, w, h, rotation, r, g, b, a);
+    capturePin(L, 1);
+    return 0;
+}
+
+void registerSpriteModule(lua_State* L) {
+    static const luaL_Reg methods[] = {
+        {"load", lua_atlasLoad},
+        {"loadSheet", lua_atlasLoadSheet},
+        {"addPixels", lua_atlasAddPixels},
+        {"region", lua_atlasRegion},
+        {"count", lua_atlasCount},
+        {NULL, NULL}
+    };
+    
+    luaL_newmetatable(L, ATLAS_METATABLE);
+    luaL_newlib(L, methods);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, lua_atlasCount);
+    lua_setfield(L, -2, "__len");
+    lua_pushcfunction(L, lua_atlasGC);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+    
+    lua_getglobal(L, "graphics");
+    lua_pushcfunction(L, lua_newAtlas);
+    lua_setfield(L, -2, "newAtlas");
+    lua_pop(L, 1);
+    
+    lua_getglobal(L, "draw");
+    lua_pushcfunction(L, lua_drawSprite);
+    lua_setfield(L, -2, "sprite");
+    lua_pop(L, 1);
+}
+
+/* ============================================================ */
+/* ASSET STREAMING */
+/* ============================================================ */
+
+/* Asynchronous loads. Files are read and decoded on loader threads
+ * (started with the first request), or fetched over HTTP on the web,
+ * where the Fetch API keeps a copy in IndexedDB. Once per frame the Lua
+ * thread packs the decoded images into their atlases, within a time
+ * budget, and the render side uploads the packed rows in budgeted slices
+ * (atlasStreamUploads). A handle becomes ready, and its callbacks run,
+ * once its pixels are on the GPU. A pending job holds a reference to its
+ * handle, so callbacks fire even if the script drops it. */
+
+#define ASSET_METATABLE "Asset"
+#define ASSET_REFS_KEY "engine.assets"
+#define ASSET_THREADS 2
+#define ASSET_DEFAULT_BUDGET_MS 2.0
+
+enum {
+    ASSET_UV_ATLAS = 1,     /* kept alive until the image is packed */
+    ASSET_UV_CALLBACKS,
+    ASSET_UV_RESULT,        /* data string, or the error message */
+    ASSET_UV_COUNT = ASSET_UV_RESULT
+};
+
+typedef enum {
+    ASSET_IMAGE,
+    ASSET_SHEET,
+    ASSET_DATA,
+} AssetKind;
+
+typedef enum {
+    ASSET_LOADING,
+    ASSET_READY,
+    ASSET_FAILED,
+} AssetStatus;
+
+typedef struct {
+    AssetStatus status;
+    int region;             /* first region, from 1 */
+    int count;              /* sheet frames */
+} Asset;
+
+typedef struct AssetJob {
+    AssetKind kind;
+    int ref;                /* the handle, in ASSET_REFS_KEY */
+    Atlas* atlas;
+    int frameW, frameH;
+    unsigned char* bytes;   /* file contents */
+    size_t size;
+    Image image;            /* decoded pixels */
+    const char* error;
+    int y0, y1;             /* packed rows, while uploading */
+    struct AssetJob* next;
+    char path[];
+} AssetJob;
+
+typedef struct {
+#ifdef ENGINE_JOBS
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;
+    pthread_t threads[ASSET_THREADS];
+    int started;            /* threads running; -1 once starting them failed */
+    int quit;
+#endif
+    AssetJob* queue;        /* to read and decode */
+    AssetJob* queueTail;
+    AssetJob* done;         /* decoded, for assetPump */
+    AssetJob* doneTail;
+    AssetJob* uploading;    /* packed, waiting for their rows to reach the GPU */
+    int inFlight;
+    double budgetMs;
+} AssetLoader;
+
+static AssetLoader g_assets = {
+#ifdef ENGINE_JOBS
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+#endif
+    .budgetMs = ASSET_DEFAULT_BUDGET_MS,
+};
+
+static void assetLock(void) {
+#ifdef ENGINE_JOBS
+    pthread_mutex_lock(&g_assets.mutex);
+#endif
+}
+
+static void assetUnlock(void) {
+#ifdef ENGINE_JOBS
+    pthread_mutex_unlock(&g_assets.mutex);
+#endif
+}
+
+static void assetAppend(AssetJob** head, AssetJob** tail, AssetJob* job) {
+    job->next = NULL;
+    if (*tail) (*tail)->next = job;
+    else *head = job;
+    *tail = job;
+}
+
+static void assetFree(AssetJob* job) {
+    free(job->bytes);
+    free(job->image.pixels);
+    free(job);
+}
+
+/* Reads (unless fetched already) and decodes; runs on a loader thread */
+static void assetDecode(AssetJob* job) {
+    if (!job->bytes && !job->error) {
+        job->bytes = readFileBytes(job->path, &job->size);
+        if (!job->bytes) job->error = "cannot open file";
+    }
+    if (job->bytes && job->kind != ASSET_DATA) {
+        decodeTGA(job->bytes, job->size, &job->image, &job->error);
+        free(job->bytes);
+        job->bytes = NULL;
+    }
+}
+
+static void assetDone(AssetJob* job) {
+    assetLock();
+    assetAppend(&g_assets.done, &g_assets.doneTail, job);
+    assetUnlock();
+}
+
+#ifdef ENGINE_JOBS
+static void* assetWorker(void* arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&g_assets.mutex);
+        while (!g_assets.queue && !g_assets.quit) pthread_cond_wait(&g_assets.wake, &g_assets.mutex);
+        if (g_assets.quit) {
+            pthread_mutex_unlock(&g_assets.mutex);
+            break;
+        }
+        AssetJob* job = g_assets.queue;
+        g_assets.queue = job->next;
+        if (!g_assets.queue) g_assets.queueTail = NULL;
+        pthread_mutex_unlock(&g_assets.mutex);
+        
+        assetDecode(job);
+        assetDone(job);
+    }
+    return NULL;
+}
+#endif
+
+/* Hands a job to the loader threads, or decodes it here without them */
+static void assetQueueDecode(AssetJob* job) {
+#ifdef ENGINE_JOBS
+    pthread_mutex_lock(&g_assets.mutex);
+    if (g_assets.started == 0) {
+        for (int i = 0; i < ASSET_THREADS; i++) {
+            if (pthread_create(&g_assets.threads[g_assets.started], NULL, assetWorker, NULL) == 0) {
+                g_assets.started++;
+            }
+        }
+        if (g_assets.started == 0) g_assets.started = -1;
+    }
+    if (g_assets.started > 0) {
+        assetAppend(&g_assets.queue, &g_assets.queueTail, job);
+        pthread_cond_signal(&g_assets.wake);
+        pthread_mutex_unlock(&g_assets.mutex);
+        return;
+    }
+    pthread_mutex_unlock(&g_assets.mutex);
+#endif
+    assetDecode(job);
+    assetDone(job);
+}
+
+#ifdef __EMSCRIPTEN__
+static void assetFetched(emscripten_fetch_t* fetch) {
+    AssetJob* job = fetch->userData;
+    job->bytes = malloc(fetch->numBytes > 0 ? (size_t)fetch->numBytes : 1);
+    if (job->bytes) {
+        memcpy(job->bytes, fetch->data, (size_t)fetch->numBytes);
+        job->size = (size_t)fetch->numBytes;
+    } else {
+        job->error = "out of memory";
+    }
+    emscripten_fetch_close(fetch);
+    assetQueueDecode(job);
+}
+
+static void assetFetchFailed(emscripten_fetch_t* fetch) {
+    AssetJob* job = fetch->userData;
+    job->error = fetch->status == 404 ? "not found" : "download failed";
+    emscripten_fetch_close(fetch);
+    assetDone(job);
+}
+#endif
+
+static void assetSubmit(AssetJob* job) {
+    g_assets.inFlight++;
+#ifdef __EMSCRIPTEN__
+    /* Files preloaded into MEMFS (WEB_PRELOAD=1) are read like native ones */
+    FILE* file = fopen(job->path, "rb");
+    if (file) {
+        fclose(file);
+        assetQueueDecode(job);
+        return;
+    }
+    emscripten_fetch_attr_t attr;
+    emscripten_fetch_attr_init(&attr);
+    strcpy(attr.requestMethod, "GET");
+    attr.attributes = EMSCRIPTEN_FETCH_LOAD_TO_MEMORY | EMSCRIPTEN_FETCH_PERSIST_FILE;
+    attr.userData = job;
+    attr.onsuccess = assetFetched;
+    attr.onerror = assetFetchFailed;
+    emscripten_fetch(&attr, job->path);
+#else
+    assetQueueDecode(job);
+#endif
+}
+
+/* Pushes what handle:get() returns */
+static int assetPushResult(lua_State* L, int idx, const Asset* asset) {
+    idx = lua_absindex(L, idx);
+    if (asset->status == ASSET_FAILED) {
+        lua_pushnil(L);
+        lua_getiuservalue(L, idx, ASSET_UV_RESULT);
+        return 2;
+    }
+    if (asset->status == ASSET_LOADING) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "loading");
+        return 2;
+    }
+    if (asset->count > 0) {
+        lua_pushinteger(L, asset->region);
+        lua_pushinteger(L, asset->count);
+        return 2;
+    }
+    if (asset->region > 0) {
+        lua_pushinteger(L, asset->region);
+        return 1;
+    }
+    lua_getiuservalue(L, idx, ASSET_UV_RESULT);
+    return 1;
+}
+
+/* fn(handle, results of handle:get()); errors are reported like loop()'s */
+static void assetCall(lua_State* L, int handle, const Asset* asset) {
+    lua_pushvalue(L, -1);
+    lua_pushvalue(L, handle);
+    int n = assetPushResult(L, handle, asset);
+    if (lua_pcall(L, 1 + n, 0, 0) != LUA_OK) {
+        fprintf(stderr, "Lua error in asset callback: %s\n", lua_tostring(L, -1));
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+}
+
+static void assetFinish(lua_State* L, AssetJob* job, AssetStatus status, const char* error) {
+    lua_getfield(L, LUA_REGISTRYINDEX, ASSET_REFS_KEY);
+    lua_rawgeti(L, -1, job->ref);
+    luaL_unref(L, -2, job->ref);
+    lua_remove(L, -2);
+    int handle = lua_gettop(L);
+    Asset* asset = (Asset*)lua_touserdata(L, handle);
+    
+    asset->status = status;
+    if (status == ASSET_FAILED) {
+        lua_pushfstring(L, "%s: %s", job->path, error);
+        lua_setiuservalue(L, handle, ASSET_UV_RESULT);
+    } else if (job->kind == ASSET_DATA) {
+        lua_pushlstring(L, (const char*)job->bytes, job->size);
+        lua_setiuservalue(L, handle, ASSET_UV_RESULT);
+    }
+    lua_pushnil(L);
+    lua_setiuservalue(L, handle, ASSET_UV_ATLAS);
+    g_assets.inFlight--;
+    assetFree(job);
+    
+    lua_getiuservalue(L, handle, ASSET_UV_CALLBACKS);
+    if (lua_istable(L, -1)) {
+        lua_pushnil(L);
+        lua_setiuservalue(L, handle, ASSET_UV_CALLBACKS);
+        lua_Integer n = (lua_Integer)lua_rawlen(L, -1);
+        for (lua_Integer i = 1; i <= n; i++) {
+            lua_rawgeti(L, -1, i);
+            assetCall(L, handle, asset);
+        }
+    }
+    lua_settop(L, handle - 1);
+}
+
+/* Packs a decoded image into its atlas; 1 if it now waits for upload */
+static int assetPack(lua_State* L, AssetJob* job) {
+    Atlas* atlas = job->atlas;
+    Image* image = &job->image;
+    const char* error = NULL;
+    int x, y, first = -1, count = 0;
+    
+    if (!atlas->pixels) {
+        error = "atlas has been released";
+    } else if (job->kind == ASSET_SHEET && (image->width < job->frameW || image->height < job->frameH)) {
+        error = "smaller than one frame";
+    } else if (!atlasBlit(atlas, image, 1, &x, &y)) {
+        error = "atlas is full";
+    } else if (job->kind == ASSET_IMAGE) {
+        first = atlasAddRegion(atlas, x, y, image->width, image->height);
+    } else {
+        int columns = image->width / job->frameW;
+        int rows = image->height / job->frameH;
+        first = atlas->regionCount;
+        for (int row = 0; row < rows && first >= 0; row++) {
+            for (int col = 0; col < columns; col++) {
+                if (atlasAddRegion(atlas, x + col * job->frameW, y + row * job->frameH,
+                                   job->frameW, job->frameH) < 0) {
+                    first = -1;
+                    break;
+                }
+            }
+        }
+        count = columns * rows;
+    }
+    if (!error && first < 0) error = "out of memory adding atlas region";
+    if (error) {
+        assetFinish(L, job, ASSET_FAILED, error);
+        return 0;
+    }
+    
+    lua_getfield(L, LUA_REGISTRYINDEX, ASSET_REFS_KEY);
+    lua_rawgeti(L, -1, job->ref);
+    Asset* asset = (Asset*)lua_touserdata(L, -1);
+    asset->region = first + 1;
+    asset->count = count;
+    lua_pop(L, 2);
+    
+    job->y0 = y - ATLAS_PADDING;
+    job->y1 = y + image->height + ATLAS_PADDING - 1;
+    free(image->pixels);
+    image->pixels = NULL;
+    return 1;
+}
+
+/* Once per frame on the Lua thread: finishes uploads that have landed,
+ * then handles decoded jobs until the budget is spent */
+static void assetPump(lua_State* L) {
+    if (g_assets.inFlight == 0) return;
+    double deadline = glfwGetTime() + g_assets.budgetMs / 1000.0;
+    
+    for (AssetJob** link = &g_assets.uploading; *link; ) {
+        AssetJob* job = *link;
+        resourceLock();
+        int resident = !job->atlas->pixels || atlasRowsResident(job->atlas, job->y0, job->y1);
+        resourceUnlock();
+        if (!resident) {
+            link = &job->next;
+            continue;
+        }
+        *link = job->next;
+        if (job->atlas->pixels) assetFinish(L, job, ASSET_READY, NULL);
+        else assetFinish(L, job, ASSET_FAILED, "atlas has been released");
+    }
+    
+    for (;;) {
+        assetLock();
+        AssetJob* job = g_assets.done;
+        if (job) {
+            g_assets.done = job->next;
+            if (!g_assets.done) g_assets.doneTail = NULL;
+        }
+        assetUnlock();
+        if (!job) break;
+        
+        if (job->error) {
+            assetFinish(L, job, ASSET_FAILED, job->error);
+        } else if (job->kind == ASSET_DATA) {
+            assetFinish(L, job, ASSET_READY, NULL);
+        } else if (assetPack(L, job)) {
+            job->next = g_assets.uploading;
+            g_assets.uploading = job;
+        }
+        if (glfwGetTime() >= deadline) break;
+    }
+}
+
+/* Stops the loader threads and frees what they were working on; after
+ * lua_close, which already dropped the handles */
+static void assetStop(void) {
+#ifdef ENGINE_JOBS
+    pthread_mutex_lock(&g_assets.mutex);
+    g_assets.quit = 1;
+    pthread_cond_broadcast(&g_assets.wake);
+    pthread_mutex_unlock(&g_assets.mutex);
+    for (int i = 0; i < g_assets.started; i++) {
+        pthread_join(g_assets.threads[i], NULL);
+    }
+    g_assets.started = 0;
+#endif
+    AssetJob* lists[] = { g_assets.queue, g_assets.done, g_assets.uploading };
+    for (int l = 0; l < 3; l++) {
+        while (lists[l]) {
+            AssetJob* next = lists[l]->next;
+            assetFree(lists[l]);
+            lists[l] = next;
+        }
+    }
+    g_assets.queue = g_assets.queueTail = NULL;
+    g_assets.done = g_assets.doneTail = NULL;
+    g_assets.uploading = NULL;
+    g_assets.inFlight = 0;
+}
+
+static Asset* checkAsset(lua_State* L, int idx) {
+    return (Asset*)luaL_checkudata(L, idx, ASSET_METATABLE);
+}
+
+/* Creates the handle (left on the stack) and submits its job; onReady
+ * is the callback's stack index, or 0 */
+static int assetLoad(lua_State* L, AssetKind kind, Atlas* atlas, const char* path,
+                     int frameW, int frameH, int onReady) {
+    Asset* asset = (Asset*)lua_newuserdatauv(L, sizeof(Asset), ASSET_UV_COUNT);
+    *asset = (Asset){ ASSET_LOADING, 0, 0 };
+    luaL_setmetatable(L, ASSET_METATABLE);
+    if (atlas) {
+        lua_pushvalue(L, 1);
+        lua_setiuservalue(L, -2, ASSET_UV_ATLAS);
+    }
+    if (onReady) {
+        lua_createtable(L, 1, 0);
+        lua_pushvalue(L, onReady);
+        lua_rawseti(L, -2, 1);
+        lua_setiuservalue(L, -2, ASSET_UV_CALLBACKS);
+    }
+    
+    lua_getfield(L, LUA_REGISTRYINDEX, ASSET_REFS_KEY);
+    lua_pushvalue(L, -2);
+    int ref = luaL_ref(L, -2);
+    size_t length = strlen(path);
+    AssetJob* job = calloc(1, sizeof(AssetJob) + length + 1);
+    if (!job) {
+        luaL_unref(L, -1, ref);
+        return luaL_error(L, "out of memory loading asset");
+    }
+    lua_pop(L, 1);
+    
+    job->kind = kind;
+    job->ref = ref;
+    job->atlas = atlas;
+    job->frameW = frameW;
+    job->frameH = frameH;
+    memcpy(job->path, path, length + 1);
+    assetSubmit(job);
+    return 1;
+}
+
+static int optCallback(lua_State* L, int idx) {
+    if (lua_isnoneornil(L, idx)) return 0;
+    luaL_checktype(L, idx, LUA_TFUNCTION);
+    return idx;
+}
+
+/* asset.loadImage(atlas, path, [onReady]) -> handle; get() gives the
+ * region, like atlas:load() (TGA images) */
+static int lua_assetLoadImage(lua_State* L) {
+    Atlas* atlas = checkAtlas(L, 1);
+    const char* path = luaL_checkstring(L, 2);
+    return assetLoad(L, ASSET_IMAGE, atlas, path, 0, 0, optCallback(L, 3));
+}
+
+/* asset.loadSheet(atlas, path, frameWidth, frameHeight, [onReady]) ->
+ * handle; get() gives firstRegion, frameCount like atlas:loadSheet() */
+static int lua_assetLoadSheet(lua_State* L) {
+    Atlas* atlas = checkAtlas(L, 1);
+    const char* path = luaL_checkstring(L, 2);
+    int frameW = (int)luaL_checkinteger(L, 3);
+    int frameH = (int)luaL_checkinteger(L, 4);
+    luaL_argcheck(L, frameW > 0, 3, "frame width must be positive");
+    luaL_argcheck(L, frameH > 0, 4, "frame height must be positive");
+    return assetLoad(L, ASSET_SHEET, atlas, path, frameW, frameH, optCallback(L, 5));
+}
+
+/* asset.loadData(path, [onReady]) -> handle; get() gives the file
+ * contents as a string */
+static int lua_assetLoadData(lua_State* L) {
+    const char* path = luaL_checkstring(L, 1);
+    return assetLoad(L, ASSET_DATA, NULL, path, 0, 0, optCallback(L, 2));
+}
+
+/* asset.setBudget(ms) -- time per frame for packing decoded images and,
+ * separately, for uploading them */
+static int lua_assetSetBudget(lua_State* L) {
+    lua_Number ms = luaL_checknumber(L, 1);
+    luaL_argcheck(L, ms > 0.0, 1, "budget must be positive");
+    g_assets.budgetMs = ms;
+    return 0;
+}
+
+/* asset.pending() -> loads not yet ready or failed */
+static int lua_assetPending(lua_State* L) {
+    lua_pushinteger(L, g_assets.inFlight);
+    return 1;
+}
+
+/* handle:status() -> "loading", "ready" or "failed" */
+static int lua_assetStatus(lua_State* L) {
+    static const char* const names[] = { "loading", "ready", "failed" };
+    lua_pushstring(L, names[checkAsset(L, 1)->status]);
+    return 1;
+}
+
+/* handle:get() -> the load's results, or nil and "loading" or the error */
+static int lua_assetGet(lua_State* L) {
+    return assetPushResult(L, 1, checkAsset(L, 1));
+}
+
+/* handle:onReady(fn) -- fn(handle, results...) once the load finishes
+ * (successfully or not); at once if it already has */
+static int lua_assetOnReady(lua_State* L) {
+    Asset* asset = checkAsset(L, 1);
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    lua_settop(L, 2);
+    if (asset->status != ASSET_LOADING) {
+        assetCall(L, 1, asset);
+        return 0;
+    }
+    if (lua_getiuservalue(L, 1, ASSET_UV_CALLBACKS) != LUA_TTABLE) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setiuservalue(L, 1, ASSET_UV_CALLBACKS);
+    }
+    lua_pushvalue(L, 2);
+    lua_rawseti(L, -2, (lua_Integer)lua_rawlen(L, -2) + 1);
+    return 0;
+}
+
+void registerAssetModule(lua_State* L) {
+    static const luaL_Reg methods[] = {
+        {"status", lua_assetStatus},
+        {"get", lua_assetGet},
+        {"onReady", lua_assetOnReady},
+        {NULL, NULL}
+    };
+    static const luaL_Reg functions[] = {
+        {"loadImage", lua_assetLoadImage},
+        {"loadSheet", lua_assetLoadSheet},
+        {"loadData", lua_assetLoadData},
+        {"setBudget", lua_assetSetBudget},
+        {"pending", lua_assetPending},
+        {NULL, NULL}
+    };
+    
+    luaL_newmetatable(L, ASSET_METATABLE);
+    luaL_newlib(L, methods);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+    
+    lua_newtable(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, ASSET_REFS_KEY);
+    luaL_newlib(L, functions);
+    lua_setglobal(L, "asset");
+}
+
+/* ============================================================ */
+/* TEXT */
+/* ============================================================ */
+
+/* Text uses the public-domain font8x8 bitmap font (ASCII 32-126, one
+ * byte per row, least significant bit leftmost), rasterized once per
+ * font at an integer scale into the font's own atlas. Glyphs are
+ * queued as sprites, so text shares the sprite batch. */
+
+#define FONT_METATABLE "Font"
+#define FONT_FIRST_CHAR 32
+#define FONT_LAST_CHAR 126
+#define FONT_GLYPH_SIZE 8
+#define FONT_MAX_SCALE 8
+
+static const unsigned char g_font8x8[FONT_LAST_CHAR - FONT_FIRST_CHAR + 1][FONT_GLYPH_SIZE] = {
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },   /* ' ' */
+    { 0x18, 0x3C, 0x3C, 0x18, 0x18, 0x00, 0x18, 0x00 },   /* '!' */
+    { 0x36, 0x36, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },   /* '"' */
+    { 0x36, 0x36, 0x7F, 0x36, 0x7F, 0x36, 0x36, 0x00 },   /* '#' */
+    { 0x0C, 0x3E, 0x03, 0x1E, 0x30, 0x1F, 0x0C, 0x00 },   /* '$' */
+    { 0x00, 0x63, 0x33, 0x18, 0x0C, 0x66, 0x63, 0x00 },   /* '%' */
+    { 0x1C, 0x36, 0x1C, 0x6E, 0x3B, 0x33, 0x6E, 0x00 },   /* '&' */
+    { 0x06, 0x06, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00 },   /* ''' */
+    { 0x18, 0x0C, 0x06, 0x06, 0x06, 0x0C, 0x18, 0x00 },   /* '(' */
+    { 0x06, 0x0C, 0x18, 0x18, 0x18, 0x0C, 0x06, 0x00 },   /* ')' */
+    { 0x00, 0x66, 0x3C, 0xFF, 0x3C, 0x66, 0x00, 0x00 },   /* '*' */
+    { 0x00, 0x0C, 0x0C, 0x3F, 0x0C, 0x0C, 0x00, 0x00 },   /* '+' */
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C, 0x06 },   /* ',' */
+    { 0x00, 0x00, 0x00, 0x3F, 0x00, 0x00, 0x00, 0x00 },   /* '-' */
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C, 0x00 },   /* '.' */
+    { 0x60, 0x30, 0x18, 0x0C, 0x06, 0x03, 0x01, 0x00 },   /* '/' */
+    { 0x3E, 0x63, 0x73, 0x7B, 0x6F, 0x67, 0x3E, 0x00 },   /* '0' */
+    { 0x0C, 0x0E, 0x0C, 0x0C, 0x0C, 0x0C, 0x3F, 0x00 },   /* '1' */
+    { 0x1E, 0x33, 0x30, 0x1C, 0x06, 0x33, 0x3F, 0x00 },   /* '2' */
+    { 0x1E, 0x33, 0x30, 0x1C, 0x30, 0x33, 0x1E, 0x00 },   /* '3' */
+    { 0x38, 0x3C, 0x36, 0x33, 0x7F, 0x30, 0x78, 0x00 },   /* '4' */
+    { 0x3F, 0x03, 0x1F, 0x30, 0x30, 0x33, 0x1E, 0x00 },   /* '5' */
+    { 0x1C, 0x06, 0x03, 0x1F, 0x33, 0x33, 0x1E, 0x00 },   /* '6' */
+    { 0x3F, 0x33, 0x30, 0x18, 0x0C, 0x0C, 0x0C, 0x00 },   /* '7' */
+    { 0x1E, 0x33, 0x33, 0x1E, 0x33, 0x33, 0x1E, 0x00 },   /* '8' */
+    { 0x1E, 0x33, 0x33, 0x3E, 0x30, 0x18, 0x0E, 0x00 },   /* '9' */
+    { 0x00, 0x0C, 0x0C, 0x00, 0x00, 0x0C, 0x0C, 0x00 },   /* ':' */
+    { 0x00, 0x0C, 0x0C, 0x00, 0x00, 0x0C, 0x0C, 0x06 },   /* ';' */
+    { 0x18, 0x0C, 0x06, 0x03, 0x06, 0x0C, 0x18, 0x00 },   /* '<' */
+    { 0x00, 0x00, 0x3F, 0x00, 0x00, 0x3F, 0x00, 0x00 },   /* '=' */
+    { 0x06, 0x0C, 0x18, 0x30, 0x18, 0x0C, 0x06, 0x00 },   /* '>' */
+    { 0x1E, 0x33, 0x30, 0x18, 0x0C, 0x00, 0x0C, 0x00 },   /* '?' */
+    { 0x3E, 0x63, 0x7B, 0x7B, 0x7B, 0x03, 0x1E, 0x00 },   /* '@' */
+    { 0x0C, 0x1E, 0x33, 0x33, 0x3F, 0x33, 0x33, 0x00 },   /* 'A' */
+    { 0x3F, 0x66, 0x66, 0x3E, 0x66, 0x66, 0x3F, 0x00 },   /* 'B' */
+    { 0x3C, 0x66, 0x03, 0x03, 0x03, 0x66, 0x3C, 0x00 },   /* 'C' */
+    { 0x1F, 0x36, 0x66, 0x66, 0x66, 0x36, 0x1F, 0x00 },   /* 'D' */
+    { 0x7F, 0x46, 0x16, 0x1E, 0x16, 0x46, 0x7F, 0x00 },   /* 'E' */
+    { 0x7F, 0x46, 0x16, 0x1E, 0x16, 0x06, 0x0F, 0x00 },   /* 'F' */
+    { 0x3C, 0x66, 0x03, 0x03, 0x73, 0x66, 0x7C, 0x00 },   /* 'G' */
+    { 0x33, 0x33, 0x33, 0x3F, 0x33, 0x33, 0x33, 0x00 },   /* 'H' */
+    { 0x1E, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00 },   /* 'I' */
+    { 0x78, 0x30, 0x30, 0x30, 0x33, 0x33, 0x1E, 0x00 },   /* 'J' */
+    { 0x67, 0x66, 0x36, 0x1E, 0x36, 0x66, 0x67, 0x00 },   /* 'K' */
+    { 0x0F, 0x06, 0x06, 0x06, 0x46, 0x66, 0x7F, 0x00 },   /* 'L' */
+    { 0x63, 0x77, 0x7F, 0x7F, 0x6B, 0x63, 0x63, 0x00 },   /* 'M' */
+    { 0x63, 0x67, 0x6F, 0x7B, 0x73, 0x63, 0x63, 0x00 },   /* 'N' */
+    { 0x1C, 0x36, 0x63, 0x63, 0x63, 0x36, 0x1C, 0x00 },   /* 'O' */
+    { 0x3F, 0x66, 0x66, 0x3E, 0x06, 0x06, 0x0F, 0x00 },   /* 'P' */
+    { 0x1E, 0x33, 0x33, 0x33, 0x3B, 0x1E, 0x38, 0x00 },   /* 'Q' */
+    { 0x3F, 0x66, 0x66, 0x3E, 0x36, 0x66, 0x67, 0x00 },   /* 'R' */
+    { 0x1E, 0x33, 0x07, 0x0E, 0x38, 0x33, 0x1E, 0x00 },   /* 'S' */
+    { 0x3F, 0x2D, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00 },   /* 'T' */
+    { 0x33, 0x33, 0x33, 0x33, 0x33, 0x33, 0x3F, 0x00 },   /* 'U' */
+    { 0x33, 0x33, 0x33, 0x33, 0x33, 0x1E, 0x0C, 0x00 },   /* 'V' */
+    { 0x63, 0x63, 0x63, 0x6B, 0x7F, 0x77, 0x63, 0x00 },   /* 'W' */
+    { 0x63, 0x63, 0x36, 0x1C, 0x1C, 0x36, 0x63, 0x00 },   /* 'X' */
+    { 0x33, 0x33, 0x33, 0x1E, 0x0C, 0x0C, 0x1E, 0x00 },   /* 'Y' */
+    { 0x7F, 0x63, 0x31, 0x18, 0x4C, 0x66, 0x7F, 0x00 },   /* 'Z' */
+    { 0x1E, 0x06, 0x06, 0x06, 0x06, 0x06, 0x1E, 0x00 },   /* '[' */
+    { 0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x40, 0x00 },   /* '\' */
+    { 0x1E, 0x18, 0x18, 0x18, 0x18, 0x18, 0x1E, 0x00 },   /* ']' */
+    { 0x08, 0x1C, 0x36, 0x63, 0x00, 0x00, 0x00, 0x00 },   /* '^' */
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF },   /* '_' */
+    { 0x0C, 0x0C, 0x18, 0x00, 0x00, 0x00, 0x00, 0x00 },   /* '`' */
+    { 0x00, 0x00, 0x1E, 0x30, 0x3E, 0x33, 0x6E, 0x00 },   /* 'a' */
+    { 0x07, 0x06, 0x06, 0x3E, 0x66, 0x66, 0x3B, 0x00 },   /* 'b' */
+    { 0x00, 0x00, 0x1E, 0x33, 0x03, 0x33, 0x1E, 0x00 },   /* 'c' */
+    { 0x38, 0x30, 0x30, 0x3E, 0x33, 0x33, 0x6E, 0x00 },   /* 'd' */
+    { 0x00, 0x00, 0x1E, 0x33, 0x3F, 0x03, 0x1E, 0x00 },   /* 'e' */
+    { 0x1C, 0x36, 0x06, 0x0F, 0x06, 0x06, 0x0F, 0x00 },   /* 'f' */
+    { 0x00, 0x00, 0x6E, 0x33, 0x33, 0x3E, 0x30, 0x1F },   /* 'g' */
+    { 0x07, 0x06, 0x36, 0x6E, 0x66, 0x66, 0x67, 0x00 },   /* 'h' */
+    { 0x0C, 0x00, 0x0E, 0x0C, 0x0C, 0x0C, 0x1E, 0x00 },   /* 'i' */
+    { 0x30, 0x00, 0x30, 0x30, 0x30, 0x33, 0x33, 0x1E },   /* 'j' */
+    { 0x07, 0x06, 0x66, 0x36, 0x1E, 0x36, 0x67, 0x00 },   /* 'k' */
+    { 0x0E, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00 },   /* 'l' */
+    { 0x00, 0x00, 0x33, 0x7F, 0x7F, 0x6B, 0x63, 0x00 },   /* 'm' */
+    { 0x00, 0x00, 0x1F, 0x33, 0x33, 0x33, 0x33, 0x00 },   /* 'n' */
+    { 0x00, 0x00, 0x1E, 0x33, 0x33, 0x33, 0x1E, 0x00 },   /* 'o' */
+    { 0x00, 0x00, 0x3B, 0x66, 0x66, 0x3E, 0x06, 0x0F },   /* 'p' */
+    { 0x00, 0x00, 0x6E, 0x33, 0x33, 0x3E, 0x30, 0x78 },   /* 'q' */
+    { 0x00, 0x00, 0x3B, 0x6E, 0x66, 0x06, 0x0F, 0x00 },   /* 'r' */
+    { 0x00, 0x00, 0x3E, 0x03, 0x1E, 0x30, 0x1F, 0x00 },   /* 's' */
+    { 0x08, 0x0C, 0x3E, 0x0C, 0x0C, 0x2C, 0x18, 0x00 },   /* 't' */
+    { 0x00, 0x00, 0x33, 0x33, 0x33, 0x33, 0x6E, 0x00 },   /* 'u' */
+    { 0x00, 0x00, 0x33, 0x33, 0x33, 0x1E, 0x0C, 0x00 },   /* 'v' */
+    { 0x00, 0x00, 0x63, 0x6B, 0x7F, 0x7F, 0x36, 0x00 },   /* 'w' */
+    { 0x00, 0x00, 0x63, 0x36, 0x1C, 0x36, 0x63, 0x00 },   /* 'x' */
+    { 0x00, 0x00, 0x33, 0x33, 0x33, 0x3E, 0x30, 0x1F },   /* 'y' */
+    { 0x00, 0x00, 0x3F, 0x19, 0x0C, 0x26, 0x3F, 0x00 },   /* 'z' */
+    { 0x38, 0x0C, 0x0C, 0x07, 0x0C, 0x0C, 0x38, 0x00 },   /* '{' */
+    { 0x18, 0x18, 0x18, 0x00, 0x18, 0x18, 0x18, 0x00 },   /* '|' */
+    { 0x07, 0x0C, 0x0C, 0x38, 0x0C, 0x0C, 0x07, 0x00 },   /* '}' */
+    { 0x6E, 0x3B, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },   /* '~' */
+};
+
+typedef struct {
+    Atlas atlas;
+    int scale;
+    int glyphRegion[FONT_LAST_CHAR - FONT_FIRST_CHAR + 1];
+} Font;
+
+/* Layout cache: 4-way set-associative, keyed by (font, string), with
+ * least-recently-used replacement inside a set. A label drawn every
+ * frame is laid out once; a changing string costs one slot per frame. */
+#define TEXT_CACHE_SETS 64
+#define TEXT_CACHE_WAYS 4
+
+typedef struct {
+    short region;
+    short column;
+    short line;
+} GlyphQuad;
+
+typedef struct {
+    const Font* font;
+    unsigned hash;
+    char* text;
+    size_t length;
+    GlyphQuad* quads;
+    int quadCount;
+    int columns;         /* widest line, in glyphs */
+    int lines;
+    unsigned lastUsed;
+} TextLayout;
+
+static TextLayout g_textCache[TEXT_CACHE_SETS][TEXT_CACHE_WAYS];
+static unsigned g_textClock;
+static Font* g_defaultFont;
+
+static int fontInit(Font* font, int scale) {
+    int cell = FONT_GLYPH_SIZE * scale;
+    int glyphs = FONT_LAST_CHAR - FONT_FIRST_CHAR + 1;
+    int size = 64;
+    while ((size / (cell + 2 * ATLAS_PADDING)) * (size / (cell + 2 * ATLAS_PADDING)) < glyphs) size *= 2;
+    
+    if (!atlasCreate(&font->atlas, size, GL_NEAREST)) return 0;
+    font->scale = scale;
+    
+    size_t mark = arenaMark(&g_frameArena);
+    unsigned char* pixels = arenaAlloc(&g_frameArena, (size_t)cell * cell * 4);
+    if (!pixels) return 0;
+    Image image = { cell, cell, pixels };
+    
+    for (int c = 0; c < glyphs; c++) {
+        for (int py = 0; py < cell; py++) {
+            unsigned char bits = g_font8x8[c][py / scale];
+            for (int px = 0; px < cell; px++) {
+                unsigned char* out = pixels + ((size_t)py * cell + px) * 4;
+                out[0] = out[1] = out[2] = 255;
+                out[3] = (bits >> (px / scale)) & 1 ? 255 : 0;
+            }
+        }
+        int x, y;
+        if (!atlasBlit(&font->atlas, &image, 0, &x, &y) ||
+            (font->glyphRegion[c] = atlasAddRegion(&font->atlas, x, y, cell, cell)) < 0) {
+            arenaRewind(&g_frameArena, mark);
+            return 0;
+        }
+    }
+    arenaRewind(&g_frameArena, mark);
+    return 1;
+}
+
+/* FNV-1a */
+static unsigned hashText(const char* text, size_t length) {
+    unsigned hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)text[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/* Breaks text into glyph positions: '\n' starts a line, '\t' advances
+ * to the next multiple of four columns, spaces take a column without
+ * a quad, and anything outside printable ASCII (including a whole
+ * UTF-8 sequence) shows as '?'. */
+static int layoutText(TextLayout* layout, const Font* font, const char* text, size_t length) {
+    GlyphQuad* quads = malloc((length ? length : 1) * sizeof(GlyphQuad));
+    if (!quads) return 0;
+    
+    int count = 0, column = 0, line = 0, columns = 0;
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = (unsigned char)text[i];
+        
+        if (c == '\n') {
+            line++;
+            column = 0;
+            continue;
+        }
+        if (c == '\t') {
+            column = (column / 4 + 1) * 4;
+        } else if (c == ' ') {
+            column++;
+        } else {
+            if (c >= 0x80) {
+                while (i + 1 < length && ((unsigned char)text[i + 1] & 0xC0) == 0x80) i++;
+            }
+            if (c < FONT_FIRST_CHAR || c > FONT_LAST_CHAR) c = '?';
+            quads[count].region = (short)font->glyphRegion[c - FONT_FIRST_CHAR];
+            quads[count].column = (short)column;
+            quads[count].line = (short)line;
+            count++;
+            column++;
+        }
+        if (column > columns) columns = column;
+    }
+    
+    layout->quads = quads;
+    layout->quadCount = count;
+    layout->columns = columns;
+    layout->lines = length ? line + 1 : 0;
+    return 1;
+}
+
+static void textLayoutRelease(TextLayout* layout) {
+    free(layout->text);
+    free(layout->quads);
+    memset(layout, 0, sizeof(*layout));
+}
+
+/* Cached layout for (font, text); NULL only when out of memory */
+static const TextLayout* getTextLayout(const Font* font, const char* text, size_t length) {
+    unsigned hash = hashText(text, length) ^ (unsigned)(size_t)font;
+    TextLayout* set = g_textCache[hash % TEXT_CACHE_SETS];
+    TextLayout* victim = &set[0];
+    
+    g_textClock++;
+    for (int way = 0; way < TEXT_CACHE_WAYS; way++) {
+        TextLayout* entry = &set[way];
+        if (entry->text && entry->font == font && entry->hash == hash &&
+            entry->length == length && memcmp(entry->text, text, length) == 0) {
+            entry->lastUsed = g_textClock;
+            return entry;
+        }
+        if (!entry->text || (victim->text && entry->lastUsed < victim->lastUsed)) {
+            victim = entry;
+        }
+    }
+    
+    textLayoutRelease(victim);
+    victim->text = malloc(length + 1);
+    if (!victim->text || !layoutText(victim, font, text, length)) {
+        textLayoutRelease(victim);
+        return NULL;
+    }
+    memcpy(victim->text, text, length);
+    victim->text[length] = '\0';
+    victim->font = font;
+    victim->hash = hash;
+    victim->length = length;
+    victim->lastUsed = g_textClock;
+    return victim;
+}
+
+/* Drops a font's cached layouts before it is freed */
+static void textCacheForget(const Font* font) {
+    for (int set = 0; set < TEXT_CACHE_SETS; set++) {
+        for (int way = 0; way < TEXT_CACHE_WAYS; way++) {
+            if (g_textCache[set][way].font == font) textLayoutRelease(&g_textCache[set][way]);
+        }
+    }
+}
+
+static void drawTextLayout(const Font* font, const TextLayout* layout, float x, float y,
+                           float r, float g, float b, float a) {
+    float cell = (float)(FONT_GLYPH_SIZE * font->scale);
+    if (viewRejectsRect(x, y, layout->columns * cell, layout->lines * cell)) return;
+    for (int i = 0; i < layout->quadCount; i++) {
+        const GlyphQuad* q = &layout->quads[i];
+        putSprite(&font->atlas, &font->atlas.regions[q->region],
+                  x + q->column * cell, y + q->line * cell, cell, cell, 0.0f, r, g, b, a);
+    }
+}
+
+static Font* optFont(lua_State* L, int idx) {
+    if (lua_isnoneornil(L, idx)) return g_defaultFont;
+    return (Font*)luaL_checkudata(L, idx, FONT_METATABLE);
+}
+
+static int pushTextSize(lua_State* L, const Font* font, const TextLayout* layout) {
+    float cell = (float)(FONT_GLYPH_SIZE * font->scale);
+    lua_pushnumber(L, layout ? layout->columns * cell : 0.0f);
+    lua_pushnumber(L, layout ? layout->lines * cell : 0.0f);
+    return 2;
+}
+
+/* draw.text(text, x, y, [r, g, b, a], [font]) -> width, height */
+static int lua_drawText(lua_State* L) {
+    size_t length;
+    const char* text = luaL_checklstring(L, 1, &length);
+    float x = luaL_checknumber(L, 2);
+    float y = luaL_checknumber(L, 3);
+    float r = luaL_optnumber(L, 4, 1.0);
+    float g = luaL_optnumber(L, 5, 1.0);
+    float b = luaL_optnumber(L, 6, 1.0);
+    float a = luaL_optnumber(L, 7, 1.0);
+    const Font* font = optFont(L, 8);
+    if (font != g_defaultFont) capturePin(L, 8);
+    
+    const TextLayout* layout = getTextLayout(font, text, length);
+    if (layout) drawTextLayout(font, layout, x, y, r, g, b, a);
+    return pushTextSize(L, font, layout);
+}
+
+/* graphics.measureText(text, [font]) -> width, height */
+static int lua_measureText(lua_State* L) {
+    size_t length;
+    const char* text = luaL_checklstring(L, 1, &length);
+    const Font* font = optFont(L, 2);
+    return pushTextSize(L, font, getTextLayout(font, text, length));
+}
+
+/* graphics.newFont([scale]) -- the built-in 8x8 font at scale x 8 pixels */
+static int lua_newFont(lua_State* L) {
+    lua_Integer scale = luaL_optinteger(L, 1, 2);
+    luaL_argcheck(L, scale >= 1 && scale <= FONT_MAX_SCALE, 1, "font scale must be in [1, 8]");
+    
+    Font* font = (Font*)lua_newuserdatauv(L, sizeof(Font), 0);
+    memset(font, 0, sizeof(*font));
+    if (!fontInit(font, (int)scale)) {
+        atlasDestroy(&font->atlas);
+        return luaL_error(L, "cannot create font (out of memory or too many atlases)");
+    }
+    luaL_setmetatable(L, FONT_METATABLE);
+    return 1;
+}
+
+static int lua_fontMeasure(lua_State* L) {
+    Font* font = (Font*)luaL_checkudata(L, 1, FONT_METATABLE);
+    size_t length;
+    const char* text = luaL_checklstring(L, 2, &length);
+    return pushTextSize(L, font, getTextLayout(font, text, length));
+}
+
+static int lua_fontLineHeight(lua_State* L) {
+    Font* font = (Font*)luaL_checkudata(L, 1, FONT_METATABLE);
+    lua_pushnumber(L, FONT_GLYPH_SIZE * font->scale);
+    return 1;
+}
+
+static int lua_fontGC(lua_State* L) {
+    Font* font = (Font*)luaL_checkudata(L, 1, FONT_METATABLE);
+    if (g_engine.batch.kind == BATCH_SPRITES) flushBatch();
+    textCacheForget(font);
+    if (font == g_defaultFont) g_defaultFont = NULL;
+    atlasDestroy(&font->atlas);
+    return 0;
+}
+
+void registerTextModule(lua_State* L) {
+    static const luaL_Reg methods[] = {
+        {"measure", lua_fontMeasure},
+        {"lineHeight", lua_fontLineHeight},
+        {NULL, NULL}
+    };
+    
+    luaL_newmetatable(L, FONT_METATABLE);
+    luaL_newlib(L, methods);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, lua_fontGC);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+    
+    /* Default font, pinned in the registry for the state's lifetime */
+    lua_pushcfunction(L, lua_newFont);
+    lua_call(L, 0, 1);
+    g_defaultFont = (Font*)lua_touserdata(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, "engine.defaultFont");
+    
+    lua_getglobal(L, "graphics");
+    lua_pushcfunction(L, lua_newFont);
+    lua_setfield(L, -2, "newFont");
+    lua_pushcfunction(L, lua_measureText);
+    lua_setfield(L, -2, "measureText");
+    lua_pop(L, 1);
+}
+
+/* ============================================================ */
+/* RETAINED MESHES */
+/* ============================================================ */
+
+#define MESH_METATABLE "Mesh"
+/* Mesh user values: the builder function, and the atlases/fonts pinned
+ * by its last recording */
+#define MESH_UV_BUILDER 1
+#define MESH_UV_PINS 2
+
+static void meshRelease(Mesh* mesh) {
+    for (int i = 0; i < MESH_STREAM_COUNT; i++) {
+        if (mesh->vao[i]) {
+            releaseGLObject(GL_OBJECT_VERTEX_ARRAY, mesh->vao[i]);
+            releaseGLObject(GL_OBJECT_BUFFER, mesh->vbo[i]);
+        }
+        free(mesh->staging[i].data);
+        mesh->staging[i].data = NULL;
+        mesh->staging[i].size = 0;
+        mesh->staged[i] = 0;
+        mesh->vao[i] = mesh->vbo[i] = 0;
+    }
+    mesh->runCount = 0;
+    mesh->valid = 0;
+    mesh->failed = 0;
+}
+
+/* Moves the staged streams into static buffers and drops the CPU copies */
+static void meshUpload(Mesh* mesh) {
+    for (int i = 0; i < MESH_STREAM_COUNT; i++) {
+        if (mesh->staged[i] == 0) continue;
+        
+        glGenVertexArrays(1, &mesh->vao[i]);
+        glGenBuffers(1, &mesh->vbo[i]);
+        bindVertexArray(mesh->vao[i]);
+        glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo[i]);
+        glBufferData(GL_ARRAY_BUFFER, (size_t)mesh->staged[i] * meshStreamFloats[i] * sizeof(float),
+                     mesh->staging[i].data, GL_STATIC_DRAW);
+        
+        if (i == MESH_COLORED) setupColorLayout(0);
+        else if (i == MESH_CIRCLES) setupCircleLayout(mesh->vbo[i]);
+        else setupSpriteLayout(0);
+        
+        free(mesh->staging[i].data);
+        mesh->staging[i].data = NULL;
+        mesh->staging[i].size = 0;
+    }
+    mesh->valid = 1;
+}
+
+static void meshDraw(Mesh* mesh) {
+    ShaderProgram* circle = &g_engine.circleProgram;
+    setProjection(g_engine.view.projection);
+    
+    for (int i = 0; i < mesh->runCount; i++) {
+        const MeshRun* run = &mesh->runs[i];
+        
+        switch (run->kind) {
+        case BATCH_TRIANGLES:
+        case BATCH_LINES:
+            bindVertexArray(mesh->vao[MESH_COLORED]);
+            useProgram(&g_engine.shaderProgram);
+            glDrawArrays(run->kind == BATCH_LINES ? GL_LINES : GL_TRIANGLES, run->first, run->count);
+            g_engine.stats.current.vertices += run->count;
+            break;
+        
+        case BATCH_CIRCLES: {
+            size_t offset = (size_t)run->first * CIRCLE_FLOATS * sizeof(float);
+            bindVertexArray(mesh->vao[MESH_CIRCLES]);
+            setupCircleInstances(mesh->vbo[MESH_CIRCLES], offset);
+            useProgram(circle);
+            glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, run->count);
+            g_engine.stats.current.vertices += run->count * 4;
+            break;
+        }
+        
+        case BATCH_SPRITES:
+            if (!g_atlases[run->atlas]) continue;
+            bindVertexArray(mesh->vao[MESH_SPRITES]);
+            useProgram(&g_engine.spriteProgram);
+            atlasBind(g_atlases[run->atlas]);
+            glDrawArrays(GL_TRIANGLES, run->first, run->count);
+            g_engine.stats.current.vertices += run->count;
+            break;
+        }
+        g_engine.stats.current.drawCalls++;
+    }
+}
+
+static Mesh* checkMesh(lua_State* L, int idx) {
+    return (Mesh*)luaL_checkudata(L, idx, MESH_METATABLE);
+}
+
+/* Meshes own GL buffers, which the simulation thread can't create or
+ * draw from */
+static void checkMeshesAvailable(lua_State* L) {
+    if (g_threaded.running) luaL_error(L, "meshes are not available in threaded mode");
+}
+
+/* Runs the function at the stack top with the mesh as capture target.
+ * Draws queued before recording are submitted first, so they stay out
+ * of the mesh. */
+static void meshRecord(lua_State* L, Mesh* mesh, int meshIdx) {
+    if (g_captureMesh) luaL_error(L, "a mesh is already recording");
+    
+    flushBatch();
+    meshRelease(mesh);
+    lua_newtable(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, CAPTURE_PINS_KEY);
+    
+    g_captureMesh = mesh;
+    int status = lua_pcall(L, 0, 0, 0);
+    flushBatch();
+    g_captureMesh = NULL;
+    
+    lua_getfield(L, LUA_REGISTRYINDEX, CAPTURE_PINS_KEY);
+    lua_setiuservalue(L, meshIdx, MESH_UV_PINS);
+    lua_pushnil(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, CAPTURE_PINS_KEY);
+    
+    if (status != LUA_OK) {
+        meshRelease(mesh);
+        lua_error(L);
+    }
+    if (mesh->failed) {
+        meshRelease(mesh);
+        luaL_error(L, "out of memory recording mesh");
+    }
+    meshUpload(mesh);
+}
+
+/* graphics.newMesh([builder]) -- builder issues the draw.* calls to
+ * record; it is re-run by the first draw after an invalidate */
+static int lua_newMesh(lua_State* L) {
+    checkMeshesAvailable(L);
+    if (!lua_isnoneornil(L, 1)) luaL_checktype(L, 1, LUA_TFUNCTION);
+    
+    Mesh* mesh = (Mesh*)lua_newuserdatauv(L, sizeof(Mesh), 2);
+    memset(mesh, 0, sizeof(*mesh));
+    luaL_setmetatable(L, MESH_METATABLE);
+    lua_pushvalue(L, 1);
+    lua_setiuservalue(L, -2, MESH_UV_BUILDER);
+    return 1;
+}
+
+/* mesh:record([fn]) -- replaces the content with fn's draws (fn also
+ * becomes the builder), or re-runs the builder */
+static int lua_meshRecord(lua_State* L) {
+    Mesh* mesh = checkMesh(L, 1);
+    checkMeshesAvailable(L);
+    
+    if (!lua_isnoneornil(L, 2)) {
+        luaL_checktype(L, 2, LUA_TFUNCTION);
+        lua_pushvalue(L, 2);
+        lua_setiuservalue(L, 1, MESH_UV_BUILDER);
+    }
+    if (lua_getiuservalue(L, 1, MESH_UV_BUILDER) != LUA_TFUNCTION) {
+        return luaL_error(L, "mesh has no builder function");
+    }
+    meshRecord(L, mesh, 1);
+    return 0;
+}
+
+/* mesh:draw() -- one draw call per recorded run; rebuilds first if the
+ * mesh was invalidated and has a builder */
+static int lua_meshDraw(lua_State* L) {
+    Mesh* mesh = checkMesh(L, 1);
+    checkMeshesAvailable(L);
+    if (g_captureMesh) return luaL_error(L, "cannot draw a mesh while recording one");
+    
+    if (!mesh->valid) {
+        if (lua_getiuservalue(L, 1, MESH_UV_BUILDER) != LUA_TFUNCTION) return 0;
+        meshRecord(L, mesh, 1);
+    }
+    
+    /* Keep painter's order with immediate draws queued before this */
+    flushBatch();
+    meshDraw(mesh);
+    return 0;
+}
+
+static int lua_meshInvalidate(lua_State* L) {
+    meshRelease(checkMesh(L, 1));
+    return 0;
+}
+
+static int lua_meshIsValid(lua_State* L) {
+    lua_pushboolean(L, checkMesh(L, 1)->valid);
+    return 1;
+}
+
+static int lua_meshGC(lua_State* L) {
+    Mesh* mesh = checkMesh(L, 1);
+    if (g_captureMesh == mesh) g_captureMesh = NULL;
+    meshRelease(mesh);
+    free(mesh->runs);
+    mesh->runs = NULL;
+    return 0;
+}
+
+void registerMeshModule(lua_State* L) {
+    static const luaL_Reg methods[] = {
+        {"record", lua_meshRecord},
+        {"draw", lua_meshDraw},
+        {"invalidate", lua_meshInvalidate},
+        {"isValid", lua_meshIsValid},
+        {NULL, NULL}
+    };
+    
+    luaL_newmetatable(L, MESH_METATABLE);
+    luaL_newlib(L, methods);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, lua_meshGC);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+    
+    lua_getglobal(L, "graphics");
+    lua_pushcfunction(L, lua_newMesh);
+    lua_setfield(L, -2, "newMesh");
+    lua_pop(L, 1);
+}
+
+/* ============================================================ */
+/* CAMERA */
+/* ============================================================ */
+
+/* The global `camera` object drives the projection; draws in window()
+ * are in world space until camera:setActive(false) switches to screen
+ * space for HUD elements. Each frame starts with the camera active. */
+
+#define CAMERA_METATABLE "Camera"
+
+/* Flushes geometry queued under the old projection, then rebuilds it */
+static void cameraChanged(void) {
+    flushBatch();
+    updateProjection();
+}
+
+static void cameraSetActive(int active) {
+    if (g_engine.view.camera.active == active) return;
+    flushBatch();
+    g_engine.view.camera.active = active;
+    updateProjection();
+}
+
+static Camera* checkCamera(lua_State* L) {
+    luaL_checkudata(L, 1, CAMERA_METATABLE);
+    return &g_engine.view.camera;
+}
+
+static int lua_cameraSetPosition(lua_State* L) {
+    Camera* camera = checkCamera(L);
+    camera->x = luaL_checknumber(L, 2);
+    camera->y = luaL_checknumber(L, 3);
+    cameraChanged();
+    return 0;
+}
+
+static int lua_cameraGetPosition(lua_State* L) {
+    Camera* camera = checkCamera(L);
+    lua_pushnumber(L, camera->x);
+    lua_pushnumber(L, camera->y);
+    return 2;
+}
+
+/* camera:lookAt(x, y) -- centers the view on a world point */
+static int lua_cameraLookAt(lua_State* L) {
+    Camera* camera = checkCamera(L);
+    camera->x = luaL_checknumber(L, 2) - g_engine.windowWidth * 0.5f / camera->zoom;
+    camera->y = luaL_checknumber(L, 3) - g_engine.windowHeight * 0.5f / camera->zoom;
+    cameraChanged();
+    return 0;
+}
+
+/* camera:setZoom(zoom) -- keeps the top-left world point fixed */
+static int lua_cameraSetZoom(lua_State* L) {
+    Camera* camera = checkCamera(L);
+    lua_Number zoom = luaL_checknumber(L, 2);
+    luaL_argcheck(L, zoom > 0.0, 2, "zoom must be positive");
+    camera->zoom = (float)zoom;
+    cameraChanged();
+    return 0;
+}
+
+static int lua_cameraGetZoom(lua_State* L) {
+    lua_pushnumber(L, checkCamera(L)->zoom);
+    return 1;
+}
+
+static int lua_cameraWorldToScreen(lua_State* L) {
+    Camera* camera = checkCamera(L);
+    lua_pushnumber(L, (luaL_checknumber(L, 2) - camera->x) * camera->zoom);
+    lua_pushnumber(L, (luaL_checknumber(L, 3) - camera->y) * camera->zoom);
+    return 2;
+}
+
+static int lua_cameraScreenToWorld(lua_State* L) {
+    Camera* camera = checkCamera(L);
+    lua_pushnumber(L, luaL_checknumber(L, 2) / camera->zoom + camera->x);
+    lua_pushnumber(L, luaL_checknumber(L, 3) / camera->zoom + camera->y);
+    return 2;
+}
+
+/* camera:getViewRect() -> x, y, width, height of the visible world area */
+static int lua_cameraGetViewRect(lua_State* L) {
+    Camera* camera = checkCamera(L);
+    float w = g_engine.windowWidth / camera->zoom;
+    float h = g_engine.windowHeight / camera->zoom;
+    lua_pushnumber(L, camera->x);
+    lua_pushnumber(L, camera->y);
+    lua_pushnumber(L, w);
+    lua_pushnumber(L, h);
+    return 4;
+}
+
+/* camera:setActive(active) -- false draws the rest of the frame in
+ * screen pixels */
+static int lua_cameraSetActive(lua_State* L) {
+    checkCamera(L);
+    cameraSetActive(lua_toboolean(L, 2));
+    return 0;
+}
+
+static int lua_cameraIsActive(lua_State* L) {
+    lua_pushboolean(L, checkCamera(L)->active);
+    return 1;
+}
+
+void registerCameraModule(lua_State* L) {
+    static const luaL_Reg methods[] = {
+        {"setPosition", lua_cameraSetPosition},
+        {"getPosition", lua_cameraGetPosition},
+        {"lookAt", lua_cameraLookAt},
+        {"setZoom", lua_cameraSetZoom},
+        {"getZoom", lua_cameraGetZoom},
+        {"worldToScreen", lua_cameraWorldToScreen},
+        {"screenToWorld", lua_cameraScreenToWorld},
+        {"getViewRect", lua_cameraGetViewRect},
+        {"setActive", lua_cameraSetActive},
+        {"isActive", lua_cameraIsActive},
+        {NULL, NULL}
+    };
+    
+    luaL_newmetatable(L, CAMERA_METATABLE);
+    luaL_newlib(L, methods);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+    
+    lua_newuserdatauv(L, 0, 0);
+    luaL_setmetatable(L, CAMERA_METATABLE);
+    lua_setglobal(L, "camera");
+}
+
+/* ============================================================ */
+/* INPUT */
+/* ============================================================ */
+
+/* GLFW callbacks keep a live snapshot of keys, buttons and the cursor
+ * and queue every event; once per frame, after glfwPollEvents(), the
+ * main thread copies the live state (adding gamepads, which have no
+ * callbacks) and every query reads that copy. Edges accumulate until a loop()
+ * tick has seen them, so a press is reported once even when a frame
+ * runs several fixed ticks, and isn't lost when it runs none. Names are
+ * resolved through Lua tables (interned strings, one hash lookup);
+ * scripts that want to skip even that can keep keyboard.code() or
+ * input.action() integers. */
+
+#define INPUT_MAX_ACTIONS 64
+#define INPUT_MAX_BINDINGS 8
+#define INPUT_MAX_EVENTS 256
+
+typedef enum {
+    INPUT_EVENT_KEY,
+    INPUT_EVENT_MOUSE,
+    INPUT_EVENT_SCROLL,
+    INPUT_EVENT_TEXT,
+} InputEventType;
+
+static const char* const g_inputEventNames[] = { "key", "mouse", "scroll", "text" };
+
+typedef struct {
+    InputEventType type;
+    int code;             /* key code, or mouse button from 0 */
+    int action;           /* GLFW_PRESS, GLFW_RELEASE or GLFW_REPEAT */
+    double x, y;          /* cursor for mouse, offsets for scroll */
+    unsigned int codepoint;
+} InputEvent;
+
+/* Filled by callbacks on the main thread, drained by input.events().
+ * Guarded by the resource lock, since in threaded mode the draining
+ * happens on the simulation thread. */
+typedef struct {
+    InputEvent events[INPUT_MAX_EVENTS];
+    int count;
+    int dropped;          /* events lost to a full queue since the last drain */
+} InputEventQueue;
+
+typedef struct {
+    InputSnapshot current;
+    unsigned char pressed[INPUT_CODE_COUNT];
+    unsigned char released[INPUT_CODE_COUNT];
+} InputState;
+
+/* Named actions, each bound to any of a few input codes */
+typedef struct {
+    int codes[INPUT_MAX_BINDINGS];
+    int count;
+} InputAction;
+
+static InputState g_input;
+static InputSnapshot g_inputLive;   /* main thread, updated by callbacks */
+static InputEventQueue g_inputEvents;
+static InputAction g_actions[INPUT_MAX_ACTIONS];
+static int g_actionCount;
+
+static const char* const g_mouseButtonNames[] = { "left", "right", "middle", NULL };
+static const char* const g_padButtonNames[] = {
+    "a", "b", "x", "y", "lb", "rb", "back", "start", "guide",
+    "lstick", "rstick", "up", "right", "down", "left", NULL
+};
+static const char* const g_padAxisNames[] = {
+    "leftx", "lefty", "rightx", "righty", "lt", "rt", NULL
+};
+
+/* Upvalue indices of the name tables shared by the input functions */
+#define INPUT_UV_KEYS 1
+#define INPUT_UV_ACTIONS 2
+
+static void inputPushEvent(const InputEvent* event) {
+    resourceLock();
+    if (g_inputEvents.count < INPUT_MAX_EVENTS) {
+        g_inputEvents.events[g_inputEvents.count++] = *event;
+    } else {
+        g_inputEvents.dropped++;
+    }
+    resourceUnlock();
+}
+
+static void inputSetDown(int code, int down) {
+    if (down && !g_inputLive.down[code]) g_inputLive.pressed[code] = 1;
+    if (!down && g_inputLive.down[code]) g_inputLive.released[code] = 1;
+    g_inputLive.down[code] = (unsigned char)down;
+}
+
+static void onKey(GLFWwindow* window, int key, int scancode, int action, int mods) {
+    (void)window;
+    (void)scancode;
+    (void)mods;
+    if (key < 0 || key > GLFW_KEY_LAST) return;
+    if (action != GLFW_REPEAT) inputSetDown(key, action == GLFW_PRESS);
+    InputEvent event = { INPUT_EVENT_KEY, key, action, 0.0, 0.0, 0 };
+    inputPushEvent(&event);
+}
+
+static void onMouseButton(GLFWwindow* window, int button, int action, int mods) {
+    (void)window;
+    (void)mods;
+    if (button < 0 || button > GLFW_MOUSE_BUTTON_LAST) return;
+    inputSetDown(INPUT_MOUSE_BASE + button, action == GLFW_PRESS);
+    InputEvent event = { INPUT_EVENT_MOUSE, button, action, g_inputLive.mouseX, g_inputLive.mouseY, 0 };
+    inputPushEvent(&event);
+}
+
+static void onCursorPos(GLFWwindow* window, double x, double y) {
+    (void)window;
+    g_inputLive.mouseX = x;
+    g_inputLive.mouseY = y;
+}
+
+static void onScroll(GLFWwindow* window, double dx, double dy) {
+    (void)window;
+    InputEvent event = { INPUT_EVENT_SCROLL, 0, 0, dx, dy, 0 };
+    inputPushEvent(&event);
+}
+
+static void onChar(GLFWwindow* window, unsigned int codepoint) {
+    (void)window;
+    InputEvent event = { INPUT_EVENT_TEXT, 0, 0, 0.0, 0.0, codepoint };
+    inputPushEvent(&event);
+}
+
+static void inputInstallCallbacks(GLFWwindow* window) {
+    glfwSetKeyCallback(window, onKey);
+    glfwSetMouseButtonCallback(window, onMouseButton);
+    glfwSetCursorPosCallback(window, onCursorPos);
+    glfwSetScrollCallback(window, onScroll);
+    glfwSetCharCallback(window, onChar);
+    /* The cursor callback only fires on movement */
+    glfwGetCursorPos(window, &g_inputLive.mouseX, &g_inputLive.mouseY);
+}
+
+/* Copies the live state into `input` and starts collecting transitions
+ * for the next sample */
+static void inputSample(InputSnapshot* input) {
+    *input = g_inputLive;
+    memset(g_inputLive.pressed, 0, sizeof(g_inputLive.pressed));
+    memset(g_inputLive.released, 0, sizeof(g_inputLive.released));
+    
+#ifndef __EMSCRIPTEN__
+    /* Gamepad mappings are native only; web pads read as disconnected */
+    for (int pad = 0; pad < INPUT_GAMEPADS; pad++) {
+        GLFWgamepadstate state;
+        if (!glfwJoystickIsGamepad(GLFW_JOYSTICK_1 + pad) ||
+            !glfwGetGamepadState(GLFW_JOYSTICK_1 + pad, &state)) continue;
+        input->padConnected[pad] = 1;
+        for (int b = 0; b < INPUT_PAD_BUTTONS; b++) {
+            input->down[INPUT_PAD_BASE + pad * INPUT_PAD_BUTTONS + b] = state.buttons[b] == GLFW_PRESS;
+        }
+        memcpy(input->padAxes[pad], state.axes, sizeof(input->padAxes[pad]));
+    }
+#endif
+}
+
+/* Makes `sample` current, adding its transitions to the pending edges */
+static void inputAdvance(InputState* input, const InputSnapshot* sample) {
+    for (int code = 0; code < INPUT_CODE_COUNT; code++) {
+        unsigned char was = input->current.down[code], is = sample->down[code];
+        input->pressed[code] |= sample->pressed[code] | (is & !was);
+        input->released[code] |= sample->released[code] | (was & !is);
+    }
+    input->current = *sample;
+}
+
+/* Called after each loop() tick */
+static void inputConsumeEdges(InputState* input) {
+    memset(input->pressed, 0, sizeof(input->pressed));
+    memset(input->released, 0, sizeof(input->released));
+}
+
+typedef enum {
+    INPUT_QUERY_DOWN,
+    INPUT_QUERY_PRESSED,
+    INPUT_QUERY_RELEASED,
+} InputQuery;
+
+static int inputTest(int code, InputQuery query) {
+    switch (query) {
+    case INPUT_QUERY_PRESSED: return g_input.pressed[code];
+    case INPUT_QUERY_RELEASED: return g_input.released[code];
+    default: return g_input.current.down[code];
+    }
+}
+
+/* Key at `arg` as a GLFW code: an integer from keyboard.code() or a
+ * name looked up in the keys table */
+static int checkKeyCode(lua_State* L, int arg) {
+    if (lua_isinteger(L, arg)) {
+        lua_Integer code = lua_tointeger(L, arg);
+        luaL_argcheck(L, code >= 0 && code <= GLFW_KEY_LAST, arg, "invalid key code");
+        return (int)code;
+    }
+    const char* name = luaL_checkstring(L, arg);
+    int known;
+    lua_getfield(L, lua_upvalueindex(INPUT_UV_KEYS), name);
+    lua_Integer code = lua_tointegerx(L, -1, &known);
+    lua_pop(L, 1);
+    if (!known) luaL_argerror(L, arg, lua_pushfstring(L, "unknown key '%s'", name));
+    return (int)code;
+}
+
+static int checkPad(lua_State* L, int arg) {
+    lua_Integer pad = luaL_optinteger(L, arg, 1);
+    luaL_argcheck(L, pad >= 1 && pad <= INPUT_GAMEPADS, arg, "invalid gamepad index");
+    return (int)pad - 1;
+}
+
+/* Button name or 1-based index */
+static int checkButton(lua_State* L, int arg, const char* const names[], int count) {
+    if (lua_isinteger(L, arg)) {
+        lua_Integer b = lua_tointeger(L, arg);
+        luaL_argcheck(L, b >= 1 && b <= count, arg, "invalid button index");
+        return (int)b - 1;
+    }
+    return luaL_checkoption(L, arg, NULL, names);
+}
+
+/* Parses a binding: a key name, "mouse:<button>" or "pad[N]:<button>" */
+static int checkBindingCode(lua_State* L, int arg) {
+    if (lua_isinteger(L, arg)) return checkKeyCode(L, arg);
+    const char* spec = luaL_checkstring(L, arg);
+    const char* colon = strchr(spec, ':');
+    if (!colon) return checkKeyCode(L, arg);
+    
+    int button = -1;
+    if ((size_t)(colon - spec) == 5 && strncmp(spec, "mouse", 5) == 0) {
+        for (int b = 0; g_mouseButtonNames[b]; b++) {
+            if (strcmp(colon + 1, g_mouseButtonNames[b]) == 0) button = INPUT_MOUSE_BASE + b;
+        }
+    } else if (strncmp(spec, "pad", 3) == 0) {
+        int pad = colon - spec == 3 ? 0 : atoi(spec + 3) - 1;
+        for (int b = 0; g_padButtonNames[b] && pad >= 0 && pad < INPUT_GAMEPADS; b++) {
+            if (strcmp(colon + 1, g_padButtonNames[b]) == 0) {
+                button = INPUT_PAD_BASE + pad * INPUT_PAD_BUTTONS + b;
+            }
+        }
+    }
+    if (button < 0) luaL_argerror(L, arg, lua_pushfstring(L, "unknown input '%s'", spec));
+    return button;
+}
+
+/* Action id at `arg`: an integer from input.action() or a bound name */
+static int checkAction(lua_State* L, int arg) {
+    if (lua_isinteger(L, arg)) {
+        lua_Integer id = lua_tointeger(L, arg);
+        luaL_argcheck(L, id >= 1 && id <= g_actionCount, arg, "invalid action id");
+        return (int)id - 1;
+    }
+    const char* name = luaL_checkstring(L, arg);
+    int known;
+    lua_getfield(L, lua_upvalueindex(INPUT_UV_ACTIONS), name);
+    lua_Integer id = lua_tointegerx(L, -1, &known);
+    lua_pop(L, 1);
+    if (!known) luaL_argerror(L, arg, lua_pushfstring(L, "unknown action '%s'", name));
+    return (int)id - 1;
+}
+
+static int keyboardQuery(lua_State* L, InputQuery query) {
+    lua_pushboolean(L, inputTest(checkKeyCode(L, 1), query));
+    return 1;
+}
+
+/* keyboard.isDown(key), wasPressed(key), wasReleased(key) */
+static int lua_keyDown(lua_State* L) {
+    return keyboardQuery(L, INPUT_QUERY_DOWN);
+}
+
+static int lua_keyPressed(lua_State* L) {
+    return keyboardQuery(L, INPUT_QUERY_PRESSED);
+}
+
+static int lua_keyReleased(lua_State* L) {
+    return keyboardQuery(L, INPUT_QUERY_RELEASED);
+}
+
+/* keyboard.code(name) -> integer code, or nil for an unknown name */
+static int lua_keyCode(lua_State* L) {
+    luaL_checkstring(L, 1);
+    lua_getfield(L, lua_upvalueindex(INPUT_UV_KEYS), lua_tostring(L, 1));
+    return 1;
+}
+
+static int mouseQuery(lua_State* L, InputQuery query) {
+    int b = checkButton(L, 1, g_mouseButtonNames, GLFW_MOUSE_BUTTON_LAST + 1);
+    lua_pushboolean(L, inputTest(INPUT_MOUSE_BASE + b, query));
+    return 1;
+}
+
+/* mouse.isDown(button), wasPressed(button), wasReleased(button), with
+ * "left", "right", "middle" or 1..8 */
+static int lua_mouseDown(lua_State* L) {
+    return mouseQuery(L, INPUT_QUERY_DOWN);
+}
+
+static int lua_mousePressed(lua_State* L) {
+    return mouseQuery(L, INPUT_QUERY_PRESSED);
+}
+
+static int lua_mouseReleased(lua_State* L) {
+    return mouseQuery(L, INPUT_QUERY_RELEASED);
+}
+
+static int lua_mouseX(lua_State* L) {
+    lua_pushnumber(L, g_input.current.mouseX);
+    return 1;
+}
+
+static int lua_mouseY(lua_State* L) {
+    lua_pushnumber(L, g_input.current.mouseY);
+    return 1;
+}
+
+/* mouse.position() -> x, y */
+static int lua_mousePosition(lua_State* L) {
+    lua_pushnumber(L, g_input.current.mouseX);
+    lua_pushnumber(L, g_input.current.mouseY);
+    return 2;
+}
+
+static int padQuery(lua_State* L, InputQuery query) {
+    int b = checkButton(L, 1, g_padButtonNames, INPUT_PAD_BUTTONS);
+    int pad = checkPad(L, 2);
+    lua_pushboolean(L, inputTest(INPUT_PAD_BASE + pad * INPUT_PAD_BUTTONS + b, query));
+    return 1;
+}
+
+/* gamepad.isDown(button, [pad]) etc.; pads are numbered from 1 */
+static int lua_padDown(lua_State* L) {
+    return padQuery(L, INPUT_QUERY_DOWN);
+}
+
+static int lua_padPressed(lua_State* L) {
+    return padQuery(L, INPUT_QUERY_PRESSED);
+}
+
+static int lua_padReleased(lua_State* L) {
+    return padQuery(L, INPUT_QUERY_RELEASED);
+}
+
+static int lua_padIsConnected(lua_State* L) {
+    lua_pushboolean(L, g_input.current.padConnected[checkPad(L, 1)]);
+    return 1;
+}
+
+/* gamepad.axis(name, [pad]) -> -1..1 (triggers rest at -1) */
+static int lua_padAxis(lua_State* L) {
+    int axis = luaL_checkoption(L, 1, NULL, g_padAxisNames);
+    lua_pushnumber(L, g_input.current.padAxes[checkPad(L, 2)][axis]);
+    return 1;
+}
+
+/* input.bind(action, binding, ...) -> id. Replaces the action's
+ * bindings; each is a key name, "mouse:left" or "pad2:a" style. */
+static int lua_inputBind(lua_State* L) {
+    const char* name = luaL_checkstring(L, 1);
+    int bindings = lua_gettop(L) - 1;
+    luaL_argcheck(L, bindings <= INPUT_MAX_BINDINGS, INPUT_MAX_BINDINGS + 2, "too many bindings");
+    
+    int codes[INPUT_MAX_BINDINGS];
+    for (int i = 0; i < bindings; i++) {
+        codes[i] = checkBindingCode(L, i + 2);
+    }
+    
+    lua_getfield(L, lua_upvalueindex(INPUT_UV_ACTIONS), name);
+    int id = (int)lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    if (id == 0) {
+        if (g_actionCount == INPUT_MAX_ACTIONS) return luaL_error(L, "too many input actions");
+        id = ++g_actionCount;
+        lua_pushinteger(L, id);
+        lua_setfield(L, lua_upvalueindex(INPUT_UV_ACTIONS), name);
+    }
+    
+    InputAction* action = &g_actions[id - 1];
+    memcpy(action->codes, codes, bindings * sizeof(int));
+    action->count = bindings;
+    lua_pushinteger(L, id);
+    return 1;
+}
+
+/* input.action(name) -> id, or nil if it was never bound */
+static int lua_inputAction(lua_State* L) {
+    luaL_checkstring(L, 1);
+    lua_getfield(L, lua_upvalueindex(INPUT_UV_ACTIONS), lua_tostring(L, 1));
+    return 1;
+}
+
+/* True if any binding matches */
+static int actionQuery(lua_State* L, InputQuery query) {
+    const InputAction* action = &g_actions[checkAction(L, 1)];
+    int result = 0;
+    for (int i = 0; i < action->count && !result; i++) {
+        result = inputTest(action->codes[i], query);
+    }
+    lua_pushboolean(L, result);
+    return 1;
+}
+
+static int lua_actionDown(lua_State* L) {
+    return actionQuery(L, INPUT_QUERY_DOWN);
+}
+
+static int lua_actionPressed(lua_State* L) {
+    return actionQuery(L, INPUT_QUERY_PRESSED);
+}
+
+static int lua_actionReleased(lua_State* L) {
+    return actionQuery(L, INPUT_QUERY_RELEASED);
+}
+
+static void setEventField(lua_State* L, int event, const char* name, int present, double value) {
+    if (present) lua_pushnumber(L, value);
+    else lua_pushnil(L);
+    lua_setfield(L, event, name);
+}
+
+/* input.events([out]) -> out, count, dropped. Drains the queue into
+ * out[1..count], reusing the event tables already there. Each has type ("key",
+ * "mouse", "scroll" or "text") and, by type: key and down/isRepeat;
+ * button (from 1), down, x and y; dx and dy; text (UTF-8). */
+static int lua_inputEvents(lua_State* L) {
+    int out = pushOutputTable(L, 1);
+    
+    /* Copy out first; the callbacks may push again while Lua runs */
+    resourceLock();
+    InputEventQueue* queue = &g_inputEvents;
+    int count = queue->count;
+    int dropped = queue->dropped;
+    InputEvent* events = arenaAlloc(&g_frameArena, (size_t)count * sizeof(InputEvent));
+    if (events) memcpy(events, queue->events, (size_t)count * sizeof(InputEvent));
+    else count = 0;
+    queue->count = 0;
+    queue->dropped = 0;
+    resourceUnlock();
+    
+    for (int i = 0; i < count; i++) {
+        const InputEvent* e = &events[i];
+        if (lua_rawgeti(L, out, i + 1) != LUA_TTABLE) {
+            lua_pop(L, 1);
+            lua_createtable(L, 0, 8);
+            lua_pushvalue(L, -1);
+            lua_rawseti(L, out, i + 1);
+        }
+        int event = lua_gettop(L);
+        int key = e->type == INPUT_EVENT_KEY, mouse = e->type == INPUT_EVENT_MOUSE;
+        int scroll = e->type == INPUT_EVENT_SCROLL;
+        
+        lua_pushstring(L, g_inputEventNames[e->type]);
+        lua_setfield(L, event, "type");
+        setEventField(L, event, "key", key, e->code);
+        setEventField(L, event, "button", mouse, e->code + 1);
+        setEventField(L, event, "x", mouse, e->x);
+        setEventField(L, event, "y", mouse, e->y);
+        setEventField(L, event, "dx", scroll, e->x);
+        setEventField(L, event, "dy", scroll, e->y);
+        if (key || mouse) lua_pushboolean(L, e->action != GLFW_RELEASE);
+        else lua_pushnil(L);
+        lua_setfield(L, event, "down");
+        if (key) lua_pushboolean(L, e->action == GLFW_REPEAT);
+        else lua_pushnil(L);
+        lua_setfield(L, event, "isRepeat");
+        
+        if (e->type == INPUT_EVENT_TEXT) {
+            char utf8[4];
+            unsigned int c = e->codepoint;
+            size_t n;
+            if (c < 0x80) {
+                utf8[0] = (char)c;
+                n = 1;
+            } else if (c < 0x800) {
+                utf8[0] = (char)(0xC0 | (c >> 6));
+                utf8[1] = (char)(0x80 | (c & 0x3F));
+                n = 2;
+            } else if (c < 0x10000) {
+                utf8[0] = (char)(0xE0 | (c >> 12));
+                utf8[1] = (char)(0x80 | ((c >> 6) & 0x3F));
+                utf8[2] = (char)(0x80 | (c & 0x3F));
+                n = 3;
+            } else {
+                utf8[0] = (char)(0xF0 | (c >> 18));
+                utf8[1] = (char)(0x80 | ((c >> 12) & 0x3F));
+                utf8[2] = (char)(0x80 | ((c >> 6) & 0x3F));
+                utf8[3] = (char)(0x80 | (c & 0x3F));
+                n = 4;
+            }
+            lua_pushlstring(L, utf8, n);
+        } else {
+            lua_pushnil(L);
+        }
+        lua_setfield(L, event, "text");
+        lua_pop(L, 1);
+    }
+    trimOutputTable(L, out, count);
+    
+    lua_pushinteger(L, count);
+    lua_pushinteger(L, dropped);
+    return 3;
+}
+
+/* keys table: lowercase names to GLFW codes */
+static void pushKeyNames(lua_State* L) {
+    static const struct { const char* name; int code; } named[] = {
+        {"space", GLFW_KEY_SPACE}, {"escape", GLFW_KEY_ESCAPE}, {"enter", GLFW_KEY_ENTER},
+        {"tab", GLFW_KEY_TAB}, {"backspace", GLFW_KEY_BACKSPACE},
+        {"insert", GLFW_KEY_INSERT}, {"delete", GLFW_KEY_DELETE},
+        {"up", GLFW_KEY_UP}, {"down", GLFW_KEY_DOWN}, {"left", GLFW_KEY_LEFT}, {"right", GLFW_KEY_RIGHT},
+        {"pageup", GLFW_KEY_PAGE_UP}, {"pagedown", GLFW_KEY_PAGE_DOWN},
+        {"home", GLFW_KEY_HOME}, {"end", GLFW_KEY_END},
+        {"lshift", GLFW_KEY_LEFT_SHIFT}, {"rshift", GLFW_KEY_RIGHT_SHIFT},
+        {"lctrl", GLFW_KEY_LEFT_CONTROL}, {"rctrl", GLFW_KEY_RIGHT_CONTROL},
+        {"lalt", GLFW_KEY_LEFT_ALT}, {"ralt", GLFW_KEY_RIGHT_ALT},
+        {"'", GLFW_KEY_APOSTROPHE}, {",", GLFW_KEY_COMMA}, {"-", GLFW_KEY_MINUS},
+        {".", GLFW_KEY_PERIOD}, {"/", GLFW_KEY_SLASH}, {";", GLFW_KEY_SEMICOLON},
+        {"=", GLFW_KEY_EQUAL}, {"[", GLFW_KEY_LEFT_BRACKET}, {"\\", GLFW_KEY_BACKSLASH},
+        {"]", GLFW_KEY_RIGHT_BRACKET}, {"`", GLFW_KEY_GRAVE_ACCENT},
+    };
+    char name[4];
+    
+    lua_createtable(L, 0, 80);
+    for (size_t i = 0; i < sizeof(named) / sizeof(named[0]); i++) {
+        lua_pushinteger(L, named[i].code);
+        lua_setfield(L, -2, named[i].name);
+    }
+    for (int c = 0; c < 26; c++) {
+        name[0] = (char)('a' + c);
+        name[1] = '\0';
+        lua_pushinteger(L, GLFW_KEY_A + c);
+        lua_setfield(L, -2, name);
+    }
+    for (int d = 0; d <= 9; d++) {
+        name[0] = (char)('0' + d);
+        name[1] = '\0';
+        lua_pushinteger(L, GLFW_KEY_0 + d);
+        lua_setfield(L, -2, name);
+    }
+    for (int f = 1; f <= 12; f++) {
+        snprintf(name, sizeof(name), "f%d", f);
+        lua_pushinteger(L, GLFW_KEY_F1 + f - 1);
+        lua_setfield(L, -2, name);
+    }
+}
+
+/* Registers `functions` into the table at the stack top, sharing the
+ * key-name and action tables as upvalues */
+static void setInputFuncs(lua_State* L, const luaL_Reg* functions, int keys, int actions) {
+    lua_pushvalue(L, keys);
+    lua_pushvalue(L, actions);
+    luaL_setfuncs(L, functions, 2);
+}
+
+void registerInputModule(lua_State* L) {
+    static const luaL_Reg keyboardFunctions[] = {
+        {"isDown", lua_keyDown},
+        {"wasPressed", lua_keyPressed},
+        {"wasReleased", lua_keyReleased},
+        {"code", lua_keyCode},
+        {NULL, NULL}
+    };
+    static const luaL_Reg mouseFunctions[] = {
+        {"x", lua_mouseX},
+        {"y", lua_mouseY},
+        {"position", lua_mousePosition},
+        {"isDown", lua_mouseDown},
+        {"wasPressed", lua_mousePressed},
+        {"wasReleased", lua_mouseReleased},
+        {NULL, NULL}
+    };
+    static const luaL_Reg gamepadFunctions[] = {
+        {"isConnected", lua_padIsConnected},
+        {"isDown", lua_padDown},
+        {"wasPressed", lua_padPressed},
+        {"wasReleased", lua_padReleased},
+        {"axis", lua_padAxis},
+        {NULL, NULL}
+    };
+    static const luaL_Reg inputFunctions[] = {
+        {"bind", lua_inputBind},
+        {"action", lua_inputAction},
+        {"isDown", lua_actionDown},
+        {"wasPressed", lua_actionPressed},
+        {"wasReleased", lua_actionReleased},
+        {"events", lua_inputEvents},
+        {NULL, NULL}
+    };
+    
+    pushKeyNames(L);
+    int keys = lua_gettop(L);
+    lua_newtable(L);
+    int actions = lua_gettop(L);
+    
+    lua_newtable(L);
+    setInputFuncs(L, keyboardFunctions, keys, actions);
+    lua_setglobal(L, "keyboard");
+    
+    lua_newtable(L);
+    setInputFuncs(L, mouseFunctions, keys, actions);
+    lua_setglobal(L, "mouse");
+    
+    lua_newtable(L);
+    setInputFuncs(L, gamepadFunctions, keys, actions);
+    lua_setglobal(L, "gamepad");
+    
+    lua_newtable(L);
+    setInputFuncs(L, inputFunctions, keys, actions);
+    lua_setglobal(L, "input");
+    
+    lua_pop(L, 2);
+}
+
+/* ============================================================ */
+/* SIMD KERNELS */
+/* ============================================================ */
+
+/* Bulk float kernels over SoA arrays. The instruction set is chosen at
+ * compile time: AVX2 (make SIMD=avx2), SSE2 (x86-64 baseline), WASM
+ * SIMD128 (emscripten with -msimd128), otherwise the scalar loops that
+ * also handle every kernel's tail. -DENGINE_NO_SIMD forces scalar. */
+
+#if !defined(ENGINE_NO_SIMD) && defined(__AVX2__)
+#include <immintrin.h>
+#define SIMD_NAME "avx2"
+#define SIMD_WIDTH 8
+typedef __m256 vfloat;
+#define VF_LOAD(p)        _mm256_loadu_ps(p)
+#define VF_STORE(p, v)    _mm256_storeu_ps((p), (v))
+#define VF_SET1(f)        _mm256_set1_ps(f)
+#define VF_ADD(a, b)      _mm256_add_ps((a), (b))
+#define VF_SUB(a, b)      _mm256_sub_ps((a), (b))
+#define VF_MUL(a, b)      _mm256_mul_ps((a), (b))
+#define VF_DIV(a, b)      _mm256_div_ps((a), (b))
+#define VF_MIN(a, b)      _mm256_min_ps((a), (b))
+#define VF_MAX(a, b)      _mm256_max_ps((a), (b))
+#define VF_GE(a, b)       _mm256_cmp_ps((a), (b), _CMP_GE_OQ)
+#define VF_LE(a, b)       _mm256_cmp_ps((a), (b), _CMP_LE_OQ)
+#define VF_LT(a, b)       _mm256_cmp_ps((a), (b), _CMP_LT_OQ)
+#define VF_GT(a, b)       _mm256_cmp_ps((a), (b), _CMP_GT_OQ)
+#define VF_AND(a, b)      _mm256_and_ps((a), (b))
+#define VF_MASKBITS(m)    _mm256_movemask_ps(m)
+#elif !defined(ENGINE_NO_SIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+#define SIMD_NAME "sse2"
+#define SIMD_WIDTH 4
+typedef __m128 vfloat;
+#define VF_LOAD(p)        _mm_loadu_ps(p)
+#define VF_STORE(p, v)    _mm_storeu_ps((p), (v))
+#define VF_SET1(f)        _mm_set1_ps(f)
+#define VF_ADD(a, b)      _mm_add_ps((a), (b))
+#define VF_SUB(a, b)      _mm_sub_ps((a), (b))
+#define VF_MUL(a, b)      _mm_mul_ps((a), (b))
+#define VF_DIV(a, b)      _mm_div_ps((a), (b))
+#define VF_MIN(a, b)      _mm_min_ps((a), (b))
+#define VF_MAX(a, b)      _mm_max_ps((a), (b))
+#define VF_GE(a, b)       _mm_cmpge_ps((a), (b))
+#define VF_LE(a, b)       _mm_cmple_ps((a), (b))
+#define VF_LT(a, b)       _mm_cmplt_ps((a), (b))
+#define VF_GT(a, b)       _mm_cmpgt_ps((a), (b))
+#define VF_AND(a, b)      _mm_and_ps((a), (b))
+#define VF_MASKBITS(m)    _mm_movemask_ps(m)
+#elif !defined(ENGINE_NO_SIMD) && defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#define SIMD_NAME "wasm-simd128"
+#define SIMD_WIDTH 4
+typedef v128_t vfloat;
+#define VF_LOAD(p)        wasm_v128_load(p)
+#define VF_STORE(p, v)    wasm_v128_store((p), (v))
+#define VF_SET1(f)        wasm_f32x4_splat(f)
+#define VF_ADD(a, b)      wasm_f32x4_add((a), (b))
+#define VF_SUB(a, b)      wasm_f32x4_sub((a), (b))
+#define VF_MUL(a, b)      wasm_f32x4_mul((a), (b))
+#define VF_DIV(a, b)      wasm_f32x4_div((a), (b))
+#define VF_MIN(a, b)      wasm_f32x4_pmin((a), (b))
+#define VF_MAX(a, b)      wasm_f32x4_pmax((a), (b))
+#define VF_GE(a, b)       wasm_f32x4_ge((a), (b))
+#define VF_LE(a, b)       wasm_f32x4_le((a), (b))
+#define VF_LT(a, b)       wasm_f32x4_lt((a), (b))
+#define VF_GT(a, b)       wasm_f32x4_gt((a), (b))
+#define VF_AND(a, b)      wasm_v128_and((a), (b))
+#define VF_MASKBITS(m)    ((int)wasm_i32x4_bitmask(m))
+#else
+#define SIMD_NAME "scalar"
+#define SIMD_WIDTH 1
+#endif
+
+/* x += vx * dt, y += vy * dt */
+static void kernelIntegrate(float* restrict x, float* restrict y,
+                            const float* restrict vx, const float* restrict vy,
+                            int n, float dt) {
+    int i = 0;
+#if SIMD_WIDTH > 1
+    vfloat vdt = VF_SET1(dt);
+    for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH) {
+        VF_STORE(x + i, VF_ADD(VF_LOAD(x + i), VF_MUL(VF_LOAD(vx + i), vdt)));
+        VF_STORE(y + i, VF_ADD(VF_LOAD(y + i), VF_MUL(VF_LOAD(vy + i), vdt)));
+    }
+#endif
+    for (; i < n; i++) {
+        x[i] += vx[i] * dt;
+        y[i] += vy[i] * dt;
+    }
+}
+
+/* v += s, used for lifetime decay (elapsed += dt) */
+static void kernelAddScalar(float* restrict v, int n, float s) {
+    int i = 0;
+#if SIMD_WIDTH > 1
+    vfloat vs = VF_SET1(s);
+    for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH) {
+        VF_STORE(v + i, VF_ADD(VF_LOAD(v + i), vs));
+    }
+#endif
+    for (; i < n; i++) {
+        v[i] += s;
+    }
+}
+
+/* out = alpha * (1 - min(elapsed / lifetime, 1)) */
+static void kernelFade(float* restrict out, const float* restrict alpha,
+                       const float* restrict elapsed, const float* restrict lifetime, int n) {
+    int i = 0;
+#if SIMD_WIDTH > 1
+    vfloat one = VF_SET1(1.0f);
+    vfloat tiny = VF_SET1(1e-6f);
+    for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH) {
+        vfloat t = VF_DIV(VF_LOAD(elapsed + i), VF_MAX(VF_LOAD(lifetime + i), tiny));
+        VF_STORE(out + i, VF_MUL(VF_LOAD(alpha + i), VF_SUB(one, VF_MIN(t, one))));
+    }
+#endif
+    for (; i < n; i++) {
+        float t = elapsed[i] / (lifetime[i] > 1e-6f ? lifetime[i] : 1e-6f);
+        out[i] = alpha[i] * (1.0f - (t < 1.0f ? t : 1.0f));
+    }
+}
+
+/* First index >= start whose elapsed has reached its lifetime, or n */
+static int kernelFindExpired(const float* restrict elapsed, const float* restrict lifetime,
+                             int start, int n) {
+    int i = start;
+#if SIMD_WIDTH > 1
+    for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH) {
+        int bits = VF_MASKBITS(VF_GE(VF_LOAD(elapsed + i), VF_LOAD(lifetime + i)));
+        if (bits) {
+            int lane = 0;
+            while (!(bits & (1 << lane))) lane++;
+            return i + lane;
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        if (elapsed[i] >= lifetime[i]) return i;
+    }
+    return n;
+}
+
+/* Appends i + lane to out for every set lane bit; returns the new count */
+static inline int appendMaskHits(int* out, int count, int i, int bits) {
+    for (int lane = 0; bits; lane++, bits >>= 1) {
+        if (bits & 1) out[count++] = i + lane;
+    }
+    return count;
+}
+
+/* Writes the indices of circles overlapping the view rectangle into
+ * `out` and returns how many there are. */
+static int kernelCullCircles(const float* restrict x, const float* restrict y, float radius, int n,
+                             float minX, float minY, float maxX, float maxY, int* restrict out) {
+    int count = 0;
+    int i = 0;
+    minX -= radius;
+    minY -= radius;
+    maxX += radius;
+    maxY += radius;
+#if SIMD_WIDTH > 1
+    vfloat vminX = VF_SET1(minX), vminY = VF_SET1(minY);
+    vfloat vmaxX = VF_SET1(maxX), vmaxY = VF_SET1(maxY);
+    for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH) {
+        vfloat vx = VF_LOAD(x + i);
+        vfloat vy = VF_LOAD(y + i);
+        vfloat inside = VF_AND(VF_AND(VF_GE(vx, vminX), VF_LE(vx, vmaxX)),
+                               VF_AND(VF_GE(vy, vminY), VF_LE(vy, vmaxY)));
+        count = appendMaskHits(out, count, i, VF_MASKBITS(inside));
+    }
+#endif
+    for (; i < n; i++) {
+        if (x[i] >= minX && x[i] <= maxX && y[i] >= minY && y[i] <= maxY) out[count++] = i;
+    }
+    return count;
+}
+
+/* Indices of rects in (bx, by, bw, bh) strictly overlapping (x, y, w, h),
+ * with the same edge rule as collision.rectRect. */
+static int kernelRectOverlaps(float x, float y, float w, float h,
+                              const float* restrict bx, const float* restrict by,
+                              const float* restrict bw, const float* restrict bh,
+                              int n, int* restrict out) {
+    int count = 0;
+    int i = 0;
+#if SIMD_WIDTH > 1
+    vfloat vx = VF_SET1(x), vy = VF_SET1(y);
+    vfloat vx2 = VF_SET1(x + w), vy2 = VF_SET1(y + h);
+    for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH) {
+        vfloat ox = VF_LOAD(bx + i), oy = VF_LOAD(by + i);
+        vfloat hit = VF_AND(VF_AND(VF_LT(vx, VF_ADD(ox, VF_LOAD(bw + i))), VF_GT(vx2, ox)),
+                            VF_AND(VF_LT(vy, VF_ADD(oy, VF_LOAD(bh + i))), VF_GT(vy2, oy)));
+        count = appendMaskHits(out, count, i, VF_MASKBITS(hit));
+    }
+#endif
+    for (; i < n; i++) {
+        if (x < bx[i] + bw[i] && x + w > bx[i] && y < by[i] + bh[i] && y + h > by[i]) out[count++] = i;
+    }
+    return count;
+}
+
+/* Indices of rects containing the point, edges inclusive like
+ * collision.pointRect. */
+static int kernelPointInRects(float px, float py,
+                              const float* restrict bx, const float* restrict by,
+                              const float* restrict bw, const float* restrict bh,
+                              int n, int* restrict out) {
+    int count = 0;
+    int i = 0;
+#if SIMD_WIDTH > 1
+    vfloat vx = VF_SET1(px), vy = VF_SET1(py);
+    for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH) {
+        vfloat ox = VF_LOAD(bx + i), oy = VF_LOAD(by + i);
+        vfloat hit = VF_AND(VF_AND(VF_GE(vx, ox), VF_LE(vx, VF_ADD(ox, VF_LOAD(bw + i)))),
+                            VF_AND(VF_GE(vy, oy), VF_LE(vy, VF_ADD(oy, VF_LOAD(bh + i)))));
+        count = appendMaskHits(out, count, i, VF_MASKBITS(hit));
+    }
+#endif
+    for (; i < n; i++) {
+        if (px >= bx[i] && px <= bx[i] + bw[i] && py >= by[i] && py <= by[i] + bh[i]) out[count++] = i;
+    }
+    return count;
+}
+
+/* Indices of circles strictly overlapping circle (x, y, r), matching
+ * collision.circleCircle without the square root. */
+static int kernelCircleOverlaps(float x, float y, float r,
+                                const float* restrict bx, const float* restrict by,
+                                const float* restrict br, int n, int* restrict out) {
+    int count = 0;
+    int i = 0;
+#if SIMD_WIDTH > 1
+    vfloat vx = VF_SET1(x), vy = VF_SET1(y), vr = VF_SET1(r);
+    for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH) {
+        vfloat dx = VF_SUB(VF_LOAD(bx + i), vx);
+        vfloat dy = VF_SUB(VF_LOAD(by + i), vy);
+        vfloat rr = VF_ADD(VF_LOAD(br + i), vr);
+        vfloat hit = VF_LT(VF_ADD(VF_MUL(dx, dx), VF_MUL(dy, dy)), VF_MUL(rr, rr));
+        count = appendMaskHits(out, count, i, VF_MASKBITS(hit));
+    }
+#endif
+    for (; i < n; i++) {
+        float dx = bx[i] - x, dy = by[i] - y, rr = br[i] + r;
+        if (dx * dx + dy * dy < rr * rr) out[count++] = i;
+    }
+    return count;
+}
+
+/* ============================================================ */
+/* JOB SYSTEM */
+/* ============================================================ */
+
+/* Fork/join parallel-for over native data. jobParallelFor() splits a
+ * range into chunks, deals them round-robin onto per-thread deques and
+ * works alongside the pool until all are done. A thread whose own
+ * deque is empty steals from the top of another's.
+ * Jobs must not touch Lua or GL. One caller at a time: the thread that
+ * owns the Lua state. Without pthreads everything runs inline. */
+
+#define JOB_MAX_WORKERS 15
+#define JOB_MAX_CHUNKS 256
+/* Ranges shorter than this run inline; waking the pool costs more */
+#define JOB_MIN_PARALLEL 4096
+
+typedef void (*JobFn)(void* data, int begin, int end);
+
+typedef struct {
+    JobFn fn;
+    void* data;
+    int begin, end;
+} JobChunk;
+
+#ifdef ENGINE_JOBS
+/* Owner pushes and pops at the bottom, thieves take from the top */
+typedef struct {
+    pthread_mutex_t mutex;
+    JobChunk chunks[JOB_MAX_CHUNKS];
+    int top, bottom;
+} JobDeque;
+
+typedef struct {
+    int workerCount;                        /* deques beyond the caller's */
+    int started;                            /* threads actually running */
+    pthread_t threads[JOB_MAX_WORKERS];
+    JobDeque deques[JOB_MAX_WORKERS + 1];   /* 0 belongs to the caller */
+    pthread_mutex_t mutex;                  /* guards the fields below */
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    unsigned int generation;                /* bumped per parallel-for */
+    int pending;                            /* chunks not yet finished */
+    int quit;
+} JobPool;
+
+static JobPool g_jobs;
+
+static void jobPush(JobDeque* d, const JobChunk* chunk) {
+    pthread_mutex_lock(&d->mutex);
+    d->chunks[d->bottom++] = *chunk;
+    pthread_mutex_unlock(&d->mutex);
+}
+
+static int jobPop(JobDeque* d, JobChunk* out, int steal) {
+    int found = 0;
+    pthread_mutex_lock(&d->mutex);
+    if (d->top < d->bottom) {
+        *out = steal ? d->chunks[d->top++] : d->chunks[--d->bottom];
+        if (d->top == d->bottom) d->top = d->bottom = 0;
+        found = 1;
+    }
+    pthread_mutex_unlock(&d->mutex);
+    return found;
+}
+
+/* Own deque first, then one pass over everyone else's */
+static int jobTake(int self, JobChunk* out) {
+    int n = g_jobs.workerCount + 1;
+    if (jobPop(&g_jobs.deques[self], out, 0)) return 1;
+    for (int k = 1; k < n; k++) {
+        if (jobPop(&g_jobs.deques[(self + k) % n], out, 1)) return 1;
+    }
+    return 0;
+}
+
+static void jobRun(const JobChunk* chunk) {
+    chunk->fn(chunk->data, chunk->begin, chunk->end);
+    pthread_mutex_lock(&g_jobs.mutex);
+    if (--g_jobs.pending == 0) pthread_cond_signal(&g_jobs.done);
+    pthread_mutex_unlock(&g_jobs.mutex);
+}
+
+static void* jobWorker(void* arg) {
+    int self = (int)(size_t)arg;
+    unsigned int seen = 0;
+    JobChunk chunk;
+    
+    for (;;) {
+        if (jobTake(self, &chunk)) {
+            jobRun(&chunk);
+            continue;
+        }
+        /* A changed generation means work arrived after the scan */
+        pthread_mutex_lock(&g_jobs.mutex);
+        while (g_jobs.generation == seen && !g_jobs.quit) {
+            pthread_cond_wait(&g_jobs.wake, &g_jobs.mutex);
+        }
+        seen = g_jobs.generation;
+        int quit = g_jobs.quit;
+        pthread_mutex_unlock(&g_jobs.mutex);
+        if (quit) break;
+    }
+    return NULL;
+}
+#endif
+
+/* Starts `workers` threads, or one per core beyond the caller's when
+ * negative. A thread that fails to start leaves its deque to be
+ * stolen from. */
+static void jobPoolStart(int workers) {
+#ifdef ENGINE_JOBS
+    JobPool* pool = &g_jobs;
+    if (workers < 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cores > 1 ? (int)cores - 1 : 0;
+    }
+    if (workers > JOB_MAX_WORKERS) workers = JOB_MAX_WORKERS;
+    
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    for (int i = 0; i <= JOB_MAX_WORKERS; i++) {
+        pthread_mutex_init(&pool->deques[i].mutex, NULL);
+    }
+    /* Workers index deques by workerCount, so it is set first */
+    pool->workerCount = workers;
+    for (int i = 0; i < workers; i++) {
+        if (pthread_create(&pool->threads[pool->started], NULL, jobWorker, (void*)(size_t)(i + 1)) == 0) {
+            pool->started++;
+        }
+    }
+    if (pool->started == 0) pool->workerCount = 0;
+#else
+    (void)workers;
+#endif
+}
+
+static void jobPoolStop(void) {
+#ifdef ENGINE_JOBS
+    JobPool* pool = &g_jobs;
+    pthread_mutex_lock(&pool->mutex);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->mutex);
+    for (int i = 0; i < pool->started; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pool->started = 0;
+    pool->workerCount = 0;
+#endif
+}
+
+static int jobWorkerCount(void) {
+#ifdef ENGINE_JOBS
+    return g_jobs.started;
+#else
+    return 0;
+#endif
+}
+
+/* Calls fn(data, begin, end) over disjoint pieces of [0, count), each at
+ * least `grain` long, and returns when all have finished */
+static void jobParallelFor(JobFn fn, void* data, int count, int grain) {
+    if (count <= 0) return;
+    if (grain < 1) grain = 1;
+#ifdef ENGINE_JOBS
+    JobPool* pool = &g_jobs;
+    if (pool->workerCount == 0 || count < 2 * grain) {
+        fn(data, 0, count);
+        return;
+    }
+    
+    int chunks = (count + grain - 1) / grain;
+    if (chunks > JOB_MAX_CHUNKS) chunks = JOB_MAX_CHUNKS;
+    int size = (count + chunks - 1) / chunks;
+    chunks = (count + size - 1) / size;
+    
+    pthread_mutex_lock(&pool->mutex);
+    pool->pending += chunks;
+    pthread_mutex_unlock(&pool->mutex);
+    
+    int n = pool->workerCount + 1;
+    for (int c = 0; c < chunks; c++) {
+        JobChunk chunk = { fn, data, c * size, c * size + size < count ? c * size + size : count };
+        jobPush(&pool->deques[c % n], &chunk);
+    }
+    
+    pthread_mutex_lock(&pool->mutex);
+    pool->generation++;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->mutex);
+    
+    JobChunk chunk;
+    while (jobTake(0, &chunk)) jobRun(&chunk);
+    
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->pending > 0) pthread_cond_wait(&pool->done, &pool->mutex);
+    pthread_mutex_unlock(&pool->mutex);
+#else
+    fn(data, 0, count);
+#endif
+}
+
+/* ============================================================ */
+/* PARTICLE SYSTEM */
+/* ============================================================ */
+
+#define PARTICLE_METATABLE "ParticleEmitter"
+#define PARTICLE_RADIUS 3.0f
+#define PARTICLE_INITIAL_CAPACITY 256
+
+/* One float array per particle attribute (structure of arrays) */
+typedef enum {
+    PARTICLE_X,
+    PARTICLE_Y,
+    PARTICLE_VX,
+    PARTICLE_VY,
+    PARTICLE_ELAPSED,
+    PARTICLE_LIFETIME,
+    PARTICLE_R,
+    PARTICLE_G,
+    PARTICLE_B,
+    PARTICLE_A,
+    PARTICLE_FIELD_COUNT
+} ParticleField;
+
+typedef struct {
+    float x, y;
+    int count;
+    int capacity;
+    int fade;           /* alpha falls to 0 over each particle's lifetime */
+    unsigned int seed;
+    float* field[PARTICLE_FIELD_COUNT];
+} ParticleEmitter;
+
+static unsigned int g_emitterSeed = 0x9E3779B9u;
+
+/* xorshift32, so emitters do not depend on (or disturb) math.random */
+static inline unsigned int emitterRandom(ParticleEmitter* e) {
+    unsigned int s = e->seed;
+    s ^= s << 13;
+    s ^= s >> 17;
+    s ^= s << 5;
+    e->seed = s;
+    return s;
+}
+
+/* Uniform integer in [lo, hi], like math.random(lo, hi) */
+static inline int emitterRandomRange(ParticleEmitter* e, int lo, int hi) {
+    return lo + (int)(emitterRandom(e) % (unsigned int)(hi - lo + 1));
+}
+
+static int emitterReserve(ParticleEmitter* e, int count) {
+    if (count <= e->capacity) return 1;
+    
+    int capacity = e->capacity ? e->capacity : PARTICLE_INITIAL_CAPACITY;
+    while (capacity < count) capacity *= 2;
+    
+    for (int f = 0; f < PARTICLE_FIELD_COUNT; f++) {
+        float* data = realloc(e->field[f], capacity * sizeof(float));
+        if (!data) return 0;
+        e->field[f] = data;
+    }
+    e->capacity = capacity;
+    return 1;
+}
+
+typedef struct {
+    ParticleEmitter* emitter;
+    float dt;
+} EmitterStep;
+
+static void emitterIntegrateRange(void* data, int begin, int end) {
+    const EmitterStep* step = data;
+    ParticleEmitter* e = step->emitter;
+    kernelIntegrate(e->field[PARTICLE_X] + begin, e->field[PARTICLE_Y] + begin,
+                    e->field[PARTICLE_VX] + begin, e->field[PARTICLE_VY] + begin, end - begin, step->dt);
+    kernelAddScalar(e->field[PARTICLE_ELAPSED] + begin, end - begin, step->dt);
+}
+
+/* Large emitters are integrated in chunks across the job pool */
+static void emitterIntegrate(ParticleEmitter* e, float dt) {
+    EmitterStep step = { e, dt };
+    jobParallelFor(emitterIntegrateRange, &step, e->count, JOB_MIN_PARALLEL);
+}
+
+/* Drops expired particles by moving the last live one into their slot.
+ * The scan skips whole SIMD lanes of live particles at a time. */
+static void emitterRemoveDead(ParticleEmitter* e) {
+    const float* elapsed = e->field[PARTICLE_ELAPSED];
+    const float* lifetime = e->field[PARTICLE_LIFETIME];
+    int i = kernelFindExpired(elapsed, lifetime, 0, e->count);
+    
+    while (i < e->count) {
+        int last = --e->count;
+        for (int f = 0; f < PARTICLE_FIELD_COUNT; f++) {
+            e->field[f][i] = e->field[f][last];
+        }
+        /* Slot i now holds the moved particle, which may be dead too */
+        i = kernelFindExpired(elapsed, lifetime, i, e->count);
+    }
+}
+
+static ParticleEmitter* checkEmitter(lua_State* L, int idx) {
+    return (ParticleEmitter*)luaL_checkudata(L, idx, PARTICLE_METATABLE);
+}
+
+/* emitter:emit(count, vx, vy, [lifetime], [color]) */
+static int lua_emitterEmit(lua_State* L) {
+    ParticleEmitter* e = checkEmitter(L, 1);
+    int count = (int)luaL_checkinteger(L, 2);
+    float vx = luaL_optnumber(L, 3, 0.0);
+    float vy = luaL_optnumber(L, 4, 0.0);
+    float lifetime = luaL_optnumber(L, 5, 1.0);
+    float r = 1.0f, g = 1.0f, b = 1.0f, a = 1.0f;
+    
+    if (lua_istable(L, 6)) {
+        lua_getfield(L, 6, "r"); r = luaL_optnumber(L, -1, 1.0);
+        lua_getfield(L, 6, "g"); g = luaL_optnumber(L, -1, 1.0);
+        lua_getfield(L, 6, "b"); b = luaL_optnumber(L, -1, 1.0);
+        lua_getfield(L, 6, "a"); a = luaL_optnumber(L, -1, 1.0);
+        lua_pop(L, 4);
+    }
+    
+    if (count <= 0) return 0;
+    if (!emitterReserve(e, e->count + count)) {
+        return luaL_error(L, "out of memory growing particle emitter");
+    }
+    
+    for (int i = e->count; i < e->count + count; i++) {
+        e->field[PARTICLE_X][i] = e->x + emitterRandomRange(e, -10, 10);
+        e->field[PARTICLE_Y][i] = e->y + emitterRandomRange(e, -10, 10);
+        e->field[PARTICLE_VX][i] = vx + emitterRandomRange(e, -50, 50) / 50.0f;
+        e->field[PARTICLE_VY][i] = vy + emitterRandomRange(e, -50, 50) / 50.0f;
+        e->field[PARTICLE_ELAPSED][i] = 0.0f;
+        e->field[PARTICLE_LIFETIME][i] = lifetime;
+        e->field[PARTICLE_R][i] = r;
+        e->field[PARTICLE_G][i] = g;
+        e->field[PARTICLE_B][i] = b;
+        e->field[PARTICLE_A][i] = a;
+    }
+    e->count += count;
+    
+    return 0;
+}
+
+static int lua_emitterUpdate(lua_State* L) {
+    ParticleEmitter* e = checkEmitter(L, 1);
+    float dt = luaL_checknumber(L, 2);
+    
+    emitterIntegrate(e, dt);
+    emitterRemoveDead(e);
+    
+    return 0;
+}
+
+typedef struct {
+    ParticleEmitter** emitters;
+    float dt;
+} EmitterGroupStep;
+
+/* One job per run of emitters; each one is updated whole, serially */
+static void emitterUpdateRange(void* data, int begin, int end) {
+    const EmitterGroupStep* group = data;
+    for (int i = begin; i < end; i++) {
+        EmitterStep step = { group->emitters[i], group->dt };
+        emitterIntegrateRange(&step, 0, step.emitter->count);
+        emitterRemoveDead(step.emitter);
+    }
+}
+
+/* particle.updateAll(emitters, dt) -- emitter:update(dt) for every
+ * emitter in the array, spread across the job pool */
+static int lua_particleUpdateAll(lua_State* L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    float dt = luaL_checknumber(L, 2);
+    int n = (int)lua_rawlen(L, 1);
+    if (n == 0) return 0;
+    
+    size_t mark = arenaMark(&g_frameArena);
+    ParticleEmitter** emitters = arenaAlloc(&g_frameArena, n * sizeof(ParticleEmitter*));
+    if (!emitters) return luaL_error(L, "out of memory updating emitters");
+    int particles = 0;
+    for (int i = 0; i < n; i++) {
+        lua_rawgeti(L, 1, i + 1);
+        emitters[i] = checkEmitter(L, -1);
+        particles += emitters[i]->count;
+        lua_pop(L, 1);
+    }
+    
+    /* A handful of small emitters isn't worth waking the pool for */
+    EmitterGroupStep group = { emitters, dt };
+    jobParallelFor(emitterUpdateRange, &group, n, particles < JOB_MIN_PARALLEL ? n : 1);
+    arenaRewind(&g_frameArena, mark);
+    return 0;
+}
+
+/* Submits the visible part of the emitter as one run of circle instances;
+ * the culling and fade buffers come from the frame arena. A mesh being
+ * recorded gets every particle, like viewRejects() lets it. */
+static void emitterSubmit(const ParticleEmitter* e) {
+    int* visible = NULL;
+    int count = e->count;
+    if (!g_captureMesh) {
+        visible = arenaAlloc(&g_frameArena, e->count * sizeof(int));
+        if (!visible) return;
+        
+        float minX, minY, maxX, maxY;
+        getViewRect(&minX, &minY, &maxX, &maxY);
+        count = kernelCullCircles(e->field[PARTICLE_X], e->field[PARTICLE_Y], PARTICLE_RADIUS,
+                                  e->count, minX, minY, maxX, maxY, visible);
+        if (count == 0) return;
+    }
+    
+    const float* alpha = e->field[PARTICLE_A];
+    if (e->fade) {
+        float* faded = arenaAlloc(&g_frameArena, e->count * sizeof(float));
+        if (!faded) return;
+        kernelFade(faded, alpha, e->field[PARTICLE_ELAPSED], e->field[PARTICLE_LIFETIME], e->count);
+        alpha = faded;
+    }
+    
+    float* v = batchReserve(BATCH_CIRCLES, count);
+    if (!v) return;
+    
+    for (int k = 0; k < count; k++) {
+        int i = visible ? visible[k] : k;
+        v = putCircle(v, e->field[PARTICLE_X][i], e->field[PARTICLE_Y][i], PARTICLE_RADIUS,
+                      e->field[PARTICLE_R][i], e->field[PARTICLE_G][i],
+                      e->field[PARTICLE_B][i], alpha[i]);
+    }
+}
+
+static int lua_emitterDraw(lua_State* L) {
+    ParticleEmitter* e = checkEmitter(L, 1);
+    if (e->count == 0) return 0;
+    
+    size_t mark = arenaMark(&g_frameArena);
+    emitterSubmit(e);
+    arenaRewind(&g_frameArena, mark);
+    return 0;
+}
+
+/* emitter:setFade(enabled) */
+static int lua_emitterSetFade(lua_State* L) {
+    ParticleEmitter* e = checkEmitter(L, 1);
+    e->fade = lua_toboolean(L, 2);
+    return 0;
+}
+
+static int lua_emitterCount(lua_State* L) {
+    lua_pushinteger(L, checkEmitter(L, 1)->count);
+    return 1;
+}
+
+static int lua_emitterClear(lua_State* L) {
+    checkEmitter(L, 1)->count = 0;
+    return 0;
+}
+
+static int lua_emitterSetPosition(lua_State* L) {
+    ParticleEmitter* e = checkEmitter(L, 1);
+    e->x = luaL_checknumber(L, 2);
+    e->y = luaL_checknumber(L, 3);
+    return 0;
+}
+
+/* Fields behave like the old Lua table: emitter.x / emitter.y */
+static int lua_emitterIndex(lua_State* L) {
+    ParticleEmitter* e = checkEmitter(L, 1);
+    const char* key = luaL_checkstring(L, 2);
+    
+    if (strcmp(key, "x") == 0) lua_pushnumber(L, e->x);
+    else if (strcmp(key, "y") == 0) lua_pushnumber(L, e->y);
+    else lua_getfield(L, lua_upvalueindex(1), key);
+    
+    return 1;
+}
+
+static int lua_emitterNewIndex(lua_State* L) {
+    ParticleEmitter* e = checkEmitter(L, 1);
+    const char* key = luaL_checkstring(L, 2);
+    
+    if (strcmp(key, "x") == 0) e->x = luaL_checknumber(L, 3);
+    else if (strcmp(key, "y") == 0) e->y = luaL_checknumber(L, 3);
+    else return luaL_error(L, "cannot set field '%s' on a particle emitter", key);
+    
+    return 0;
+}
+
+static int lua_emitterGC(lua_State* L) {
+    ParticleEmitter* e = checkEmitter(L, 1);
+    for (int f = 0; f < PARTICLE_FIELD_COUNT; f++) {
+        free(e->field[f]);
+        e->field[f] = NULL;
+    }
+    e->count = e->capacity = 0;
+    return 0;
+}
+
+/* particle.newEmitter(x, y) */
+static int lua_newEmitter(lua_State* L) {
+    float x = luaL_optnumber(L, 1, 0.0);
+    float y = luaL_optnumber(L, 2, 0.0);
+    
+    ParticleEmitter* e = (ParticleEmitter*)lua_newuserdatauv(L, sizeof(ParticleEmitter), 0);
+    memset(e, 0, sizeof(*e));
+    e->x = x;
+    e->y = y;
+    
+    g_emitterSeed = g_emitterSeed * 1664525u + 1013904223u;
+    e->seed = g_emitterSeed ? g_emitterSeed : 1u;
+    
+    luaL_setmetatable(L, PARTICLE_METATABLE);
+    return 1;
+}
+
+void registerParticleModule(lua_State* L) {
+    static const luaL_Reg methods[] = {
+        {"emit", lua_emitterEmit},
+        {"update", lua_emitterUpdate},
+        {"draw", lua_emitterDraw},
+        {"count", lua_emitterCount},
+        {"clear", lua_emitterClear},
+        {"setPosition", lua_emitterSetPosition},
+        {"setFade", lua_emitterSetFade},
+        {NULL, NULL}
+    };
+    
+    luaL_newmetatable(L, PARTICLE_METATABLE);
+    luaL_newlib(L, methods);
+    lua_pushcclosure(L, lua_emitterIndex, 1);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, lua_emitterNewIndex);
+    lua_setfield(L, -2, "__newindex");
+    lua_pushcfunction(L, lua_emitterCount);
+    lua_setfield(L, -2, "__len");
+    lua_pushcfunction(L, lua_emitterGC);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+    
+    lua_newtable(L);
+    lua_pushcfunction(L, lua_newEmitter);
+    lua_setfield(L, -2, "newEmitter");
+    lua_pushcfunction(L, lua_particleUpdateAll);
+    lua_setfield(L, -2, "updateAll");
+    lua_setglobal(L, "particle");
+}
+
+/* ============================================================ */
+/* COLLISION WORLD (SPATIAL HASH) */
+/* ============================================================ */
+
+#define WORLD_METATABLE "CollisionWorld"
+
+typedef struct {
+    float x, y, w, h;
+    int active;
+    int nextFree;       /* free-list link while inactive */
+} WorldBody;
+
+/* One (cell, body) pair; a body spanning several cells has several */
+typedef struct {
+    int cx, cy;
+    int body;
+    unsigned int bucket;    /* cell hash masked to the table */
+} CellEntry;
+
+/* Uniform grid keyed by hashed cell coordinates. Bodies are stored in a
+ * slot array with a free list; queryPairs() rehashes every body into a
+ * counting-sorted cell table and tests pairs that share a cell. */
+typedef struct {
+    float cellSize;
+    float invCellSize;
+    WorldBody* bodies;
+    int bodyCount;      /* slots handed out (live or free) */
+    int bodyCapacity;
+    int freeList;
+    int live;
+    
+    CellEntry* entries;
+    CellEntry* sorted;
+    int entryCount;
+    int entryCapacity;
+    int* buckets;       /* bucketCount + 1 start offsets into sorted */
+    int bucketCount;
+} CollisionWorld;
+
+/* Cell coordinates are clamped so far-out boxes share the edge cells
+ * rather than overflowing int */
+#define WORLD_CELL_LIMIT 536870912.0f   /* 2^29 */
+/* Boxes spanning more cells than this on an axis stay out of the table
+ * and are tested against every body instead */
+#define WORLD_MAX_SPAN 256
+/* Cell entries per rebuild, keeping offsets and the bucket table in int */
+#define WORLD_MAX_ENTRIES (1 << 26)
+
+static inline int worldCell(const CollisionWorld* w, float v) {
+    float cell = floorf(v * w->invCellSize);
+    return (int)fmaxf(-WORLD_CELL_LIMIT, fminf(cell, WORLD_CELL_LIMIT));
+}
+
+/* The body's cell range, or 0 if it is too large for the table */
+static inline int worldBodyCells(const CollisionWorld* w, const WorldBody* b,
+                                 int* x0, int* x1, int* y0, int* y1) {
+    *x0 = worldCell(w, b->x);
+    *x1 = worldCell(w, b->x + b->w);
+    *y0 = worldCell(w, b->y);
+    *y1 = worldCell(w, b->y + b->h);
+    return *x1 - *x0 < WORLD_MAX_SPAN && *y1 - *y0 < WORLD_MAX_SPAN;
+}
+
+static inline unsigned int cellHash(int cx, int cy) {
+    return (unsigned int)cx * 73856093u ^ (unsigned int)cy * 19349663u;
+}
+
+static inline int aabbOverlap(const WorldBody* a, const WorldBody* b) {
+    return a->x <= b->x + b->w && b->x <= a->x + a->w &&
+           a->y <= b->y + b->h && b->y <= a->y + a->h;
+}
+
+/* Bodies per rebuild job; the body range is cut into at most
+ * WORLD_REBUILD_CHUNKS pieces */
+#define WORLD_REBUILD_GRAIN 1024
+#define WORLD_REBUILD_CHUNKS 64
+
+typedef struct {
+    CollisionWorld* world;
+    int chunkSize;
+    unsigned int mask;
+    int offsets[WORLD_REBUILD_CHUNKS + 1];  /* entry counts, then start offsets */
+} WorldRebuild;
+
+static void worldCountRange(void* data, int begin, int end) {
+    WorldRebuild* r = data;
+    const CollisionWorld* w = r->world;
+    
+    for (int c = begin; c < end; c++) {
+        int first = c * r->chunkSize;
+        int last = first + r->chunkSize < w->bodyCount ? first + r->chunkSize : w->bodyCount;
+        long long n = 0;
+        for (int i = first; i < last && n <= WORLD_MAX_ENTRIES; i++) {
+            const WorldBody* b = &w->bodies[i];
+            int x0, x1, y0, y1;
+            if (!b->active || !worldBodyCells(w, b, &x0, &x1, &y0, &y1)) continue;
+            n += (long long)(x1 - x0 + 1) * (y1 - y0 + 1);
+        }
+        r->offsets[c + 1] = n > WORLD_MAX_ENTRIES ? WORLD_MAX_ENTRIES + 1 : (int)n;
+    }
+}
+
+static void worldFillRange(void* data, int begin, int end) {
+    WorldRebuild* r = data;
+    const CollisionWorld* w = r->world;
+    
+    for (int c = begin; c < end; c++) {
+        int first = c * r->chunkSize;
+        int last = first + r->chunkSize < w->bodyCount ? first + r->chunkSize : w->bodyCount;
+        CellEntry* e = w->entries + r->offsets[c];
+        for (int i = first; i < last; i++) {
+            const WorldBody* b = &w->bodies[i];
+            int x0, x1, y0, y1;
+            if (!b->active || !worldBodyCells(w, b, &x0, &x1, &y0, &y1)) continue;
+            
+            for (int cy = y0; cy <= y1; cy++) {
+                for (int cx = x0; cx <= x1; cx++) {
+                    e->cx = cx;
+                    e->cy = cy;
+                    e->body = i;
+                    e->bucket = cellHash(cx, cy) & r->mask;
+                    e++;
+                }
+            }
+        }
+    }
+}
+
+/* Rehashes every live body into the cell table. Counting and filling
+ * the entries run across the job pool, each chunk of bodies writing its
+ * own slice; the bucket sort stays serial. */
+static int worldRebuild(CollisionWorld* w) {
+    WorldRebuild r;
+    r.world = w;
+    int chunks = (w->bodyCount + WORLD_REBUILD_GRAIN - 1) / WORLD_REBUILD_GRAIN;
+    if (chunks > WORLD_REBUILD_CHUNKS) chunks = WORLD_REBUILD_CHUNKS;
+    if (chunks < 1) chunks = 1;
+    r.chunkSize = (w->bodyCount + chunks - 1) / chunks;
+    
+    r.offsets[0] = 0;
+    jobParallelFor(worldCountRange, &r, chunks, 1);
+    for (int c = 0; c < chunks; c++) {
+        if (r.offsets[c + 1] > WORLD_MAX_ENTRIES - r.offsets[c]) return 0;
+        r.offsets[c + 1] += r.offsets[c];
+    }
+    w->entryCount = r.offsets[chunks];
+    
+    if (w->entryCount > w->entryCapacity) {
+        int capacity = w->entryCapacity ? w->entryCapacity : 256;
+        while (capacity < w->entryCount) capacity *= 2;
+        CellEntry* entries = realloc(w->entries, capacity * sizeof(CellEntry));
+        if (!entries) return 0;
+        w->entries = entries;
+        w->entryCapacity = capacity;
+    }
+    
+    /* Power-of-two table at least twice the entry count */
+    int bucketCount = 64;
+    while (bucketCount < w->entryCount * 2) bucketCount *= 2;
+    if (bucketCount != w->bucketCount) {
+        int* buckets = realloc(w->buckets, (bucketCount + 1) * sizeof(int));
+        if (!buckets) return 0;
+        w->buckets = buckets;
+        w->bucketCount = bucketCount;
+    }
+    CellEntry* sorted = realloc(w->sorted, (w->entryCapacity ? w->entryCapacity : 1) * sizeof(CellEntry));
+    if (!sorted) return 0;
+    w->sorted = sorted;
+    
+    r.mask = (unsigned int)bucketCount - 1;
+    jobParallelFor(worldFillRange, &r, chunks, 1);
+    
+    /* Counting sort of entries by bucket */
+    memset(w->buckets, 0, (bucketCount + 1) * sizeof(int));
+    for (int i = 0; i < w->entryCount; i++) {
+        w->buckets[w->entries[i].bucket + 1]++;
+    }
+    for (int i = 0; i < bucketCount; i++) {
+        w->buckets[i + 1] += w->buckets[i];
+    }
+    for (int i = 0; i < w->entryCount; i++) {
+        w->sorted[w->buckets[w->entries[i].bucket]++] = w->entries[i];
+    }
+    /* The fill pass advanced each start to the next bucket's; shift back */
+    for (int i = bucketCount; i > 0; i--) {
+        w->buckets[i] = w->buckets[i - 1];
+    }
+    w->buckets[0] = 0;
+    
+    return 1;
+}
+
+static CollisionWorld* checkWorld(lua_State* L, int idx) {
+    return (CollisionWorld*)luaL_checkudata(L, idx, WORLD_METATABLE);
+}
+
+static int checkBodyId(lua_State* L, CollisionWorld* w, int arg) {
+    lua_Integer id = luaL_checkinteger(L, arg);
+    luaL_argcheck(L, id >= 1 && id <= w->bodyCount && w->bodies[id - 1].active, arg, "invalid body id");
+    return (int)id - 1;
+}
+
+/* Reads x, y, [w], [h] from arg on; the box must be finite with a
+ * non-negative size. w and h default to dw and dh. */
+static void checkBodyBox(lua_State* L, int arg, float dw, float dh, WorldBody* box) {
+    box->x = luaL_checknumber(L, arg);
+    box->y = luaL_checknumber(L, arg + 1);
+    box->w = luaL_optnumber(L, arg + 2, dw);
+    box->h = luaL_optnumber(L, arg + 3, dh);
+    luaL_argcheck(L, isfinite(box->x), arg, "x must be finite");
+    luaL_argcheck(L, isfinite(box->y), arg + 1, "y must be finite");
+    luaL_argcheck(L, isfinite(box->w) && box->w >= 0.0f, arg + 2, "width must be finite and non-negative");
+    luaL_argcheck(L, isfinite(box->h) && box->h >= 0.0f, arg + 3, "height must be finite and non-negative");
+}
+
+/* world:insert(x, y, w, h) -> id */
+static int lua_worldInsert(lua_State* L) {
+    CollisionWorld* w = checkWorld(L, 1);
+    WorldBody box;
+    checkBodyBox(L, 2, 0.0f, 0.0f, &box);
+    int slot;
+    
+    if (w->freeList >= 0) {
+        slot = w->freeList;
+        w->freeList = w->bodies[slot].nextFree;
+    } else {
+        if (w->bodyCount == w->bodyCapacity) {
+            int capacity = w->bodyCapacity ? w->bodyCapacity * 2 : 64;
+            WorldBody* bodies = realloc(w->bodies, capacity * sizeof(WorldBody));
+            if (!bodies) return luaL_error(L, "out of memory growing collision world");
+            w->bodies = bodies;
+            w->bodyCapacity = capacity;
+        }
+        slot = w->bodyCount++;
+    }
+    
+    WorldBody* b = &w->bodies[slot];
+    b->x = box.x;
+    b->y = box.y;
+    b->w = box.w;
+    b->h = box.h;
+    b->active = 1;
+    b->nextFree = -1;
+    w->live++;
+    
+    lua_pushinteger(L, slot + 1);
+    return 1;
+}
+
+/* world:update(id, x, y, [w], [h]) */
+static int lua_worldUpdate(lua_State* L) {
+    CollisionWorld* w = checkWorld(L, 1);
+    WorldBody* b = &w->bodies[checkBodyId(L, w, 2)];
+    WorldBody box;
+    checkBodyBox(L, 3, b->w, b->h, &box);
+    b->x = box.x;
+    b->y = box.y;
+    b->w = box.w;
+    b->h = box.h;
+    return 0;
+}
+
+/* world:remove(id) -- the id may be handed out again by insert() */
+static int lua_worldRemove(lua_State* L) {
+    CollisionWorld* w = checkWorld(L, 1);
+    int slot = checkBodyId(L, w, 2);
+    w->bodies[slot].active = 0;
+    w->bodies[slot].nextFree = w->freeList;
+    w->freeList = slot;
+    w->live--;
+    return 0;
+}
+
+/* world:get(id) -> x, y, w, h */
+static int lua_worldGet(lua_State* L) {
+    CollisionWorld* w = checkWorld(L, 1);
+    const WorldBody* b = &w->bodies[checkBodyId(L, w, 2)];
+    lua_pushnumber(L, b->x);
+    lua_pushnumber(L, b->y);
+    lua_pushnumber(L, b->w);
+    lua_pushnumber(L, b->h);
+    return 4;
+}
+
+/* world:queryPairs([out]) -> {a1, b1, a2, b2, ...}, pairCount
+ * Every pair of bodies whose boxes overlap, each reported once. */
+static int lua_worldQueryPairs(lua_State* L) {
+    CollisionWorld* w = checkWorld(L, 1);
+    int out = pushOutputTable(L, 2);
+    
+    if (!worldRebuild(w)) {
+        return luaL_error(L, "cannot rebuild collision world (out of memory or too many occupied cells)");
+    }
+    
+    int n = 0;
+    for (int bucket = 0; bucket < w->bucketCount; bucket++) {
+        int start = w->buckets[bucket];
+        int end = w->buckets[bucket + 1];
+        
+        for (int i = start; i < end; i++) {
+            const CellEntry* ei = &w->sorted[i];
+            for (int j = i + 1; j < end; j++) {
+                const CellEntry* ej = &w->sorted[j];
+                if (ei->cx != ej->cx || ei->cy != ej->cy || ei->body == ej->body) continue;
+                
+                const WorldBody* a = &w->bodies[ei->body];
+                const WorldBody* b = &w->bodies[ej->body];
+                if (!aabbOverlap(a, b)) continue;
+                
+                /* Report only from the cell holding the overlap's min corner */
+                if (worldCell(w, a->x > b->x ? a->x : b->x) != ei->cx ||
+                    worldCell(w, a->y > b->y ? a->y : b->y) != ei->cy) continue;
+                
+                int lo = ei->body < ej->body ? ei->body : ej->body;
+                int hi = ei->body < ej->body ? ej->body : ei->body;
+                lua_pushinteger(L, lo + 1);
+                lua_rawseti(L, out, ++n);
+                lua_pushinteger(L, hi + 1);
+                lua_rawseti(L, out, ++n);
+            }
+        }
+    }
+    
+    /* Bodies too large for the table, against everything else; a pair of
+     * them is reported from the lower id */
+    for (int i = 0; i < w->bodyCount; i++) {
+        const WorldBody* a = &w->bodies[i];
+        int x0, x1, y0, y1;
+        if (!a->active || worldBodyCells(w, a, &x0, &x1, &y0, &y1)) continue;
+        for (int j = 0; j < w->bodyCount; j++) {
+            const WorldBody* b = &w->bodies[j];
+            if (j == i || !b->active || !aabbOverlap(a, b)) continue;
+            if (j < i && !worldBodyCells(w, b, &x0, &x1, &y0, &y1)) continue;
+            lua_pushinteger(L, (i < j ? i : j) + 1);
+            lua_rawseti(L, out, ++n);
+            lua_pushinteger(L, (i < j ? j : i) + 1);
+            lua_rawseti(L, out, ++n);
+        }
+    }
+    
+    trimOutputTable(L, out, n);
+    lua_pushinteger(L, n / 2);
+    return 2;
+}
+
+/* world:queryRect(x, y, w, h, [out]) -> {id, ...}, count */
+static int lua_worldQueryRect(lua_State* L) {
+    CollisionWorld* w = checkWorld(L, 1);
+    WorldBody query;
+    query.x = luaL_checknumber(L, 2);
+    query.y = luaL_checknumber(L, 3);
+    query.w = luaL_optnumber(L, 4, 0.0);
+    query.h = luaL_optnumber(L, 5, 0.0);
+    int out = pushOutputTable(L, 6);
+    
+    /* A single box against the live bodies: a linear sweep beats a rebuild */
+    int n = 0;
+    for (int i = 0; i < w->bodyCount; i++) {
+        if (w->bodies[i].active && aabbOverlap(&w->bodies[i], &query)) {
+            lua_pushinteger(L, i + 1);
+            lua_rawseti(L, out, ++n);
+        }
+    }
+    
+    trimOutputTable(L, out, n);
+    lua_pushinteger(L, n);
+    return 2;
+}
+
+static int lua_worldCount(lua_State* L) {
+    lua_pushinteger(L, checkWorld(L, 1)->live);
+    return 1;
+}
+
+static int lua_worldGC(lua_State* L) {
+    CollisionWorld* w = checkWorld(L, 1);
+    free(w->bodies);
+    free(w->entries);
+    free(w->sorted);
+    free(w->buckets);
+    memset(w, 0, sizeof(*w));
+    return 0;
+}
+
+/* collision.newWorld([cellSize]) */
+static int lua_newWorld(lua_State* L) {
+    float cellSize = luaL_optnumber(L, 1, 64.0);
+    luaL_argcheck(L, cellSize > 0, 1, "cell size must be positive");
+    
+    CollisionWorld* w = (CollisionWorld*)lua_newuserdatauv(L, sizeof(CollisionWorld), 0);
+    memset(w, 0, sizeof(*w));
+    w->cellSize = cellSize;
+    w->invCellSize = 1.0f / cellSize;
+    w->freeList = -1;
+    
+    luaL_setmetatable(L, WORLD_METATABLE);
+    return 1;
+}
+
+void registerCollisionModule(lua_State* L) {
+    static const luaL_Reg methods[] = {
+        {"insert", lua_worldInsert},
+        {"update", lua_worldUpdate},
+        {"remove", lua_worldRemove},
+        {"get", lua_worldGet},
+        {"queryPairs", lua_worldQueryPairs},
+        {"queryRect", lua_worldQueryRect},
+        {"count", lua_worldCount},
+        {NULL, NULL}
+    };
+    
+    luaL_newmetatable(L, WORLD_METATABLE);
+    luaL_newlib(L, methods);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, lua_worldCount);
+    lua_setfield(L, -2, "__len");
+    lua_pushcfunction(L, lua_worldGC);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+    
+    /* game.lua adds the pairwise tests to this same table */
+    lua_newtable(L);
+    lua_pushcfunction(L, lua_newWorld);
+    lua_setfield(L, -2, "newWorld");
+    lua_setglobal(L, "collision");
+}
+
+/* ============================================================ */
+/* DYNAMIC AABB TREE */
+/* ============================================================ */
+
+#define TREE_METATABLE "AABBTree"
+#define TREE_NULL (-1)
+#define TREE_DEFAULT_MARGIN 4.0f
+/* Fat boxes also stretch this many frames of displacement ahead */
+#define TREE_DISPLACEMENT_MULTIPLIER 2.0f
+
+typedef struct {
+    float minX, minY, maxX, maxY;
+} AABB;
+
+/* Leaves hold a fat box (tight box plus margin) so small moves need no
+ * tree update; internal nodes hold the union of their children. */
+typedef struct {
+    AABB box;
+    AABB tight;         /* leaves only: the box the script gave us */
+    int parent;
+    int child1, child2; /* TREE_NULL for leaves */
+    int height;         /* 0 for leaves, -1 for free nodes */
+    int next;           /* free-list link */
+} TreeNode;
+
+typedef struct {
+    TreeNode* nodes;
+    int nodeCapacity;
+    int root;
+    int freeList;
+    int leafCount;
+    float margin;
+    int* stack;         /* traversal scratch */
+    int stackCapacity;
+} AABBTree;
+
+static inline AABB aabbUnion(const AABB* a, const AABB* b) {
+    AABB r;
+    r.minX = a->minX < b->minX ? a->minX : b->minX;
+    r.minY = a->minY < b->minY ? a->minY : b->minY;
+    r.maxX = a->maxX > b->maxX ? a->maxX : b->maxX;
+    r.maxY = a->maxY > b->maxY ? a->maxY : b->maxY;
+    return r;
+}
+
+static inline float aabbPerimeter(const AABB* a) {
+    return 2.0f * ((a->maxX - a->minX) + (a->maxY - a->minY));
+}
+
+static inline int aabbContains(const AABB* outer, const AABB* inner) {
+    return outer->minX <= inner->minX && outer->minY <= inner->minY &&
+           inner->maxX <= outer->maxX && inner->maxY <= outer->maxY;
+}
+
+static inline int aabbOverlaps(const AABB* a, const AABB* b) {
+    return a->minX <= b->maxX && b->minX <= a->maxX &&
+           a->minY <= b->maxY && b->minY <= a->maxY;
+}
+
+/* Slab test of the segment origin + t * dir, t in [0, maxT]. On a hit
+ * stores the entry parameter (0 when the origin is inside). */
+static int segmentAABB(float ox, float oy, float dx, float dy, const AABB* b, float maxT, float* tHit) {
+    float tmin = 0.0f, tmax = maxT;
+    float o[2] = { ox, oy };
+    float d[2] = { dx, dy };
+    float lo[2] = { b->minX, b->minY };
+    float hi[2] = { b->maxX, b->maxY };
+    
+    for (int axis = 0; axis < 2; axis++) {
+        if (fabsf(d[axis]) < 1e-12f) {
+            if (o[axis] < lo[axis] || o[axis] > hi[axis]) return 0;
+        } else {
+            float inv = 1.0f / d[axis];
+            float t1 = (lo[axis] - o[axis]) * inv;
+            float t2 = (hi[axis] - o[axis]) * inv;
+            if (t1 > t2) { float t = t1; t1 = t2; t2 = t; }
+            if (t1 > tmin) tmin = t1;
+            if (t2 < tmax) tmax = t2;
+            if (tmin > tmax) return 0;
+        }
+    }
+    
+    *tHit = tmin;
+    return 1;
+}
+
+static int treeAllocNode(AABBTree* t) {
+    if (t->freeList == TREE_NULL) {
+        int capacity = t->nodeCapacity ? t->nodeCapacity * 2 : 64;
+        TreeNode* nodes = realloc(t->nodes, capacity * sizeof(TreeNode));
+        if (!nodes) return TREE_NULL;
+        
+        for (int i = t->nodeCapacity; i < capacity; i++) {
+            nodes[i].next = i + 1 < capacity ? i + 1 : TREE_NULL;
+            nodes[i].height = -1;
+        }
+        t->freeList = t->nodeCapacity;
+        t->nodes = nodes;
+        t->nodeCapacity = capacity;
+    }
+    
+    int id = t->freeList;
+    TreeNode* n = &t->nodes[id];
+    t->freeList = n->next;
+    n->parent = n->child1 = n->child2 = TREE_NULL;
+    n->height = 0;
+    n->next = TREE_NULL;
+    return id;
+}
+
+static void treeFreeNode(AABBTree* t, int id) {
+    t->nodes[id].next = t->freeList;
+    t->nodes[id].height = -1;
+    t->freeList = id;
+}
+
+static inline int treeIsLeaf(const TreeNode* n) {
+    return n->child1 == TREE_NULL;
+}
+
+static inline int maxInt(int a, int b) {
+    return a > b ? a : b;
+}
+
+static void treeReplaceChild(AABBTree* t, int parent, int oldChild, int newChild) {
+    if (parent == TREE_NULL) {
+        t->root = newChild;
+    } else if (t->nodes[parent].child1 == oldChild) {
+        t->nodes[parent].child1 = newChild;
+    } else {
+        t->nodes[parent].child2 = newChild;
+    }
+}
+
+/* Rotates the taller grandchild up if node iA is out of balance and
+ * returns the index now at iA's position. */
+static int treeBalance(AABBTree* t, int iA) {
+    TreeNode* nodes = t->nodes;
+    TreeNode* A = &nodes[iA];
+    if (treeIsLeaf(A) || A->height < 2) return iA;
+    
+    int iB = A->child1;
+    int iC = A->child2;
+    TreeNode* B = &nodes[iB];
+    TreeNode* C = &nodes[iC];
+    int balance = C->height - B->height;
+    
+    if (balance > 1) {
+        int iF = C->child1;
+        int iG = C->child2;
+        TreeNode* F = &nodes[iF];
+        TreeNode* G = &nodes[iG];
+        
+        C->child1 = iA;
+        C->parent = A->parent;
+        A->parent = iC;
+        treeReplaceChild(t, C->parent, iA, iC);
+        
+        if (F->height > G->height) {
+            C->child2 = iF;
+            A->child2 = iG;
+            G->parent = iA;
+            A->box = aabbUnion(&B->box, &G->box);
+            C->box = aabbUnion(&A->box, &F->box);
+            A->height = 1 + maxInt(B->height, G->height);
+            C->height = 1 + maxInt(A->height, F->height);
+        } else {
+            C->child2 = iG;
+            A->child2 = iF;
+            F->parent = iA;
+            A->box = aabbUnion(&B->box, &F->box);
+            C->box = aabbUnion(&A->box, &G->box);
+            A->height = 1 + maxInt(B->height, F->height);
+            C->height = 1 + maxInt(A->height, G->height);
+        }
+        return iC;
+    }
+    
+    if (balance < -1) {
+        int iD = B->child1;
+        int iE = B->child2;
+        TreeNode* D = &nodes[iD];
+        TreeNode* E = &nodes[iE];
+        
+        B->child1 = iA;
+        B->parent = A->parent;
+        A->parent = iB;
+        treeReplaceChild(t, B->parent, iA, iB);
+        
+        if (D->height > E->height) {
+            B->child2 = iD;
+            A->child1 = iE;
+            E->parent = iA;
+            A->box = aabbUnion(&C->box, &E->box);
+            B->box = aabbUnion(&A->box, &D->box);
+            A->height = 1 + maxInt(C->height, E->height);
+            B->height = 1 + maxInt(A->height, D->height);
+        } else {
+            B->child2 = iE;
+            A->child1 = iD;
+            D->parent = iA;
+            A->box = aabbUnion(&C->box, &D->box);
+            B->box = aabbUnion(&A->box, &E->box);
+            A->height = 1 + maxInt(C->height, D->height);
+            B->height = 1 + maxInt(A->height, E->height);
+        }
+        return iB;
+    }
+    
+    return iA;
+}
+
+/* Refits boxes and heights from `index` to the root, rebalancing */
+static void treeRefitUpward(AABBTree* t, int index) {
+    while (index != TREE_NULL) {
+        index = treeBalance(t, index);
+        
+        TreeNode* n = &t->nodes[index];
+        const TreeNode* c1 = &t->nodes[n->child1];
+        const TreeNode* c2 = &t->nodes[n->child2];
+        n->height = 1 + maxInt(c1->height, c2->height);
+        n->box = aabbUnion(&c1->box, &c2->box);
+        
+        index = n->parent;
+    }
+}
+
+/* Inserts a leaf next to the sibling that grows the tree's total
+ * perimeter the least (the surface-area heuristic in 2D). */
+static int treeInsertLeaf(AABBTree* t, int leaf) {
+    if (t->root == TREE_NULL) {
+        t->root = leaf;
+        t->nodes[leaf].parent = TREE_NULL;
+        return 1;
+    }
+    
+    AABB leafBox = t->nodes[leaf].box;
+    int index = t->root;
+    
+    while (!treeIsLeaf(&t->nodes[index])) {
+        const TreeNode* n = &t->nodes[index];
+        float area = aabbPerimeter(&n->box);
+        AABB combined = aabbUnion(&n->box, &leafBox);
+        float combinedArea = aabbPerimeter(&combined);
+        
+        /* Cost of making a new parent for this node and the leaf */
+        float cost = 2.0f * combinedArea;
+        /* Minimum cost of pushing the leaf further down */
+        float inheritance = 2.0f * (combinedArea - area);
+        
+        float childCost[2];
+        int children[2] = { n->child1, n->child2 };
+        for (int c = 0; c < 2; c++) {
+            const TreeNode* child = &t->nodes[children[c]];
+            AABB box = aabbUnion(&leafBox, &child->box);
+            childCost[c] = aabbPerimeter(&box) + inheritance;
+            if (!treeIsLeaf(child)) childCost[c] -= aabbPerimeter(&child->box);
+        }
+        
+        if (cost < childCost[0] && cost < childCost[1]) break;
+        index = childCost[0] < childCost[1] ? children[0] : children[1];
+    }
+    
+    int sibling = index;
+    int newParent = treeAllocNode(t);
+    if (newParent == TREE_NULL) return 0;
+    
+    TreeNode* nodes = t->nodes;
+    int oldParent = nodes[sibling].parent;
+    nodes[newParent].parent = oldParent;
+    nodes[newParent].box = aabbUnion(&leafBox, &nodes[sibling].box);
+    nodes[newParent].height = nodes[sibling].height + 1;
+    nodes[newParent].child1 = sibling;
+    nodes[newParent].child2 = leaf;
+    nodes[sibling].parent = newParent;
+    nodes[leaf].parent = newParent;
+    treeReplaceChild(t, oldParent, sibling, newParent);
+    
+    treeRefitUpward(t, nodes[leaf].parent);
+    return 1;
+}
+
+static void treeRemoveLeaf(AABBTree* t, int leaf) {
+    if (leaf == t->root) {
+        t->root = TREE_NULL;
+        return;
+    }
+    
+    int parent = t->nodes[leaf].parent;
+    int grandParent = t->nodes[parent].parent;
+    int sibling = t->nodes[parent].child1 == leaf ? t->nodes[parent].child2 : t->nodes[parent].child1;
+    
+    treeReplaceChild(t, grandParent, parent, sibling);
+    t->nodes[sibling].parent = grandParent;
+    treeFreeNode(t, parent);
+    
+    treeRefitUpward(t, grandParent);
+}
+
+static void treeFatten(const AABBTree* t, AABB* box, const AABB* tight, float dx, float dy) {
+    box->minX = tight->minX - t->margin;
+    box->minY = tight->minY - t->margin;
+    box->maxX = tight->maxX + t->margin;
+    box->maxY = tight->maxY + t->margin;
+    
+    dx *= TREE_DISPLACEMENT_MULTIPLIER;
+    dy *= TREE_DISPLACEMENT_MULTIPLIER;
+    if (dx < 0) box->minX += dx; else box->maxX += dx;
+    if (dy < 0) box->minY += dy; else box->maxY += dy;
+}
+
+static int treeCreateProxy(AABBTree* t, const AABB* tight) {
+    int leaf = treeAllocNode(t);
+    if (leaf == TREE_NULL) return TREE_NULL;
+    
+    t->nodes[leaf].tight = *tight;
+    treeFatten(t, &t->nodes[leaf].box, tight, 0.0f, 0.0f);
+    if (!treeInsertLeaf(t, leaf)) {
+        treeFreeNode(t, leaf);
+        return TREE_NULL;
+    }
+    t->leafCount++;
+    return leaf;
+}
+
+static void treeDestroyProxy(AABBTree* t, int leaf) {
+    treeRemoveLeaf(t, leaf);
+    treeFreeNode(t, leaf);
+    t->leafCount--;
+}
+
+/* Updates a proxy's tight box. The tree only changes when the box left
+ * its fat box, or the fat box became far larger than needed; returns
+ * whether the leaf was reinserted. */
+static int treeMoveProxy(AABBTree* t, int leaf, const AABB* tight) {
+    TreeNode* n = &t->nodes[leaf];
+    float dx = tight->minX - n->tight.minX;
+    float dy = tight->minY - n->tight.minY;
+    n->tight = *tight;
+    
+    AABB fat;
+    treeFatten(t, &fat, tight, dx, dy);
+    
+    if (aabbContains(&n->box, tight)) {
+        /* Still fits; keep it unless the old fat box is grossly oversized */
+        AABB huge = fat;
+        float growX = 4.0f * (fat.maxX - fat.minX), growY = 4.0f * (fat.maxY - fat.minY);
+        huge.minX -= growX; huge.maxX += growX;
+        huge.minY -= growY; huge.maxY += growY;
+        if (aabbContains(&huge, &n->box)) return 0;
+    }
+    
+    treeRemoveLeaf(t, leaf);
+    t->nodes[leaf].box = fat;
+    treeInsertLeaf(t, leaf);
+    return 1;
+}
+
+static int* treeStack(AABBTree* t, int depth) {
+    if (depth > t->stackCapacity) {
+        int capacity = t->stackCapacity ? t->stackCapacity : 64;
+        while (capacity < depth) capacity *= 2;
+        int* stack = realloc(t->stack, capacity * sizeof(int));
+        if (!stack) return NULL;
+        t->stack = stack;
+        t->stackCapacity = capacity;
+    }
+    return t->stack;
+}
+
+typedef void (*TreeVisitFn)(void* ud, int leaf);
+
+/* Calls visit() for every leaf whose tight box overlaps `box` */
+static int treeQuery(AABBTree* t, const AABB* box, TreeVisitFn visit, void* ud) {
+    if (t->root == TREE_NULL) return 1;
+    
+    /* A stack of 2 * height + 2 entries always suffices */
+    int* stack = treeStack(t, 2 * t->nodes[t->root].height + 2);
+    if (!stack) return 0;
+    
+    int top = 0;
+    stack[top++] = t->root;
+    while (top > 0) {
+        const TreeNode* n = &t->nodes[stack[--top]];
+        if (!aabbOverlaps(&n->box, box)) continue;
+        
+        if (treeIsLeaf(n)) {
+            if (aabbOverlaps(&n->tight, box)) visit(ud, (int)(n - t->nodes));
+        } else {
+            stack[top++] = n->child1;
+            stack[top++] = n->child2;
+        }
+    }
+    return 1;
+}
+
+/* Closest leaf hit by the segment (x1, y1) -> (x2, y2), or TREE_NULL.
+ * Subtrees whose entry point lies beyond the best hit are skipped. */
+static int treeRaycast(AABBTree* t, float x1, float y1, float x2, float y2, float* tOut) {
+    if (t->root == TREE_NULL) return TREE_NULL;
+    
+    int* stack = treeStack(t, 2 * t->nodes[t->root].height + 2);
+    if (!stack) return TREE_NULL;
+    
+    float dx = x2 - x1, dy = y2 - y1;
+    float best = 1.0f;
+    int hit = TREE_NULL;
+    int top = 0;
+    stack[top++] = t->root;
+    
+    while (top > 0) {
+        const TreeNode* n = &t->nodes[stack[--top]];
+        float tEnter;
+        if (!segmentAABB(x1, y1, dx, dy, &n->box, best, &tEnter)) continue;
+        
+        if (treeIsLeaf(n)) {
+            if (segmentAABB(x1, y1, dx, dy, &n->tight, best, &tEnter) &&
+                (hit == TREE_NULL || tEnter < best)) {
+                best = tEnter;
+                hit = (int)(n - t->nodes);
+            }
+        } else {
+            stack[top++] = n->child1;
+            stack[top++] = n->child2;
+        }
+    }
+    
+    *tOut = best;
+    return hit;
+}
+
+static AABBTree* checkTree(lua_State* L, int idx) {
+    return (AABBTree*)luaL_checkudata(L, idx, TREE_METATABLE);
+}
+
+static int checkProxy(lua_State* L, AABBTree* t, int arg) {
+    lua_Integer id = luaL_checkinteger(L, arg);
+    luaL_argcheck(L, id >= 1 && id <= t->nodeCapacity &&
+                  t->nodes[id - 1].height == 0 && treeIsLeaf(&t->nodes[id - 1]),
+                  arg, "invalid proxy id");
+    return (int)id - 1;
+}
+
+static AABB checkRectArgs(lua_State* L, int arg) {
+    AABB box;
+    box.minX = luaL_checknumber(L, arg);
+    box.minY = luaL_checknumber(L, arg + 1);
+    box.maxX = box.minX + luaL_optnumber(L, arg + 2, 0.0);
+    box.maxY = box.minY + luaL_optnumber(L, arg + 3, 0.0);
+    return box;
+}
+
+/* tree:insert(x, y, w, h) -> id */
+static int lua_treeInsert(lua_State* L) {
+    AABBTree* t = checkTree(L, 1);
+    AABB tight = checkRectArgs(L, 2);
+    int leaf = treeCreateProxy(t, &tight);
+    if (leaf == TREE_NULL) return luaL_error(L, "out of memory growing AABB tree");
+    lua_pushinteger(L, leaf + 1);
+    return 1;
+}
+
+/* tree:move(id, x, y, w, h) -> reinserted */
+static int lua_treeMove(lua_State* L) {
+    AABBTree* t = checkTree(L, 1);
+    int leaf = checkProxy(L, t, 2);
+    AABB tight = checkRectArgs(L, 3);
+    lua_pushboolean(L, treeMoveProxy(t, leaf, &tight));
+    return 1;
+}
+
+static int lua_treeRemove(lua_State* L) {
+    AABBTree* t = checkTree(L, 1);
+    treeDestroyProxy(t, checkProxy(L, t, 2));
+    return 0;
+}
+
+/* tree:get(id) -> x, y, w, h */
+static int lua_treeGet(lua_State* L) {
+    AABBTree* t = checkTree(L, 1);
+    const AABB* b = &t->nodes[checkProxy(L, t, 2)].tight;
+    lua_pushnumber(L, b->minX);
+    lua_pushnumber(L, b->minY);
+    lua_pushnumber(L, b->maxX - b->minX);
+    lua_pushnumber(L, b->maxY - b->minY);
+    return 4;
+}
+
+typedef struct {
+    lua_State* L;
+    int out;
+    int count;
+} TreeQueryResult;
+
+static void treeCollect(void* ud, int leaf) {
+    TreeQueryResult* r = (TreeQueryResult*)ud;
+    lua_pushinteger(r->L, leaf + 1);
+    lua_rawseti(r->L, r->out, ++r->count);
+}
+
+static int treePushQuery(lua_State* L, AABBTree* t, const AABB* box, int outArg) {
+    TreeQueryResult r;
+    r.L = L;
+    r.out = pushOutputTable(L, outArg);
+    r.count = 0;
+    
+    if (!treeQuery(t, box, treeCollect, &r)) return luaL_error(L, "out of memory querying AABB tree");
+    
+    trimOutputTable(L, r.out, r.count);
+    lua_pushinteger(L, r.count);
+    return 2;
+}
+
+/* tree:queryRect(x, y, w, h, [out]) -> {id, ...}, count */
+static int lua_treeQueryRect(lua_State* L) {
+    AABBTree* t = checkTree(L, 1);
+    AABB box = checkRectArgs(L, 2);
+    return treePushQuery(L, t, &box, 6);
+}
+
+/* tree:queryPoint(x, y, [out]) -> {id, ...}, count */
+static int lua_treeQueryPoint(lua_State* L) {
+    AABBTree* t = checkTree(L, 1);
+    AABB box;
+    box.minX = box.maxX = luaL_checknumber(L, 2);
+    box.minY = box.maxY = luaL_checknumber(L, 3);
+    return treePushQuery(L, t, &box, 4);
+}
+
+/* tree:raycast(x1, y1, x2, y2) -> id, t, hitX, hitY  (nil on a miss) */
+static int lua_treeRaycast(lua_State* L) {
+    AABBTree* t = checkTree(L, 1);
+    float x1 = luaL_checknumber(L, 2);
+    float y1 = luaL_checknumber(L, 3);
+    float x2 = luaL_checknumber(L, 4);
+    float y2 = luaL_checknumber(L, 5);
+    
+    float tHit;
+    int leaf = treeRaycast(t, x1, y1, x2, y2, &tHit);
+    if (leaf == TREE_NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+    
+    lua_pushinteger(L, leaf + 1);
+    lua_pushnumber(L, tHit);
+    lua_pushnumber(L, x1 + (x2 - x1) * tHit);
+    lua_pushnumber(L, y1 + (y2 - y1) * tHit);
+    return 4;
+}
+
+static int lua_treeCount(lua_State* L) {
+    lua_pushinteger(L, checkTree(L, 1)->leafCount);
+    return 1;
+}
+
+static int lua_treeHeight(lua_State* L) {
+    AABBTree* t = checkTree(L, 1);
+    lua_pushinteger(L, t->root == TREE_NULL ? 0 : t->nodes[t->root].height);
+    return 1;
+}
+
+static int lua_treeGC(lua_State* L) {
+    AABBTree* t = checkTree(L, 1);
+    free(t->nodes);
+    free(t->stack);
+    memset(t, 0, sizeof(*t));
+    return 0;
+}
+
+/* collision.newTree([margin]) */
+static int lua_newTree(lua_State* L) {
+    float margin = luaL_optnumber(L, 1, TREE_DEFAULT_MARGIN);
+    
+    AABBTree* t = (AABBTree*)lua_newuserdatauv(L, sizeof(AABBTree), 0);
+    memset(t, 0, sizeof(*t));
+    t->root = TREE_NULL;
+    t->freeList = TREE_NULL;
+    t->margin = margin;
+    
+    luaL_setmetatable(L, TREE_METATABLE);
+    return 1;
+}
+
+void registerTreeModule(lua_State* L) {
+    static const luaL_Reg methods[] = {
+        {"insert", lua_treeInsert},
+        {"move", lua_treeMove},
+        {"remove", lua_treeRemove},
+        {"get", lua_treeGet},
+        {"queryRect", lua_treeQueryRect},
+        {"queryPoint", lua_treeQueryPoint},
+        {"raycast", lua_treeRaycast},
+        {"count", lua_treeCount},
+        {"height", lua_treeHeight},
+        {NULL, NULL}
+    };
+    
+    luaL_newmetatable(L, TREE_METATABLE);
+    luaL_newlib(L, methods);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, lua_treeCount);
+    lua_setfield(L, -2, "__len");
+    lua_pushcfunction(L, lua_treeGC);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+    
+    lua_getglobal(L, "collision");
+    lua_pushcfunction(L, lua_newTree);
+    lua_setfield(L, -2, "newTree");
+    lua_pop(L, 1);
+}
+
+/* ============================================================ */
+/* BATCHED COLLISION QUERIES */
+/* ============================================================ */
+
+/* Many-vs-many tests over packed number arrays in one call. Inputs are
+ * copied into structure-of-arrays buffers in the frame arena (field f
+ * of element i at data[f * count + i]) and each element of the first
+ * set is tested against the whole second set with a SIMD kernel. */
+
+static float* readPackedArray(lua_State* L, int arg, int stride, int* count) {
+    luaL_checktype(L, arg, LUA_TTABLE);
+    int n = (int)(lua_rawlen(L, arg) / stride);
+    
+    float* data = arenaAlloc(&g_frameArena, (size_t)n * stride * sizeof(float));
+    if (!data) {
+        luaL_error(L, "out of memory reading packed array");
+        return NULL;
+    }
+    
+    for (int i = 0; i < n; i++) {
+        for (int f = 0; f < stride; f++) {
+            lua_rawgeti(L, arg, i * stride + f + 1);
+            data[f * n + i] = (float)lua_tonumber(L, -1);
+            lua_pop(L, 1);
+        }
+    }
+    
+    *count = n;
+    return data;
+}
+
+typedef enum {
+    QUERY_RECTS,
+    QUERY_CIRCLES,
+    QUERY_POINTS_RECTS,
+} BatchQueryKind;
+
+static int batchQuery(lua_State* L, BatchQueryKind kind) {
+    int strideA = kind == QUERY_RECTS ? 4 : kind == QUERY_CIRCLES ? 3 : 2;
+    int strideB = kind == QUERY_CIRCLES ? 3 : 4;
+    int na, nb;
+    
+    /* An error below leaves the buffers to the next arena reset */
+    size_t mark = arenaMark(&g_frameArena);
+    const float* a = readPackedArray(L, 1, strideA, &na);
+    const float* b = readPackedArray(L, 2, strideB, &nb);
+    int* hits = arenaAlloc(&g_frameArena, (size_t)nb * sizeof(int));
+    if (!hits) return luaL_error(L, "out of memory running batched query");
+    
+    int out = pushOutputTable(L, 3);
+    int n = 0;
+    
+    for (int i = 0; i < na; i++) {
+        int count;
+        switch (kind) {
+        case QUERY_RECTS:
+            count = kernelRectOverlaps(a[i], a[na + i], a[2 * na + i], a[3 * na + i],
+                                       b, b + nb, b + 2 * nb, b + 3 * nb, nb, hits);
+            break;
+        case QUERY_CIRCLES:
+            count = kernelCircleOverlaps(a[i], a[na + i], a[2 * na + i],
+                                         b, b + nb, b + 2 * nb, nb, hits);
+            break;
+        default:
+            count = kernelPointInRects(a[i], a[na + i],
+                                       b, b + nb, b + 2 * nb, b + 3 * nb, nb, hits);
+            break;
+        }
+        
+        for (int k = 0; k < count; k++) {
+            lua_pushinteger(L, i + 1);
+            lua_rawseti(L, out, ++n);
+            lua_pushinteger(L, hits[k] + 1);
+            lua_rawseti(L, out, ++n);
+        }
+    }
+    
+    arenaRewind(&g_frameArena, mark);
+    trimOutputTable(L, out, n);
+    lua_pushinteger(L, n / 2);
+    return 2;
+}
+
+/* collision.rectsRects(a, b, [out]) -> {i1, j1, i2, j2, ...}, pairCount
+ * a and b are flat {x, y, w, h, ...}; indices are element numbers. */
+static int lua_rectsRects(lua_State* L) {
+    return batchQuery(L, QUERY_RECTS);
+}
+
+/* collision.circlesCircles(a, b, [out]) with flat {x, y, r, ...} */
+static int lua_circlesCircles(lua_State* L) {
+    return batchQuery(L, QUERY_CIRCLES);
+}
+
+/* collision.pointsRects(points, rects, [out]) with flat {x, y, ...} */
+static int lua_pointsRects(lua_State* L) {
+    return batchQuery(L, QUERY_POINTS_RECTS);
+}
+
+void registerBatchQueries(lua_State* L) {
+    lua_getglobal(L, "collision");
+    lua_pushcfunction(L, lua_rectsRects);
+    lua_setfield(L, -2, "rectsRects");
+    lua_pushcfunction(L, lua_circlesCircles);
+    lua_setfield(L, -2, "circlesCircles");
+    lua_pushcfunction(L, lua_pointsRects);
+    lua_setfield(L, -2, "pointsRects");
+    lua_pop(L, 1);
+}
+
+/* ============================================================ */
+/* ENTITY STORE */
+/* ============================================================ */
+
+/* Dense, swap-removed component arrays addressed through generational
+ * handles. A handle packs (generation << 32 | slot); the slot table
+ * maps it to the entity's current dense index, and destroying an
+ * entity bumps the slot's generation so stale handles are rejected.
+ *
+ * Entities form a hierarchy: x, y, rotation and scale are relative to
+ * the parent, and each entity caches its world matrix. Links are slots,
+ * which survive swap-removal. Changing a transform marks the entity and
+ * its descendants dirty, stopping at nodes already dirty, so a dirty
+ * node's subtree is always dirty too; world matrices are then rebuilt
+ * lazily, only for the moved subtrees, the next time one is needed. */
+
+typedef enum {
+    ENTITY_X,
+    ENTITY_Y,
+    ENTITY_WIDTH,
+    ENTITY_HEIGHT,
+    ENTITY_ROTATION,
+    ENTITY_SCALE_X,
+    ENTITY_SCALE_Y,
+    ENTITY_VX,
+    ENTITY_VY,
+    ENTITY_R,
+    ENTITY_G,
+    ENTITY_B,
+    ENTITY_A,
+    ENTITY_LAYER,        /* render queue order: layer, then material, then depth */
+    ENTITY_DEPTH,
+    ENTITY_FLOAT_FIELDS,
+    /* Flag fields, read and written as booleans */
+    ENTITY_VISIBLE = ENTITY_FLOAT_FIELDS,
+    ENTITY_ACTIVE,
+    ENTITY_FIELD_COUNT
+} EntityField;
+
+#define ENTITY_FLAG_VISIBLE 0x01
+#define ENTITY_FLAG_ACTIVE  0x02
+#define ENTITY_FLAG_DIRTY   0x04   /* world matrix is stale */
+#define ENTITY_SHOWN (ENTITY_FLAG_VISIBLE | ENTITY_FLAG_ACTIVE)
+/* Fields X through SCALE_Y feed the world matrix */
+#define ENTITY_TRANSFORM_LAST ENTITY_SCALE_Y
+#define ENTITY_MATRIX_FLOATS 6
+#define ENTITY_REFS_KEY "entity.refs"
+#define ENTITY_INITIAL_CAPACITY 256
+#define ENTITY_NO_SLOT 0xFFFFFFFFu
+
+typedef enum {
+    SHAPE_NONE,
+    SHAPE_RECT,
+    SHAPE_CIRCLE,
+    SHAPE_SPRITE,
+    SHAPE_TEXT,
+} EntityShape;
+
+/* What sprite and text entities draw. The atlas, font and string are
+ * kept alive by references in the ENTITY_REFS_KEY registry table. */
+typedef struct {
+    const void* resource;   /* Atlas for sprites; Font for text, NULL for the default */
+    int region;             /* sprite atlas region, from 0 */
+    const char* text;
+    size_t length;
+    int resourceRef;
+    int textRef;
+} EntityVisual;
+
+typedef struct {
+    int count;
+    int capacity;
+    float* field[ENTITY_FLOAT_FIELDS];
+    unsigned char* flags;
+    unsigned char* shape;
+    unsigned int* denseSlot;        /* dense index -> slot */
+    float* world;                   /* a, b, c, d, tx, ty per entity: (x, y) ->
+                                     * (a x + c y + tx, b x + d y + ty) */
+    unsigned int* parent;           /* slots, ENTITY_NO_SLOT when absent */
+    unsigned int* firstChild;
+    unsigned int* lastChild;
+    unsigned int* nextSibling;
+    EntityVisual* visual;
+    
+    unsigned int* slotDense;        /* slot -> dense index, or free-list link */
+    unsigned int* slotGeneration;
+    unsigned int slotCount;
+    unsigned int slotCapacity;
+    unsigned int freeSlot;
+} EntityStore;
+
+static EntityStore g_entities = { .freeSlot = ENTITY_NO_SLOT };
+
+static const float g_entityDefaults[ENTITY_FLOAT_FIELDS] = {
+    0, 0, 0, 0,     /* x, y, width, height */
+    0, 1, 1,        /* rotation, scaleX, scaleY */
+    0, 0,           /* vx, vy */
+    1, 1, 1, 1,     /* r, g, b, a */
+    0, 0,           /* layer, depth */
+};
+
+static inline lua_Integer entityHandle(unsigned int slot, unsigned int generation) {
+    return (lua_Integer)(((unsigned long long)generation << 32) | slot);
+}
+
+/* Dense index for a handle, or -1 if it is stale or malformed. A free
+ * slot's slotDense is a free-list link, hence the liveness check. */
+static int entityResolve(const EntityStore* es, lua_Integer handle) {
+    unsigned long long h = (unsigned long long)handle;
+    unsigned int slot = (unsigned int)(h & 0xFFFFFFFFu);
+    unsigned int generation = (unsigned int)(h >> 32);
+    
+    if (slot >= es->slotCount || es->slotGeneration[slot] != generation) return -1;
+    unsigned int dense = es->slotDense[slot];
+    if (dense >= (unsigned int)es->count || es->denseSlot[dense] != slot) return -1;
+    return (int)dense;
+}
+
+static int entityGrow(EntityStore* es) {
+    int capacity = es->capacity ? es->capacity * 2 : ENTITY_INITIAL_CAPACITY;
+    
+    for (int f = 0; f < ENTITY_FLOAT_FIELDS; f++) {
+        float* data = realloc(es->field[f], capacity * sizeof(float));
+        if (!data) return 0;
+        es->field[f] = data;
+    }
+    unsigned char* flags = realloc(es->flags, capacity);
+    if (!flags) return 0;
+    es->flags = flags;
+    unsigned char* shape = realloc(es->shape, capacity);
+    if (!shape) return 0;
+    es->shape = shape;
+    unsigned int** links[] = { &es->denseSlot, &es->parent, &es->firstChild, &es->lastChild, &es->nextSibling };
+    for (size_t l = 0; l < sizeof(links) / sizeof(links[0]); l++) {
+        unsigned int* data = realloc(*links[l], capacity * sizeof(unsigned int));
+        if (!data) return 0;
+        *links[l] = data;
+    }
+    float* world = realloc(es->world, (size_t)capacity * ENTITY_MATRIX_FLOATS * sizeof(float));
+    if (!world) return 0;
+    es->world = world;
+    EntityVisual* visual = realloc(es->visual, capacity * sizeof(EntityVisual));
+    if (!visual) return 0;
+    es->visual = visual;
+    
+    es->capacity = capacity;
+    return 1;
+}
+
+static int entityReserve(EntityStore* es, int count) {
+    while (es->capacity < count) {
+        if (!entityGrow(es)) return 0;
+    }
+    return 1;
+}
+
+static int entityReserveSlots(EntityStore* es, unsigned int count) {
+    if (count <= es->slotCapacity) return 1;
+    unsigned int capacity = es->slotCapacity ? es->slotCapacity : ENTITY_INITIAL_CAPACITY;
+    while (capacity < count) capacity *= 2;
+    
+    unsigned int* dense = realloc(es->slotDense, capacity * sizeof(unsigned int));
+    if (!dense) return 0;
+    es->slotDense = dense;
+    unsigned int* generation = realloc(es->slotGeneration, capacity * sizeof(unsigned int));
+    if (!generation) return 0;
+    es->slotGeneration = generation;
+    es->slotCapacity = capacity;
+    return 1;
+}
+
+static unsigned int entityAllocSlot(EntityStore* es) {
+    if (es->freeSlot != ENTITY_NO_SLOT) {
+        unsigned int slot = es->freeSlot;
+        es->freeSlot = es->slotDense[slot];
+        return slot;
+    }
+    
+    if (!entityReserveSlots(es, es->slotCount + 1)) return ENTITY_NO_SLOT;
+    
+    unsigned int slot = es->slotCount++;
+    es->slotGeneration[slot] = 1;
+    return slot;
+}
+
+/* Returns the new entity's dense index, or -1 when out of memory */
+static int entityCreate(EntityStore* es, EntityShape shape, lua_Integer* handleOut) {
+    if (es->count == es->capacity && !entityGrow(es)) return -1;
+    
+    unsigned int slot = entityAllocSlot(es);
+    if (slot == ENTITY_NO_SLOT) return -1;
+    
+    int i = es->count++;
+    for (int f = 0; f < ENTITY_FLOAT_FIELDS; f++) {
+        es->field[f][i] = g_entityDefaults[f];
+    }
+    es->flags[i] = ENTITY_SHOWN | ENTITY_FLAG_DIRTY;
+    es->shape[i] = (unsigned char)shape;
+    es->denseSlot[i] = slot;
+    es->slotDense[slot] = (unsigned int)i;
+    es->parent[i] = ENTITY_NO_SLOT;
+    es->firstChild[i] = ENTITY_NO_SLOT;
+    es->lastChild[i] = ENTITY_NO_SLOT;
+    es->nextSibling[i] = ENTITY_NO_SLOT;
+    es->visual[i] = (EntityVisual){ .resourceRef = LUA_NOREF, .textRef = LUA_NOREF };
+    
+    *handleOut = entityHandle(slot, es->slotGeneration[slot]);
+    return i;
+}
+
+static void entityMarkDirty(EntityStore* es, int i) {
+    if (es->flags[i] & ENTITY_FLAG_DIRTY) return;
+    es->flags[i] |= ENTITY_FLAG_DIRTY;
+    for (unsigned int child = es->firstChild[i]; child != ENTITY_NO_SLOT; ) {
+        int c = (int)es->slotDense[child];
+        entityMarkDirty(es, c);
+        child = es->nextSibling[c];
+    }
+}
+
+/* Writes a float field, dirtying the subtree if it moves the entity */
+static inline void entitySetField(EntityStore* es, int i, int f, float value) {
+    es->field[f][i] = value;
+    if (f <= ENTITY_TRANSFORM_LAST) entityMarkDirty(es, i);
+}
+
+static void entityUnlink(EntityStore* es, int i) {
+    unsigned int parent = es->parent[i];
+    if (parent == ENTITY_NO_SLOT) return;
+    
+    int p = (int)es->slotDense[parent];
+    unsigned int slot = es->denseSlot[i];
+    unsigned int prev = ENTITY_NO_SLOT;
+    for (unsigned int child = es->firstChild[p]; child != slot; ) {
+        prev = child;
+        child = es->nextSibling[es->slotDense[child]];
+    }
+    if (prev == ENTITY_NO_SLOT) es->firstChild[p] = es->nextSibling[i];
+    else es->nextSibling[es->slotDense[prev]] = es->nextSibling[i];
+    if (es->lastChild[p] == slot) es->lastChild[p] = prev;
+    
+    es->parent[i] = ENTITY_NO_SLOT;
+    es->nextSibling[i] = ENTITY_NO_SLOT;
+    entityMarkDirty(es, i);
+}
+
+/* Appends i to p's children, so siblings keep the order they were added */
+static void entityLink(EntityStore* es, int i, int p) {
+    unsigned int slot = es->denseSlot[i];
+    if (es->lastChild[p] == ENTITY_NO_SLOT) es->firstChild[p] = slot;
+    else es->nextSibling[es->slotDense[es->lastChild[p]]] = slot;
+    es->lastChild[p] = slot;
+    es->parent[i] = es->denseSlot[p];
+    entityMarkDirty(es, i);
+}
+
+static int entityIsAncestor(const EntityStore* es, int ancestor, int i) {
+    unsigned int target = es->denseSlot[ancestor];
+    for (unsigned int slot = es->parent[i]; slot != ENTITY_NO_SLOT; slot = es->parent[es->slotDense[slot]]) {
+        if (slot == target) return 1;
+    }
+    return 0;
+}
+
+/* Moves the last entity into the hole so the arrays stay dense.
+ * Children become roots, keeping their local transforms. */
+static void entityDestroy(EntityStore* es, int i) {
+    unsigned int slot = es->denseSlot[i];
+    
+    entityUnlink(es, i);
+    while (es->firstChild[i] != ENTITY_NO_SLOT) {
+        entityUnlink(es, (int)es->slotDense[es->firstChild[i]]);
+    }
+    
+    int last = --es->count;
+    if (i != last) {
+        for (int f = 0; f < ENTITY_FLOAT_FIELDS; f++) {
+            es->field[f][i] = es->field[f][last];
+        }
+        es->flags[i] = es->flags[last];
+        es->shape[i] = es->shape[last];
+        es->denseSlot[i] = es->denseSlot[last];
+        es->slotDense[es->denseSlot[i]] = (unsigned int)i;
+        memcpy(es->world + (size_t)i * ENTITY_MATRIX_FLOATS, es->world + (size_t)last * ENTITY_MATRIX_FLOATS,
+               ENTITY_MATRIX_FLOATS * sizeof(float));
+        es->parent[i] = es->parent[last];
+        es->firstChild[i] = es->firstChild[last];
+        es->lastChild[i] = es->lastChild[last];
+        es->nextSibling[i] = es->nextSibling[last];
+        es->visual[i] = es->visual[last];
+    }
+    
+    es->slotGeneration[slot]++;
+    es->slotDense[slot] = es->freeSlot;
+    es->freeSlot = slot;
+}
+
+typedef struct {
+    EntityStore* store;
+    float dt;
+} EntityStep;
+
+static void entityIntegrateRange(void* data, int begin, int end) {
+    const EntityStep* step = data;
+    EntityStore* es = step->store;
+    kernelIntegrate(es->field[ENTITY_X] + begin, es->field[ENTITY_Y] + begin,
+                    es->field[ENTITY_VX] + begin, es->field[ENTITY_VY] + begin, end - begin, step->dt);
+}
+
+/* Velocity integration over every active entity's transform, in chunks
+ * across the job pool. Dirtying crosses into other entities' subtrees,
+ * so it runs afterwards on the calling thread. */
+static void entityIntegrate(EntityStore* es, float dt) {
+    EntityStep step = { es, dt };
+    jobParallelFor(entityIntegrateRange, &step, es->count, JOB_MIN_PARALLEL);
+    
+    const float* vx = es->field[ENTITY_VX];
+    const float* vy = es->field[ENTITY_VY];
+    for (int i = 0; i < es->count; i++) {
+        if (vx[i] != 0.0f || vy[i] != 0.0f) entityMarkDirty(es, i);
+    }
+}
+
+/* The entity's world matrix, rebuilding it (and any dirty ancestors)
+ * if it is stale. Rotation and scale pivot on the center of the
+ * entity's width x height box, or its position for circles. */
+static const float* entityWorld(EntityStore* es, int i) {
+    float* m = es->world + (size_t)i * ENTITY_MATRIX_FLOATS;
+    if (!(es->flags[i] & ENTITY_FLAG_DIRTY)) return m;
+    
+    float rotation = es->field[ENTITY_ROTATION][i];
+    float sx = es->field[ENTITY_SCALE_X][i], sy = es->field[ENTITY_SCALE_Y][i];
+    float px = 0.0f, py = 0.0f;
+    if (es->shape[i] != SHAPE_CIRCLE) {
+        px = es->field[ENTITY_WIDTH][i] * 0.5f;
+        py = es->field[ENTITY_HEIGHT][i] * 0.5f;
+    }
+    float c = rotation == 0.0f ? 1.0f : cosf(rotation);
+    float s = rotation == 0.0f ? 0.0f : sinf(rotation);
+    float local[ENTITY_MATRIX_FLOATS] = { c * sx, s * sx, -s * sy, c * sy, 0.0f, 0.0f };
+    local[4] = es->field[ENTITY_X][i] + px - (local[0] * px + local[2] * py);
+    local[5] = es->field[ENTITY_Y][i] + py - (local[1] * px + local[3] * py);
+    
+    if (es->parent[i] == ENTITY_NO_SLOT) {
+        memcpy(m, local, sizeof(local));
+    } else {
+        const float* p = entityWorld(es, (int)es->slotDense[es->parent[i]]);
+        m[0] = p[0] * local[0] + p[2] * local[1];
+        m[1] = p[1] * local[0] + p[3] * local[1];
+        m[2] = p[0] * local[2] + p[2] * local[3];
+        m[3] = p[1] * local[2] + p[3] * local[3];
+        m[4] = p[0] * local[4] + p[2] * local[5] + p[4];
+        m[5] = p[1] * local[4] + p[3] * local[5] + p[5];
+    }
+    es->flags[i] &= (unsigned char)~ENTITY_FLAG_DIRTY;
+    return m;
+}
+
+static inline void matrixApply2D(const float* m, float x, float y, float* out) {
+    out[0] = m[0] * x + m[2] * y + m[4];
+    out[1] = m[1] * x + m[3] * y + m[5];
+}
+
+/* Corners of the local box (x, y, w, h) under m, clockwise from
+ * top-left; returns 1 if the view rejects their bounds */
+static int transformQuad(const float* m, float x, float y, float w, float h, float corners[8]) {
+    matrixApply2D(m, x, y, corners);
+    matrixApply2D(m, x + w, y, corners + 2);
+    matrixApply2D(m, x + w, y + h, corners + 4);
+    matrixApply2D(m, x, y + h, corners + 6);
+    
+    float minX = corners[0], maxX = corners[0], minY = corners[1], maxY = corners[1];
+    for (int k = 2; k < 8; k += 2) {
+        minX = fminf(minX, corners[k]);
+        maxX = fmaxf(maxX, corners[k]);
+        minY = fminf(minY, corners[k + 1]);
+        maxY = fmaxf(maxY, corners[k + 1]);
+    }
+    return viewRejects(minX, minY, maxX, maxY);
+}
+
+static inline int matrixIsTranslation(const float* m) {
+    return m[0] == 1.0f && m[1] == 0.0f && m[2] == 0.0f && m[3] == 1.0f;
+}
+
+static const Font* entityFont(const EntityVisual* visual) {
+    return visual->resource ? (const Font*)visual->resource : g_defaultFont;
+}
+
+static void entityDrawText(const Font* font, const EntityVisual* visual, const float* m,
+                           float r, float g, float b, float a) {
+    const TextLayout* layout = getTextLayout(font, visual->text, visual->length);
+    if (!layout) return;
+    if (matrixIsTranslation(m)) {
+        drawTextLayout(font, layout, m[4], m[5], r, g, b, a);
+        return;
+    }
+    
+    float cell = (float)(FONT_GLYPH_SIZE * font->scale);
+    float corners[8];
+    if (transformQuad(m, 0.0f, 0.0f, layout->columns * cell, layout->lines * cell, corners)) return;
+    for (int q = 0; q < layout->quadCount; q++) {
+        const GlyphQuad* glyph = &layout->quads[q];
+        transformQuad(m, glyph->column * cell, glyph->line * cell, cell, cell, corners);
+        putSpriteQuad(&font->atlas, &font->atlas.regions[glyph->region], corners, r, g, b, a);
+    }
+}
+
+static void entityDrawOne(EntityStore* es, int i) {
+    if ((es->flags[i] & ENTITY_SHOWN) != ENTITY_SHOWN) return;
+    
+    const float* m = entityWorld(es, i);
+    const EntityVisual* visual = &es->visual[i];
+    float w = es->field[ENTITY_WIDTH][i], h = es->field[ENTITY_HEIGHT][i];
+    float r = es->field[ENTITY_R][i], g = es->field[ENTITY_G][i];
+    float b = es->field[ENTITY_B][i], a = es->field[ENTITY_A][i];
+    float corners[8];
+    float* v;
+    
+    switch (es->shape[i]) {
+    case SHAPE_RECT:
+        if (matrixIsTranslation(m)) {
+            if (viewRejectsRect(m[4], m[5], w, h)) return;
+            v = batchReserve(BATCH_TRIANGLES, 6);
+            if (!v) return;
+            putRect(v, m[4], m[5], w, h, r, g, b, a);
+            break;
+        }
+        if (transformQuad(m, 0.0f, 0.0f, w, h, corners)) return;
+        v = batchReserve(BATCH_TRIANGLES, 6);
+        if (!v) return;
+        v = putVertex(v, corners[0], corners[1], r, g, b, a);
+        v = putVertex(v, corners[2], corners[3], r, g, b, a);
+        v = putVertex(v, corners[4], corners[5], r, g, b, a);
+        v = putVertex(v, corners[0], corners[1], r, g, b, a);
+        v = putVertex(v, corners[4], corners[5], r, g, b, a);
+        putVertex(v, corners[6], corners[7], r, g, b, a);
+        break;
+    case SHAPE_CIRCLE: {
+        /* Circle components use width as the radius, as before; scale
+         * applies as its area factor */
+        float radius = w * sqrtf(fabsf(m[0] * m[3] - m[1] * m[2]));
+        if (viewRejects(m[4] - radius, m[5] - radius, m[4] + radius, m[5] + radius)) return;
+        v = batchReserve(BATCH_CIRCLES, 1);
+        if (!v) return;
+        putCircle(v, m[4], m[5], radius, r, g, b, a);
+        break;
+    }
+    case SHAPE_SPRITE: {
+        const Atlas* atlas = visual->resource;
+        if (!atlas->pixels || visual->region >= atlas->regionCount) return;
+        if (transformQuad(m, 0.0f, 0.0f, w, h, corners)) return;
+        putSpriteQuad(atlas, &atlas->regions[visual->region], corners, r, g, b, a);
+        break;
+    }
+    case SHAPE_TEXT: {
+        const Font* font = entityFont(visual);
+        if (font) entityDrawText(font, visual, m, r, g, b, a);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+/* ------------------------------------------------------------ */
+/* Render queue: a subtree flattened into items sorted by (layer,
+ * material, depth), so each material's draws end up adjacent in the
+ * batch. Equal keys keep tree order: parents before children, siblings
+ * in the order they were added. */
+
+typedef struct {
+    unsigned long long key;
+    unsigned int order;
+    int index;              /* dense index */
+} RenderItem;
+
+typedef struct {
+    RenderItem* items;
+    int count;
+} RenderQueue;
+
+/* Floats as unsigned with the same ordering */
+static inline unsigned int sortableFloat(float value) {
+    unsigned int bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return (bits & 0x80000000u) ? ~bits : bits | 0x80000000u;
+}
+
+/* Material: the batch kind, plus the atlas for sprites and text */
+static unsigned int entityMaterial(const EntityStore* es, int i) {
+    const EntityVisual* visual = &es->visual[i];
+    switch (es->shape[i]) {
+    case SHAPE_RECT:
+        return BATCH_TRIANGLES << 8;
+    case SHAPE_CIRCLE:
+        return BATCH_CIRCLES << 8;
+    case SHAPE_SPRITE:
+        return (BATCH_SPRITES << 8) | (unsigned int)((const Atlas*)visual->resource)->slot;
+    case SHAPE_TEXT: {
+        const Font* font = entityFont(visual);
+        return (BATCH_SPRITES << 8) | (unsigned int)(font ? font->atlas.slot : 0);
+    }
+    default:
+        return 0;
+    }
+}
+
+static unsigned long long entitySortKey(const EntityStore* es, int i) {
+    float layer = es->field[ENTITY_LAYER][i];
+    int bucket = layer < -32768.0f ? -32768 : layer > 32767.0f ? 32767 : (int)layer;
+    return ((unsigned long long)(bucket + 32768) << 48) |
+           ((unsigned long long)entityMaterial(es, i) << 32) |
+           sortableFloat(es->field[ENTITY_DEPTH][i]);
+}
+
+/* Adds i's subtree in tree order, pruning hidden or inactive nodes */
+static void entityQueueTree(const EntityStore* es, int i, RenderQueue* queue) {
+    if ((es->flags[i] & ENTITY_SHOWN) != ENTITY_SHOWN) return;
+    if (es->shape[i] != SHAPE_NONE) {
+        RenderItem* item = &queue->items[queue->count];
+        item->key = entitySortKey(es, i);
+        item->order = (unsigned int)queue->count++;
+        item->index = i;
+    }
+    for (unsigned int child = es->firstChild[i]; child != ENTITY_NO_SLOT; ) {
+        int c = (int)es->slotDense[child];
+        entityQueueTree(es, c, queue);
+        child = es->nextSibling[c];
+    }
+}
+
+static int compareRenderItems(const void* a, const void* b) {
+    const RenderItem* x = a;
+    const RenderItem* y = b;
+    if (x->key != y->key) return x->key < y->key ? -1 : 1;
+    return (x->order > y->order) - (x->order < y->order);
+}
+
+/* Sprite and text resources are reached through the refs table, so a
+ * mesh being recorded has to pin them itself */
+static void entityPinVisual(lua_State* L, const EntityVisual* visual) {
+    if (!g_captureMesh) return;
+    lua_getfield(L, LUA_REGISTRYINDEX, ENTITY_REFS_KEY);
+    if (visual->resourceRef != LUA_NOREF) {
+        lua_rawgeti(L, -1, visual->resourceRef);
+        capturePin(L, -1);
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+}
+
+/* Sorts and draws a queue built from the store */
+static void entityDrawQueue(lua_State* L, EntityStore* es, RenderQueue* queue) {
+    qsort(queue->items, (size_t)queue->count, sizeof(RenderItem), compareRenderItems);
+    for (int k = 0; k < queue->count; k++) {
+        int i = queue->items[k].index;
+        entityPinVisual(L, &es->visual[i]);
+        entityDrawOne(es, i);
+    }
+}
+
+static int entityBeginQueue(lua_State* L, const EntityStore* es, RenderQueue* queue) {
+    queue->count = 0;
+    queue->items = arenaAlloc(&g_frameArena, (size_t)es->count * sizeof(RenderItem));
+    if (!queue->items) return luaL_error(L, "out of memory building render queue");
+    return 0;
+}
+
+static int checkEntity(lua_State* L, int arg) {
+    int i = entityResolve(&g_entities, luaL_checkinteger(L, arg));
+    if (i < 0) luaL_argerror(L, arg, "stale or invalid entity handle");
+    return i;
+}
+
+static int checkEntityField(lua_State* L, int arg) {
+    lua_Integer f = luaL_checkinteger(L, arg);
+    luaL_argcheck(L, f >= 0 && f < ENTITY_FIELD_COUNT, arg, "unknown entity field");
+    return (int)f;
+}
+
+/* entity.create([shape]) -> handle; shape is "rect", "circle" or nil */
+static int lua_entityCreate(lua_State* L) {
+    static const char* const shapes[] = { "none", "rect", "circle", NULL };
+    EntityShape shape = (EntityShape)luaL_checkoption(L, 1, "none", shapes);
+    lua_Integer handle;
+    
+    if (entityCreate(&g_entities, shape, &handle) < 0) {
+        return luaL_error(L, "out of memory growing entity store");
+    }
+    lua_pushinteger(L, handle);
+    return 1;
+}
+
+/* Drops the references behind a sprite or text entity */
+static void entityReleaseVisual(lua_State* L, EntityVisual* visual) {
+    lua_getfield(L, LUA_REGISTRYINDEX, ENTITY_REFS_KEY);
+    luaL_unref(L, -1, visual->resourceRef);
+    luaL_unref(L, -1, visual->textRef);
+    lua_pop(L, 1);
+    *visual = (EntityVisual){ .resourceRef = LUA_NOREF, .textRef = LUA_NOREF };
+}
+
+static int entityRef(lua_State* L, int idx) {
+    idx = lua_absindex(L, idx);
+    lua_getfield(L, LUA_REGISTRYINDEX, ENTITY_REFS_KEY);
+    lua_pushvalue(L, idx);
+    int ref = luaL_ref(L, -2);
+    lua_pop(L, 1);
+    return ref;
+}
+
+/* entity.destroy(handle) -- stale handles are ignored; children become
+ * roots */
+static int lua_entityDestroy(lua_State* L) {
+    int i = entityResolve(&g_entities, luaL_checkinteger(L, 1));
+    if (i >= 0) {
+        entityReleaseVisual(L, &g_entities.visual[i]);
+        entityDestroy(&g_entities, i);
+    }
+    return 0;
+}
+
+static int lua_entityIsValid(lua_State* L) {
+    lua_pushboolean(L, entityResolve(&g_entities, luaL_checkinteger(L, 1)) >= 0);
+    return 1;
+}
+
+/* entity.get(handle, field) with field one of entity.X, entity.VISIBLE, ... */
+static int lua_entityGet(lua_State* L) {
+    int i = checkEntity(L, 1);
+    int f = checkEntityField(L, 2);
+    
+    if (f == ENTITY_VISIBLE) lua_pushboolean(L, g_entities.flags[i] & ENTITY_FLAG_VISIBLE);
+    else if (f == ENTITY_ACTIVE) lua_pushboolean(L, g_entities.flags[i] & ENTITY_FLAG_ACTIVE);
+    else lua_pushnumber(L, g_entities.field[f][i]);
+    return 1;
+}
+
+static int lua_entitySet(lua_State* L) {
+    int i = checkEntity(L, 1);
+    int f = checkEntityField(L, 2);
+    
+    if (f == ENTITY_VISIBLE || f == ENTITY_ACTIVE) {
+        unsigned char bit = f == ENTITY_VISIBLE ? ENTITY_FLAG_VISIBLE : ENTITY_FLAG_ACTIVE;
+        if (lua_toboolean(L, 3)) g_entities.flags[i] |= bit;
+        else g_entities.flags[i] &= (unsigned char)~bit;
+    } else {
+        entitySetField(&g_entities, i, f, luaL_checknumber(L, 3));
+    }
+    return 0;
+}
+
+static int lua_entityGetPosition(lua_State* L) {
+    int i = checkEntity(L, 1);
+    lua_pushnumber(L, g_entities.field[ENTITY_X][i]);
+    lua_pushnumber(L, g_entities.field[ENTITY_Y][i]);
+    return 2;
+}
+
+static int lua_entitySetPosition(lua_State* L) {
+    int i = checkEntity(L, 1);
+    g_entities.field[ENTITY_X][i] = luaL_checknumber(L, 2);
+    g_entities.field[ENTITY_Y][i] = luaL_checknumber(L, 3);
+    entityMarkDirty(&g_entities, i);
+    return 0;
+}
+
+/* entity.setParent(handle, [parent]) -- x, y, rotation and scale become
+ * relative to the parent; nil makes the entity a root again */
+static int lua_entitySetParent(lua_State* L) {
+    EntityStore* es = &g_entities;
+    int i = checkEntity(L, 1);
+    int p = lua_isnoneornil(L, 2) ? -1 : checkEntity(L, 2);
+    luaL_argcheck(L, p != i && (p < 0 || !entityIsAncestor(es, i, p)), 2, "parent would create a cycle");
+    
+    entityUnlink(es, i);
+    if (p >= 0) entityLink(es, i, p);
+    return 0;
+}
+
+/* entity.getParent(handle) -> parent handle, or nil for a root */
+static int lua_entityGetParent(lua_State* L) {
+    const EntityStore* es = &g_entities;
+    unsigned int parent = es->parent[checkEntity(L, 1)];
+    if (parent == ENTITY_NO_SLOT) lua_pushnil(L);
+    else lua_pushinteger(L, entityHandle(parent, es->slotGeneration[parent]));
+    return 1;
+}
+
+/* entity.localToWorld(handle, [x, y]) -> world x, y of a point in the
+ * entity's local box (default its origin) */
+static int lua_entityLocalToWorld(lua_State* L) {
+    int i = checkEntity(L, 1);
+    float point[2];
+    matrixApply2D(entityWorld(&g_entities, i), luaL_optnumber(L, 2, 0.0), luaL_optnumber(L, 3, 0.0), point);
+    lua_pushnumber(L, point[0]);
+    lua_pushnumber(L, point[1]);
+    return 2;
+}
+
+/* entity.setSprite(handle, atlas, region) -- draws the region over the
+ * entity's box */
+static int lua_entitySetSprite(lua_State* L) {
+    EntityStore* es = &g_entities;
+    int i = checkEntity(L, 1);
+    Atlas* atlas = checkAtlas(L, 2);
+    const AtlasRegion* region = checkRegion(L, atlas, 3);
+    EntityVisual* visual = &es->visual[i];
+    
+    /* Animating through an atlas only changes the region */
+    if (es->shape[i] != SHAPE_SPRITE || visual->resource != atlas) {
+        entityReleaseVisual(L, visual);
+        visual->resource = atlas;
+        visual->resourceRef = entityRef(L, 2);
+        es->shape[i] = SHAPE_SPRITE;
+    }
+    visual->region = (int)(region - atlas->regions);
+    return 0;
+}
+
+/* entity.setText(handle, text, [font]) -- draws text from the entity's
+ * origin, in its color */
+static int lua_entitySetText(lua_State* L) {
+    EntityStore* es = &g_entities;
+    int i = checkEntity(L, 1);
+    size_t length;
+    const char* text = luaL_checklstring(L, 2, &length);
+    Font* font = lua_isnoneornil(L, 3) ? NULL : (Font*)luaL_checkudata(L, 3, FONT_METATABLE);
+    EntityVisual* visual = &es->visual[i];
+    
+    entityReleaseVisual(L, visual);
+    visual->text = text;
+    visual->length = length;
+    visual->textRef = entityRef(L, 2);
+    if (font) {
+        visual->resource = font;
+        visual->resourceRef = entityRef(L, 3);
+    }
+    es->shape[i] = SHAPE_TEXT;
+    return 0;
+}
+
+static int lua_entitySetVelocity(lua_State* L) {
+    int i = checkEntity(L, 1);
+    g_entities.field[ENTITY_VX][i] = luaL_checknumber(L, 2);
+    g_entities.field[ENTITY_VY][i] = luaL_checknumber(L, 3);
+    return 0;
+}
+
+static int lua_entityGetColor(lua_State* L) {
+    int i = checkEntity(L, 1);
+    for (int f = ENTITY_R; f <= ENTITY_A; f++) {
+        lua_pushnumber(L, g_entities.field[f][i]);
+    }
+    return 4;
+}
+
+/* entity.setColor(handle, r, g, b, [a]) */
+static int lua_entitySetColor(lua_State* L) {
+    int i = checkEntity(L, 1);
+    g_entities.field[ENTITY_R][i] = luaL_checknumber(L, 2);
+    g_entities.field[ENTITY_G][i] = luaL_checknumber(L, 3);
+    g_entities.field[ENTITY_B][i] = luaL_checknumber(L, 4);
+    g_entities.field[ENTITY_A][i] = luaL_optnumber(L, 5, 1.0);
+    return 0;
+}
+
+/* entity.integrate(dt) -- applies velocities to every entity */
+static int lua_entityIntegrate(lua_State* L) {
+    entityIntegrate(&g_entities, luaL_checknumber(L, 1));
+    return 0;
+}
+
+/* entity.draw(handle) -- draws one rect or circle entity */
+static int lua_entityDraw(lua_State* L) {
+    entityDrawOne(&g_entities, checkEntity(L, 1));
+    return 0;
+}
+
+/* entity.drawSprite(handle, atlas, region) -- draws the region over the
+ * entity's box, with its world transform and color */
+static int lua_entityDrawSprite(lua_State* L) {
+    int i = checkEntity(L, 1);
+    Atlas* atlas = checkAtlas(L, 2);
+    const AtlasRegion* region = checkRegion(L, atlas, 3);
+    EntityStore* es = &g_entities;
+    float corners[8];
+    capturePin(L, 2);
+    
+    if ((es->flags[i] & ENTITY_SHOWN) != ENTITY_SHOWN) return 0;
+    if (transformQuad(entityWorld(es, i), 0.0f, 0.0f,
+                      es->field[ENTITY_WIDTH][i], es->field[ENTITY_HEIGHT][i], corners)) return 0;
+    putSpriteQuad(atlas, region, corners,
+                  es->field[ENTITY_R][i], es->field[ENTITY_G][i], es->field[ENTITY_B][i], es->field[ENTITY_A][i]);
+    return 0;
+}
+
+/* entity.drawTree(handle) -- the entity and its shown descendants,
+ * through the render queue */
+static int lua_entityDrawTree(lua_State* L) {
+    int i = checkEntity(L, 1);
+    RenderQueue queue;
+    entityBeginQueue(L, &g_entities, &queue);
+    entityQueueTree(&g_entities, i, &queue);
+    entityDrawQueue(L, &g_entities, &queue);
+    return 0;
+}
+
+/* entity.drawAll() -- every root's tree through one render queue */
+static int lua_entityDrawAll(lua_State* L) {
+    EntityStore* es = &g_entities;
+    RenderQueue queue;
+    entityBeginQueue(L, es, &queue);
+    for (int i = 0; i < es->count; i++) {
+        if (es->parent[i] == ENTITY_NO_SLOT) entityQueueTree(es, i, &queue);
+    }
+    entityDrawQueue(L, es, &queue);
+    return 0;
+}
+
+static int lua_entityCount(lua_State* L) {
+    lua_pushinteger(L, g_entities.count);
+    return 1;
+}
+
+void registerEntityModule(lua_State* L) {
+    static const luaL_Reg functions[] = {
+        {"create", lua_entityCreate},
+        {"destroy", lua_entityDestroy},
+        {"isValid", lua_entityIsValid},
+        {"get", lua_entityGet},
+        {"set", lua_entitySet},
+        {"getPosition", lua_entityGetPosition},
+        {"setPosition", lua_entitySetPosition},
+        {"setVelocity", lua_entitySetVelocity},
+        {"setParent", lua_entitySetParent},
+        {"getParent", lua_entityGetParent},
+        {"localToWorld", lua_entityLocalToWorld},
+        {"setSprite", lua_entitySetSprite},
+        {"setText", lua_entitySetText},
+        {"getColor", lua_entityGetColor},
+        {"setColor", lua_entitySetColor},
+        {"integrate", lua_entityIntegrate},
+        {"draw", lua_entityDraw},
+        {"drawSprite", lua_entityDrawSprite},
+        {"drawTree", lua_entityDrawTree},
+        {"drawAll", lua_entityDrawAll},
+        {"count", lua_entityCount},
+        {NULL, NULL}
+    };
+    static const struct { const char* name; int field; } fields[] = {
+        {"X", ENTITY_X}, {"Y", ENTITY_Y},
+        {"WIDTH", ENTITY_WIDTH}, {"HEIGHT", ENTITY_HEIGHT},
+        {"ROTATION", ENTITY_ROTATION},
+        {"SCALE_X", ENTITY_SCALE_X}, {"SCALE_Y", ENTITY_SCALE_Y},
+        {"VX", ENTITY_VX}, {"VY", ENTITY_VY},
+        {"R", ENTITY_R}, {"G", ENTITY_G}, {"B", ENTITY_B}, {"A", ENTITY_A},
+        {"LAYER", ENTITY_LAYER}, {"DEPTH", ENTITY_DEPTH},
+        {"VISIBLE", ENTITY_VISIBLE}, {"ACTIVE", ENTITY_ACTIVE},
+    };
+    
+    lua_newtable(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, ENTITY_REFS_KEY);
+    
+    luaL_newlib(L, functions);
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        lua_pushinteger(L, fields[i].field);
+        lua_setfield(L, -2, fields[i].name);
+    }
+    lua_setglobal(L, "entity");
+}
+
+/* ============================================================ */
+/* SCHEDULER */
+/* ============================================================ */
+
+/* Engine-owned timers and animations, advanced once per loop() tick on
+ * simulation time. Pending timers sit in a min-heap ordered by due time
+ * and are only touched when they fire. Animations (a Lua callback fed
+ * progress) and tweens (an entity field eased in C, no Lua at all) tick
+ * together in one pass. Tasks are addressed through generational
+ * handles, like entities, so a cancelled or finished handle is inert. */
+
+#define SCHEDULER_CALLBACKS_KEY "engine.scheduler"
+#define TASK_NO_SLOT 0xFFFFFFFFu
+#define TASK_INITIAL_CAPACITY 64
+
+typedef enum {
+    TASK_FREE,
+    TASK_TIMER,
+    TASK_ANIMATION,
+    TASK_TWEEN,
+} TaskKind;
+
+typedef enum {
+    EASE_LINEAR,
+    EASE_IN_QUAD,
+    EASE_OUT_QUAD,
+    EASE_IN_OUT_QUAD,
+} Ease;
+
+typedef struct {
+    unsigned int generation;
+    unsigned char kind;
+    unsigned char cancelled;     /* cancelled mid-pass, reclaimed by the next pass */
+    unsigned char loop;
+    unsigned char ease;
+    unsigned int index;          /* heap position (timers) or active list position */
+    double time;                 /* timers: due time; animations: start time */
+    double period;               /* timers: repeat interval; animations: duration */
+    int repeats;                 /* timers: fires left after the next, -1 forever */
+    unsigned long long seq;      /* creation order, breaks due-time ties */
+    lua_Integer entity;          /* tweens */
+    int field;
+    float from, to;
+    unsigned int nextFree;
+} Task;
+
+typedef struct {
+    double now;
+    Task* tasks;
+    unsigned int taskCount;
+    unsigned int taskCapacity;
+    unsigned int freeTask;
+    unsigned int* heap;          /* timer slots, heap-ordered by (time, seq) */
+    unsigned int heapCount;
+    unsigned int* active;        /* animation and tween slots */
+    unsigned int activeCount;
+    unsigned int cancelledCount; /* active entries awaiting reclaim */
+    unsigned long long nextSeq;
+    int ticking;                 /* inside the animation pass */
+} Scheduler;
+
+static Scheduler g_scheduler = { .freeTask = TASK_NO_SLOT };
+
+static inline lua_Integer taskHandle(unsigned int slot, unsigned int generation) {
+    return (lua_Integer)(((unsigned long long)generation << 32) | slot);
+}
+
+/* Slot for a live handle, or TASK_NO_SLOT */
+static unsigned int taskResolve(const Scheduler* s, lua_Integer handle) {
+    unsigned long long h = (unsigned long long)handle;
+    unsigned int slot = (unsigned int)(h & 0xFFFFFFFFu);
+    
+    if (slot >= s->taskCount || s->tasks[slot].generation != (unsigned int)(h >> 32) ||
+        s->tasks[slot].kind == TASK_FREE) {
+        return TASK_NO_SLOT;
+    }
+    return slot;
+}
+
+/* The heap and active list never hold more entries than there are
+ * tasks, so they grow with the task table */
+static int schedulerReserve(Scheduler* s, unsigned int count) {
+    if (count <= s->taskCapacity) return 1;
+    unsigned int capacity = s->taskCapacity ? s->taskCapacity : TASK_INITIAL_CAPACITY;
+    while (capacity < count) capacity *= 2;
+    
+    Task* tasks = realloc(s->tasks, capacity * sizeof(Task));
+    if (!tasks) return 0;
+    s->tasks = tasks;
+    unsigned int* heap = realloc(s->heap, capacity * sizeof(unsigned int));
+    if (!heap) return 0;
+    s->heap = heap;
+    unsigned int* active = realloc(s->active, capacity * sizeof(unsigned int));
+    if (!active) return 0;
+    s->active = active;
+    s->taskCapacity = capacity;
+    return 1;
+}
+
+static unsigned int taskAlloc(Scheduler* s, TaskKind kind) {
+    unsigned int slot = s->freeTask;
+    if (slot != TASK_NO_SLOT) {
+        s->freeTask = s->tasks[slot].nextFree;
+    } else {
+        if (!schedulerReserve(s, s->taskCount + 1)) return TASK_NO_SLOT;
+        slot = s->taskCount++;
+        s->tasks[slot].generation = 1;
+    }
+    
+    Task* task = &s->tasks[slot];
+    unsigned int generation = task->generation;
+    memset(task, 0, sizeof(*task));
+    task->generation = generation;
+    task->kind = (unsigned char)kind;
+    task->seq = s->nextSeq++;
+    return slot;
+}
+
+static void taskFree(lua_State* L, Scheduler* s, unsigned int slot) {
+    Task* task = &s->tasks[slot];
+    if (task->cancelled) s->cancelledCount--;
+    task->generation++;
+    task->kind = TASK_FREE;
+    task->cancelled = 0;
+    task->nextFree = s->freeTask;
+    s->freeTask = slot;
+    
+    lua_getfield(L, LUA_REGISTRYINDEX, SCHEDULER_CALLBACKS_KEY);
+    lua_pushnil(L);
+    lua_rawseti(L, -2, (lua_Integer)slot + 1);
+    lua_pop(L, 1);
+}
+
+static inline int heapLess(const Scheduler* s, unsigned int a, unsigned int b) {
+    const Task* ta = &s->tasks[s->heap[a]];
+    const Task* tb = &s->tasks[s->heap[b]];
+    return ta->time < tb->time || (ta->time == tb->time && ta->seq < tb->seq);
+}
+
+static inline void heapSwap(Scheduler* s, unsigned int a, unsigned int b) {
+    unsigned int slot = s->heap[a];
+    s->heap[a] = s->heap[b];
+    s->heap[b] = slot;
+    s->tasks[s->heap[a]].index = a;
+    s->tasks[s->heap[b]].index = b;
+}
+
+static void heapSiftUp(Scheduler* s, unsigned int i) {
+    while (i > 0 && heapLess(s, i, (i - 1) / 2)) {
+        heapSwap(s, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void heapSiftDown(Scheduler* s, unsigned int i) {
+    for (;;) {
+        unsigned int left = 2 * i + 1, right = left + 1, least = i;
+        if (left < s->heapCount && heapLess(s, left, least)) least = left;
+        if (right < s->heapCount && heapLess(s, right, least)) least = right;
+        if (least == i) return;
+        heapSwap(s, i, least);
+        i = least;
+    }
+}
+
+static void heapPush(Scheduler* s, unsigned int slot) {
+    unsigned int i = s->heapCount++;
+    s->heap[i] = slot;
+    s->tasks[slot].index = i;
+    heapSiftUp(s, i);
+}
+
+static void heapRemove(Scheduler* s, unsigned int i) {
+    unsigned int last = --s->heapCount;
+    if (i == last) return;
+    heapSwap(s, i, last);
+    heapSiftDown(s, i);
+    heapSiftUp(s, i);
+}
+
+static void activePush(Scheduler* s, unsigned int slot) {
+    s->tasks[slot].index = s->activeCount;
+    s->active[s->activeCount++] = slot;
+}
+
+/* Outside the animation pass an active entry is swap-removed at once;
+ * during it the entry is flagged and reclaimed when the pass (or the
+ * next one) reaches it, so the list isn't reshuffled under the loop */
+static int schedulerCancel(lua_State* L, Scheduler* s, lua_Integer handle) {
+    unsigned int slot = taskResolve(s, handle);
+    if (slot == TASK_NO_SLOT || s->tasks[slot].cancelled) return 0;
+    Task* task = &s->tasks[slot];
+    
+    if (task->kind == TASK_TIMER) {
+        heapRemove(s, task->index);
+        taskFree(L, s, slot);
+    } else if (s->ticking) {
+        task->cancelled = 1;
+        s->cancelledCount++;
+    } else {
+        unsigned int i = task->index;
+        s->active[i] = s->active[--s->activeCount];
+        s->tasks[s->active[i]].index = i;
+        taskFree(L, s, slot);
+    }
+    return 1;
+}
+
+static float easeApply(Ease ease, float t) {
+    switch (ease) {
+    case EASE_IN_QUAD:
+        return t * t;
+    case EASE_OUT_QUAD:
+        return t * (2.0f - t);
+    case EASE_IN_OUT_QUAD:
+        return t < 0.5f ? 2.0f * t * t : -1.0f + (4.0f - 2.0f * t) * t;
+    default:
+        return t;
+    }
+}
+
+/* Calls the slot's callback with the value at the stack top (popped) and
+ * the handle. Errors are reported and swallowed like loop()'s. */
+static void schedulerCall(lua_State* L, unsigned int slot, lua_Integer handle, int nargs) {
+    lua_getfield(L, LUA_REGISTRYINDEX, SCHEDULER_CALLBACKS_KEY);
+    lua_rawgeti(L, -1, (lua_Integer)slot + 1);
+    lua_replace(L, -2);
+    if (nargs) lua_rotate(L, -2, 1);
+    lua_pushinteger(L, handle);
+    if (lua_pcall(L, nargs + 1, 0, 0) != LUA_OK) {
+        fprintf(stderr, "Lua error in scheduler callback: %s\n", lua_tostring(L, -1));
+        lua_pop(L, 1);
+    }
+}
+
+/* Fires due timers, then ticks every animation and tween. Tasks created
+ * by callbacks first run on the next tick, so after(0, fn) chains can't
+ * spin inside one. */
+static void schedulerAdvance(lua_State* L, Scheduler* s, double dt) {
+    s->now += dt;
+    unsigned long long limit = s->nextSeq;
+    
+    while (s->heapCount > 0) {
+        unsigned int slot = s->heap[0];
+        Task* task = &s->tasks[slot];
+        if (task->time > s->now || task->seq >= limit) break;
+        
+        lua_Integer handle = taskHandle(slot, task->generation);
+        if (task->repeats != 0) {
+            if (task->repeats > 0) task->repeats--;
+            task->time += task->period;
+            heapSiftDown(s, 0);
+            schedulerCall(L, slot, handle, 0);
+        } else {
+            /* Keep the callback alive past taskFree */
+            heapRemove(s, 0);
+            lua_getfield(L, LUA_REGISTRYINDEX, SCHEDULER_CALLBACKS_KEY);
+            lua_rawgeti(L, -1, (lua_Integer)slot + 1);
+            lua_replace(L, -2);
+            taskFree(L, s, slot);
+            lua_pushinteger(L, handle);
+            if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
+                fprintf(stderr, "Lua error in scheduler callback: %s\n", lua_tostring(L, -1));
+                lua_pop(L, 1);
+            }
+        }
+    }
+    
+    unsigned int n = s->activeCount, kept = 0;
+    s->ticking = 1;
+    for (unsigned int i = 0; i < n; i++) {
+        unsigned int slot = s->active[i];
+        Task* task = &s->tasks[slot];
+        if (task->cancelled) {
+            taskFree(L, s, slot);
+            continue;
+        }
+        
+        float t = task->period > 0.0 ? (float)((s->now - task->time) / task->period) : 1.0f;
+        int done = t >= 1.0f;
+        if (done) t = 1.0f;
+        
+        if (task->kind == TASK_TWEEN) {
+            int e = entityResolve(&g_entities, task->entity);
+            if (e < 0) {
+                taskFree(L, s, slot);
+                continue;
+            }
+            entitySetField(&g_entities, e, task->field, task->from + (task->to - task->from) * easeApply(task->ease, t));
+        } else {
+            lua_pushnumber(L, t);
+            schedulerCall(L, slot, taskHandle(slot, task->generation), 1);
+            task = &s->tasks[slot];
+            if (task->cancelled) {
+                taskFree(L, s, slot);
+                continue;
+            }
+        }
+        
+        if (done) {
+            if (!task->loop) {
+                taskFree(L, s, slot);
+                continue;
+            }
+            task->time = s->now;
+        }
+        s->active[kept] = slot;
+        task->index = kept++;
+    }
+    
+    /* Entries added by callbacks during the pass */
+    for (unsigned int i = n; i < s->activeCount; i++) {
+        s->active[kept] = s->active[i];
+        s->tasks[s->active[kept]].index = kept;
+        kept++;
+    }
+    s->activeCount = kept;
+    s->ticking = 0;
+}
+
+/* Stores the callback at `fn` for a new task, or raises on allocation
+ * failure */
+static unsigned int schedulerAdd(lua_State* L, TaskKind kind, int fn) {
+    unsigned int slot = taskAlloc(&g_scheduler, kind);
+    if (slot == TASK_NO_SLOT) luaL_error(L, "out of memory scheduling task");
+    if (fn) {
+        lua_getfield(L, LUA_REGISTRYINDEX, SCHEDULER_CALLBACKS_KEY);
+        lua_pushvalue(L, fn);
+        lua_rawseti(L, -2, (lua_Integer)slot + 1);
+        lua_pop(L, 1);
+    }
+    return slot;
+}
+
+static int pushTaskHandle(lua_State* L, unsigned int slot) {
+    lua_pushinteger(L, taskHandle(slot, g_scheduler.tasks[slot].generation));
+    return 1;
+}
+
+/* scheduler.after(delay, fn) -> handle; fn(handle) runs once */
+static int lua_schedulerAfter(lua_State* L) {
+    lua_Number delay = luaL_checknumber(L, 1);
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    
+    unsigned int slot = schedulerAdd(L, TASK_TIMER, 2);
+    Task* task = &g_scheduler.tasks[slot];
+    task->time = g_scheduler.now + (delay > 0.0 ? delay : 0.0);
+    heapPush(&g_scheduler, slot);
+    return pushTaskHandle(L, slot);
+}
+
+/* scheduler.every(interval, fn, [count]) -> handle; fn(handle) runs
+ * every interval seconds, count times or until cancelled */
+static int lua_schedulerEvery(lua_State* L) {
+    lua_Number interval = luaL_checknumber(L, 1);
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    lua_Integer count = luaL_optinteger(L, 3, -1);
+    luaL_argcheck(L, interval > 0.0, 1, "interval must be positive");
+    luaL_argcheck(L, count != 0 && count >= -1, 3, "count must be positive");
+    
+    unsigned int slot = schedulerAdd(L, TASK_TIMER, 2);
+    Task* task = &g_scheduler.tasks[slot];
+    task->time = g_scheduler.now + interval;
+    task->period = interval;
+    task->repeats = count > 0 ? (int)count - 1 : -1;
+    heapPush(&g_scheduler, slot);
+    return pushTaskHandle(L, slot);
+}
+
+/* scheduler.animate(duration, fn, [loop]) -> handle; fn(progress, handle)
+ * runs every tick with progress in [0, 1], ending with exactly 1 */
+static int lua_schedulerAnimate(lua_State* L) {
+    lua_Number duration = luaL_checknumber(L, 1);
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    
+    unsigned int slot = schedulerAdd(L, TASK_ANIMATION, 2);
+    Task* task = &g_scheduler.tasks[slot];
+    task->time = g_scheduler.now;
+    task->period = duration;
+    task->loop = (unsigned char)lua_toboolean(L, 3);
+    activePush(&g_scheduler, slot);
+    return pushTaskHandle(L, slot);
+}
+
+/* scheduler.tween(entity, field, to, duration, [ease], [loop]) -> handle;
+ * eases a numeric entity field from its current value. Ends early if
+ * the entity is destroyed. */
+static int lua_schedulerTween(lua_State* L) {
+    static const char* const eases[] = { "linear", "inQuad", "outQuad", "inOutQuad", NULL };
+    lua_Integer entity = luaL_checkinteger(L, 1);
+    int e = checkEntity(L, 1);
+    int field = checkEntityField(L, 2);
+    luaL_argcheck(L, field < ENTITY_FLOAT_FIELDS, 2, "only numeric fields can be tweened");
+    float to = (float)luaL_checknumber(L, 3);
+    lua_Number duration = luaL_checknumber(L, 4);
+    int ease = luaL_checkoption(L, 5, "linear", eases);
+    
+    unsigned int slot = schedulerAdd(L, TASK_TWEEN, 0);
+    Task* task = &g_scheduler.tasks[slot];
+    task->time = g_scheduler.now;
+    task->period = duration;
+    task->loop = (unsigned char)lua_toboolean(L, 6);
+    task->ease = (unsigned char)ease;
+    task->entity = entity;
+    task->field = field;
+    task->from = g_entities.field[field][e];
+    task->to = to;
+    activePush(&g_scheduler, slot);
+    return pushTaskHandle(L, slot);
+}
+
+/* scheduler.cancel(handle) -> true if the task was still pending */
+static int lua_schedulerCancel(lua_State* L) {
+    lua_pushboolean(L, schedulerCancel(L, &g_scheduler, luaL_checkinteger(L, 1)));
+    return 1;
+}
+
+static int lua_schedulerIsPending(lua_State* L) {
+    unsigned int slot = taskResolve(&g_scheduler, luaL_checkinteger(L, 1));
+    lua_pushboolean(L, slot != TASK_NO_SLOT && !g_scheduler.tasks[slot].cancelled);
+    return 1;
+}
+
+/* scheduler.time() -> seconds of simulation time */
+static int lua_schedulerTime(lua_State* L) {
+    lua_pushnumber(L, g_scheduler.now);
+    return 1;
+}
+
+/* scheduler.count() -> pending timers, running animations and tweens */
+static int lua_schedulerCount(lua_State* L) {
+    lua_pushinteger(L, g_scheduler.heapCount);
+    lua_pushinteger(L, g_scheduler.activeCount - g_scheduler.cancelledCount);
+    return 2;
+}
+
+void registerSchedulerModule(lua_State* L) {
+    static const luaL_Reg functions[] = {
+        {"after", lua_schedulerAfter},
+        {"every", lua_schedulerEvery},
+        {"animate", lua_schedulerAnimate},
+        {"tween", lua_schedulerTween},
+        {"cancel", lua_schedulerCancel},
+        {"isPending", lua_schedulerIsPending},
+        {"time", lua_schedulerTime},
+        {"count", lua_schedulerCount},
+        {NULL, NULL}
+    };
+    
+    lua_newtable(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, SCHEDULER_CALLBACKS_KEY);
+    luaL_newlib(L, functions);
+    lua_setglobal(L, "scheduler");
+}
+
+/* ============================================================ */
+/* OBJECT POOLS */
+/* ============================================================ */
+
+/* Free lists of Lua values for gameplay objects created and dropped
+ * every frame (bullets, timers, temporaries), so steady-state play
+ * allocates nothing for the collector to chase. The constructor,
+ * reset function and free list live in the pool's user values. */
+
+#define POOL_METATABLE "Pool"
+
+enum {
+    POOL_UV_CTOR = 1,
+    POOL_UV_RESET,
+    POOL_UV_FREE,
+    POOL_UV_COUNT = POOL_UV_FREE
+};
+
+typedef struct {
+    int free;        /* objects on the free list */
+    int live;        /* acquired and not yet released */
+} Pool;
+
+static Pool* checkPool(lua_State* L, int idx) {
+    return (Pool*)luaL_checkudata(L, idx, POOL_METATABLE);
+}
+
+/* pool.new(ctor, [reset]) -- ctor(...) builds a fresh object; reset(obj,
+ * ...) re-initializes a recycled one with the same arguments */
+static int lua_poolNew(lua_State* L) {
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    if (!lua_isnoneornil(L, 2)) luaL_checktype(L, 2, LUA_TFUNCTION);
+    
+    Pool* pool = (Pool*)lua_newuserdatauv(L, sizeof(Pool), POOL_UV_COUNT);
+    pool->free = 0;
+    pool->live = 0;
+    luaL_setmetatable(L, POOL_METATABLE);
+    lua_pushvalue(L, 1);
+    lua_setiuservalue(L, -2, POOL_UV_CTOR);
+    lua_pushvalue(L, 2);
+    lua_setiuservalue(L, -2, POOL_UV_RESET);
+    lua_newtable(L);
+    lua_setiuservalue(L, -2, POOL_UV_FREE);
+    return 1;
+}
+
+/* pool:acquire(...) -> a recycled object passed through reset, or a new
+ * one from ctor */
+static int lua_poolAcquire(lua_State* L) {
+    Pool* pool = checkPool(L, 1);
+    int nargs = lua_gettop(L) - 1;
+    
+    if (pool->free == 0) {
+        lua_getiuservalue(L, 1, POOL_UV_CTOR);
+        lua_insert(L, 2);
+        lua_call(L, nargs, 1);
+        pool->live++;
+        return 1;
+    }
+    
+    lua_getiuservalue(L, 1, POOL_UV_FREE);
+    lua_rawgeti(L, -1, pool->free);
+    lua_pushnil(L);
+    lua_rawseti(L, -3, pool->free);
+    pool->free--;
+    pool->live++;
+    lua_replace(L, -2);
+    
+    lua_getiuservalue(L, 1, POOL_UV_RESET);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        return 1;
+    }
+    /* [pool, args..., obj, reset] -> [pool, obj, reset, obj, args...] */
+    lua_insert(L, 2);
+    lua_insert(L, 3);
+    lua_pushvalue(L, 3);
+    lua_insert(L, 2);
+    lua_call(L, nargs + 1, 0);
+    return 1;
+}
+
+/* pool:release(obj) -- obj must not be used afterwards; nil is ignored.
+ * Releasing the same object twice hands it out twice. */
+static int lua_poolRelease(lua_State* L) {
+    Pool* pool = checkPool(L, 1);
+    if (lua_isnoneornil(L, 2)) return 0;
+    
+    lua_getiuservalue(L, 1, POOL_UV_FREE);
+    lua_pushvalue(L, 2);
+    lua_rawseti(L, -2, ++pool->free);
+    if (pool->live > 0) pool->live--;
+    return 0;
+}
+
+/* pool:reserve(n) -- builds objects with ctor() until n are free, so the
+ * first busy frame doesn't allocate them */
+static int lua_poolReserve(lua_State* L) {
+    Pool* pool = checkPool(L, 1);
+    lua_Integer n = luaL_checkinteger(L, 2);
+    
+    lua_getiuservalue(L, 1, POOL_UV_FREE);
+    while (pool->free < n) {
+        lua_getiuservalue(L, 1, POOL_UV_CTOR);
+        lua_call(L, 0, 1);
+        lua_rawseti(L, -2, ++pool->free);
+    }
+    return 0;
+}
+
+/* pool:clear() -- drops the free list, leaving it to the collector */
+static int lua_poolClear(lua_State* L) {
+    Pool* pool = checkPool(L, 1);
+    lua_newtable(L);
+    lua_setiuservalue(L, 1, POOL_UV_FREE);
+    pool->free = 0;
+    return 0;
+}
+
+/* pool:count() -> live, free */
+static int lua_poolCount(lua_State* L) {
+    Pool* pool = checkPool(L, 1);
+    lua_pushinteger(L, pool->live);
+    lua_pushinteger(L, pool->free);
+    return 2;
+}
+
+void registerPoolModule(lua_State* L) {
+    static const luaL_Reg methods[] = {
+        {"acquire", lua_poolAcquire},
+        {"release", lua_poolRelease},
+        {"reserve", lua_poolReserve},
+        {"clear", lua_poolClear},
+        {"count", lua_poolCount},
+        {NULL, NULL}
+    };
+    static const luaL_Reg functions[] = {
+        {"new", lua_poolNew},
+        {NULL, NULL}
+    };
+    
+    luaL_newmetatable(L, POOL_METATABLE);
+    luaL_newlib(L, methods);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+    
+    luaL_newlib(L, functions);
+    lua_setglobal(L, "pool");
+}
+
+/* ============================================================ */
+/* SNAPSHOTS */
+/* ============================================================ */
+
+/* Binary copies of the simulation for save/load, rewind and rollback.
+ * The entity store, the scheduler and every registered particle emitter
+ * are written as their raw arrays, in sections padded to 8 bytes, so a
+ * capture or restore is a handful of memcpys; registered Lua tables use
+ * a compact tagged encoding. Lua objects the native state points at --
+ * sprite atlases, fonts, label strings and scheduler callbacks -- can't
+ * be bytes, so the snapshot keeps them in its user values: restoring in
+ * the same session brings them back, while a snapshot rebuilt with
+ * snapshot.load() drops them. The layout is native, so saved bytes are
+ * only meant to be loaded by the same build. */
+
+#define SNAPSHOT_METATABLE "Snapshot"
+#define SNAPSHOT_REGISTRY_KEY "engine.snapshots"
+#define SNAPSHOT_MAGIC 0x504E5345u   /* "ESNP" */
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_MAX_DEPTH 32
+
+enum {
+    SNAPSHOT_UV_VALUES = 1,   /* atlases, fonts and strings entity visuals use */
+    SNAPSHOT_UV_CALLBACKS,    /* copy of the scheduler callback table */
+    SNAPSHOT_UV_COUNT = SNAPSHOT_UV_CALLBACKS
+};
+
+typedef enum {
+    SNAP_END,
+    SNAP_ENTITIES,
+    SNAP_SCHEDULER,
+    SNAP_EMITTER,
+    SNAP_TABLE,
+} SnapshotSection;
+
+/* Value tags in the table encoding; a table is its key/value pairs
+ * closed by SNAP_TAG_END */
+typedef enum {
+    SNAP_TAG_END,
+    SNAP_TAG_FALSE,
+    SNAP_TAG_TRUE,
+    SNAP_TAG_INTEGER,
+    SNAP_TAG_NUMBER,
+    SNAP_TAG_STRING,
+    SNAP_TAG_TABLE,
+} SnapshotTag;
+
+typedef struct {
+    unsigned char* data;
+    size_t size;
+    size_t capacity;
+    int failed;          /* ran out of memory while writing */
+} Snapshot;
+
+typedef struct {
+    unsigned int magic;
+    unsigned int version;
+} SnapshotHeader;
+
+typedef struct {
+    unsigned int tag;
+    unsigned int reserved;
+    unsigned long long size;     /* payload bytes, a multiple of 8 */
+} SnapshotSectionHeader;
+
+typedef struct {
+    int count;
+    unsigned int slotCount;
+    unsigned int freeSlot;
+    unsigned int reserved;
+} EntitySnapshotHeader;
+
+/* Visuals are stored as indices into SNAPSHOT_UV_VALUES, from 1, with 0
+ * for none */
+typedef struct {
+    int region;
+    int resource;
+    int text;
+    int reserved;
+} EntitySnapshotVisual;
+
+typedef struct {
+    double now;
+    unsigned long long nextSeq;
+    unsigned int taskCount;
+    unsigned int freeTask;
+    unsigned int heapCount;
+    unsigned int activeCount;
+    unsigned int cancelledCount;
+    unsigned int reserved;
+} SchedulerSnapshotHeader;
+
+typedef struct {
+    float x, y;
+    int count;
+    int fade;
+    unsigned int seed;
+    unsigned int reserved;
+} EmitterSnapshotHeader;
+
+typedef struct {
+    const unsigned char* base;   /* start of the snapshot, for alignment */
+    const unsigned char* p;
+    const unsigned char* end;
+} SnapshotReader;
+
+static Snapshot* checkSnapshot(lua_State* L, int idx) {
+    return (Snapshot*)luaL_checkudata(L, idx, SNAPSHOT_METATABLE);
+}
+
+static void* snapAppend(Snapshot* snap, size_t bytes) {
+    if (snap->failed) return NULL;
+    if (snap->size + bytes > snap->capacity) {
+        size_t capacity = snap->capacity ? snap->capacity : 4096;
+        while (capacity < snap->size + bytes) capacity *= 2;
+        unsigned char* data = realloc(snap->data, capacity);
+        if (!data) {
+            snap->failed = 1;
+            return NULL;
+        }
+        snap->data = data;
+        snap->capacity = capacity;
+    }
+    void* p = snap->data + snap->size;
+    snap->size += bytes;
+    return p;
+}
+
+static void snapWrite(Snapshot* snap, const void* src, size_t bytes) {
+    void* p = snapAppend(snap, bytes);
+    if (p && bytes) memcpy(p, src, bytes);
+}
+
+/* Zero padding, so equal states give equal bytes */
+static void snapPad(Snapshot* snap) {
+    size_t pad = (8 - (snap->size & 7)) & 7;
+    void* p = snapAppend(snap, pad);
+    if (p && pad) memset(p, 0, pad);
+}
+
+static void snapWriteArray(Snapshot* snap, const void* src, size_t bytes) {
+    snapWrite(snap, src, bytes);
+    snapPad(snap);
+}
+
+static size_t snapBeginSection(Snapshot* snap, SnapshotSection tag) {
+    size_t at = snap->size;
+    SnapshotSectionHeader header = { tag, 0, 0 };
+    snapWrite(snap, &header, sizeof(header));
+    return at;
+}
+
+static void snapEndSection(Snapshot* snap, size_t at) {
+    snapPad(snap);
+    if (snap->failed) return;
+    SnapshotSectionHeader* header = (SnapshotSectionHeader*)(snap->data + at);
+    header->size = snap->size - at - sizeof(SnapshotSectionHeader);
+}
+
+static void snapWriteName(Snapshot* snap, const char* name, size_t length) {
+    unsigned int n = (unsigned int)length;
+    snapWrite(snap, &n, sizeof(n));
+    snapWriteArray(snap, name, length);
+}
+
+static const void* snapRead(SnapshotReader* r, size_t bytes) {
+    if ((size_t)(r->end - r->p) < bytes) return NULL;
+    const void* p = r->p;
+    r->p += bytes;
+    return p;
+}
+
+/* count items of size bytes each; the count is checked against what is
+ * left before multiplying, so a bad header can't wrap the length */
+static const void* snapReadArray(SnapshotReader* r, size_t count, size_t size) {
+    if (count > (size_t)(r->end - r->p) / size) return NULL;
+    const void* p = snapRead(r, count * size);
+    size_t pad = (8 - ((size_t)(r->p - r->base) & 7)) & 7;
+    if (p && !snapRead(r, pad)) return NULL;
+    return p;
+}
+
+/* Name of an emitter or table section, pushed as a string */
+static int snapReadName(lua_State* L, SnapshotReader* r) {
+    const unsigned int* n = snapRead(r, sizeof(unsigned int));
+    const char* name = n ? snapReadArray(r, *n, 1) : NULL;
+    if (!name) return 0;
+    lua_pushlstring(L, name, *n);
+    return 1;
+}
+
+/* --- Entities --- */
+
+static int snapValue(lua_State* L, int refs, int values, int ref, int* count) {
+    if (ref == LUA_NOREF || ref == LUA_REFNIL) return 0;
+    lua_rawgeti(L, refs, ref);
+    lua_rawseti(L, values, ++*count);
+    return *count;
+}
+
+static void snapshotEntities(lua_State* L, Snapshot* snap, int values) {
+    const EntityStore* es = &g_entities;
+    int n = es->count;
+    size_t at = snapBeginSection(snap, SNAP_ENTITIES);
+    EntitySnapshotHeader header = { n, es->slotCount, es->freeSlot, 0 };
+    snapWrite(snap, &header, sizeof(header));
+    
+    for (int f = 0; f < ENTITY_FLOAT_FIELDS; f++) {
+        snapWriteArray(snap, es->field[f], n * sizeof(float));
+    }
+    snapWriteArray(snap, es->flags, n);
+    snapWriteArray(snap, es->shape, n);
+    const unsigned int* links[] = { es->denseSlot, es->parent, es->firstChild, es->lastChild, es->nextSibling };
+    for (int l = 0; l < 5; l++) {
+        snapWriteArray(snap, links[l], n * sizeof(unsigned int));
+    }
+    snapWriteArray(snap, es->world, n * ENTITY_MATRIX_FLOATS * sizeof(float));
+    
+    /* Visuals point at Lua objects; collect those into the values table
+     * (atlases shared by consecutive sprites are stored once) */
+    EntitySnapshotVisual* visuals = snapAppend(snap, n * sizeof(EntitySnapshotVisual));
+    if (visuals) {
+        lua_getfield(L, LUA_REGISTRYINDEX, ENTITY_REFS_KEY);
+        int refs = lua_gettop(L);
+        int count = 0, lastIndex = 0;
+        const void* lastResource = NULL;
+        for (int i = 0; i < n; i++) {
+            const EntityVisual* visual = &es->visual[i];
+            EntitySnapshotVisual* out = &visuals[i];
+            *out = (EntitySnapshotVisual){ visual->region, 0, 0, 0 };
+            if (es->shape[i] != SHAPE_SPRITE && es->shape[i] != SHAPE_TEXT) continue;
+            
+            if (visual->resource && visual->resource == lastResource) {
+                out->resource = lastIndex;
+            } else {
+                out->resource = snapValue(L, refs, values, visual->resourceRef, &count);
+                lastResource = visual->resource;
+                lastIndex = out->resource;
+            }
+            out->text = snapValue(L, refs, values, visual->textRef, &count);
+        }
+        lua_pop(L, 1);
+    }
+    snapPad(snap);
+    
+    snapWriteArray(snap, es->slotDense, es->slotCount * sizeof(unsigned int));
+    snapWriteArray(snap, es->slotGeneration, es->slotCount * sizeof(unsigned int));
+    snapEndSection(snap, at);
+}
+
+/* Whether a link names a live slot, given slot -> dense and dense -> slot */
+static int snapSlotLive(unsigned int slot, unsigned int slotCount, const unsigned int* slotDense,
+                        const unsigned int* denseSlot, int n) {
+    return slot < slotCount && slotDense[slot] < (unsigned int)n && denseSlot[slotDense[slot]] == slot;
+}
+
+/* Checks that the saved slots and hierarchy are what the store itself
+ * would build: live slots map both ways, every free slot is on one
+ * acyclic free list, every link names a live entity, child lists agree
+ * with the parents and every entity hangs off a root */
+static int snapEntitiesValid(int n, unsigned int slotCount, unsigned int freeSlot,
+                             const unsigned int* slotDense, const unsigned int* const links[5],
+                             const unsigned char* shape) {
+    const unsigned int* denseSlot = links[0];
+    const unsigned int* parent = links[1];
+    const unsigned int* firstChild = links[2];
+    const unsigned int* lastChild = links[3];
+    const unsigned int* nextSibling = links[4];
+    
+    for (int i = 0; i < n; i++) {
+        if (denseSlot[i] >= slotCount || slotDense[denseSlot[i]] != (unsigned int)i) return 0;
+        if (shape[i] > SHAPE_TEXT) return 0;
+    }
+    unsigned int freeCount = slotCount - (unsigned int)n, walked = 0;
+    for (unsigned int slot = freeSlot; slot != ENTITY_NO_SLOT; slot = slotDense[slot]) {
+        if (slot >= slotCount || snapSlotLive(slot, slotCount, slotDense, denseSlot, n)) return 0;
+        if (++walked > freeCount) return 0;
+    }
+    if (walked != freeCount) return 0;
+    
+    int parented = 0;
+    for (int i = 0; i < n; i++) {
+        for (int l = 1; l < 5; l++) {
+            unsigned int link = links[l][i];
+            if (link != ENTITY_NO_SLOT && !snapSlotLive(link, slotCount, slotDense, denseSlot, n)) return 0;
+        }
+        if ((firstChild[i] == ENTITY_NO_SLOT) != (lastChild[i] == ENTITY_NO_SLOT)) return 0;
+        if (parent[i] == ENTITY_NO_SLOT && nextSibling[i] != ENTITY_NO_SLOT) return 0;
+        if (parent[i] != ENTITY_NO_SLOT) parented++;
+    }
+    /* Each child names its parent, so the lists are disjoint; visiting
+     * no more than `parented` children rules out sibling cycles */
+    int visited = 0;
+    for (int p = 0; p < n; p++) {
+        unsigned int last = ENTITY_NO_SLOT;
+        for (unsigned int child = firstChild[p]; child != ENTITY_NO_SLOT; child = nextSibling[slotDense[child]]) {
+            if (parent[slotDense[child]] != denseSlot[p] || ++visited > parented) return 0;
+            last = child;
+        }
+        if (last != lastChild[p]) return 0;
+    }
+    if (visited != parented) return 0;
+    
+    /* Walk down from the roots; entities in a parent cycle are never reached */
+    int reached = 0;
+    for (int root = 0; root < n; root++) {
+        if (parent[root] != ENTITY_NO_SLOT) continue;
+        int i = root;
+        for (;;) {
+            reached++;
+            if (firstChild[i] != ENTITY_NO_SLOT) {
+                i = (int)slotDense[firstChild[i]];
+                continue;
+            }
+            while (i != root && nextSibling[i] == ENTITY_NO_SLOT) i = (int)slotDense[parent[i]];
+            if (i == root) break;
+            i = (int)slotDense[nextSibling[i]];
+        }
+    }
+    return reached == n;
+}
+
+/* values is the snapshot's value table, or 0 when it has none */
+static int restoreEntities(lua_State* L, SnapshotReader* r, int values) {
+    const EntitySnapshotHeader* header = snapRead(r, sizeof(EntitySnapshotHeader));
+    if (!header || header->count < 0 || (unsigned int)header->count > header->slotCount) return 0;
+    int n = header->count;
+    unsigned int slotCount = header->slotCount;
+    
+    const float* fields[ENTITY_FLOAT_FIELDS];
+    for (int f = 0; f < ENTITY_FLOAT_FIELDS; f++) {
+        if (!(fields[f] = snapReadArray(r, (size_t)n, sizeof(float)))) return 0;
+    }
+    const unsigned char* flags = snapReadArray(r, (size_t)n, 1);
+    const unsigned char* shape = snapReadArray(r, (size_t)n, 1);
+    const unsigned int* links[5];
+    for (int l = 0; l < 5; l++) {
+        if (!(links[l] = snapReadArray(r, (size_t)n, sizeof(unsigned int)))) return 0;
+    }
+    const float* world = snapReadArray(r, (size_t)n, ENTITY_MATRIX_FLOATS * sizeof(float));
+    const EntitySnapshotVisual* visuals = snapReadArray(r, (size_t)n, sizeof(EntitySnapshotVisual));
+    const unsigned int* slotDense = snapReadArray(r, slotCount, sizeof(unsigned int));
+    const unsigned int* slotGeneration = snapReadArray(r, slotCount, sizeof(unsigned int));
+    if (!flags || !shape || !world || !visuals || !slotDense || !slotGeneration) return 0;
+    
+    /* Check everything before touching the store, so bad bytes can't
+     * leave it half-written or pointing out of bounds */
+    if (!snapEntitiesValid(n, slotCount, header->freeSlot, slotDense, links, shape)) return 0;
+    
+    EntityStore* es = &g_entities;
+    if (!entityReserve(es, n) || !entityReserveSlots(es, slotCount)) {
+        return luaL_error(L, "out of memory restoring entities");
+    }
+    for (int i = 0; i < es->count; i++) {
+        entityReleaseVisual(L, &es->visual[i]);
+    }
+    
+    for (int f = 0; f < ENTITY_FLOAT_FIELDS; f++) {
+        memcpy(es->field[f], fields[f], n * sizeof(float));
+    }
+    memcpy(es->flags, flags, n);
+    memcpy(es->shape, shape, n);
+    unsigned int* dst[] = { es->denseSlot, es->parent, es->firstChild, es->lastChild, es->nextSibling };
+    for (int l = 0; l < 5; l++) {
+        memcpy(dst[l], links[l], n * sizeof(unsigned int));
+    }
+    memcpy(es->world, world, (size_t)n * ENTITY_MATRIX_FLOATS * sizeof(float));
+    memcpy(es->slotDense, slotDense, slotCount * sizeof(unsigned int));
+    memcpy(es->slotGeneration, slotGeneration, slotCount * sizeof(unsigned int));
+    es->count = n;
+    es->slotCount = slotCount;
+    es->freeSlot = header->freeSlot;
+    /* Handles made after the capture on slots free in it must go stale */
+    for (unsigned int slot = es->freeSlot; slot != ENTITY_NO_SLOT; slot = es->slotDense[slot]) {
+        es->slotGeneration[slot]++;
+    }
+    
+    /* Re-reference what sprites and labels draw; without the objects they
+     * keep their transform but draw nothing */
+    for (int i = 0; i < n; i++) {
+        EntityVisual* visual = &es->visual[i];
+        *visual = (EntityVisual){ .region = visuals[i].region, .resourceRef = LUA_NOREF, .textRef = LUA_NOREF };
+        if (shape[i] != SHAPE_SPRITE && shape[i] != SHAPE_TEXT) continue;
+        
+        int ok = values != 0;
+        if (ok && visuals[i].resource > 0) {
+            lua_rawgeti(L, values, visuals[i].resource);
+            const char* tname = shape[i] == SHAPE_SPRITE ? ATLAS_METATABLE : FONT_METATABLE;
+            visual->resource = luaL_testudata(L, -1, tname);
+            if (visual->resource) visual->resourceRef = entityRef(L, -1);
+            else ok = 0;
+            lua_pop(L, 1);
+        } else if (shape[i] == SHAPE_SPRITE) {
+            ok = 0;
+        }
+        if (ok && visuals[i].text > 0) {
+            lua_rawgeti(L, values, visuals[i].text);
+            visual->text = lua_tolstring(L, -1, &visual->length);
+            if (visual->text) visual->textRef = entityRef(L, -1);
+            else ok = 0;
+            lua_pop(L, 1);
+        } else if (shape[i] == SHAPE_TEXT) {
+            ok = 0;
+        }
+        if (!ok) {
+            entityReleaseVisual(L, visual);
+            es->shape[i] = SHAPE_NONE;
+        }
+    }
+    return 1;
+}
+
+/* --- Scheduler --- */
+
+static void snapshotScheduler(Snapshot* snap) {
+    const Scheduler* s = &g_scheduler;
+    size_t at = snapBeginSection(snap, SNAP_SCHEDULER);
+    SchedulerSnapshotHeader header = {
+        s->now, s->nextSeq, s->taskCount, s->freeTask,
+        s->heapCount, s->activeCount, s->cancelledCount, 0
+    };
+    snapWrite(snap, &header, sizeof(header));
+    snapWriteArray(snap, s->tasks, s->taskCount * sizeof(Task));
+    snapWriteArray(snap, s->heap, s->heapCount * sizeof(unsigned int));
+    snapWriteArray(snap, s->active, s->activeCount * sizeof(unsigned int));
+    snapEndSection(snap, at);
+}
+
+/* Checks the saved tasks the way the scheduler relies on them: known
+ * kinds, tween fields in range, each timer at its own heap position in
+ * heap order, each animation and tween at its own active position, and
+ * the free tasks on one acyclic free list */
+static int snapTasksValid(const SchedulerSnapshotHeader* header, const Task* tasks,
+                          const unsigned int* heap, const unsigned int* active) {
+    unsigned int taskCount = header->taskCount;
+    unsigned int timers = 0, running = 0, cancelled = 0, freeCount = 0;
+    for (unsigned int slot = 0; slot < taskCount; slot++) {
+        const Task* task = &tasks[slot];
+        if (task->kind > TASK_TWEEN || task->ease > EASE_IN_OUT_QUAD) return 0;
+        if (task->cancelled && task->kind != TASK_ANIMATION && task->kind != TASK_TWEEN) return 0;
+        if (task->kind == TASK_TWEEN && (task->field < 0 || task->field >= ENTITY_FLOAT_FIELDS)) return 0;
+        if (task->kind == TASK_FREE) freeCount++;
+        else if (task->kind == TASK_TIMER) timers++;
+        else running++;
+        if (task->cancelled) cancelled++;
+    }
+    if (timers != header->heapCount || running != header->activeCount ||
+        cancelled != header->cancelledCount) return 0;
+    
+    /* A slot can't be listed twice: its index names one position */
+    for (unsigned int i = 0; i < header->heapCount; i++) {
+        if (heap[i] >= taskCount) return 0;
+        const Task* task = &tasks[heap[i]];
+        if (task->kind != TASK_TIMER || task->index != i) return 0;
+        if (i > 0) {
+            const Task* up = &tasks[heap[(i - 1) / 2]];
+            if (task->time < up->time || (task->time == up->time && task->seq < up->seq)) return 0;
+        }
+    }
+    for (unsigned int i = 0; i < header->activeCount; i++) {
+        if (active[i] >= taskCount) return 0;
+        const Task* task = &tasks[active[i]];
+        if ((task->kind != TASK_ANIMATION && task->kind != TASK_TWEEN) || task->index != i) return 0;
+    }
+    
+    unsigned int walked = 0;
+    for (unsigned int slot = header->freeTask; slot != TASK_NO_SLOT; slot = tasks[slot].nextFree) {
+        if (slot >= taskCount || tasks[slot].kind != TASK_FREE || ++walked > freeCount) return 0;
+    }
+    return walked == freeCount;
+}
+
+/* callbacks is the snapshot's callback table, or 0 when it has none, in
+ * which case restored timers and animations are cancelled (tweens need
+ * no Lua and carry on) */
+static int restoreScheduler(lua_State* L, SnapshotReader* r, int callbacks) {
+    const SchedulerSnapshotHeader* header = snapRead(r, sizeof(SchedulerSnapshotHeader));
+    if (!header) return 0;
+    unsigned int taskCount = header->taskCount;
+    
+    const Task* tasks = snapReadArray(r, taskCount, sizeof(Task));
+    const unsigned int* heap = snapReadArray(r, header->heapCount, sizeof(unsigned int));
+    const unsigned int* active = snapReadArray(r, header->activeCount, sizeof(unsigned int));
+    if (!tasks || !heap || !active || !snapTasksValid(header, tasks, heap, active)) return 0;
+    
+    Scheduler* s = &g_scheduler;
+    if (!schedulerReserve(s, taskCount)) {
+        return luaL_error(L, "out of memory restoring scheduler");
+    }
+    memcpy(s->tasks, tasks, taskCount * sizeof(Task));
+    memcpy(s->heap, heap, header->heapCount * sizeof(unsigned int));
+    memcpy(s->active, active, header->activeCount * sizeof(unsigned int));
+    s->now = header->now;
+    s->nextSeq = header->nextSeq;
+    s->taskCount = taskCount;
+    s->freeTask = header->freeTask;
+    s->heapCount = header->heapCount;
+    s->activeCount = header->activeCount;
+    s->cancelledCount = header->cancelledCount;
+    /* As for entities: tasks made after the capture must not match */
+    for (unsigned int slot = s->freeTask; slot != TASK_NO_SLOT; slot = s->tasks[slot].nextFree) {
+        s->tasks[slot].generation++;
+    }
+    
+    /* The live table is a copy, so the snapshot can be restored again */
+    lua_newtable(L);
+    if (callbacks) {
+        lua_pushnil(L);
+        while (lua_next(L, callbacks)) {
+            lua_pushvalue(L, -2);
+            lua_insert(L, -2);
+            lua_rawset(L, -4);
+        }
+    }
+    lua_setfield(L, LUA_REGISTRYINDEX, SCHEDULER_CALLBACKS_KEY);
+    
+    if (!callbacks) {
+        for (unsigned int slot = 0; slot < taskCount; slot++) {
+            Task* task = &s->tasks[slot];
+            if ((task->kind == TASK_TIMER || task->kind == TASK_ANIMATION) && !task->cancelled) {
+                schedulerCancel(L, s, taskHandle(slot, task->generation));
+            }
+        }
+    }
+    return 1;
+}
+
+/* --- Emitters --- */
+
+static void snapshotEmitter(Snapshot* snap, const char* name, size_t length, const ParticleEmitter* e) {
+    size_t at = snapBeginSection(snap, SNAP_EMITTER);
+    snapWriteName(snap, name, length);
+    EmitterSnapshotHeader header = { e->x, e->y, e->count, e->fade, e->seed, 0 };
+    snapWrite(snap, &header, sizeof(header));
+    for (int f = 0; f < PARTICLE_FIELD_COUNT; f++) {
+        snapWriteArray(snap, e->field[f], e->count * sizeof(float));
+    }
+    snapEndSection(snap, at);
+}
+
+static int restoreEmitter(lua_State* L, SnapshotReader* r, ParticleEmitter* e) {
+    const EmitterSnapshotHeader* header = snapRead(r, sizeof(EmitterSnapshotHeader));
+    if (!header || header->count < 0) return 0;
+    const float* fields[PARTICLE_FIELD_COUNT];
+    for (int f = 0; f < PARTICLE_FIELD_COUNT; f++) {
+        if (!(fields[f] = snapReadArray(r, (size_t)header->count, sizeof(float)))) return 0;
+    }
+    
+    if (!emitterReserve(e, header->count)) {
+        return luaL_error(L, "out of memory restoring emitter");
+    }
+    for (int f = 0; f < PARTICLE_FIELD_COUNT; f++) {
+        memcpy(e->field[f], fields[f], header->count * sizeof(float));
+    }
+    e->x = header->x;
+    e->y = header->y;
+    e->count = header->count;
+    e->fade = header->fade;
+    e->seed = header->seed;
+    return 1;
+}
+
+/* --- Lua tables --- */
+
+static void snapEncodeValue(lua_State* L, Snapshot* snap, int idx, const char* name, int depth);
+
+static void snapEncodeTable(lua_State* L, Snapshot* snap, int idx, const char* name, int depth) {
+    if (depth > SNAPSHOT_MAX_DEPTH) {
+        luaL_error(L, "snapshot table '%s' is nested too deeply (or cyclic)", name);
+    }
+    idx = lua_absindex(L, idx);
+    luaL_checkstack(L, 3, "snapshot table nesting");
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+        snapEncodeValue(L, snap, -2, name, depth);
+        snapEncodeValue(L, snap, -1, name, depth);
+        lua_pop(L, 1);
+    }
+    unsigned char end = SNAP_TAG_END;
+    snapWrite(snap, &end, 1);
+}
+
+static void snapEncodeValue(lua_State* L, Snapshot* snap, int idx, const char* name, int depth) {
+    unsigned char tag;
+    switch (lua_type(L, idx)) {
+    case LUA_TBOOLEAN:
+        tag = lua_toboolean(L, idx) ? SNAP_TAG_TRUE : SNAP_TAG_FALSE;
+        snapWrite(snap, &tag, 1);
+        break;
+    case LUA_TNUMBER:
+        if (lua_isinteger(L, idx)) {
+            lua_Integer value = lua_tointeger(L, idx);
+            tag = SNAP_TAG_INTEGER;
+            snapWrite(snap, &tag, 1);
+            snapWrite(snap, &value, sizeof(value));
+        } else {
+            lua_Number value = lua_tonumber(L, idx);
+            tag = SNAP_TAG_NUMBER;
+            snapWrite(snap, &tag, 1);
+            snapWrite(snap, &value, sizeof(value));
+        }
+        break;
+    case LUA_TSTRING: {
+        size_t length;
+        const char* str = lua_tolstring(L, idx, &length);
+        unsigned int n = (unsigned int)length;
+        tag = SNAP_TAG_STRING;
+        snapWrite(snap, &tag, 1);
+        snapWrite(snap, &n, sizeof(n));
+        snapWrite(snap, str, length);
+        break;
+    }
+    case LUA_TTABLE:
+        tag = SNAP_TAG_TABLE;
+        snapWrite(snap, &tag, 1);
+        snapEncodeTable(L, snap, idx, name, depth + 1);
+        break;
+    default:
+        luaL_error(L, "cannot snapshot a %s in table '%s'", luaL_typename(L, idx), name);
+    }
+}
+
+static void snapshotTable(lua_State* L, Snapshot* snap, const char* name, size_t length, int idx) {
+    size_t at = snapBeginSection(snap, SNAP_TABLE);
+    snapWriteName(snap, name, length);
+    snapEncodeTable(L, snap, idx, name, 0);
+    snapEndSection(snap, at);
+}
+
+static int snapDecodeTable(lua_State* L, SnapshotReader* r, int idx, int depth);
+
+/* Pushes one decoded value; tag is the one already read. Returns 0 on
+ * malformed input. Unaligned fields are read with memcpy. */
+static int snapDecodeValue(lua_State* L, SnapshotReader* r, unsigned char tag, int depth) {
+    const void* p;
+    switch (tag) {
+    case SNAP_TAG_FALSE:
+    case SNAP_TAG_TRUE:
+        lua_pushboolean(L, tag == SNAP_TAG_TRUE);
+        return 1;
+    case SNAP_TAG_INTEGER: {
+        lua_Integer value;
+        if (!(p = snapRead(r, sizeof(value)))) return 0;
+        memcpy(&value, p, sizeof(value));
+        lua_pushinteger(L, value);
+        return 1;
+    }
+    case SNAP_TAG_NUMBER: {
+        lua_Number value;
+        if (!(p = snapRead(r, sizeof(value)))) return 0;
+        memcpy(&value, p, sizeof(value));
+        lua_pushnumber(L, value);
+        return 1;
+    }
+    case SNAP_TAG_STRING: {
+        unsigned int n;
+        if (!(p = snapRead(r, sizeof(n)))) return 0;
+        memcpy(&n, p, sizeof(n));
+        if (!(p = snapRead(r, n))) return 0;
+        lua_pushlstring(L, p, n);
+        return 1;
+    }
+    case SNAP_TAG_TABLE:
+        if (depth >= SNAPSHOT_MAX_DEPTH) return 0;
+        lua_newtable(L);
+        return snapDecodeTable(L, r, lua_gettop(L), depth + 1);
+    default:
+        return 0;
+    }
+}
+
+static int snapDecodeTable(lua_State* L, SnapshotReader* r, int idx, int depth) {
+    luaL_checkstack(L, 3, "snapshot table nesting");
+    for (;;) {
+        const unsigned char* tag = snapRead(r, 1);
+        if (!tag) return 0;
+        if (*tag == SNAP_TAG_END) return 1;
+        if (!snapDecodeValue(L, r, *tag, depth)) return 0;
+        
+        const unsigned char* valueTag = snapRead(r, 1);
+        if (!valueTag || !snapDecodeValue(L, r, *valueTag, depth)) return 0;
+        if (lua_type(L, -2) == LUA_TNUMBER && lua_tonumber(L, -2) != lua_tonumber(L, -2)) return 0;
+        lua_rawset(L, idx);
+    }
+}
+
+/* Registered tables are refilled in place, so references to them stay
+ * valid; nested tables are rebuilt and metatables are not saved */
+static int restoreTable(lua_State* L, SnapshotReader* r, int idx) {
+    idx = lua_absindex(L, idx);
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        lua_pushnil(L);
+        lua_rawset(L, idx);
+    }
+    return snapDecodeTable(L, r, idx, 0);
+}
+
+/* --- Capture and restore --- */
+
+static int snapshotInvalid(lua_State* L) {
+    return luaL_error(L, "malformed snapshot");
+}
+
+/* Checks the header and section framing of a whole snapshot */
+static int snapshotValid(const unsigned char* data, size_t size) {
+    SnapshotReader r = { data, data, data + size };
+    const SnapshotHeader* header = snapRead(&r, sizeof(SnapshotHeader));
+    if (!header || header->magic != SNAPSHOT_MAGIC || header->version != SNAPSHOT_VERSION) return 0;
+    
+    for (;;) {
+        const SnapshotSectionHeader* section = snapRead(&r, sizeof(SnapshotSectionHeader));
+        if (!section || (section->size & 7)) return 0;
+        if (section->tag == SNAP_END) return r.p == r.end && section->size == 0;
+        if (section->size > (unsigned long long)(r.end - r.p)) return 0;
+        r.p += section->size;
+    }
+}
+
+/* snapshot.capture([snap]) -> snap -- pass an earlier snapshot to reuse
+ * its buffer, as a rewind or rollback ring would */
+static int lua_snapshotCapture(lua_State* L) {
+    Snapshot* snap = lua_isnoneornil(L, 1) ? NULL : checkSnapshot(L, 1);
+    /* Mid-pass the active list is being compacted in place */
+    if (g_scheduler.ticking) {
+        return luaL_error(L, "cannot capture a snapshot from an animation callback");
+    }
+    if (!snap) {
+        snap = (Snapshot*)lua_newuserdatauv(L, sizeof(Snapshot), SNAPSHOT_UV_COUNT);
+        *snap = (Snapshot){ 0 };
+        luaL_setmetatable(L, SNAPSHOT_METATABLE);
+    } else {
+        lua_settop(L, 1);
+    }
+    int self = lua_gettop(L);
+    snap->size = 0;
+    snap->failed = 0;
+    
+    lua_newtable(L);
+    int values = lua_gettop(L);
+    SnapshotHeader header = { SNAPSHOT_MAGIC, SNAPSHOT_VERSION };
+    snapWrite(snap, &header, sizeof(header));
+    snapshotEntities(L, snap, values);
+    snapshotScheduler(snap);
+    
+    lua_newtable(L);
+    lua_getfield(L, LUA_REGISTRYINDEX, SCHEDULER_CALLBACKS_KEY);
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+        lua_pushvalue(L, -2);
+        lua_insert(L, -2);
+        lua_rawset(L, -5);
+    }
+    lua_pop(L, 1);
+    lua_setiuservalue(L, self, SNAPSHOT_UV_CALLBACKS);
+    lua_setiuservalue(L, self, SNAPSHOT_UV_VALUES);
+    
+    lua_getfield(L, LUA_REGISTRYINDEX, SNAPSHOT_REGISTRY_KEY);
+    lua_Integer n = luaL_len(L, -1);
+    for (lua_Integer i = 1; i <= n; i++) {
+        /* The name stays referenced by the registry list */
+        size_t length;
+        lua_rawgeti(L, -1, i);
+        const char* name = lua_tolstring(L, -1, &length);
+        lua_rawget(L, -2);
+        ParticleEmitter* e = luaL_testudata(L, -1, PARTICLE_METATABLE);
+        if (e) snapshotEmitter(snap, name, length, e);
+        else snapshotTable(L, snap, name, length, -1);
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+    
+    SnapshotSectionHeader end = { SNAP_END, 0, 0 };
+    snapWrite(snap, &end, sizeof(end));
+    if (snap->failed) return luaL_error(L, "out of memory capturing snapshot");
+    lua_settop(L, self);
+    return 1;
+}
+
+/* snapshot.restore(snap) -- rewinds entities, the scheduler and every
+ * registered emitter and table to the captured state. Sections for
+ * names no longer registered are skipped. */
+static int lua_snapshotRestore(lua_State* L) {
+    Snapshot* snap = checkSnapshot(L, 1);
+    if (g_scheduler.ticking) {
+        return luaL_error(L, "cannot restore a snapshot from an animation callback");
+    }
+    lua_settop(L, 1);
+    lua_getiuservalue(L, 1, SNAPSHOT_UV_VALUES);
+    int values = lua_istable(L, 2) ? 2 : 0;
+    lua_getiuservalue(L, 1, SNAPSHOT_UV_CALLBACKS);
+    int callbacks = lua_istable(L, 3) ? 3 : 0;
+    lua_getfield(L, LUA_REGISTRYINDEX, SNAPSHOT_REGISTRY_KEY);
+    int registered = 4;
+    
+    SnapshotReader r = { snap->data, snap->data, snap->data + snap->size };
+    if (!snapshotValid(snap->data, snap->size)) return snapshotInvalid(L);
+    snapRead(&r, sizeof(SnapshotHeader));
+    
+    for (;;) {
+        const SnapshotSectionHeader* section = snapRead(&r, sizeof(SnapshotSectionHeader));
+        if (section->tag == SNAP_END) break;
+        SnapshotReader payload = { r.base, r.p, r.p + section->size };
+        r.p += section->size;
+        
+        int ok = 1;
+        switch (section->tag) {
+        case SNAP_ENTITIES:
+            ok = restoreEntities(L, &payload, values);
+            break;
+        case SNAP_SCHEDULER:
+            ok = restoreScheduler(L, &payload, callbacks);
+            break;
+        case SNAP_EMITTER:
+        case SNAP_TABLE:
+            if (!(ok = snapReadName(L, &payload))) break;
+            lua_rawget(L, registered);
+            if (section->tag == SNAP_EMITTER) {
+                ParticleEmitter* e = luaL_testudata(L, -1, PARTICLE_METATABLE);
+                if (e) ok = restoreEmitter(L, &payload, e);
+            } else if (lua_istable(L, -1)) {
+                ok = restoreTable(L, &payload, -1);
+            }
+            lua_settop(L, registered);
+            break;
+        default:
+            break;
+        }
+        if (!ok) return snapshotInvalid(L);
+    }
+    return 0;
+}
+
+/* snapshot.load(bytes) -> snap -- from snap:bytes(), e.g. a save file.
+ * Restoring it cancels timers and animations, and sprite and text
+ * entities draw nothing until given a sprite or text again. */
+static int lua_snapshotLoad(lua_State* L) {
+    size_t size;
+    const char* bytes = luaL_checklstring(L, 1, &size);
+    if (!snapshotValid((const unsigned char*)bytes, size)) return snapshotInvalid(L);
+    
+    Snapshot* snap = (Snapshot*)lua_newuserdatauv(L, sizeof(Snapshot), SNAPSHOT_UV_COUNT);
+    *snap = (Snapshot){ 0 };
+    luaL_setmetatable(L, SNAPSHOT_METATABLE);
+    snapWrite(snap, bytes, size);
+    if (snap->failed) return luaL_error(L, "out of memory loading snapshot");
+    return 1;
+}
+
+/* snapshot.register(name, value) -- value is a table or a particle
+ * emitter, captured and restored under name */
+static int lua_snapshotRegister(lua_State* L) {
+    luaL_checkstring(L, 1);
+    if (!lua_istable(L, 2) && !luaL_testudata(L, 2, PARTICLE_METATABLE)) {
+        return luaL_typeerror(L, 2, "table or ParticleEmitter");
+    }
+    lua_settop(L, 2);
+    lua_getfield(L, LUA_REGISTRYINDEX, SNAPSHOT_REGISTRY_KEY);
+    lua_pushvalue(L, 1);
+    if (lua_rawget(L, 3) == LUA_TNIL) {
+        lua_pushvalue(L, 1);
+        lua_rawseti(L, 3, luaL_len(L, 3) + 1);
+    }
+    lua_pushvalue(L, 1);
+    lua_pushvalue(L, 2);
+    lua_rawset(L, 3);
+    return 0;
+}
+
+/* snapshot.unregister(name) */
+static int lua_snapshotUnregister(lua_State* L) {
+    luaL_checkstring(L, 1);
+    lua_settop(L, 1);
+    lua_getfield(L, LUA_REGISTRYINDEX, SNAPSHOT_REGISTRY_KEY);
+    lua_pushvalue(L, 1);
+    if (lua_rawget(L, 2) == LUA_TNIL) return 0;
+    
+    lua_Integer n = luaL_len(L, 2), at = 0;
+    for (lua_Integer i = 1; i <= n; i++) {
+        lua_rawgeti(L, 2, i);
+        if (lua_rawequal(L, -1, 1)) at = i;
+        lua_pop(L, 1);
+        if (at && i < n) {
+            lua_rawgeti(L, 2, i + 1);
+            lua_rawseti(L, 2, i);
+        }
+    }
+    lua_pushnil(L);
+    lua_rawseti(L, 2, n);
+    lua_pushvalue(L, 1);
+    lua_pushnil(L);
+    lua_rawset(L, 2);
+    return 0;
+}
+
+/* snap:size() -> bytes */
+static int lua_snapshotSize(lua_State* L) {
+    lua_pushinteger(L, (lua_Integer)checkSnapshot(L, 1)->size);
+    return 1;
+}
+
+/* snap:bytes() -> string, for snapshot.load() */
+static int lua_snapshotBytes(lua_State* L) {
+    Snapshot* snap = checkSnapshot(L, 1);
+    lua_pushlstring(L, (const char*)snap->data, snap->size);
+    return 1;
+}
+
+static int lua_snapshotGC(lua_State* L) {
+    Snapshot* snap = checkSnapshot(L, 1);
+    free(snap->data);
+    snap->data = NULL;
+    snap->size = snap->capacity = 0;
+    return 0;
+}
+
+void registerSnapshotModule(lua_State* L) {
+    static const luaL_Reg methods[] = {
+        {"size", lua_snapshotSize},
+        {"bytes", lua_snapshotBytes},
+        {NULL, NULL}
+    };
+    static const luaL_Reg functions[] = {
+        {"capture", lua_snapshotCapture},
+        {"restore", lua_snapshotRestore},
+        {"load", lua_snapshotLoad},
+        {"register", lua_snapshotRegister},
+        {"unregister", lua_snapshotUnregister},
+        {NULL, NULL}
+    };
+    
+    luaL_newmetatable(L, SNAPSHOT_METATABLE);
+    luaL_newlib(L, methods);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, lua_snapshotGC);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+    
+    lua_newtable(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, SNAPSHOT_REGISTRY_KEY);
+    luaL_newlib(L, functions);
+    lua_setglobal(L, "snapshot");
+}
+
+/* ============================================================ */
+/* NETWORK REPLICATION */
+/* ============================================================ */
+
+/* Server-authoritative entity replication over UDP. Each flush() the
+ * server quantizes every entity once, then sends each client a single
+ * datagram: the messages queued for it this tick, then the entities
+ * that differ from the last state that client acknowledged as varint
+ * field deltas. Entities that don't fit the per-packet byte budget wait
+ * for a later tick, picking up round-robin where the previous packet
+ * stopped, so bandwidth stays bounded however many entities there are.
+ * Both ends keep the last NET_HISTORY states as baselines, so a lost
+ * packet only means a delta against an older one. The client mirrors
+ * the server's entities into its own store. Messages are unreliable. */
+
+#ifdef ENGINE_NET
+
+#define NET_METATABLE "NetHost"
+#define NET_PROTOCOL 0x314E4545u        /* "EEN1" */
+#define NET_MAX_PACKET 1400             /* stays under common path MTUs */
+#define NET_MAX_MESSAGE (NET_MAX_PACKET - 16)
+#define NET_DEFAULT_BUDGET 1200
+#define NET_MIN_BUDGET 256
+#define NET_HISTORY 16                  /* baselines per peer, a power of two */
+#define NET_DEFAULT_PEERS 8
+#define NET_MAX_PEERS 64
+#define NET_MAX_SLOT (1u << 24)         /* sanity bound on received slots */
+#define NET_TIMEOUT 5.0                 /* seconds of silence before a peer is dropped */
+#define NET_CONNECT_RETRY 0.25
+#define NET_POSITION_STEPS 16.0f        /* 1/16 px */
+#define NET_SCALE_STEPS 1024.0f
+#define NET_DEPTH_STEPS 256.0f
+#define NET_ROTATION_STEPS 65536.0f     /* per turn */
+
+typedef enum {
+    NET_PACKET_CONNECT = 1,    /* client: protocol */
+    NET_PACKET_ACCEPT,         /* server: protocol, peer id */
+    NET_PACKET_REJECT,         /* server: full */
+    NET_PACKET_STATE,          /* server: seq, baseline, messages, entity deltas */
+    NET_PACKET_CLIENT,         /* client: newest seq applied, messages */
+    NET_PACKET_DISCONNECT,
+} NetPacket;
+
+/* The quantized entity fields, one bit each in a delta's field mask */
+typedef enum {
+    NET_X,
+    NET_Y,
+    NET_WIDTH,
+    NET_HEIGHT,
+    NET_ROTATION,
+    NET_SCALE_X,
+    NET_SCALE_Y,
+    NET_VX,
+    NET_VY,
+    NET_COLOR,       /* r, g, b, a as bytes */
+    NET_LAYER,
+    NET_DEPTH,
+    NET_FLAGS,       /* visible and active flags, shape << 8 */
+    NET_PARENT,      /* parent slot + 1, 0 for a root */
+    NET_FIELD_COUNT
+} NetField;
+
+#define NET_MASK_NEW     (1u << NET_FIELD_COUNT)        /* generation follows; deltas from zero */
+#define NET_MASK_REMOVED (1u << (NET_FIELD_COUNT + 1))
+
+/* Entity store field behind each quantized field, and its steps per unit */
+static const int g_netEntityField[NET_FIELD_COUNT] = {
+    ENTITY_X, ENTITY_Y, ENTITY_WIDTH, ENTITY_HEIGHT, ENTITY_ROTATION,
+    ENTITY_SCALE_X, ENTITY_SCALE_Y, ENTITY_VX, ENTITY_VY,
+    -1, ENTITY_LAYER, ENTITY_DEPTH, -1, -1,
+};
+static const float g_netFieldSteps[NET_FIELD_COUNT] = {
+    NET_POSITION_STEPS, NET_POSITION_STEPS, NET_POSITION_STEPS, NET_POSITION_STEPS, 0.0f,
+    NET_SCALE_STEPS, NET_SCALE_STEPS, NET_POSITION_STEPS, NET_POSITION_STEPS,
+    0.0f, 1.0f, NET_DEPTH_STEPS, 0.0f, 0.0f,
+};
+
+typedef struct {
+    unsigned int slot;
+    unsigned int generation;
+    int value[NET_FIELD_COUNT];
+} NetEntityState;
+
+/* A whole replicated state, sorted by slot */
+typedef struct {
+    unsigned int seq;          /* 0 when unused */
+    int count;
+    int capacity;
+    NetEntityState* states;
+} NetFrame;
+
+/* A slot that differs between a baseline and the current state;
+ * indices into each, -1 where absent */
+typedef struct {
+    unsigned int slot;
+    int now;
+    int base;
+    int written;
+} NetChange;
+
+/* A decoded delta (client) */
+typedef struct {
+    NetEntityState state;
+    unsigned int mask;
+} NetRecord;
+
+/* Client-side entity standing in for a server slot */
+typedef struct {
+    lua_Integer entity;        /* 0 for none */
+    unsigned int generation;
+} NetMirror;
+
+typedef struct {
+    struct sockaddr_in addr;
+    int connected;
+    double lastHeard;
+    unsigned int ack;               /* newest state the peer has, 0 for none */
+    unsigned int cursor;            /* slot the next packet's deltas start from */
+    NetFrame frames[NET_HISTORY];   /* states sent (server) or applied (client), by seq */
+    Snapshot outbox;                /* queued messages: varint length, bytes */
+    int outboxCount;
+} NetPeer;
+
+typedef struct {
+    int socket;
+    int server;
+    NetPeer* peers;                 /* server: one per client slot; client: the server */
+    int maxPeers;
+    unsigned int seq;               /* server: last state sent */
+    int budget;
+    NetFrame world;                 /* server: this tick's state; client: the decoded one */
+    NetChange* changes;
+    int changeCapacity;
+    NetRecord* records;
+    int recordCapacity;
+    NetMirror* mirror;              /* client: by server slot */
+    unsigned int mirrorCapacity;
+    int unlinked;                   /* client: parents may need relinking */
+    double nextConnect;
+    Snapshot packet;                /* datagram being built */
+    unsigned long long bytesSent;
+    unsigned long long bytesReceived;
+    unsigned int packetsSent;
+    unsigned int packetsReceived;
+    unsigned int dropped;           /* messages that didn't fit a packet */
+    int lastPacket;                 /* bytes in the last datagram sent */
+} NetHost;
+
+static const NetFrame g_netEmptyFrame = { 0 };
+
+static NetHost* checkNet(lua_State* L, int idx) {
+    NetHost* host = (NetHost*)luaL_checkudata(L, idx, NET_METATABLE);
+    if (host->socket < 0) luaL_error(L, "net host is closed");
+    return host;
+}
+
+static inline int netNewer(unsigned int a, unsigned int b) {
+    return (int)(a - b) > 0;
+}
+
+/* --- Wire encoding: little-endian integers and LEB128 varints --- */
+
+static void netPutByte(Snapshot* b, unsigned int v) {
+    unsigned char byte = (unsigned char)v;
+    snapWrite(b, &byte, 1);
+}
+
+static void netPutU32(Snapshot* b, unsigned int v) {
+    unsigned char bytes[4] = {
+        (unsigned char)v, (unsigned char)(v >> 8), (unsigned char)(v >> 16), (unsigned char)(v >> 24)
+    };
+    snapWrite(b, bytes, 4);
+}
+
+static void netPutVarint(Snapshot* b, unsigned int v) {
+    unsigned char bytes[5];
+    int n = 0;
+    while (v >= 0x80) {
+        bytes[n++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    bytes[n++] = (unsigned char)v;
+    snapWrite(b, bytes, n);
+}
+
+static inline unsigned int netZigzag(int v) {
+    return ((unsigned int)v << 1) ^ (v < 0 ? 0xFFFFFFFFu : 0u);
+}
+
+static inline int netUnzigzag(unsigned int v) {
+    return (int)((v >> 1) ^ (0u - (v & 1)));
+}
+
+static int netGetByte(SnapshotReader* r, unsigned int* v) {
+    const unsigned char* p = snapRead(r, 1);
+    if (!p) return 0;
+    *v = *p;
+    return 1;
+}
+
+static int netGetU32(SnapshotReader* r, unsigned int* v) {
+    const unsigned char* p = snapRead(r, 4);
+    if (!p) return 0;
+    *v = (unsigned int)p[0] | (unsigned int)p[1] << 8 | (unsigned int)p[2] << 16 | (unsigned int)p[3] << 24;
+    return 1;
+}
+
+static int netGetVarint(SnapshotReader* r, unsigned int* v) {
+    *v = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        const unsigned char* p = snapRead(r, 1);
+        if (!p) return 0;
+        *v |= (unsigned int)(*p & 0x7F) << shift;
+        if (!(*p & 0x80)) return 1;
+    }
+    return 0;
+}
+
+/* --- Quantization --- */
+
+static int netQuantize(int f, float v) {
+    if (f == NET_ROTATION) {
+        double turns = v / 6.283185307179586;
+        return (int)((turns - floor(turns)) * NET_ROTATION_STEPS) & 0xFFFF;
+    }
+    double q = floor((double)v * g_netFieldSteps[f] + 0.5);
+    if (q > 2147483647.0) q = 2147483647.0;
+    if (q < -2147483647.0) q = -2147483647.0;
+    return (int)q;
+}
+
+static float netDequantize(int f, int q) {
+    if (f == NET_ROTATION) return (float)(q * (6.283185307179586 / NET_ROTATION_STEPS));
+    return (float)q / g_netFieldSteps[f];
+}
+
+static unsigned int netColorByte(float c) {
+    if (c <= 0.0f) return 0;
+    if (c >= 1.0f) return 255;
+    return (unsigned int)(c * 255.0f + 0.5f);
+}
+
+static int netFrameReserve(NetFrame* frame, int count) {
+    if (count <= frame->capacity) return 1;
+    int capacity = frame->capacity ? frame->capacity : ENTITY_INITIAL_CAPACITY;
+    while (capacity < count) capacity *= 2;
+    NetEntityState* states = realloc(frame->states, capacity * sizeof(NetEntityState));
+    if (!states) return 0;
+    frame->states = states;
+    frame->capacity = capacity;
+    return 1;
+}
+
+static int netFrameCopy(NetFrame* dst, const NetFrame* src, unsigned int seq) {
+    if (!netFrameReserve(dst, src->count)) return 0;
+    memcpy(dst->states, src->states, src->count * sizeof(NetEntityState));
+    dst->count = src->count;
+    dst->seq = seq;
+    return 1;
+}
+
+static int netFrameFind(const NetFrame* frame, unsigned int slot) {
+    int lo = 0, hi = frame->count - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        unsigned int s = frame->states[mid].slot;
+        if (s == slot) return mid;
+        if (s < slot) lo = mid + 1;
+        else hi = mid - 1;
+    }
+    return -1;
+}
+
+/* The peer's state at seq if it is still kept, else NULL */
+static const NetFrame* netBaseline(const NetPeer* peer, unsigned int seq, unsigned int now) {
+    if (seq == 0 || now - seq >= NET_HISTORY) return NULL;
+    const NetFrame* frame = &peer->frames[seq & (NET_HISTORY - 1)];
+    return frame->seq == seq ? frame : NULL;
+}
+
+static void netFreePeer(NetPeer* peer) {
+    for (int i = 0; i < NET_HISTORY; i++) {
+        free(peer->frames[i].states);
+    }
+    free(peer->outbox.data);
+    memset(peer, 0, sizeof(NetPeer));
+}
+
+static void netResetPeer(NetPeer* peer) {
+    for (int i = 0; i < NET_HISTORY; i++) {
+        peer->frames[i].seq = 0;
+    }
+    peer->connected = 0;
+    peer->ack = 0;
+    peer->cursor = 0;
+    peer->outbox.size = 0;
+    peer->outboxCount = 0;
+}
+
+/* --- Sockets --- */
+
+static int netOpenSocket(int port) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) return -1;
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (port > 0) {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons((unsigned short)port);
+        if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+/* Full sockets are treated as packet loss */
+static void netSend(NetHost* host, const struct sockaddr_in* addr, const void* data, size_t size) {
+    if (sendto(host->socket, data, size, 0, (const struct sockaddr*)addr, sizeof(*addr)) < 0) return;
+    host->bytesSent += size;
+    host->packetsSent++;
+    host->lastPacket = (int)size;
+}
+
+static void netSendControl(NetHost* host, const struct sockaddr_in* addr, NetPacket type, int peerId) {
+    Snapshot* b = &host->packet;
+    b->size = 0;
+    b->failed = 0;
+    netPutByte(b, type);
+    if (type == NET_PACKET_CONNECT || type == NET_PACKET_ACCEPT) netPutU32(b, NET_PROTOCOL);
+    if (type == NET_PACKET_ACCEPT) netPutVarint(b, (unsigned int)peerId);
+    if (!b->failed) netSend(host, addr, b->data, b->size);
+}
+
+static int netSameAddress(const struct sockaddr_in* a, const struct sockaddr_in* b) {
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+/* --- Events --- */
+
+/* Appends an event table to out (reusing one left there) at the stack
+ * top; the caller fills in the rest and pops it */
+static int netEvent(lua_State* L, int out, int* count, const char* type, int peer) {
+    if (lua_rawgeti(L, out, ++*count) != LUA_TTABLE) {
+        lua_pop(L, 1);
+        lua_createtable(L, 0, 5);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, out, *count);
+    }
+    int event = lua_gettop(L);
+    lua_pushstring(L, type);
+    lua_setfield(L, event, "type");
+    if (peer) lua_pushinteger(L, peer);
+    else lua_pushnil(L);
+    lua_setfield(L, event, "peer");
+    lua_pushnil(L);
+    lua_setfield(L, event, "data");
+    lua_pushnil(L);
+    lua_setfield(L, event, "entity");
+    lua_pushnil(L);
+    lua_setfield(L, event, "id");
+    return event;
+}
+
+/* Queued messages, as many as fit in order; the rest are dropped */
+static void netWriteMessages(NetHost* host, NetPeer* peer, Snapshot* b) {
+    SnapshotReader r = { peer->outbox.data, peer->outbox.data, peer->outbox.data + peer->outbox.size };
+    int fit = 0;
+    size_t span = 0;
+    for (int i = 0; i < peer->outboxCount; i++) {
+        unsigned int length;
+        netGetVarint(&r, &length);
+        r.p += length;
+        size_t end = (size_t)(r.p - r.base);
+        if (b->size + 2 + end > NET_MAX_PACKET) break;
+        fit++;
+        span = end;
+    }
+    host->dropped += (unsigned int)(peer->outboxCount - fit);
+    
+    netPutVarint(b, (unsigned int)fit);
+    snapWrite(b, peer->outbox.data, span);
+    peer->outbox.size = 0;
+    peer->outboxCount = 0;
+}
+
+static int netReadMessages(lua_State* L, SnapshotReader* r, int out, int* count, int peer) {
+    unsigned int n;
+    if (!netGetVarint(r, &n)) return 0;
+    for (unsigned int i = 0; i < n; i++) {
+        unsigned int length;
+        const char* data;
+        if (!netGetVarint(r, &length) || !(data = snapRead(r, length))) return 0;
+        int event = netEvent(L, out, count, "message", peer);
+        lua_pushlstring(L, data, length);
+        lua_setfield(L, event, "data");
+        lua_pop(L, 1);
+    }
+    return 1;
+}
+
+/* --- Server --- */
+
+/* Quantizes every live entity, in slot order */
+static int netCaptureWorld(NetHost* host) {
+    const EntityStore* es = &g_entities;
+    NetFrame* frame = &host->world;
+    if (!netFrameReserve(frame, es->count)) return 0;
+    
+    int n = 0;
+    for (unsigned int slot = 0; slot < es->slotCount; slot++) {
+        unsigned int i = es->slotDense[slot];
+        if (i >= (unsigned int)es->count || es->denseSlot[i] != slot) continue;
+        
+        NetEntityState* s = &frame->states[n++];
+        s->slot = slot;
+        s->generation = es->slotGeneration[slot];
+        for (int f = 0; f < NET_FIELD_COUNT; f++) {
+            if (g_netEntityField[f] >= 0) s->value[f] = netQuantize(f, es->field[g_netEntityField[f]][i]);
+        }
+        s->value[NET_COLOR] = (int)(netColorByte(es->field[ENTITY_R][i]) |
+                                    netColorByte(es->field[ENTITY_G][i]) << 8 |
+                                    netColorByte(es->field[ENTITY_B][i]) << 16 |
+                                    netColorByte(es->field[ENTITY_A][i]) << 24);
+        s->value[NET_FLAGS] = (es->flags[i] & ENTITY_SHOWN) | es->shape[i] << 8;
+        s->value[NET_PARENT] = es->parent[i] == ENTITY_NO_SLOT ? 0 : (int)es->parent[i] + 1;
+    }
+    frame->count = n;
+    return 1;
+}
+
+/* Slots that differ between base and now, in slot order */
+static int netDiff(NetHost* host, const NetFrame* base, const NetFrame* now) {
+    int need = base->count + now->count;
+    if (need > host->changeCapacity) {
+        NetChange* changes = realloc(host->changes, need * sizeof(NetChange));
+        if (!changes) return -1;
+        host->changes = changes;
+        host->changeCapacity = need;
+    }
+    
+    int n = 0, i = 0, j = 0;
+    while (i < base->count || j < now->count) {
+        const NetEntityState* b = i < base->count ? &base->states[i] : NULL;
+        const NetEntityState* c = j < now->count ? &now->states[j] : NULL;
+        NetChange* change = &host->changes[n];
+        if (b && (!c || b->slot < c->slot)) {
+            *change = (NetChange){ b->slot, -1, i++, 0 };
+            n++;
+        } else if (c && (!b || c->slot < b->slot)) {
+            *change = (NetChange){ c->slot, j++, -1, 0 };
+            n++;
+        } else {
+            if (b->generation != c->generation || memcmp(b->value, c->value, sizeof(b->value)) != 0) {
+                *change = (NetChange){ c->slot, j, i, 0 };
+                n++;
+            }
+            i++;
+            j++;
+        }
+    }
+    return n;
+}
+
+static void netWriteChange(Snapshot* b, const NetChange* change, const NetFrame* base, const NetFrame* now,
+                           unsigned int prevSlot) {
+    static const int zero[NET_FIELD_COUNT];
+    netPutVarint(b, netZigzag((int)(change->slot - prevSlot)));
+    if (change->now < 0) {
+        netPutVarint(b, NET_MASK_REMOVED);
+        return;
+    }
+    
+    const NetEntityState* s = &now->states[change->now];
+    const NetEntityState* ref = change->base >= 0 ? &base->states[change->base] : NULL;
+    int isNew = !ref || ref->generation != s->generation;
+    const int* from = isNew ? zero : ref->value;
+    
+    unsigned int mask = isNew ? NET_MASK_NEW : 0;
+    for (int f = 0; f < NET_FIELD_COUNT; f++) {
+        if (s->value[f] != from[f]) mask |= 1u << f;
+    }
+    netPutVarint(b, mask);
+    if (isNew) netPutVarint(b, s->generation);
+    for (int f = 0; f < NET_FIELD_COUNT; f++) {
+        if (mask & (1u << f)) netPutVarint(b, netZigzag((int)((unsigned int)s->value[f] - (unsigned int)from[f])));
+    }
+}
+
+/* What the peer will hold once it applies this packet: the baseline
+ * with the written changes taken from now */
+static int netMergeSent(NetFrame* out, const NetFrame* base, const NetFrame* now,
+                        const NetChange* changes, int n) {
+    if (!netFrameReserve(out, base->count + now->count)) return 0;
+    int count = 0, i = 0, j = 0, k = 0;
+    while (i < base->count || j < now->count) {
+        const NetEntityState* b = i < base->count ? &base->states[i] : NULL;
+        const NetEntityState* c = j < now->count ? &now->states[j] : NULL;
+        unsigned int slot = !b ? c->slot : !c ? b->slot : (b->slot < c->slot ? b->slot : c->slot);
+        if (b && b->slot != slot) b = NULL;
+        if (c && c->slot != slot) c = NULL;
+        
+        /* Slots without a change are equal in both */
+        int written = 1;
+        if (k < n && changes[k].slot == slot) written = changes[k++].written;
+        const NetEntityState* pick = written ? c : b;
+        if (pick) out->states[count++] = *pick;
+        if (b) i++;
+        if (c) j++;
+    }
+    out->count = count;
+    return 1;
+}
+
+static void netSendState(NetHost* host, NetPeer* peer) {
+    const NetFrame* base = netBaseline(peer, peer->ack, host->seq);
+    const NetFrame* now = &host->world;
+    if (!base) base = &g_netEmptyFrame;
+    
+    Snapshot* b = &host->packet;
+    b->size = 0;
+    b->failed = 0;
+    netPutByte(b, NET_PACKET_STATE);
+    netPutU32(b, host->seq);
+    netPutU32(b, base->seq);
+    netWriteMessages(host, peer, b);
+    
+    int n = netDiff(host, base, now);
+    size_t countAt = b->size;
+    netPutByte(b, 0);
+    netPutByte(b, 0);
+    if (n < 0 || b->failed) return;
+    
+    /* Round-robin from the cursor until the budget runs out */
+    int start = 0;
+    while (start < n && host->changes[start].slot < peer->cursor) start++;
+    if (start == n) start = 0;
+    int written = 0;
+    unsigned int prevSlot = 0;
+    peer->cursor = 0;
+    for (int k = 0; k < n; k++) {
+        NetChange* change = &host->changes[(start + k) % n];
+        size_t mark = b->size;
+        netWriteChange(b, change, base, now, prevSlot);
+        if (b->failed || b->size > (size_t)host->budget || written == 0xFFFF) {
+            b->size = mark;
+            b->failed = 0;
+            peer->cursor = change->slot;
+            break;
+        }
+        change->written = 1;
+        prevSlot = change->slot;
+        written++;
+    }
+    b->data[countAt] = (unsigned char)written;
+    b->data[countAt + 1] = (unsigned char)(written >> 8);
+    
+    NetFrame* sent = &peer->frames[host->seq & (NET_HISTORY - 1)];
+    if (!netMergeSent(sent, base, now, host->changes, n)) {
+        sent->seq = 0;
+        return;
+    }
+    sent->seq = host->seq;
+    netSend(host, &peer->addr, b->data, b->size);
+}
+
+static void netDisconnectPeer(lua_State* L, NetHost* host, int p, int out, int* count) {
+    netResetPeer(&host->peers[p]);
+    netEvent(L, out, count, "disconnect", p + 1);
+    lua_pop(L, 1);
+}
+
+static void netServerPacket(lua_State* L, NetHost* host, SnapshotReader* r, const struct sockaddr_in* from,
+                            double now, int out, int* count) {
+    int p = -1;
+    for (int i = 0; i < host->maxPeers; i++) {
+        if (host->peers[i].connected && netSameAddress(&host->peers[i].addr, from)) {
+            p = i;
+            break;
+        }
+    }
+    
+    unsigned int type, value;
+    if (!netGetByte(r, &type)) return;
+    if (type == NET_PACKET_CONNECT) {
+        if (!netGetU32(r, &value) || value != NET_PROTOCOL) return;
+        if (p < 0) {
+            for (int i = 0; i < host->maxPeers && p < 0; i++) {
+                if (!host->peers[i].connected) p = i;
+            }
+            if (p < 0) {
+                netSendControl(host, from, NET_PACKET_REJECT, 0);
+                return;
+            }
+            NetPeer* peer = &host->peers[p];
+            netResetPeer(peer);
+            peer->addr = *from;
+            peer->connected = 1;
+            netEvent(L, out, count, "connect", p + 1);
+            lua_pop(L, 1);
+        }
+        host->peers[p].lastHeard = now;
+        netSendControl(host, from, NET_PACKET_ACCEPT, p + 1);
+        return;
+    }
+    if (p < 0) return;
+    NetPeer* peer = &host->peers[p];
+    peer->lastHeard = now;
+    
+    if (type == NET_PACKET_DISCONNECT) {
+        netDisconnectPeer(L, host, p, out, count);
+    } else if (type == NET_PACKET_CLIENT) {
+        if (!netGetU32(r, &value)) return;
+        if (netBaseline(peer, value, host->seq) && (!peer->ack || netNewer(value, peer->ack))) peer->ack = value;
+        netReadMessages(L, r, out, count, p + 1);
+    }
+}
+
+/* --- Client --- */
+
+static int netMirrorReserve(NetHost* host, unsigned int slot) {
+    if (slot < host->mirrorCapacity) return 1;
+    unsigned int capacity = host->mirrorCapacity ? host->mirrorCapacity : ENTITY_INITIAL_CAPACITY;
+    while (capacity <= slot) capacity *= 2;
+    NetMirror* mirror = realloc(host->mirror, capacity * sizeof(NetMirror));
+    if (!mirror) return 0;
+    memset(mirror + host->mirrorCapacity, 0, (capacity - host->mirrorCapacity) * sizeof(NetMirror));
+    host->mirror = mirror;
+    host->mirrorCapacity = capacity;
+    return 1;
+}
+
+static int compareNetRecords(const void* a, const void* b) {
+    unsigned int x = ((const NetRecord*)a)->state.slot;
+    unsigned int y = ((const NetRecord*)b)->state.slot;
+    return (x > y) - (x < y);
+}
+
+/* Decodes a packet's deltas against base into host->world */
+static int netDecodeState(NetHost* host, SnapshotReader* r, const NetFrame* base) {
+    unsigned int lo, hi;
+    if (!netGetByte(r, &lo) || !netGetByte(r, &hi)) return 0;
+    int n = (int)(lo | hi << 8);
+    if (n > host->recordCapacity) {
+        NetRecord* records = realloc(host->records, n * sizeof(NetRecord));
+        if (!records) return 0;
+        host->records = records;
+        host->recordCapacity = n;
+    }
+    
+    unsigned int slot = 0;
+    for (int k = 0; k < n; k++) {
+        NetRecord* record = &host->records[k];
+        unsigned int delta, mask;
+        if (!netGetVarint(r, &delta) || !netGetVarint(r, &mask)) return 0;
+        slot += (unsigned int)netUnzigzag(delta);
+        if (slot >= NET_MAX_SLOT) return 0;
+        record->mask = mask;
+        record->state.slot = slot;
+        if (mask & NET_MASK_REMOVED) continue;
+        
+        if (mask & NET_MASK_NEW) {
+            if (!netGetVarint(r, &record->state.generation)) return 0;
+            memset(record->state.value, 0, sizeof(record->state.value));
+        } else {
+            int b = netFrameFind(base, slot);
+            if (b < 0) return 0;
+            record->state = base->states[b];
+        }
+        for (int f = 0; f < NET_FIELD_COUNT; f++) {
+            if (!(mask & (1u << f))) continue;
+            if (!netGetVarint(r, &delta)) return 0;
+            record->state.value[f] = (int)((unsigned int)record->state.value[f] + (unsigned int)netUnzigzag(delta));
+        }
+    }
+    qsort(host->records, n, sizeof(NetRecord), compareNetRecords);
+    
+    NetFrame* frame = &host->world;
+    if (!netFrameReserve(frame, base->count + n)) return 0;
+    int count = 0, i = 0, k = 0;
+    while (i < base->count || k < n) {
+        const NetEntityState* b = i < base->count ? &base->states[i] : NULL;
+        const NetRecord* record = k < n ? &host->records[k] : NULL;
+        if (record && k + 1 < n && record[1].state.slot == record->state.slot) return 0;
+        if (b && (!record || b->slot < record->state.slot)) {
+            frame->states[count++] = *b;
+            i++;
+            continue;
+        }
+        if (b && b->slot == record->state.slot) i++;
+        if (!(record->mask & NET_MASK_REMOVED)) frame->states[count++] = record->state;
+        k++;
+    }
+    frame->count = count;
+    return 1;
+}
+
+static void netApplyFields(lua_State* L, EntityStore* es, int i, const NetEntityState* s, const NetEntityState* prev) {
+    for (int f = 0; f < NET_FIELD_COUNT; f++) {
+        if (prev && prev->value[f] == s->value[f]) continue;
+        int v = s->value[f];
+        if (g_netEntityField[f] >= 0) {
+            entitySetField(es, i, g_netEntityField[f], netDequantize(f, v));
+        } else if (f == NET_COLOR) {
+            unsigned int rgba = (unsigned int)v;
+            es->field[ENTITY_R][i] = (float)(rgba & 0xFF) / 255.0f;
+            es->field[ENTITY_G][i] = (float)((rgba >> 8) & 0xFF) / 255.0f;
+            es->field[ENTITY_B][i] = (float)((rgba >> 16) & 0xFF) / 255.0f;
+            es->field[ENTITY_A][i] = (float)(rgba >> 24) / 255.0f;
+        } else if (f == NET_FLAGS) {
+            /* Sprites and labels get their visual from client code */
+            unsigned int shape = (unsigned int)v >> 8;
+            es->flags[i] = (unsigned char)((es->flags[i] & ~ENTITY_SHOWN) | (v & ENTITY_SHOWN));
+            if (shape <= SHAPE_CIRCLE) {
+                if (es->shape[i] == SHAPE_SPRITE || es->shape[i] == SHAPE_TEXT) entityReleaseVisual(L, &es->visual[i]);
+                es->shape[i] = (unsigned char)shape;
+            }
+        }
+    }
+}
+
+static void netDespawn(lua_State* L, NetHost* host, unsigned int slot, int out, int* count) {
+    NetMirror* mirror = &host->mirror[slot];
+    int i = entityResolve(&g_entities, mirror->entity);
+    int event = netEvent(L, out, count, "despawn", 0);
+    lua_pushinteger(L, entityHandle(slot, mirror->generation));
+    lua_setfield(L, event, "id");
+    if (i >= 0) {
+        lua_pushinteger(L, mirror->entity);
+        lua_setfield(L, event, "entity");
+        entityReleaseVisual(L, &g_entities.visual[i]);
+        entityDestroy(&g_entities, i);
+    }
+    lua_pop(L, 1);
+    mirror->entity = 0;
+    host->unlinked = 1;
+}
+
+/* A mirrored entity left from before a reconnect is reused */
+static int netSpawn(lua_State* L, NetHost* host, const NetEntityState* s, int out, int* count) {
+    EntityStore* es = &g_entities;
+    NetMirror* mirror = &host->mirror[s->slot];
+    int i = entityResolve(es, mirror->entity);
+    if (i >= 0 && mirror->generation == s->generation) {
+        netApplyFields(L, es, i, s, NULL);
+        host->unlinked = 1;
+        return 1;
+    }
+    if (i >= 0) netDespawn(L, host, s->slot, out, count);
+    
+    lua_Integer handle;
+    if ((i = entityCreate(es, SHAPE_NONE, &handle)) < 0) return 0;
+    mirror->entity = handle;
+    mirror->generation = s->generation;
+    netApplyFields(L, es, i, s, NULL);
+    if (s->value[NET_PARENT]) host->unlinked = 1;
+    
+    int event = netEvent(L, out, count, "spawn", 0);
+    lua_pushinteger(L, handle);
+    lua_setfield(L, event, "entity");
+    lua_pushinteger(L, entityHandle(s->slot, s->generation));
+    lua_setfield(L, event, "id");
+    lua_pop(L, 1);
+    return 1;
+}
+
+/* Parents may arrive after their children; unresolved links are retried
+ * after each later packet */
+static void netRelink(NetHost* host, const NetFrame* frame) {
+    EntityStore* es = &g_entities;
+    host->unlinked = 0;
+    for (int k = 0; k < frame->count; k++) {
+        const NetEntityState* s = &frame->states[k];
+        int i = entityResolve(es, host->mirror[s->slot].entity);
+        if (i < 0) continue;
+        
+        unsigned int want = (unsigned int)s->value[NET_PARENT];
+        int p = -1;
+        if (want) {
+            if (want - 1 < host->mirrorCapacity) p = entityResolve(es, host->mirror[want - 1].entity);
+            if (p < 0 || p == i || entityIsAncestor(es, i, p)) {
+                host->unlinked = 1;
+                continue;
+            }
+        }
+        unsigned int have = es->parent[i];
+        if (p < 0 ? have == ENTITY_NO_SLOT : have == es->denseSlot[p]) continue;
+        entityUnlink(es, i);
+        if (p >= 0) entityLink(es, i, p);
+    }
+}
+
+/* Brings the local entities from the peer's current state to the
+ * decoded one */
+static int netApply(lua_State* L, NetHost* host, const NetFrame* from, const NetFrame* to, int out, int* count) {
+    EntityStore* es = &g_entities;
+    int i = 0, j = 0;
+    while (i < from->count || j < to->count) {
+        const NetEntityState* a = i < from->count ? &from->states[i] : NULL;
+        const NetEntityState* b = j < to->count ? &to->states[j] : NULL;
+        if (a && (!b || a->slot < b->slot)) {
+            netDespawn(L, host, a->slot, out, count);
+            i++;
+            continue;
+        }
+        if (!netMirrorReserve(host, b->slot)) return 0;
+        if (!a || b->slot < a->slot || a->generation != b->generation) {
+            if (!netSpawn(L, host, b, out, count)) return 0;
+        } else {
+            int e = entityResolve(es, host->mirror[b->slot].entity);
+            if (e >= 0) netApplyFields(L, es, e, b, a);
+            if (a->value[NET_PARENT] != b->value[NET_PARENT]) host->unlinked = 1;
+        }
+        if (a && a->slot == b->slot) i++;
+        j++;
+    }
+    if (host->unlinked) netRelink(host, to);
+    return 1;
+}
+
+static void netClientState(lua_State* L, NetHost* host, SnapshotReader* r, int out, int* count) {
+    NetPeer* peer = &host->peers[0];
+    unsigned int seq, baseline;
+    if (!netGetU32(r, &seq) || !netGetU32(r, &baseline)) return;
+    if (!netReadMessages(L, r, out, count, 1)) return;
+    
+    /* Late packets are older than what is on screen */
+    if (seq == 0 || (peer->ack && !netNewer(seq, peer->ack))) return;
+    const NetFrame* base = &g_netEmptyFrame;
+    if (baseline && !(base = netBaseline(peer, baseline, seq))) return;
+    if (!netDecodeState(host, r, base)) return;
+    
+    const NetFrame* current = netBaseline(peer, peer->ack, peer->ack);
+    if (!netApply(L, host, current ? current : &g_netEmptyFrame, &host->world, out, count)) {
+        luaL_error(L, "out of memory applying replicated state");
+    }
+    if (!netFrameCopy(&peer->frames[seq & (NET_HISTORY - 1)], &host->world, seq)) {
+        luaL_error(L, "out of memory applying replicated state");
+    }
+    peer->ack = seq;
+}
+
+static void netClientPacket(lua_State* L, NetHost* host, SnapshotReader* r, const struct sockaddr_in* from,
+                            double now, int out, int* count) {
+    NetPeer* peer = &host->peers[0];
+    unsigned int type, value;
+    if (!netSameAddress(&peer->addr, from) || !netGetByte(r, &type)) return;
+    peer->lastHeard = now;
+    
+    /* A state packet also means the accept was lost */
+    if ((type == NET_PACKET_ACCEPT || type == NET_PACKET_STATE) && !peer->connected) {
+        if (type == NET_PACKET_ACCEPT && (!netGetU32(r, &value) || value != NET_PROTOCOL)) return;
+        peer->connected = 1;
+        netEvent(L, out, count, "connect", 1);
+        lua_pop(L, 1);
+    }
+    if (type == NET_PACKET_STATE) {
+        netClientState(L, host, r, out, count);
+    } else if (type == NET_PACKET_REJECT) {
+        /* Full: try again later rather than every retry interval */
+        host->nextConnect = now + NET_TIMEOUT;
+        netDisconnectPeer(L, host, 0, out, count);
+    } else if (type == NET_PACKET_DISCONNECT && peer->connected) {
+        netDisconnectPeer(L, host, 0, out, count);
+    }
+}
+
+static void netClose(NetHost* host) {
+    if (host->socket < 0) return;
+    for (int p = 0; p < host->maxPeers; p++) {
+        if (host->peers[p].connected) netSendControl(host, &host->peers[p].addr, NET_PACKET_DISCONNECT, 0);
+    }
+    close(host->socket);
+    host->socket = -1;
+}
+
+/* --- Lua API --- */
+
+static NetHost* netNewHost(lua_State* L, int server, int maxPeers) {
+    NetHost* host = (NetHost*)lua_newuserdatauv(L, sizeof(NetHost), 0);
+    memset(host, 0, sizeof(NetHost));
+    host->socket = -1;
+    luaL_setmetatable(L, NET_METATABLE);
+    host->server = server;
+    host->budget = NET_DEFAULT_BUDGET;
+    host->peers = calloc(maxPeers, sizeof(NetPeer));
+    if (!host->peers) luaL_error(L, "out of memory creating net host");
+    host->maxPeers = maxPeers;
+    return host;
+}
+
+/* net.host(port, [maxPeers]) -> host, or nil and an error message */
+static int lua_netHost(lua_State* L) {
+    lua_Integer port = luaL_checkinteger(L, 1);
+    lua_Integer maxPeers = luaL_optinteger(L, 2, NET_DEFAULT_PEERS);
+    luaL_argcheck(L, port > 0 && port < 65536, 1, "port out of range");
+    luaL_argcheck(L, maxPeers >= 1 && maxPeers <= NET_MAX_PEERS, 2, "peer count out of range");
+    
+    NetHost* host = netNewHost(L, 1, (int)maxPeers);
+    if ((host->socket = netOpenSocket((int)port)) < 0) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "cannot listen on port %d: %s", (int)port, strerror(errno));
+        return 2;
+    }
+    return 1;
+}
+
+/* net.connect(address, port) -> host, or nil and an error message. The
+ * connect event arrives from receive() once the server answers. */
+static int lua_netConnect(lua_State* L) {
+    const char* address = luaL_checkstring(L, 1);
+    lua_Integer port = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, port > 0 && port < 65536, 2, "port out of range");
+    
+    struct addrinfo hints, *result;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    int status = getaddrinfo(address, NULL, &hints, &result);
+    if (status != 0) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "%s: %s", address, gai_strerror(status));
+        return 2;
+    }
+    
+    NetHost* host = netNewHost(L, 0, 1);
+    NetPeer* server = &host->peers[0];
+    memcpy(&server->addr, result->ai_addr, sizeof(server->addr));
+    server->addr.sin_port = htons((unsigned short)port);
+    freeaddrinfo(result);
+    if ((host->socket = netOpenSocket(0)) < 0) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "cannot open socket: %s", strerror(errno));
+        return 2;
+    }
+    return 1;
+}
+
+/* host:receive([out]) -> out, count. Reads every pending datagram:
+ * events have type "connect", "disconnect", "message" (with data),
+ * "spawn" or "despawn" (client only: entity is the local handle, id the
+ * server's), and peer, the sender's id on the server. */
+static int lua_netReceive(lua_State* L) {
+    NetHost* host = checkNet(L, 1);
+    int out = pushOutputTable(L, 2);
+    int count = 0;
+    double now = glfwGetTime();
+    unsigned char buffer[NET_MAX_PACKET];
+    
+    for (;;) {
+        struct sockaddr_in from;
+        socklen_t fromLength = sizeof(from);
+        ssize_t n = recvfrom(host->socket, buffer, sizeof(buffer), 0, (struct sockaddr*)&from, &fromLength);
+        if (n < 0) break;
+        host->bytesReceived += (unsigned long long)n;
+        host->packetsReceived++;
+        
+        SnapshotReader r = { buffer, buffer, buffer + n };
+        if (host->server) netServerPacket(L, host, &r, &from, now, out, &count);
+        else netClientPacket(L, host, &r, &from, now, out, &count);
+    }
+    
+    for (int p = 0; p < host->maxPeers; p++) {
+        NetPeer* peer = &host->peers[p];
+        if (peer->connected && now - peer->lastHeard > NET_TIMEOUT) netDisconnectPeer(L, host, p, out, &count);
+    }
+    trimOutputTable(L, out, count);
+    lua_pushinteger(L, count);
+    return 2;
+}
+
+static void netQueue(lua_State* L, NetPeer* peer, int arg) {
+    size_t length;
+    const char* data = luaL_checklstring(L, arg, &length);
+    luaL_argcheck(L, length <= NET_MAX_MESSAGE, arg, "message larger than a packet");
+    netPutVarint(&peer->outbox, (unsigned int)length);
+    snapWrite(&peer->outbox, data, length);
+    if (peer->outbox.failed) luaL_error(L, "out of memory queueing message");
+    peer->outboxCount++;
+}
+
+/* host:send(peer, data) on a server, host:send(data) on a client --
+ * queued until flush(); a client drops messages until it is connected */
+static int lua_netSend(lua_State* L) {
+    NetHost* host = checkNet(L, 1);
+    if (!host->server) {
+        luaL_checkstring(L, 2);
+        if (host->peers[0].connected) netQueue(L, &host->peers[0], 2);
+        else host->dropped++;
+        return 0;
+    }
+    lua_Integer id = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, id >= 1 && id <= host->maxPeers && host->peers[id - 1].connected, 2, "not a connected peer");
+    netQueue(L, &host->peers[id - 1], 3);
+    return 0;
+}
+
+/* host:broadcast(data) -- to every connected peer */
+static int lua_netBroadcast(lua_State* L) {
+    NetHost* host = checkNet(L, 1);
+    for (int p = 0; p < host->maxPeers; p++) {
+        if (host->peers[p].connected) netQueue(L, &host->peers[p], 2);
+    }
+    return 0;
+}
+
+/* host:flush() -- once per tick: a server sends every peer the entity
+ * deltas and its queued messages, a client its ack and messages */
+static int lua_netFlush(lua_State* L) {
+    NetHost* host = checkNet(L, 1);
+    if (host->server) {
+        if (++host->seq == 0) host->seq = 1;
+        if (!netCaptureWorld(host)) return luaL_error(L, "out of memory capturing replicated state");
+        for (int p = 0; p < host->maxPeers; p++) {
+            if (host->peers[p].connected) netSendState(host, &host->peers[p]);
+        }
+        return 0;
+    }
+    
+    NetPeer* peer = &host->peers[0];
+    if (!peer->connected) {
+        double now = glfwGetTime();
+        if (now >= host->nextConnect) {
+            netSendControl(host, &peer->addr, NET_PACKET_CONNECT, 0);
+            host->nextConnect = now + NET_CONNECT_RETRY;
+            peer->lastHeard = now;
+        }
+        return 0;
+    }
+    Snapshot* b = &host->packet;
+    b->size = 0;
+    b->failed = 0;
+    netPutByte(b, NET_PACKET_CLIENT);
+    netPutU32(b, peer->ack);
+    netWriteMessages(host, peer, b);
+    if (!b->failed) netSend(host, &peer->addr, b->data, b->size);
+    return 0;
+}
+
+/* host:setBudget(bytes) -- datagram size entity deltas stop at */
+static int lua_netSetBudget(lua_State* L) {
+    NetHost* host = checkNet(L, 1);
+    lua_Integer bytes = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, bytes >= NET_MIN_BUDGET && bytes <= NET_MAX_PACKET, 2, "budget out of range");
+    host->budget = (int)bytes;
+    return 0;
+}
+
+/* host:peers() -> number of connected peers (a client has the server) */
+static int lua_netPeers(lua_State* L) {
+    NetHost* host = checkNet(L, 1);
+    int n = 0;
+    for (int p = 0; p < host->maxPeers; p++) {
+        n += host->peers[p].connected;
+    }
+    lua_pushinteger(L, n);
+    return 1;
+}
+
+/* host:entity(id) -> the local entity mirroring server entity id, or nil */
+static int lua_netEntity(lua_State* L) {
+    NetHost* host = checkNet(L, 1);
+    unsigned long long id = (unsigned long long)luaL_checkinteger(L, 2);
+    unsigned int slot = (unsigned int)(id & 0xFFFFFFFFu);
+    if (host->server || slot >= host->mirrorCapacity || host->mirror[slot].generation != (unsigned int)(id >> 32) ||
+        entityResolve(&g_entities, host->mirror[slot].entity) < 0) {
+        lua_pushnil(L);
+    } else {
+        lua_pushinteger(L, host->mirror[slot].entity);
+    }
+    return 1;
+}
+
+/* host:stats() -> table of sent, received (bytes), packetsSent,
+ * packetsReceived, lastPacket (bytes) and dropped (messages) */
+static int lua_netStats(lua_State* L) {
+    NetHost* host = checkNet(L, 1);
+    lua_createtable(L, 0, 6);
+    lua_pushinteger(L, (lua_Integer)host->bytesSent);
+    lua_setfield(L, -2, "sent");
+    lua_pushinteger(L, (lua_Integer)host->bytesReceived);
+    lua_setfield(L, -2, "received");
+    lua_pushinteger(L, host->packetsSent);
+    lua_setfield(L, -2, "packetsSent");
+    lua_pushinteger(L, host->packetsReceived);
+    lua_setfield(L, -2, "packetsReceived");
+    lua_pushinteger(L, host->lastPacket);
+    lua_setfield(L, -2, "lastPacket");
+    lua_pushinteger(L, host->dropped);
+    lua_setfield(L, -2, "dropped");
+    return 1;
+}
+
+/* host:close() -- tells the peers, then closes the socket */
+static int lua_netClose(lua_State* L) {
+    NetHost* host = (NetHost*)luaL_checkudata(L, 1, NET_METATABLE);
+    netClose(host);
+    return 0;
+}
+
+static int lua_netGC(lua_State* L) {
+    NetHost* host = (NetHost*)luaL_checkudata(L, 1, NET_METATABLE);
+    netClose(host);
+    for (int p = 0; p < host->maxPeers; p++) {
+        netFreePeer(&host->peers[p]);
+    }
+    free(host->peers);
+    free(host->world.states);
+    free(host->changes);
+    free(host->records);
+    free(host->mirror);
+    free(host->packet.data);
+    memset(host, 0, sizeof(NetHost));
+    host->socket = -1;
+    return 0;
+}
+
+void registerNetModule(lua_State* L) {
+    static const luaL_Reg methods[] = {
+        {"receive", lua_netReceive},
+        {"send", lua_netSend},
+        {"broadcast", lua_netBroadcast},
+        {"flush", lua_netFlush},
+        {"setBudget", lua_netSetBudget},
+        {"peers", lua_netPeers},
+        {"entity", lua_netEntity},
+        {"stats", lua_netStats},
+        {"close", lua_netClose},
+        {NULL, NULL}
+    };
+    static const luaL_Reg functions[] = {
+        {"host", lua_netHost},
+        {"connect", lua_netConnect},
+        {NULL, NULL}
+    };
+    
+    luaL_newmetatable(L, NET_METATABLE);
+    luaL_newlib(L, methods);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, lua_netGC);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+    
+    luaL_newlib(L, functions);
+    lua_setglobal(L, "net");
+}
+
+#endif /* ENGINE_NET */
+
+/* ============================================================ */
+/* LUA ALLOCATOR */
+/* ============================================================ */
+
+/* lua_Alloc with size-class pools. Blocks up to LUA_POOL_MAX bytes come
+ * from per-class free lists carved out of LUA_POOL_PAGE pages that are
+ * kept until the state closes, so table and string churn stays off
+ * libc malloc. Lua passes the old size on every free and resize, which
+ * identifies the class without a block header. Bigger blocks go
+ * straight to malloc. */
+#define LUA_POOL_GRANULE 16
+#define LUA_POOL_MAX 512
+#define LUA_POOL_CLASSES (LUA_POOL_MAX / LUA_POOL_GRANULE)
+#define LUA_POOL_PAGE (64 * 1024)
+
+typedef struct LuaPoolBlock {
+    struct LuaPoolBlock* next;
+} LuaPoolBlock;
+
+typedef struct LuaPoolPage {
+    struct LuaPoolPage* next;
+} LuaPoolPage;
+
+typedef struct {
+    LuaPoolBlock* free[LUA_POOL_CLASSES];
+    LuaPoolPage* pages;
+    size_t pageBytes;
+    int allocations;     /* since the last luaPoolTakeCounts */
+    int mallocs;
+} LuaPool;
+
+static LuaPool g_luaPool;
+
+static inline int luaPoolClass(size_t size) {
+    return (int)((size + LUA_POOL_GRANULE - 1) / LUA_POOL_GRANULE) - 1;
+}
+
+static void* luaPoolTake(LuaPool* pool, int c) {
+    if (!pool->free[c]) {
+        size_t blockSize = (size_t)(c + 1) * LUA_POOL_GRANULE;
+        LuaPoolPage* page = malloc(LUA_POOL_PAGE);
+        if (!page) return NULL;
+        pool->mallocs++;
+        page->next = pool->pages;
+        pool->pages = page;
+        pool->pageBytes += LUA_POOL_PAGE;
+        
+        /* The page link takes the first granule, keeping blocks aligned */
+        unsigned char* end = (unsigned char*)page + LUA_POOL_PAGE;
+        for (unsigned char* p = (unsigned char*)page + LUA_POOL_GRANULE; p + blockSize <= end; p += blockSize) {
+            LuaPoolBlock* block = (LuaPoolBlock*)p;
+            block->next = pool->free[c];
+            pool->free[c] = block;
+        }
+    }
+    LuaPoolBlock* block = pool->free[c];
+    pool->free[c] = block->next;
+    return block;
+}
+
+static void luaPoolGive(LuaPool* pool, int c, void* ptr) {
+    LuaPoolBlock* block = ptr;
+    block->next = pool->free[c];
+    pool->free[c] = block;
+}
+
+static void* luaPoolAlloc(void* ud, void* ptr, size_t osize, size_t nsize) {
+    LuaPool* pool = ud;
+    if (!ptr) osize = 0;  /* osize is then the object's type, not a size */
+    int pooledOld = ptr && osize <= LUA_POOL_MAX;
     
-    glDrawArrays(GL_TRIANGLE_FAN, 0, segments + 2);
+    if (nsize == 0) {
+        if (pooledOld) luaPoolGive(pool, luaPoolClass(osize), ptr);
+        else free(ptr);
+        return NULL;
+    }
     
-    glDeleteBuffers(1, &VBO);
-    glDeleteVertexArrays(1, &VAO);
-    free(vertices);
+    if (nsize > LUA_POOL_MAX) {
+        pool->allocations++;
+        pool->mallocs++;
+        if (!ptr || !pooledOld) return realloc(ptr, nsize);
+        void* block = malloc(nsize);
+        if (!block) return NULL;
+        memcpy(block, ptr, osize);
+        luaPoolGive(pool, luaPoolClass(osize), ptr);
+        return block;
+    }
     
+    int c = luaPoolClass(nsize);
+    if (pooledOld && luaPoolClass(osize) == c) return ptr;
+    pool->allocations++;
+    void* block = luaPoolTake(pool, c);
+    if (!block) return NULL;
+    if (ptr) {
+        memcpy(block, ptr, osize < nsize ? osize : nsize);
+        if (pooledOld) luaPoolGive(pool, luaPoolClass(osize), ptr);
+        else free(ptr);
+    }
+    return block;
+}
+
+/* Hands out the allocation counters and starts them again from zero */
+static void luaPoolTakeCounts(LuaPool* pool, int* allocations, int* mallocs) {
+    *allocations = pool->allocations;
+    *mallocs = pool->mallocs;
+    pool->allocations = 0;
+    pool->mallocs = 0;
+}
+
+/* Frees every page; only once the state using them is closed */
+static void luaPoolRelease(LuaPool* pool) {
+    while (pool->pages) {
+        LuaPoolPage* next = pool->pages->next;
+        free(pool->pages);
+        pool->pages = next;
+    }
+    memset(pool, 0, sizeof(*pool));
+}
+
+/* lua_newstate installs no panic handler; this one matches luaL_newstate's */
+static int luaPanic(lua_State* L) {
+    const char* msg = lua_tostring(L, -1);
+    fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n", msg ? msg : "error object is not a string");
     return 0;
 }
 
-static int lua_drawLine(lua_State* L) {
-    float x1 = luaL_checknumber(L, 1);
-    float y1 = luaL_checknumber(L, 2);
-    float x2 = luaL_checknumber(L, 3);
-    float y2 = luaL_checknumber(L, 4);
-    float r = luaL_checknumber(L, 5);
-    float g = luaL_checknumber(L, 6);
-    float b = luaL_checknumber(L, 7);
-    float a = luaL_optnumber(L, 8, 1.0);
-    
-    float vertices[] = {
-        x1, y1, r, g, b, a,
-        x2, y2, r, g, b, a,
-    };
+/* ============================================================ */
+/* GARBAGE COLLECTION */
+/* ============================================================ */
+
+static double gcHeapKB(lua_State* L) {
+    return lua_gc(L, LUA_GCCOUNT, 0) + lua_gc(L, LUA_GCCOUNTB, 0) / 1024.0;
+}
+
+/* Runs the frame's collection step when pacing is on. Stepping by at
+ * least what was allocated since the last step keeps the collector as
+ * far ahead as Lua's own pacing would, just at a fixed point in the
+ * frame instead of inside whichever allocation tripped it. */
+static void gcFrameStep(GCControl* gc, lua_State* L) {
+    if (gc->stepKB <= 0) return;
+    
+    double allocated = gcHeapKB(L) - gc->lastKB;
+    int kb = allocated > gc->stepKB ? (int)allocated + 1 : gc->stepKB;
+    lua_gc(L, LUA_GCSTEP, kb);
+    gc->lastKB = gcHeapKB(L);
+}
+
+static int optFieldInt(lua_State* L, int idx, const char* name) {
+    lua_getfield(L, idx, name);
+    int value = (int)luaL_optinteger(L, -1, 0);
+    lua_pop(L, 1);
+    return value;
+}
+
+/* engine.gc([options]) -> mode. All options are optional, and tuning
+ * values left out (or 0) keep their current setting:
+ *   mode = "incremental" | "generational"
+ *   pause, stepmul, stepsize   incremental tuning, as collectgarbage()
+ *   minormul, majormul         generational tuning
+ *   stepKB                     > 0 steps once per frame, 0 back to automatic */
+static int lua_engineGC(lua_State* L) {
+    static const char* const modes[] = { "incremental", "generational", NULL };
+    GCControl* gc = &g_engine.gc;
     
-    GLuint VAO, VBO;
-    glGenVertexArrays(1, &VAO);
-    glGenBuffers(1, &VBO);
-    
-    glBindVertexArray(VAO);
-    glBindBuffer(GL_ARRAY_BUFFER, VBO);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
-    
-    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)0);
-    glEnableVertexAttribArray(0);
-    
-    glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)(2 * sizeof(float)));
-    glEnableVertexAttribArray(1);
+    if (!lua_isnoneornil(L, 1)) {
+        luaL_checktype(L, 1, LUA_TTABLE);
+        
+        lua_getfield(L, 1, "mode");
+        if (!lua_isnil(L, -1)) gc->generational = luaL_checkoption(L, -1, NULL, modes);
+        lua_pop(L, 1);
+        if (gc->generational) {
+            lua_gc(L, LUA_GCGEN, optFieldInt(L, 1, "minormul"), optFieldInt(L, 1, "majormul"));
+        } else {
+            lua_gc(L, LUA_GCINC, optFieldInt(L, 1, "pause"),
+                   optFieldInt(L, 1, "stepmul"), optFieldInt(L, 1, "stepsize"));
+        }
+        
+        lua_getfield(L, 1, "stepKB");
+        if (!lua_isnil(L, -1)) {
+            lua_Integer stepKB = luaL_checkinteger(L, -1);
+            luaL_argcheck(L, stepKB >= 0, 1, "stepKB must be non-negative");
+            gc->stepKB = (int)stepKB;
+            if (gc->stepKB > 0) {
+                lua_gc(L, LUA_GCSTOP);
+                gc->lastKB = gcHeapKB(L);
+            } else {
+                lua_gc(L, LUA_GCRESTART);
+            }
+        }
+        lua_pop(L, 1);
+    }
     
-    glUseProgram(g_engine.shaderProgram);
+    lua_pushstring(L, modes[gc->generational]);
+    return 1;
+}
+
+/* ============================================================ */
+/* FRAME STATISTICS */
+/* ============================================================ */
+
+static const char* const g_phaseNames[PHASE_COUNT] = {
+    "frame", "loop", "window", "submit", "swap", "poll", "gc",
+};
+
+/* Overlay bar colors, one per stacked phase (PHASE_LOOP onwards) */
+static const float g_phaseColors[PHASE_COUNT][3] = {
+    {0.0f, 0.0f, 0.0f},
+    {0.3f, 0.8f, 0.3f},
+    {0.3f, 0.6f, 1.0f},
+    {1.0f, 0.8f, 0.2f},
+    {0.9f, 0.3f, 0.3f},
+    {0.7f, 0.4f, 0.9f},
+    {0.9f, 0.9f, 0.9f},
+};
+
+#define STATS_GRAPH_X 10.0f
+#define STATS_GRAPH_Y 50.0f
+#define STATS_GRAPH_HEIGHT 80.0f
+#define STATS_GRAPH_MAX_MS 33.3f
+
+/* Closes the current frame's sample into the ring and starts a new one.
+ * L is NULL on the render thread, which gets the heap size from the
+ * simulation. */
+static void statsCommit(FrameStats* stats, lua_State* L) {
+    if (L) {
+        stats->current.luaMemoryKB = (float)lua_gc(L, LUA_GCCOUNT, 0) +
+                                     (float)lua_gc(L, LUA_GCCOUNTB, 0) / 1024.0f;
+        luaPoolTakeCounts(&g_luaPool, &stats->current.allocations, &stats->current.mallocs);
+    }
+    stats->history[stats->head] = stats->current;
+    stats->head = (stats->head + 1) % STATS_HISTORY;
+    if (stats->filled < STATS_HISTORY) stats->filled++;
+    memset(&stats->current, 0, sizeof(stats->current));
+}
+
+static const FrameSample* statsSample(const FrameStats* stats, int age) {
+    return &stats->history[(stats->head - 1 - age + STATS_HISTORY) % STATS_HISTORY];
+}
+
+/* Stacked bar per recorded frame, newest on the right, with a line at
+ * the 60 Hz budget. Queued into the batch like any other drawing. */
+static void statsDrawOverlay(const FrameStats* stats) {
+    const float barWidth = 2.0f;
+    const float scale = STATS_GRAPH_HEIGHT / STATS_GRAPH_MAX_MS;
+    const float baseY = STATS_GRAPH_Y + STATS_GRAPH_HEIGHT;
+    float* v = batchReserve(BATCH_TRIANGLES, 6);
+    if (!v) return;
+    putRect(v, STATS_GRAPH_X, STATS_GRAPH_Y, STATS_HISTORY * barWidth, STATS_GRAPH_HEIGHT,
+            0.0f, 0.0f, 0.0f, 0.5f);
     
-    float projection[16];
-    orthographicMatrix(projection, 0, g_engine.windowWidth, g_engine.windowHeight, 0);
+    for (int age = 0; age < stats->filled; age++) {
+        const FrameSample* sample = statsSample(stats, age);
+        float x = STATS_GRAPH_X + (STATS_HISTORY - 1 - age) * barWidth;
+        float y = baseY;
+        
+        for (int p = PHASE_LOOP; p < PHASE_COUNT; p++) {
+            float h = sample->ms[p] * scale;
+            if (y - h < STATS_GRAPH_Y) h = y - STATS_GRAPH_Y;
+            if (h <= 0.0f) continue;
+            y -= h;
+            v = batchReserve(BATCH_TRIANGLES, 6);
+            if (!v) return;
+            putRect(v, x, y, barWidth, h,
+                    g_phaseColors[p][0], g_phaseColors[p][1], g_phaseColors[p][2], 0.9f);
+        }
+    }
     
-    GLint projLoc = glGetUniformLocation(g_engine.shaderProgram, "projection");
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, projection);
+    v = batchReserve(BATCH_TRIANGLES, 6);
+    if (!v) return;
+    putRect(v, STATS_GRAPH_X, baseY - 16.7f * scale, STATS_HISTORY * barWidth, 1.0f,
+            1.0f, 1.0f, 1.0f, 0.6f);
+}
+
+/* engine.stats([out]) -> table with the latest frame's "<phase>Ms"
+ * timings, drawCalls, vertices, allocations, mallocs, luaMemoryKB, plus fps, frameAvgMs and
+ * frameMaxMs over the recorded history, streamMode, jobWorkers and
+ * arenaKB (the frame arena's peak last frame) */
+static int lua_engineStats(lua_State* L) {
+    const FrameStats* stats = g_threaded.running ? &g_threaded.simStats : &g_engine.stats;
+    int out = pushOutputTable(L, 1);
+    FrameSample latest = {0};
+    float sum = 0.0f, max = 0.0f;
+    char key[32];
     
-    glDrawArrays(GL_LINE_LOOP, 0, 2);
+    if (stats->filled > 0) latest = *statsSample(stats, 0);
+    for (int age = 0; age < stats->filled; age++) {
+        float ms = statsSample(stats, age)->ms[PHASE_FRAME];
+        sum += ms;
+        if (ms > max) max = ms;
+    }
+    float avg = stats->filled > 0 ? sum / stats->filled : 0.0f;
     
-    glDeleteBuffers(1, &VBO);
-    glDeleteVertexArrays(1, &VAO);
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        snprintf(key, sizeof(key), "%sMs", g_phaseNames[p]);
+        lua_pushnumber(L, latest.ms[p]);
+        lua_setfield(L, out, key);
+    }
+    lua_pushinteger(L, latest.ticks);
+    lua_setfield(L, out, "ticks");
+    lua_pushinteger(L, latest.drawCalls);
+    lua_setfield(L, out, "drawCalls");
+    lua_pushinteger(L, latest.vertices);
+    lua_setfield(L, out, "vertices");
+    lua_pushinteger(L, latest.allocations);
+    lua_setfield(L, out, "allocations");
+    lua_pushinteger(L, latest.mallocs);
+    lua_setfield(L, out, "mallocs");
+    lua_pushnumber(L, latest.luaMemoryKB);
+    lua_setfield(L, out, "luaMemoryKB");
+    lua_pushnumber(L, avg > 0.0f ? 1000.0f / avg : 0.0f);
+    lua_setfield(L, out, "fps");
+    lua_pushnumber(L, avg);
+    lua_setfield(L, out, "frameAvgMs");
+    lua_pushnumber(L, max);
+    lua_setfield(L, out, "frameMaxMs");
+    lua_pushinteger(L, jobWorkerCount());
+    lua_setfield(L, out, "jobWorkers");
+    lua_pushnumber(L, g_frameArena.lastPeak / 1024.0);
+    lua_setfield(L, out, "arenaKB");
+    lua_pushstring(L, g_streamModeNames[g_engine.stream.mode]);
+    lua_setfield(L, out, "streamMode");
+    return 1;
+}
+
+/* engine.setFixedTimestep(hz, [maxSteps]) -- hz of 0 or nil restores
+ * variable dt */
+static int lua_engineSetFixedTimestep(lua_State* L) {
+    lua_Number hz = luaL_optnumber(L, 1, 0.0);
+    lua_Integer maxSteps = luaL_optinteger(L, 2, TIMESTEP_DEFAULT_MAX_STEPS);
+    luaL_argcheck(L, hz >= 0.0, 1, "tick rate must be non-negative");
+    luaL_argcheck(L, maxSteps >= 1, 2, "maxSteps must be at least 1");
     
+    g_engine.timestep.step = hz > 0.0 ? 1.0 / hz : 0.0;
+    g_engine.timestep.maxSteps = (int)maxSteps;
+    g_engine.timestep.accumulator = 0.0;
     return 0;
 }
 
-static int lua_drawText(lua_State* L) {
-    const char* text = luaL_checkstring(L, 1);
-    float x = luaL_checknumber(L, 2);
-    float y = luaL_checknumber(L, 3);
-    
-    /* Stub: Text rendering would require a font atlas system */
-    printf("[TEXT] %s at (%.1f, %.1f)\n", text, x, y);
-    
+/* engine.getFixedTimestep() -> hz, maxSteps (hz is 0 in variable mode) */
+static int lua_engineGetFixedTimestep(lua_State* L) {
+    const TimeStep* ts = &g_engine.timestep;
+    lua_pushnumber(L, ts->step > 0.0 ? 1.0 / ts->step : 0.0);
+    lua_pushinteger(L, ts->maxSteps ? ts->maxSteps : TIMESTEP_DEFAULT_MAX_STEPS);
+    return 2;
+}
+
+/* engine.setStatsOverlay(enabled) -- frame-time graph drawn over window() */
+static int lua_engineSetStatsOverlay(lua_State* L) {
+    FrameStats* stats = g_threaded.running ? &g_threaded.simStats : &g_engine.stats;
+    stats->overlay = lua_toboolean(L, 1);
     return 0;
 }
 
-static int lua_keyDown(lua_State* L) {
-    const char* key = luaL_checkstring(L, 1);
-    int keyCode = GLFW_KEY_SPACE;
-    
-    if (strcmp(key, "space") == 0) keyCode = GLFW_KEY_SPACE;
-    else if (strcmp(key, "up") == 0) keyCode = GLFW_KEY_UP;
-    else if (strcmp(key, "down") == 0) keyCode = GLFW_KEY_DOWN;
-    else if (strcmp(key, "left") == 0) keyCode = GLFW_KEY_LEFT;
-    else if (strcmp(key, "right") == 0) keyCode = GLFW_KEY_RIGHT;
-    else if (strcmp(key, "a") == 0) keyCode = GLFW_KEY_A;
-    else if (strcmp(key, "d") == 0) keyCode = GLFW_KEY_D;
-    else if (strcmp(key, "w") == 0) keyCode = GLFW_KEY_W;
-    else if (strcmp(key, "s") == 0) keyCode = GLFW_KEY_S;
-    else if (strcmp(key, "escape") == 0) keyCode = GLFW_KEY_ESCAPE;
-    
-    int state = glfwGetKey(g_engine.window, keyCode);
-    lua_pushboolean(L, state == GLFW_PRESS);
+/* ============================================================ */
+/* SCRIPTS AND HOT RELOAD */
+/* ============================================================ */
+
+/* Scripts compiled into the binary by the Makefile: source text or
+ * luac -s bytecode (LUA_EMBED=bytecode); luaL_loadbufferx accepts both.
+ * Entry 0 is game.lua, the rest are served to require(). */
+typedef struct {
+    const char* module;
+    const char* file;
+    const unsigned char* data;
+    size_t size;
+} EmbeddedScript;
+
+#include "game.lua.h"
+
+#define EMBEDDED_SCRIPT_COUNT (sizeof(g_embeddedScripts) / sizeof(g_embeddedScripts[0]))
+
+/* Dev mode (--dev): scripts load from the working directory instead of
+ * the binary, and are polled for changes so edits apply to the running
+ * state. A file is reloaded once its mtime has been stable for one poll,
+ * which skips editors' partial writes. */
+#define DEV_POLL_INTERVAL 0.25
+
+typedef struct {
+    time_t loaded;     /* mtime of the version running now */
+    time_t seen;       /* mtime at the previous poll */
+} DevWatch;
+
+typedef struct {
+    int enabled;
+    double nextPoll;
+    DevWatch watch[EMBEDDED_SCRIPT_COUNT];
+} DevMode;
+
+static DevMode g_dev;
+
+/* Loads a script as a function on the stack: from disk in dev mode,
+ * otherwise the copy compiled into the binary */
+static int loadEmbeddedScript(lua_State* L, const EmbeddedScript* script) {
+    char chunkName[256];
     
-    return 1;
+    if (g_dev.enabled) {
+        return luaL_loadfilex(L, script->file, "t");
+    }
+    snprintf(chunkName, sizeof(chunkName), "@%s", script->file);
+    return luaL_loadbufferx(L, (const char*)script->data, script->size, chunkName, "bt");
 }
 
-static int lua_mouseX(lua_State* L) {
-    double x, y;
-    glfwGetCursorPos(g_engine.window, &x, &y);
-    lua_pushnumber(L, x);
+/* package.preload entry: loads the embedded chunk and runs it with the
+ * module name, like the standard file searcher */
+static int requireEmbeddedScript(lua_State* L) {
+    const EmbeddedScript* script = lua_touserdata(L, lua_upvalueindex(1));
+    if (loadEmbeddedScript(L, script) != LUA_OK) {
+        return lua_error(L);
+    }
+    lua_pushvalue(L, 1);
+    lua_call(L, 1, 1);
     return 1;
 }
 
-static int lua_mouseY(lua_State* L) {
-    double x, y;
-    glfwGetCursorPos(g_engine.window, &x, &y);
-    lua_pushnumber(L, y);
-    return 1;
+static void registerEmbeddedModules(lua_State* L) {
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "preload");
+    for (size_t i = 1; i < EMBEDDED_SCRIPT_COUNT; i++) {
+        lua_pushlightuserdata(L, (void*)&g_embeddedScripts[i]);
+        lua_pushcclosure(L, requireEmbeddedScript, 1);
+        lua_setfield(L, -2, g_embeddedScripts[i].module);
+    }
+    lua_pop(L, 2);
 }
 
-static int lua_getClearColor(lua_State* L) {
-    lua_newtable(L);
-    lua_pushnumber(L, 0.1);
-    lua_setfield(L, -2, "r");
-    lua_pushnumber(L, 0.1);
-    lua_setfield(L, -2, "g");
-    lua_pushnumber(L, 0.1);
-    lua_setfield(L, -2, "b");
+#define KEEP_REGISTRY_KEY "engine.keep"
+
+/* engine.keep(name, [initial]) -> value that survives hot reloads.
+ * The first call stores initial (calling it first if it is a function);
+ * later calls, including from reloaded code, return the stored value. */
+static int lua_engineKeep(lua_State* L) {
+    luaL_checkstring(L, 1);
+    lua_settop(L, 2);
+    lua_getfield(L, LUA_REGISTRYINDEX, KEEP_REGISTRY_KEY);
+    lua_pushvalue(L, 1);
+    if (lua_rawget(L, 3) != LUA_TNIL) {
+        return 1;
+    }
+    lua_pop(L, 1);
+    
+    if (lua_isfunction(L, 2)) {
+        lua_pushvalue(L, 2);
+        lua_call(L, 0, 1);
+    } else {
+        lua_pushvalue(L, 2);
+    }
+    lua_pushvalue(L, 1);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, 3);
     return 1;
 }
 
-static int lua_setClearColor(lua_State* L) {
-    float r = luaL_checknumber(L, 1);
-    float g = luaL_checknumber(L, 2);
-    float b = luaL_checknumber(L, 3);
-    glClearColor(r, g, b, 1.0f);
-    return 0;
+#ifndef __EMSCRIPTEN__
+static time_t fileModifiedTime(const char* path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? st.st_mtime : 0;
 }
 
-static int lua_getWindowSize(lua_State* L) {
-    lua_newtable(L);
-    lua_pushnumber(L, g_engine.windowWidth);
-    lua_setfield(L, -2, "width");
-    lua_pushnumber(L, g_engine.windowHeight);
-    lua_setfield(L, -2, "height");
-    return 1;
+/* Re-runs a changed script into the live state. The chunk is compiled
+ * before anything is replaced, so a syntax error leaves the old code
+ * running. Modules that return tables are patched in place so existing
+ * references see the new functions. */
+static void devReload(lua_State* L, size_t index) {
+    const EmbeddedScript* script = &g_embeddedScripts[index];
+    double start = glfwGetTime();
+    int top = lua_gettop(L);
+    
+    if (loadEmbeddedScript(L, script) != LUA_OK) {
+        fprintf(stderr, "[DEV] %s not reloaded: %s\n", script->file, lua_tostring(L, -1));
+        lua_settop(L, top);
+        return;
+    }
+    
+    if (index == 0) {
+        if (lua_pcall(L, 0, 0, 0) != LUA_OK) {
+            fprintf(stderr, "[DEV] Lua error reloading %s: %s\n", script->file, lua_tostring(L, -1));
+            lua_settop(L, top);
+            return;
+        }
+        lua_getglobal(L, "onReload");
+        if (lua_isfunction(L, -1) && lua_pcall(L, 0, 0, 0) != LUA_OK) {
+            fprintf(stderr, "Lua error in onReload: %s\n", lua_tostring(L, -1));
+        }
+    } else {
+        lua_pushstring(L, script->module);
+        if (lua_pcall(L, 1, 1, 0) != LUA_OK) {
+            fprintf(stderr, "[DEV] Lua error reloading %s: %s\n", script->file, lua_tostring(L, -1));
+            lua_settop(L, top);
+            return;
+        }
+        lua_getglobal(L, "package");
+        lua_getfield(L, -1, "loaded");
+        int loaded = lua_gettop(L);
+        lua_getfield(L, loaded, script->module);
+        int old = lua_gettop(L);
+        int fresh = top + 1;
+        
+        if (lua_istable(L, old) && lua_istable(L, fresh)) {
+            lua_pushnil(L);
+            while (lua_next(L, fresh)) {
+                lua_pushvalue(L, -2);
+                lua_insert(L, -2);
+                lua_rawset(L, old);
+            }
+        } else if (!lua_isnil(L, fresh)) {
+            lua_pushvalue(L, fresh);
+            lua_setfield(L, loaded, script->module);
+        }
+    }
+    
+    lua_settop(L, top);
+    printf("[DEV] Reloaded %s in %.2f ms\n", script->file, (glfwGetTime() - start) * 1000.0);
+}
+
+static void devInit(void) {
+    g_dev.enabled = 1;
+    for (size_t i = 0; i < EMBEDDED_SCRIPT_COUNT; i++) {
+        time_t mtime = fileModifiedTime(g_embeddedScripts[i].file);
+        g_dev.watch[i].loaded = mtime;
+        g_dev.watch[i].seen = mtime;
+    }
+    printf("[DEV] Watching %d script(s) for changes\n", (int)EMBEDDED_SCRIPT_COUNT);
+}
+
+/* Called once per frame; costs one stat() per script every
+ * DEV_POLL_INTERVAL seconds */
+static void devPoll(lua_State* L) {
+    double now = glfwGetTime();
+    if (!g_dev.enabled || now < g_dev.nextPoll) return;
+    g_dev.nextPoll = now + DEV_POLL_INTERVAL;
+    
+    for (size_t i = 0; i < EMBEDDED_SCRIPT_COUNT; i++) {
+        DevWatch* watch = &g_dev.watch[i];
+        time_t mtime = fileModifiedTime(g_embeddedScripts[i].file);
+        
+        if (mtime != 0 && mtime == watch->seen && mtime != watch->loaded) {
+            watch->loaded = mtime;
+            devReload(L, i);
+        }
+        watch->seen = mtime;
+    }
 }
+#endif
 
 /* ============================================================ */
 /* LUA REGISTRATION */
@@ -352,24 +10117,14 @@ void registerLuaFunctions(lua_State* L) {
     lua_setfield(L, -2, "rect");
     lua_pushcfunction(L, lua_drawCircle);
     lua_setfield(L, -2, "circle");
+    lua_pushcfunction(L, lua_drawCircles);
+    lua_setfield(L, -2, "circles");
     lua_pushcfunction(L, lua_drawLine);
     lua_setfield(L, -2, "line");
     lua_pushcfunction(L, lua_drawText);
     lua_setfield(L, -2, "text");
     lua_setglobal(L, "draw");
     
-    lua_newtable(L);
-    lua_pushcfunction(L, lua_keyDown);
-    lua_setfield(L, -2, "isDown");
-    lua_setglobal(L, "keyboard");
-    
-    lua_newtable(L);
-    lua_pushcfunction(L, lua_mouseX);
-    lua_setfield(L, -2, "x");
-    lua_pushcfunction(L, lua_mouseY);
-    lua_setfield(L, -2, "y");
-    lua_setglobal(L, "mouse");
-    
     lua_newtable(L);
     lua_pushcfunction(L, lua_getClearColor);
     lua_setfield(L, -2, "getClearColor");
@@ -378,47 +10133,508 @@ void registerLuaFunctions(lua_State* L) {
     lua_pushcfunction(L, lua_getWindowSize);
     lua_setfield(L, -2, "getWindowSize");
     lua_setglobal(L, "graphics");
+    
+    registerSpriteModule(L);
+    registerAssetModule(L);
+    registerTextModule(L);
+    registerMeshModule(L);
+    registerCameraModule(L);
+    registerInputModule(L);
+    registerParticleModule(L);
+    registerCollisionModule(L);
+    registerTreeModule(L);
+    registerBatchQueries(L);
+    registerEntityModule(L);
+    registerPoolModule(L);
+    registerSchedulerModule(L);
+    registerSnapshotModule(L);
+#ifdef ENGINE_NET
+    registerNetModule(L);
+#endif
+    
+    lua_newtable(L);
+    lua_pushcfunction(L, lua_engineStats);
+    lua_setfield(L, -2, "stats");
+    lua_pushcfunction(L, lua_engineSetStatsOverlay);
+    lua_setfield(L, -2, "setStatsOverlay");
+    lua_pushcfunction(L, lua_engineSetFixedTimestep);
+    lua_setfield(L, -2, "setFixedTimestep");
+    lua_pushcfunction(L, lua_engineGetFixedTimestep);
+    lua_setfield(L, -2, "getFixedTimestep");
+    lua_pushcfunction(L, lua_engineGC);
+    lua_setfield(L, -2, "gc");
+    lua_pushcfunction(L, lua_engineKeep);
+    lua_setfield(L, -2, "keep");
+    lua_pushboolean(L, g_dev.enabled);
+    lua_setfield(L, -2, "dev");
+    lua_setglobal(L, "engine");
+    
+    lua_newtable(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, KEEP_REGISTRY_KEY);
 }
 
 /* ============================================================ */
 /* MAIN LOOP */
 /* ============================================================ */
 
+static void callLoop(float dt) {
+    schedulerAdvance(g_engine.L, &g_scheduler, dt);
+    
+    lua_getglobal(g_engine.L, "loop");
+    lua_pushnumber(g_engine.L, dt);
+    if (lua_pcall(g_engine.L, 1, 0, 0) != LUA_OK) {
+        fprintf(stderr, "Lua error in loop: %s\n", lua_tostring(g_engine.L, -1));
+        lua_pop(g_engine.L, 1);
+    }
+    inputConsumeEdges(&g_input);
+}
+
+/* Lua window(alpha) in world space, then the stats overlay on top */
+static void callWindow(float alpha, const FrameStats* stats) {
+    cameraSetActive(1);
+    lua_getglobal(g_engine.L, "window");
+    lua_pushnumber(g_engine.L, alpha);
+    if (lua_pcall(g_engine.L, 1, 0, 0) != LUA_OK) {
+        fprintf(stderr, "Lua error in window: %s\n", lua_tostring(g_engine.L, -1));
+        lua_pop(g_engine.L, 1);
+    }
+    if (stats->overlay) {
+        cameraSetActive(0);
+        statsDrawOverlay(stats);
+    }
+}
+
+/* Runs this frame's simulation and returns the interpolation alpha for
+ * window(): the fraction of a tick left in the accumulator. `ticks` gets
+ * the number of loop() calls. */
+static float runSimulation(double frameTime, int* ticks) {
+    TimeStep* ts = &g_engine.timestep;
+    
+    if (ts->step <= 0.0) {
+        callLoop((float)frameTime);
+        *ticks = 1;
+        return 1.0f;
+    }
+    
+    if (frameTime > TIMESTEP_MAX_FRAME) frameTime = TIMESTEP_MAX_FRAME;
+    ts->accumulator += frameTime;
+    
+    int steps = 0;
+    while (ts->accumulator >= ts->step && steps < ts->maxSteps) {
+        callLoop((float)ts->step);
+        ts->accumulator -= ts->step;
+        steps++;
+    }
+    *ticks = steps;
+    
+    /* Out of catch-up budget: drop the backlog rather than spiral */
+    if (ts->accumulator >= ts->step) {
+        ts->accumulator = fmod(ts->accumulator, ts->step);
+    }
+    
+    return (float)(ts->accumulator / ts->step);
+}
+
 #ifdef __EMSCRIPTEN__
 void mainLoopCallback() {
 #else
 void mainLoop() {
 #endif
+    FrameSample* sample = &g_engine.stats.current;
+    arenaReset(&g_frameArena);
+    arenaReset(&g_renderArena);
+    streamBeginFrame(&g_engine.stream);
+#ifndef __EMSCRIPTEN__
+    devPoll(g_engine.L);
+#endif
+    assetPump(g_engine.L);
     double currentTime = glfwGetTime();
-    float dt = (float)(currentTime - g_engine.lastTime);
+    double frameTime = currentTime - g_engine.lastTime;
     g_engine.lastTime = currentTime;
+    sample->ms[PHASE_FRAME] = (float)frameTime * 1000.0f;
     
-    /* Call Lua loop(dt) */
-    lua_getglobal(g_engine.L, "loop");
-    lua_pushnumber(g_engine.L, dt);
-    if (lua_pcall(g_engine.L, 1, 0, 0) != LUA_OK) {
-        fprintf(stderr, "Lua error in loop: %s\n", lua_tostring(g_engine.L, -1));
-        lua_pop(g_engine.L, 1);
-    }
+    /* Lua loop(dt), once or per fixed tick */
+    float alpha = runSimulation(g_bench.script ? BENCH_FRAME_TIME : frameTime, &sample->ticks);
+    double t = glfwGetTime();
+    sample->ms[PHASE_LOOP] = (float)(t - currentTime) * 1000.0f;
     
     /* Clear screen */
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    atlasStreamUploads(g_assets.budgetMs);
     
-    /* Call Lua window() */
-    lua_getglobal(g_engine.L, "window");
-    if (lua_pcall(g_engine.L, 0, 0, 0) != LUA_OK) {
-        fprintf(stderr, "Lua error in window: %s\n", lua_tostring(g_engine.L, -1));
-        lua_pop(g_engine.L, 1);
+    callWindow(alpha, &g_engine.stats);
+    double mark = glfwGetTime();
+    sample->ms[PHASE_WINDOW] = (float)(mark - t) * 1000.0f;
+    t = mark;
+    
+    /* Submit whatever window() queued */
+    flushBatch();
+    streamEndFrame(&g_engine.stream);
+    mark = glfwGetTime();
+    sample->ms[PHASE_SUBMIT] = (float)(mark - t) * 1000.0f;
+    t = mark;
+    
+    glfwSwapBuffers(g_engine.window);
+    mark = glfwGetTime();
+    sample->ms[PHASE_SWAP] = (float)(mark - t) * 1000.0f;
+    t = mark;
+    
+    glfwPollEvents();
+    InputSnapshot input;
+    inputSample(&input);
+    inputAdvance(&g_input, &input);
+    mark = glfwGetTime();
+    sample->ms[PHASE_POLL] = (float)(mark - t) * 1000.0f;
+    t = mark;
+    
+    gcFrameStep(&g_engine.gc, g_engine.L);
+    sample->ms[PHASE_GC] = (float)(glfwGetTime() - t) * 1000.0f;
+    statsCommit(&g_engine.stats, g_engine.L);
+    
+    if (glfwWindowShouldClose(g_engine.window)) {
+        g_engine.running = 0;
+    }
+}
+
+/* ============================================================ */
+/* THREADED SIMULATION */
+/* ============================================================ */
+
+#ifdef ENGINE_THREADS
+/* Simulation thread: loop() and window() record into the writing list,
+ * which is published as ready once the frame is complete */
+static void* simulationThread(void* arg) {
+    ThreadedState* ts = &g_threaded;
+    float gcMs = 0.0f;
+    (void)arg;
+    
+    for (;;) {
+        pthread_mutex_lock(&ts->mutex);
+        while (ts->hasReady && !ts->quit) pthread_cond_wait(&ts->cond, &ts->mutex);
+        if (ts->quit) {
+            pthread_mutex_unlock(&ts->mutex);
+            break;
+        }
+        inputAdvance(&g_input, &ts->input);
+        int overlay = ts->simStats.overlay;
+        ts->simStats = ts->stats;
+        ts->simStats.overlay = overlay;
+        int width = ts->resizeWidth;
+        int height = ts->resizeHeight;
+        ts->resizeWidth = 0;
+        ts->resizeHeight = 0;
+        pthread_mutex_unlock(&ts->mutex);
+        
+        if (width > 0) {
+            g_engine.windowWidth = width;
+            g_engine.windowHeight = height;
+            updateProjection();
+        }
+        
+        arenaReset(&g_frameArena);
+        devPoll(g_engine.L);
+        assetPump(g_engine.L);
+        double currentTime = glfwGetTime();
+        double frameTime = currentTime - g_engine.lastTime;
+        g_engine.lastTime = currentTime;
+        
+        /* Draws from loop() are recorded too, in submission order */
+        DrawList* list = &ts->lists[ts->writing];
+        list->commandCount = 0;
+        list->used = 0;
+        list->frame = ++ts->recordFrame;
+        g_recordList = list;
+        
+        float alpha = runSimulation(frameTime, &list->ticks);
+        double t = glfwGetTime();
+        list->loopMs = (float)(t - currentTime) * 1000.0f;
+        
+        callWindow(alpha, &ts->simStats);
+        flushBatch();
+        g_recordList = NULL;
+        double mark = glfwGetTime();
+        list->windowMs = (float)(mark - t) * 1000.0f;
+        
+        memcpy(list->clearColor, g_engine.clearColor, sizeof(list->clearColor));
+        list->gcMs = gcMs;
+        list->luaMemoryKB = (float)lua_gc(g_engine.L, LUA_GCCOUNT, 0) +
+                            (float)lua_gc(g_engine.L, LUA_GCCOUNTB, 0) / 1024.0f;
+        luaPoolTakeCounts(&g_luaPool, &list->allocations, &list->mallocs);
+        
+        pthread_mutex_lock(&ts->mutex);
+        int ready = ts->ready;
+        ts->ready = ts->writing;
+        ts->writing = ready;
+        ts->hasReady = 1;
+        pthread_mutex_unlock(&ts->mutex);
+        
+        /* Collect while the render thread submits */
+        t = glfwGetTime();
+        gcFrameStep(&g_engine.gc, g_engine.L);
+        gcMs = (float)(glfwGetTime() - t) * 1000.0f;
+    }
+    return NULL;
+}
+
+/* Main thread frame in threaded mode: take the newest finished list,
+ * hand the simulation fresh input, and submit. With no new list the
+ * previous one is drawn again. */
+static void threadedFrame(void) {
+    ThreadedState* ts = &g_threaded;
+    FrameSample* sample = &g_engine.stats.current;
+    arenaReset(&g_renderArena);
+    streamBeginFrame(&g_engine.stream);
+    double currentTime = glfwGetTime();
+    sample->ms[PHASE_FRAME] = (float)(currentTime - ts->lastTime) * 1000.0f;
+    ts->lastTime = currentTime;
+    
+    int fresh = 0;
+    pthread_mutex_lock(&ts->mutex);
+    if (ts->hasReady) {
+        int ready = ts->ready;
+        ts->ready = ts->reading;
+        ts->reading = ready;
+        ts->hasReady = 0;
+        fresh = 1;
+        pthread_cond_signal(&ts->cond);
+    }
+    inputSample(&ts->input);
+    ts->stats = g_engine.stats;
+    pthread_mutex_unlock(&ts->mutex);
+    
+    const DrawList* list = &ts->lists[ts->reading];
+    deleteReleasedGLObjects(list->frame);
+    atlasStreamUploads(g_assets.budgetMs);
+    
+    if (fresh) {
+        sample->ms[PHASE_LOOP] = list->loopMs;
+        sample->ms[PHASE_WINDOW] = list->windowMs;
+        sample->ms[PHASE_GC] = list->gcMs;
+        sample->ticks = list->ticks;
+        sample->allocations = list->allocations;
+        sample->mallocs = list->mallocs;
+    }
+    sample->luaMemoryKB = list->luaMemoryKB;
+    
+    double t = glfwGetTime();
+    glClearColor(list->clearColor[0], list->clearColor[1], list->clearColor[2], 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    for (int i = 0; i < list->commandCount; i++) {
+        const DrawCommand* command = &list->commands[i];
+        Batch batch = {
+            .data = list->data + command->first,
+            .count = command->count,
+            .used = command->used,
+            .capacity = command->used,
+            .kind = command->kind,
+        };
+        setProjection(command->projection);
+        submitBatch(&batch);
     }
+    streamEndFrame(&g_engine.stream);
+    double mark = glfwGetTime();
+    sample->ms[PHASE_SUBMIT] = (float)(mark - t) * 1000.0f;
+    t = mark;
     
     glfwSwapBuffers(g_engine.window);
+    mark = glfwGetTime();
+    sample->ms[PHASE_SWAP] = (float)(mark - t) * 1000.0f;
+    t = mark;
+    
     glfwPollEvents();
+    sample->ms[PHASE_POLL] = (float)(glfwGetTime() - t) * 1000.0f;
+    statsCommit(&g_engine.stats, NULL);
     
     if (glfwWindowShouldClose(g_engine.window)) {
         g_engine.running = 0;
     }
 }
 
+/* Moves Lua onto the simulation thread; from here on only that thread
+ * may touch the Lua state */
+static int threadedStart(void) {
+    ThreadedState* ts = &g_threaded;
+    ts->writing = 0;
+    ts->ready = 1;
+    ts->reading = 2;
+    for (int i = 0; i < 3; i++) {
+        memcpy(ts->lists[i].clearColor, g_engine.clearColor, sizeof(g_engine.clearColor));
+    }
+    ts->input = g_input.current;
+    ts->stats = g_engine.stats;
+    ts->simStats = g_engine.stats;
+    ts->lastTime = glfwGetTime();
+    g_engine.lastTime = ts->lastTime;
+    
+    pthread_mutex_init(&ts->mutex, NULL);
+    pthread_mutex_init(&ts->resourceMutex, NULL);
+    pthread_cond_init(&ts->cond, NULL);
+    ts->running = 1;
+    if (pthread_create(&ts->thread, NULL, simulationThread, NULL) != 0) {
+        fprintf(stderr, "Failed to start simulation thread\n");
+        ts->running = 0;
+        pthread_cond_destroy(&ts->cond);
+        pthread_mutex_destroy(&ts->resourceMutex);
+        pthread_mutex_destroy(&ts->mutex);
+        return 0;
+    }
+    return 1;
+}
+
+/* Joins the simulation thread, handing Lua back to the main thread */
+static void threadedStop(void) {
+    ThreadedState* ts = &g_threaded;
+    if (!ts->running) return;
+    
+    pthread_mutex_lock(&ts->mutex);
+    ts->quit = 1;
+    pthread_cond_broadcast(&ts->cond);
+    pthread_mutex_unlock(&ts->mutex);
+    pthread_join(ts->thread, NULL);
+    
+    /* No list is drawn again */
+    deleteReleasedGLObjects(ts->recordFrame + 1);
+    ts->running = 0;
+    pthread_cond_destroy(&ts->cond);
+    pthread_mutex_destroy(&ts->resourceMutex);
+    pthread_mutex_destroy(&ts->mutex);
+    
+    for (int i = 0; i < 3; i++) {
+        free(ts->lists[i].commands);
+        free(ts->lists[i].data);
+    }
+    free(ts->released);
+    memset(ts->lists, 0, sizeof(ts->lists));
+    ts->released = NULL;
+    ts->releasedCount = 0;
+    ts->releasedCapacity = 0;
+}
+#endif
+
+/* ============================================================ */
+/* BENCHMARK */
+/* ============================================================ */
+
+#ifndef __EMSCRIPTEN__
+static int benchStart(void) {
+    BenchState* b = &g_bench;
+    if (b->frames < 1) b->frames = 1;
+    if (b->warmup < 0) b->warmup = 0;
+    b->samples = malloc((size_t)b->frames * sizeof(FrameSample));
+    if (!b->samples) {
+        fprintf(stderr, "Out of memory for %d benchmark frames\n", b->frames);
+        return 0;
+    }
+    return 1;
+}
+
+/* Called after each frame; returns 0 once enough frames are recorded */
+static int benchRecord(void) {
+    BenchState* b = &g_bench;
+    if (b->frame++ < b->warmup) return 1;
+    b->samples[b->recorded++] = *statsSample(&g_engine.stats, 0);
+    if (g_frameArena.peak > b->arenaPeak) b->arenaPeak = g_frameArena.peak;
+    return b->recorded < b->frames;
+}
+
+static int compareFloats(const void* a, const void* b) {
+    float x = *(const float*)a, y = *(const float*)b;
+    return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile of sorted values */
+static float benchPercentile(const float* sorted, int count, float p) {
+    int rank = (int)ceilf(p / 100.0f * count);
+    if (rank < 1) rank = 1;
+    return sorted[rank - 1];
+}
+
+static void benchWriteString(FILE* out, const char* s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') fprintf(out, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20) fprintf(out, "\\u%04x", *s);
+        else fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+/* Writes {"mean", "p50", "p90", "p99", "max"} of values, sorting them */
+static void benchWriteDistribution(FILE* out, float* values, int count) {
+    double sum = 0.0;
+    for (int i = 0; i < count; i++) sum += values[i];
+    qsort(values, (size_t)count, sizeof(float), compareFloats);
+    fprintf(out, "{\"mean\": %.4f, \"p50\": %.4f, \"p90\": %.4f, \"p99\": %.4f, \"max\": %.4f}",
+            sum / count, benchPercentile(values, count, 50.0f), benchPercentile(values, count, 90.0f),
+            benchPercentile(values, count, 99.0f), values[count - 1]);
+}
+
+/* Summarizes the recorded frames as one JSON object: per-phase
+ * millisecond distributions and per-frame counter distributions */
+static int benchReport(void) {
+    BenchState* b = &g_bench;
+    int n = b->recorded;
+    if (n == 0) {
+        fprintf(stderr, "Benchmark ended before any frame was recorded\n");
+        return 0;
+    }
+    float* values = malloc((size_t)n * sizeof(float));
+    FILE* out = b->output ? fopen(b->output, "w") : stdout;
+    if (!values || !out) {
+        fprintf(stderr, "Failed to write benchmark results%s%s\n", b->output ? " to " : "",
+                b->output ? b->output : "");
+        free(values);
+        if (out && out != stdout) fclose(out);
+        return 0;
+    }
+    
+    fprintf(out, "{\n  \"scenario\": ");
+    benchWriteString(out, b->script);
+    fprintf(out, ",\n  \"frames\": %d,\n  \"warmup\": %d,\n", n, b->warmup);
+    fprintf(out, "  \"jobWorkers\": %d,\n  \"streamMode\": \"%s\",\n",
+            jobWorkerCount(), g_streamModeNames[g_engine.stream.mode]);
+    fprintf(out, "  \"luaMemoryKB\": %.1f,\n  \"arenaPeakKB\": %.1f,\n",
+            b->samples[n - 1].luaMemoryKB, b->arenaPeak / 1024.0);
+    
+    fprintf(out, "  \"ms\": {");
+    float p50 = 0.0f, p99 = 0.0f;
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        for (int i = 0; i < n; i++) values[i] = b->samples[i].ms[p];
+        fprintf(out, "%s\n    \"%s\": ", p ? "," : "", g_phaseNames[p]);
+        benchWriteDistribution(out, values, n);
+        if (p == PHASE_FRAME) {
+            p50 = benchPercentile(values, n, 50.0f);
+            p99 = benchPercentile(values, n, 99.0f);
+        }
+    }
+    
+    static const char* const counterNames[] = { "ticks", "drawCalls", "vertices", "allocations", "mallocs" };
+    fprintf(out, "\n  },\n  \"perFrame\": {");
+    for (int c = 0; c < 5; c++) {
+        for (int i = 0; i < n; i++) {
+            const FrameSample* s = &b->samples[i];
+            const int counters[] = { s->ticks, s->drawCalls, s->vertices, s->allocations, s->mallocs };
+            values[i] = (float)counters[c];
+        }
+        fprintf(out, "%s\n    \"%s\": ", c ? "," : "", counterNames[c]);
+        benchWriteDistribution(out, values, n);
+    }
+    fprintf(out, "\n  }\n}\n");
+    
+    if (out != stdout) {
+        fclose(out);
+        printf("%s: %d frames, %.2f ms p50, %.2f ms p99 -> %s\n", b->script, n, p50, p99, b->output);
+    }
+    free(values);
+    return 1;
+}
+
+static void benchStop(void) {
+    free(g_bench.samples);
+    g_bench.samples = NULL;
+}
+#endif
+
 /* ============================================================ */
 /* INITIALIZATION */
 /* ============================================================ */
@@ -429,14 +10645,17 @@ int initGLFW(int width, int height) {
         return 0;
     }
     
+    /* Instanced drawing needs WebGL 2 / OpenGL 3.3 */
 #ifdef __EMSCRIPTEN__
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 2);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 0);
 #else
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 2);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 1);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GLFW_TRUE);
 #endif
+    if (g_bench.script) glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
     
     g_engine.window = glfwCreateWindow(width, height, "Game Framework", NULL, NULL);
     if (!g_engine.window) {
@@ -446,32 +10665,36 @@ int initGLFW(int width, int height) {
     }
     
     glfwMakeContextCurrent(g_engine.window);
-    glfwSwapInterval(1);
+    glfwSwapInterval(g_bench.script ? 0 : 1);
     
     glViewport(0, 0, width, height);
-    glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
+    glClearColor(g_engine.clearColor[0], g_engine.clearColor[1], g_engine.clearColor[2], 1.0f);
     
     g_engine.windowWidth = width;
     g_engine.windowHeight = height;
     
+    glfwSetFramebufferSizeCallback(g_engine.window, onFramebufferResize);
+    inputInstallCallbacks(g_engine.window);
+    inputSample(&g_input.current);
+    
     return 1;
 }
 
 int initLua() {
-    g_engine.L = luaL_newstate();
+    g_engine.L = lua_newstate(luaPoolAlloc, &g_luaPool);
     if (!g_engine.L) {
         fprintf(stderr, "Failed to create Lua state\n");
         return 0;
     }
+    lua_atpanic(g_engine.L, luaPanic);
     
     luaL_openlibs(g_engine.L);
     registerLuaFunctions(g_engine.L);
+    registerEmbeddedModules(g_engine.L);
     
-    const char* luaCode =
-#include "game.lua.h"
-    ;
-    
-    if (luaL_dostring(g_engine.L, luaCode) != LUA_OK) {
+    int status = g_bench.script ? luaL_loadfilex(g_engine.L, g_bench.script, "t")
+                                : loadEmbeddedScript(g_engine.L, &g_embeddedScripts[0]);
+    if (status != LUA_OK || lua_pcall(g_engine.L, 0, 0, 0) != LUA_OK) {
         fprintf(stderr, "Lua error: %s\n", lua_tostring(g_engine.L, -1));
         lua_pop(g_engine.L, 1);
         return 0;
@@ -489,8 +10712,22 @@ int initLua() {
 }
 
 int initGraphics() {
-    g_engine.shaderProgram = createShaderProgram();
-    glUseProgram(g_engine.shaderProgram);
+    g_engine.view.camera.zoom = 1.0f;
+    g_engine.view.camera.active = 1;
+    initShaderProgram(&g_engine.shaderProgram,
+                      createShaderProgram(vertexShaderSource, fragmentShaderSource));
+    initShaderProgram(&g_engine.circleProgram,
+                      createShaderProgram(circleVertexShaderSource, circleFragmentShaderSource));
+    initShaderProgram(&g_engine.spriteProgram,
+                      createShaderProgram(spriteVertexShaderSource, spriteFragmentShaderSource));
+    updateProjection();
+    
+    /* Straight alpha blending; the circle edge relies on it */
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    
+    useProgram(&g_engine.shaderProgram);
+    initBatch();
     return 1;
 }
 
@@ -502,6 +10739,7 @@ int initGraphics() {
 int main() {
     if (!initGLFW(1280, 720)) return 1;
     if (!initGraphics()) return 1;
+    jobPoolStart(-1);
     if (!initLua()) return 1;
     
     g_engine.running = 1;
@@ -510,26 +10748,65 @@ int main() {
     emscripten_set_main_loop(mainLoopCallback, 0, 1);
     
     lua_close(g_engine.L);
+    assetStop();
+    luaPoolRelease(&g_luaPool);
+    jobPoolStop();
+    arenaRelease(&g_frameArena);
+    arenaRelease(&g_renderArena);
+    shutdownBatch();
     glfwTerminate();
     
     return 0;
 }
 #else
-int main() {
+int main(int argc, char** argv) {
+    int jobWorkers = -1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--dev") == 0) devInit();
+        else if (strcmp(argv[i], "--threaded") == 0) g_threaded.enabled = 1;
+        else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) jobWorkers = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) g_bench.script = argv[++i];
+        else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) g_bench.frames = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) g_bench.warmup = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--bench-out") == 0 && i + 1 < argc) g_bench.output = argv[++i];
+    }
+    /* Measured single-threaded, against the script on the command line */
+    if (g_bench.script) {
+        g_threaded.enabled = 0;
+        g_dev.enabled = 0;
+        if (!benchStart()) return 1;
+    }
+    
     if (!initGLFW(1280, 720)) return 1;
     if (!initGraphics()) return 1;
+    jobPoolStart(jobWorkers);
     if (!initLua()) return 1;
     
     g_engine.running = 1;
     g_engine.lastTime = glfwGetTime();
+    if (g_threaded.enabled && !threadedStart()) return 1;
     
     while (g_engine.running && !glfwWindowShouldClose(g_engine.window)) {
-        mainLoop();
+        if (g_threaded.running) threadedFrame();
+        else mainLoop();
+        if (g_bench.script && !benchRecord()) break;
     }
     
+    int status = 0;
+    if (g_bench.script) {
+        status = benchReport() ? 0 : 1;
+        benchStop();
+    }
+    threadedStop();
     lua_close(g_engine.L);
+    assetStop();
+    luaPoolRelease(&g_luaPool);
+    jobPoolStop();
+    arenaRelease(&g_frameArena);
+    arenaRelease(&g_renderArena);
+    shutdownBatch();
     glfwTerminate();
     
-    return 0;
+    return status;
 }
 #endif
\ No newline at end of file
@@ -43,13 +43,67 @@ function vec2:normalize()
 end
 
 function vec2:distance(other)
-    return (self - other):length()
+    local dx, dy = self.x - other.x, self.y - other.y
+    return math.sqrt(dx * dx + dy * dy)
 end
 
 function vec2:dot(other)
     return self.x * other.x + self.y * other.y
 end
 
+-- In-place variants write into self and return it, so hot loops can
+-- reuse one vector instead of allocating a table per operation.
+function vec2:set(x, y)
+    self.x = x or 0
+    self.y = y or 0
+    return self
+end
+
+function vec2:copy(other)
+    self.x = other.x
+    self.y = other.y
+    return self
+end
+
+function vec2:addInPlace(other)
+    self.x = self.x + other.x
+    self.y = self.y + other.y
+    return self
+end
+
+function vec2:subInPlace(other)
+    self.x = self.x - other.x
+    self.y = self.y - other.y
+    return self
+end
+
+function vec2:mulInPlace(scalar)
+    self.x = self.x * scalar
+    self.y = self.y * scalar
+    return self
+end
+
+function vec2:normalizeInPlace()
+    local len = self:length()
+    if len > 0 then
+        self.x = self.x / len
+        self.y = self.y / len
+    end
+    return self
+end
+
+-- Recycled vectors for short-lived temporaries: vec2.acquire(x, y) and
+-- vec2.release(v) once v is no longer referenced
+local vec2Pool = pool.new(vec2.new, vec2.set)
+
+function vec2.acquire(x, y)
+    return vec2Pool:acquire(x, y)
+end
+
+function vec2.release(v)
+    vec2Pool:release(v)
+end
+
 function vec2.__add(a, b)
     return a:add(b)
 end
@@ -69,8 +123,10 @@ end
 
 local class = {}
 
+-- Class tables are kept across hot reloads (engine.keep) and refilled in
+-- place, so live instances pick up edited methods.
 function class.new(name, parent)
-    local cls = {}
+    local cls = engine.keep("class." .. name, {})
     cls.__name = name
     cls.__parent = parent
     cls.__index = cls
@@ -104,7 +160,124 @@ component.TYPE_MENU = "menu"
 
 local Component = class.new("Component")
 
+-- Transform, color and flags live in the engine's entity store
+-- (engine.c) as contiguous arrays; a Component is a thin view that
+-- keeps only its handle and Lua-side data (type, props, children).
+-- Reads and writes of the fields below go straight to the store.
+-- Children are parented in the store too, so a child's x, y, rotation
+-- and scale are relative to its parent.
+local entity = entity
+
+local viewFields = {
+    x = entity.X, y = entity.Y,
+    width = entity.WIDTH, height = entity.HEIGHT,
+    rotation = entity.ROTATION,
+    scaleX = entity.SCALE_X, scaleY = entity.SCALE_Y,
+    layer = entity.LAYER, depth = entity.DEPTH,
+    visible = entity.VISIBLE, active = entity.ACTIVE,
+}
+
+local shapeForType = {
+    [component.TYPE_RECT] = "rect",
+    [component.TYPE_CIRCLE] = "circle",
+}
+
+-- comp.color is a proxy onto the stored channels, so both
+-- comp.color = {...} and comp.color.r = 0.5 write through.
+local colorFields = {r = entity.R, g = entity.G, b = entity.B, a = entity.A}
+local ColorView = {
+    __index = function(view, key)
+        local field = colorFields[key]
+        if field then return entity.get(view[1], field) end
+    end,
+    __newindex = function(view, key, value)
+        local field = colorFields[key]
+        if field then
+            entity.set(view[1], field, value)
+        else
+            rawset(view, key, value)
+        end
+    end,
+}
+
+function Component.__index(self, key)
+    local field = viewFields[key]
+    if field then
+        return entity.get(rawget(self, "handle"), field)
+    end
+    if key == "color" then
+        local view = setmetatable({rawget(self, "handle")}, ColorView)
+        rawset(self, "color", view)
+        return view
+    end
+    return Component[key]
+end
+
+-- Fields that move a component's box and everything parented to it
+local transformFields = {
+    x = true, y = true, width = true, height = true,
+    rotation = true, scaleX = true, scaleY = true,
+}
+local refreshButtons
+
+function Component.__newindex(self, key, value)
+    local field = viewFields[key]
+    if field then
+        entity.set(rawget(self, "handle"), field, value)
+        if transformFields[key] then refreshButtons(self) end
+    elseif key == "color" then
+        entity.setColor(rawget(self, "handle"),
+                        value.r or 1, value.g or 1, value.b or 1, value.a or 1)
+    else
+        rawset(self, key, value)
+    end
+end
+
+-- The store slot is released when the view is collected
+function Component.__gc(self)
+    entity.destroy(rawget(self, "handle"))
+end
+
+-- Buttons are indexed in a dynamic AABB tree (engine.c), so mouse
+-- picking is one tree query instead of a pointRect sweep over every
+-- button. A transform change made through a component refreshes the
+-- boxes of the buttons below it; buttonsBelow counts them so subtrees
+-- without buttons are skipped. Writes made straight to the store
+-- (entity.set, scheduler tweens) are picked up by the next such change.
+local buttonTree = engine.keep("buttonTree", collision.newTree)
+local buttonsByProxy = engine.keep("buttonsByProxy", {})
+local buttonPickBuffer = {}
+local buttonCount = 0
+
+-- World-space bounds of the button's four corners, so rotation and
+-- scale from it or its ancestors are covered
+local function buttonBox(button)
+    local handle, w, h = button.handle, button.width, button.height
+    local x1, y1 = entity.localToWorld(handle, 0, 0)
+    local x2, y2 = entity.localToWorld(handle, w, 0)
+    local x3, y3 = entity.localToWorld(handle, 0, h)
+    local x4, y4 = entity.localToWorld(handle, w, h)
+    local minX, minY = math.min(x1, x2, x3, x4), math.min(y1, y2, y3, y4)
+    return minX, minY, math.max(x1, x2, x3, x4) - minX, math.max(y1, y2, y3, y4) - minY
+end
+
+function refreshButtons(comp)
+    if (comp.buttonsBelow or 0) == 0 then return end
+    if comp.proxy then buttonTree:move(comp.proxy, buttonBox(comp)) end
+    for _, child in ipairs(comp.children) do
+        refreshButtons(child)
+    end
+end
+
+local function addButtonsBelow(comp, n)
+    while comp do
+        comp.buttonsBelow = (comp.buttonsBelow or 0) + n
+        comp = comp.parent
+    end
+end
+
 function Component:init(compType, props)
+    rawset(self, "handle", entity.create(shapeForType[compType]))
     self.type = compType
     self.x = props.x or 0
     self.y = props.y or 0
@@ -114,7 +287,9 @@ function Component:init(compType, props)
     self.scaleX = props.scaleX or 1
     self.scaleY = props.scaleY or 1
     self.visible = props.visible ~= false
-    self.color = props.color or {r = 1, g = 1, b = 1, a = 1}
+    if props.color then self.color = props.color end
+    if props.layer then self.layer = props.layer end
+    if props.depth then self.depth = props.depth end
     self.props = props
     self.children = {}
     self.parent = nil
@@ -122,8 +297,9 @@ function Component:init(compType, props)
 end
 
 function Component:setPosition(x, y)
-    self.x = x
-    self.y = y
+    entity.set(self.handle, entity.X, x)
+    entity.set(self.handle, entity.Y, y)
+    refreshButtons(self)
 end
 
 function Component:getPosition()
@@ -133,6 +309,9 @@ end
 function Component:addChild(child)
     table.insert(self.children, child)
     child.parent = self
+    entity.setParent(child.handle, self.handle)
+    addButtonsBelow(self, child.buttonsBelow or 0)
+    refreshButtons(child)
     return child
 end
 
@@ -140,7 +319,10 @@ function Component:removeChild(child)
     for i, c in ipairs(self.children) do
         if c == child then
             table.remove(self.children, i)
+            addButtonsBelow(self, -(child.buttonsBelow or 0))
             child.parent = nil
+            entity.setParent(child.handle, nil)
+            refreshButtons(child)
             break
         end
     end
@@ -148,12 +330,29 @@ end
 
 function Component:destroy()
     self.active = false
+    if self.proxy then
+        buttonTree:remove(self.proxy)
+        buttonsByProxy[self.proxy] = nil
+        self.proxy = nil
+        addButtonsBelow(self, -1)
+    end
     for _, child in ipairs(self.children) do
         child:destroy()
     end
 end
 
 function Component:update(dt)
+    -- Sprite sheet animation: cycle frameCount regions from firstFrame
+    if self.frameCount and self.frameCount > 1 then
+        self.frameTime = self.frameTime + dt
+        local step = math.floor(self.frameTime * self.fps)
+        local frame = self.firstFrame + step % self.frameCount
+        if frame ~= self.frame then
+            self.frame = frame
+            entity.setSprite(self.handle, self.atlas, frame)
+        end
+    end
+    
     -- Override in subclasses
     for _, child in ipairs(self.children) do
         if child.active then
@@ -162,24 +361,16 @@ function Component:update(dt)
     end
 end
 
+-- Draws the component's whole tree natively: world transforms are
+-- cached per entity and the shown nodes are drawn sorted by layer,
+-- material and depth. Hidden or inactive nodes hide their subtree.
 function Component:draw()
-    if not self.visible then return end
-    
-    if self.type == component.TYPE_RECT then
-        draw.rect(self.x, self.y, self.width, self.height, 
-                  self.color.r, self.color.g, self.color.b, self.color.a)
-    elseif self.type == component.TYPE_CIRCLE then
-        draw.circle(self.x, self.y, self.width, 
-                    self.color.r, self.color.g, self.color.b, self.color.a)
-    elseif self.type == component.TYPE_LABEL then
-        draw.text(self.props.text or "Label", self.x, self.y)
-    end
-    
-    for _, child in ipairs(self.children) do
-        if child.active then
-            child:draw()
-        end
-    end
+    entity.drawTree(self.handle)
+end
+
+function Component:setText(text)
+    self.props.text = text
+    entity.setText(self.handle, text, self.props.font)
 end
 
 component.Component = Component
@@ -192,16 +383,56 @@ function component.newCircle(props)
     return Component.new(component.TYPE_CIRCLE, props)
 end
 
+-- props.atlas and props.frame name an atlas region; with frameCount
+-- (e.g. from atlas:loadSheet) and fps the sprite animates through
+-- consecutive regions. Size defaults to the first frame's.
 function component.newSprite(props)
-    return Component.new(component.TYPE_SPRITE, props)
+    local sprite = Component.new(component.TYPE_SPRITE, props)
+    sprite.atlas = props.atlas
+    sprite.firstFrame = props.frame or 1
+    sprite.frame = sprite.firstFrame
+    sprite.frameCount = props.frameCount or 1
+    sprite.fps = props.fps or 10
+    sprite.frameTime = 0
+    if sprite.atlas and (props.width == nil or props.height == nil) then
+        local _, _, w, h = sprite.atlas:region(sprite.frame)
+        sprite.width = props.width or w
+        sprite.height = props.height or h
+    end
+    if sprite.atlas then
+        entity.setSprite(sprite.handle, sprite.atlas, sprite.frame)
+    end
+    return sprite
 end
 
 function component.newButton(props)
-    return Component.new(component.TYPE_BUTTON, props)
+    local button = Component.new(component.TYPE_BUTTON, props)
+    buttonCount = buttonCount + 1
+    button.pickOrder = buttonCount
+    button.proxy = buttonTree:insert(buttonBox(button))
+    buttonsByProxy[button.proxy] = button
+    addButtonsBelow(button, 1)
+    return button
+end
+
+-- Topmost (most recently created) visible button under a point, or nil
+function component.buttonAt(x, y)
+    local ids, n = buttonTree:queryPoint(x, y, buttonPickBuffer)
+    local best = nil
+    for i = 1, n do
+        local button = buttonsByProxy[ids[i]]
+        if button and button.active and button.visible and
+           (not best or button.pickOrder > best.pickOrder) then
+            best = button
+        end
+    end
+    return best
 end
 
 function component.newLabel(props)
-    return Component.new(component.TYPE_LABEL, props)
+    local label = Component.new(component.TYPE_LABEL, props)
+    label:setText(props.text or "Label")
+    return label
 end
 
 function component.newPlayer(props)
@@ -216,50 +447,40 @@ end
 -- 4. ANIMATION SYSTEM
 -- ============================================================
 
+-- Animations and timers are driven by the engine scheduler: nothing
+-- needs an update(dt) call, and a pending timer costs nothing until it
+-- fires. The objects below are thin wrappers over scheduler handles.
+
 local Animation = class.new("Animation")
 
 function Animation:init(duration, callback)
     self.duration = duration or 1.0
-    self.elapsed = 0
     self.callback = callback
     self.loop = false
-    self.running = true
-end
-
-function Animation:update(dt)
-    if not self.running then return end
-    
-    self.elapsed = self.elapsed + dt
-    
-    if self.elapsed >= self.duration then
-        self.elapsed = self.duration
-        if self.callback then
-            self.callback(1.0)
-        end
-        if self.loop then
-            self.elapsed = 0
-        else
-            self.running = false
-        end
-    else
-        if self.callback then
-            self.callback(self.elapsed / self.duration)
-        end
-    end
+    self:reset()
 end
 
 function Animation:setLoop(loop)
     self.loop = loop
+    if self:isRunning() then self:reset() end
     return self
 end
 
 function Animation:stop()
-    self.running = false
+    if self.handle then scheduler.cancel(self.handle) end
+    self.handle = nil
 end
 
 function Animation:reset()
-    self.elapsed = 0
-    self.running = true
+    self:stop()
+    if self.callback then
+        self.handle = scheduler.animate(self.duration, self.callback, self.loop)
+    end
+    return self
+end
+
+function Animation:isRunning()
+    return self.handle ~= nil and scheduler.isPending(self.handle)
 end
 
 local animation = {}
@@ -276,36 +497,36 @@ local Timer = class.new("Timer")
 
 function Timer:init(duration, callback)
     self.duration = duration
-    self.elapsed = 0
-    self.callback = callback
-    self.finished = false
+    self.callback = callback or function() end
+    self.handle = scheduler.after(duration, self.callback)
 end
 
-function Timer:update(dt)
-    if self.finished then return end
-    
-    self.elapsed = self.elapsed + dt
-    if self.elapsed >= self.duration then
-        self.finished = true
-        if self.callback then
-            self.callback()
-        end
-    end
+function Timer:isFinished()
+    return not scheduler.isPending(self.handle)
 end
 
-function Timer:isFinished()
-    return self.finished
+function Timer:cancel()
+    scheduler.cancel(self.handle)
 end
 
 function Timer:reset()
-    self.elapsed = 0
-    self.finished = false
+    scheduler.cancel(self.handle)
+    self.handle = scheduler.after(self.duration, self.callback)
 end
 
 local timer = {}
 
+-- Timer:init assigns every field, so it doubles as the pool's reset
+local timerPool = pool.new(Timer.new, Timer.init)
+
 function timer.create(duration, callback)
-    return Timer.new(duration, callback)
+    return timerPool:acquire(duration, callback)
+end
+
+-- Cancels the timer if still pending and recycles it for timer.create
+function timer.release(t)
+    t:cancel()
+    timerPool:release(t)
 end
 
 -- ============================================================
@@ -354,7 +575,17 @@ local gameState = GameState.new()
 -- 7. COLLISION SYSTEM
 -- ============================================================
 
-local collision = {}
+-- The engine provides the table with collision.newWorld(cellSize), a
+-- spatial-hash broadphase:
+--
+--   local world = collision.newWorld(64)
+--   local id = world:insert(x, y, w, h)
+--   world:update(id, x, y, w, h)
+--   world:remove(id)
+--   local pairs, n = world:queryPairs(out)  -- {a1, b1, a2, b2, ...}
+--
+-- The pairwise tests below are added to it.
+local collision = collision
 
 function collision.pointRect(px, py, rx, ry, rw, rh)
     return px >= rx and px <= rx + rw and py >= ry and py <= ry + rh
@@ -382,77 +613,19 @@ end
 -- 8. PARTICLE SYSTEM
 -- ============================================================
 
-local Particle = class.new("Particle")
-
-function Particle:init(x, y, vx, vy, lifetime, color)
-    self.x = x
-    self.y = y
-    self.vx = vx or 0
-    self.vy = vy or 0
-    self.lifetime = lifetime or 1.0
-    self.elapsed = 0
-    self.color = color or {r = 1, g = 1, b = 1, a = 1}
-    self.alive = true
-end
-
-function Particle:update(dt)
-    self.elapsed = self.elapsed + dt
-    self.x = self.x + self.vx * dt
-    self.y = self.y + self.vy * dt
-    
-    if self.elapsed >= self.lifetime then
-        self.alive = false
-    end
-end
-
-function Particle:draw()
-    draw.circle(self.x, self.y, 3, self.color.r, self.color.g, self.color.b, self.color.a)
-end
-
-local ParticleEmitter = class.new("ParticleEmitter")
-
-function ParticleEmitter:init(x, y)
-    self.x = x
-    self.y = y
-    self.particles = {}
-    self.emitting = false
-end
-
-function ParticleEmitter:emit(count, vx, vy, lifetime, color)
-    for i = 1, count do
-        local particle = Particle.new(
-            self.x + math.random(-10, 10),
-            self.y + math.random(-10, 10),
-            vx + math.random(-50, 50) / 50,
-            vy + math.random(-50, 50) / 50,
-            lifetime,
-            color
-        )
-        table.insert(self.particles, particle)
-    end
-end
-
-function ParticleEmitter:update(dt)
-    for i = #self.particles, 1, -1 do
-        local p = self.particles[i]
-        p:update(dt)
-        if not p.alive then
-            table.remove(self.particles, i)
-        end
-    end
-end
+-- Emitters are native userdata owned by the engine (engine.c). They
+-- keep particles in flat C arrays and expose the same interface the
+-- old Lua emitter had:
+--
+--   local emitter = particle.newEmitter(x, y)
+--   emitter:emit(count, vx, vy, lifetime, color)
+--   emitter:update(dt)
+--   emitter:draw()
+--
+-- plus emitter.x / emitter.y, emitter:count() (or #emitter) and
+-- emitter:clear().
 
-function ParticleEmitter:draw()
-    for _, p in ipairs(self.particles) do
-        p:draw()
-    end
-end
-
-local particle = {}
-
-function particle.newEmitter(x, y)
-    return ParticleEmitter.new(x, y)
-end
+local particle = particle
 
 -- ============================================================
 -- 9. SIGNAL/EVENT DISPATCHER
@@ -494,34 +667,10 @@ end
 -- 10. CAMERA SYSTEM
 -- ============================================================
 
-local Camera = class.new("Camera")
-
-function Camera:init(x, y, width, height)
-    self.x = x or 0
-    self.y = y or 0
-    self.width = width or 800
-    self.height = height or 600
-    self.zoom = 1.0
-end
-
-function Camera:setPosition(x, y)
-    self.x = x
-    self.y = y
-end
-
-function Camera:setZoom(zoom)
-    self.zoom = zoom
-end
-
-function Camera:worldToScreen(wx, wy)
-    return (wx - self.x) * self.zoom, (wy - self.y) * self.zoom
-end
-
-function Camera:screenToWorld(sx, sy)
-    return sx / self.zoom + self.x, sy / self.zoom + self.y
-end
-
-local camera = Camera.new(0, 0, 800, 600)
+-- The camera lives in the engine: it sets the projection for window()
+-- and culls draws outside its view. Call camera:setActive(false) before
+-- drawing HUD elements in screen pixels.
+local camera = camera
 
 -- ============================================================
 -- 11. AI SYSTEM
@@ -608,8 +757,11 @@ end
 -- MAIN GAME FRAMEWORK INITIALIZATION
 -- ============================================================
 
--- Global component registry
-local components = {}
+-- Global component registry, kept when the script is hot reloaded
+local components = engine.keep("components", {})
+
+-- Reused by engine.stats() every frame
+local frameStats = {}
 
 -- ============================================================
 -- INIT - Called once at startup
@@ -661,11 +813,10 @@ function init()
     local animRotation = 0
     local rotAnim = animation.create(2.0, function(progress)
         animRotation = progress * 360
-    end):setLoop(true):reset()
+    end):setLoop(true)
     table.insert(components, {
         type = "animation",
         anim = rotAnim,
-        update = function(self, dt) self.anim:update(dt) end,
         draw = function(self) end
     })
     
@@ -676,6 +827,16 @@ function init()
     _G.animRotation = animRotation
 end
 
+-- ============================================================
+-- ONRELOAD - Called after a hot reload in dev mode (--dev)
+-- ============================================================
+-- init() is not re-run: state held through engine.keep survives, and
+-- the freshly defined functions take effect immediately.
+
+function onReload()
+    print("[ENGINE] Game script reloaded, " .. #components .. " components kept")
+end
+
 -- ============================================================
 -- LOOP - Called every frame with dt (delta time)
 -- ============================================================
@@ -723,8 +884,10 @@ end
 -- ============================================================
 -- WINDOW - Called every frame to render
 -- ============================================================
+-- alpha is the fraction of a simulation tick elapsed since the last
+-- loop() when engine.setFixedTimestep is on (always 1 otherwise).
 
-function window()
+function window(alpha)
     -- Clear and set background
     graphics.setClearColor(0.05, 0.05, 0.1)
     
@@ -736,6 +899,8 @@ function window()
     end
     
     -- Draw debug info
-    local winSize = graphics.getWindowSize()
-    draw.text("FPS: ~60 | Components: " .. #components, 10, 30)
+    local stats = engine.stats(frameStats)
+    draw.text(string.format("FPS: %.0f (%.1f ms, max %.1f) | Draws: %d | Lua: %.0f KB | Components: %d",
+                            stats.fps, stats.frameAvgMs, stats.frameMaxMs,
+                            stats.drawCalls, stats.luaMemoryKB, #components), 10, 30)
 end
\ No newline at end of file
@@ -9,6 +9,15 @@
 
 local GameScene = class.new("GameScene")
 
+-- Bullets are recycled rather than dropped for the collector: one is
+-- fired every 0.1 s and most live well under a second
+local bulletPool = pool.new(function(x, y)
+    return {x = x, y = y}
+end, function(bullet, x, y)
+    bullet.x = x
+    bullet.y = y
+end)
+
 function GameScene:init()
     self.player = nil
     self.enemies = {}
@@ -16,6 +25,25 @@ function GameScene:init()
     self.score = 0
     self.wave = 1
     self.waveTimer = nil
+    
+    -- Broadphase for bullets vs enemies; bodies maps body id -> object
+    self.world = collision.newWorld(64)
+    self.bodies = {}
+    self.pairBuffer = {}
+end
+
+function GameScene:addBody(obj, kind, x, y, w, h)
+    obj.kind = kind
+    obj.body = self.world:insert(x, y, w, h)
+    self.bodies[obj.body] = obj
+end
+
+function GameScene:removeBody(obj)
+    if obj.body then
+        self.world:remove(obj.body)
+        self.bodies[obj.body] = nil
+        obj.body = nil
+    end
 end
 
 function GameScene:enter()
@@ -54,16 +82,18 @@ function GameScene:spawnWave()
         enemy.ai = ai.newAI(enemy.comp)
         enemy.ai:setState("move")
         
+        local r = enemy.comp.width
+        self:addBody(enemy, "enemy", enemy.comp.x - r, enemy.comp.y - r, r * 2, r * 2)
         table.insert(self.enemies, enemy)
     end
 end
 
 function GameScene:update(dt)
     -- Update player
-    if keyboard.isDown("a") then
+    if input.isDown("left") then
         self.player.comp.x = self.player.comp.x - self.player.speed * dt
     end
-    if keyboard.isDown("d") then
+    if input.isDown("right") then
         self.player.comp.x = self.player.comp.x + self.player.speed * dt
     end
     
@@ -72,7 +102,7 @@ function GameScene:update(dt)
     if self.player.comp.x > 1250 then self.player.comp.x = 1250 end
     
     -- Shooting
-    if keyboard.isDown("space") then
+    if input.isDown("fire") then
         self:shoot()
     end
     
@@ -83,7 +113,11 @@ function GameScene:update(dt)
         
         -- Remove off-screen bullets
         if bullet.y < 0 then
+            self:removeBody(bullet)
             table.remove(self.bullets, i)
+            bulletPool:release(bullet)
+        else
+            self.world:update(bullet.body, bullet.x, bullet.y)
         end
     end
     
@@ -96,29 +130,49 @@ function GameScene:update(dt)
         
         -- Remove off-screen enemies
         if enemy.comp.y > 720 then
+            self:removeBody(enemy)
             table.remove(self.enemies, i)
             self.score = self.score + 100
         else
-            -- Check collision with bullets
-            for j = #self.bullets, 1, -1 do
-                local bullet = self.bullets[j]
+            local r = enemy.comp.width
+            self.world:update(enemy.body, enemy.comp.x - r, enemy.comp.y - r)
+        end
+    end
+    
+    -- Check bullets against enemies: one broadphase query for the wave
+    local hits, n = self.world:queryPairs(self.pairBuffer)
+    for k = 1, n do
+        local a = self.bodies[hits[2 * k - 1]]
+        local b = self.bodies[hits[2 * k]]
+        if a and b and a.kind ~= b.kind then
+            local bullet = a.kind == "bullet" and a or b
+            local enemy = a.kind == "enemy" and a or b
+            
+            if bullet.body and enemy.body and
+               collision.pointCircle(bullet.x, bullet.y,
+                                     enemy.comp.x, enemy.comp.y,
+                                     enemy.comp.width) then
+                enemy.health = enemy.health - 10
+                self:removeBody(bullet)
                 
-                if collision.pointCircle(bullet.x, bullet.y,
-                                        enemy.comp.x, enemy.comp.y,
-                                        enemy.comp.width) then
-                    enemy.health = enemy.health - 10
-                    table.remove(self.bullets, j)
-                    
-                    if enemy.health <= 0 then
-                        table.remove(self.enemies, i)
-                        self.score = self.score + 50
-                        break
-                    end
+                if enemy.health <= 0 then
+                    self:removeBody(enemy)
+                    self.score = self.score + 50
                 end
             end
         end
     end
     
+    -- Drop everything that was hit
+    for i = #self.bullets, 1, -1 do
+        if not self.bullets[i].body then
+            bulletPool:release(table.remove(self.bullets, i))
+        end
+    end
+    for i = #self.enemies, 1, -1 do
+        if not self.enemies[i].body then table.remove(self.enemies, i) end
+    end
+    
     -- Spawn next wave
     if #self.enemies == 0 then
         self.wave = self.wave + 1
@@ -127,12 +181,12 @@ function GameScene:update(dt)
 end
 
 function GameScene:shoot()
-    if not self.lastShot or (love.timer.getTime() - self.lastShot) > 0.1 then
-        table.insert(self.bullets, {
-            x = self.player.comp.x + 15,
-            y = self.player.comp.y
-        })
-        self.lastShot = 0 -- Simplified timer
+    local now = scheduler.time()
+    if not self.lastShot or now - self.lastShot > 0.1 then
+        local bullet = bulletPool:acquire(self.player.comp.x + 15, self.player.comp.y)
+        self:addBody(bullet, "bullet", bullet.x, bullet.y, 0, 0)
+        table.insert(self.bullets, bullet)
+        self.lastShot = now
     end
 end
 
@@ -172,6 +226,11 @@ end
 function init()
     print("[GAME] Advanced Example Initialized!")
     
+    -- Rebindable controls; queries below go through these actions
+    input.bind("left", "a", "left", "pad:left")
+    input.bind("right", "d", "right", "pad:right")
+    input.bind("fire", "space", "mouse:left", "pad:a")
+    
     -- Initialize game state manager
     gameState:register("game", GameScene.new())
     gameState:enter("game")